@@ -646,18 +646,15 @@ SIMD_ATTR void ComputePredictionResiduals(const Image3F& pred2x2,
   }
 }
 
-void AddPredictions(const Image3F& pred2x2, const AcStrategyImage& ac_strategy,
-                    const Rect& acs_rect, Image3F* PIK_RESTRICT dcoeffs) {
+void AddPredictions(const ImageF& pred2x2, const AcStrategyImage& ac_strategy,
+                    const Rect& acs_rect, ImageF* PIK_RESTRICT dcoeffs) {
   PROFILER_FUNC;
   Rect dc_rect(0, 0, pred2x2.xsize() / 2 - 2, pred2x2.ysize() / 2 - 2);
   Ub4Kernel kernel;
   ComputeUb4Kernel(k4x4BlurStrength, &kernel);
-  for (int c = 0; c < dcoeffs->kNumPlanes; ++c) {
-    // Updates dcoeffs _except_ 0HVD.
-    UpSample4x4BlurDCT</*add=*/true>(dc_rect, pred2x2.Plane(c), kernel,
-                                     ac_strategy, acs_rect,
-                                     dcoeffs->MutablePlane(c));
-  }
+  // Updates dcoeffs _except_ 0HVD.
+  UpSample4x4BlurDCT</*add=*/true>(dc_rect, pred2x2, kernel, ac_strategy,
+                                   acs_rect, dcoeffs);
 }
 
 }  // namespace pik
@@ -62,8 +62,9 @@ SIMD_ATTR void UpdateLfForDecoder(const Rect& tile, bool predict_lf,
                                   ImageF* ac64_plane, ImageF* dc2x2_plane,
                                   ImageF* lf2x2_plane);
 
-void AddPredictions(const Image3F& pred2x2, const AcStrategyImage& ac_strategy,
-                    const Rect& acs_rect, Image3F* PIK_RESTRICT dcoeffs);
+// Adds the predictions of one plane; called for each plane whose AC is used.
+void AddPredictions(const ImageF& pred2x2, const AcStrategyImage& ac_strategy,
+                    const Rect& acs_rect, ImageF* PIK_RESTRICT dcoeffs);
 
 }  // namespace pik
 
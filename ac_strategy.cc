@@ -500,6 +500,48 @@ SIMD_ATTR void AcStrategy::DC2x2FromLowFrequencies(const float* block,
   };
 }
 
+SIMD_ATTR void AcStrategy::DC4x4FromLowFrequencies(const float* block,
+                                                   size_t block_stride,
+                                                   float* dc4x4,
+                                                   size_t dc4x4_stride) const {
+  if (block_) return;
+  switch (strategy_) {
+    case Type::DCT:
+      ReinterpretingIDCT<kBlockDim, 4, 4>(block, kBlockDim, dc4x4,
+                                          dc4x4_stride);
+      break;
+    case Type::DCT16X16: {
+      float dest[64] = {};
+      GatherBlock<2 * kBlockDim, 2 * kBlockDim, 8, 8>(block, block_stride,
+                                                      dest);
+      ReinterpretingIDCT<2 * kBlockDim, 8, 8>(dest, 8, dc4x4, dc4x4_stride);
+      break;
+    }
+    case Type::DCT32X32: {
+      float dest[256] = {};
+      GatherBlock<4 * kBlockDim, 4 * kBlockDim, 16, 16>(block, block_stride,
+                                                        dest);
+      ReinterpretingIDCT<4 * kBlockDim, 16, 16>(dest, 16, dc4x4,
+                                                dc4x4_stride);
+      break;
+    }
+    case Type::DCT4X4:
+    case Type::IDENTITY: {
+      // These have no meaningful low frequencies; average the pixels instead.
+      SIMD_ALIGN float pixels[kBlockDim * kBlockDim];
+      TransformToPixels(block, block_stride, pixels, kBlockDim);
+      for (size_t y = 0; y < kBlockDim / 2; y++) {
+        for (size_t x = 0; x < kBlockDim / 2; x++) {
+          const float* PIK_RESTRICT pos = pixels + 2 * y * kBlockDim + 2 * x;
+          dc4x4[y * dc4x4_stride + x] =
+              0.25f * (pos[0] + pos[1] + pos[kBlockDim] + pos[kBlockDim + 1]);
+        }
+      }
+      break;
+    }
+  };
+}
+
 SIMD_ATTR void AcStrategy::LowFrequenciesFromDC2x2(const float* dc2x2,
                                                    size_t dc2x2_stride,
                                                    float* block,
@@ -601,20 +643,20 @@ size_t AcStrategyImage::CountBlocks(AcStrategy::Type type) const {
 
 SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
                                   const ImageF* quant_field, const Image3F& src,
-                                  ThreadPool* pool,
+                                  const Image3F& src_dct, ThreadPool* pool,
                                   AcStrategyImage* ac_strategy,
                                   PikInfo* aux_out) {
   PROFILER_FUNC;
   size_t xsize_blocks = src.xsize() / kBlockDim;
   size_t ysize_blocks = src.ysize() / kBlockDim;
-  Image3F coeffs = Image3F(xsize_blocks * kBlockDim * kBlockDim, ysize_blocks);
-  TransposedScaledDCT(src, &coeffs);
   *ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
   if (!kChooseAcStrategy) {
     return;
   }
-  std::vector<bool> disable_dct16(xsize_blocks * ysize_blocks);
-  std::vector<bool> disable_dct32(xsize_blocks * ysize_blocks);
+  // Bytes rather than bits so that concurrent updates of neighboring blocks
+  // do not race.
+  std::vector<uint8_t> disable_dct16(xsize_blocks * ysize_blocks);
+  std::vector<uint8_t> disable_dct32(xsize_blocks * ysize_blocks);
   const auto disable_large_transforms = [&](int bx, int by) SIMD_ATTR {
     // If we find a well-fitting DCT4x4 within the larger block,
     // we disable the larger block.
@@ -662,7 +704,7 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
         maxval = std::max(maxval, total_sum);
       }
       if (maxval / (minval + 0.01) >= 0.5 * butteraugli_target + 5) {
-        // Probably not multi-threading safe.
+        // Only writes within the 4-row stripe of "by", see below.
         disable_dct32[(by & ~3) * xsize_blocks + (bx & ~3)] = true;
         disable_dct16[(by & ~1) * xsize_blocks + (bx & ~1)] = true;
       }
@@ -792,10 +834,10 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
         (by & 3) == 0) {
       static const double kDiff = 0.17023516028338581;
       double dct8x8_entropy = 0;
-      for (size_t c = 0; c < coeffs.kNumPlanes; c++) {
+      for (size_t c = 0; c < src_dct.kNumPlanes; c++) {
         double entropy = 0;
         for (size_t iy = 0; iy < 4; iy++) {
-          const float* row = coeffs.ConstPlaneRow(c, by + iy);
+          const float* row = src_dct.ConstPlaneRow(c, by + iy);
           int bx_actual = bx;
           for (size_t ix = 1; ix < kBlockDim * kBlockDim * 4; ix++) {
             // Skip the dc values at 0 and 64.
@@ -864,10 +906,10 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
         (by & 1) == 0) {
       static const double kDiff = 0.10873821113104205;
       double dct8x8_entropy = 0;
-      for (size_t c = 0; c < coeffs.kNumPlanes; c++) {
+      for (size_t c = 0; c < src_dct.kNumPlanes; c++) {
         double entropy = 0;
         for (size_t iy = 0; iy < 2; iy++) {
-          const float* row = coeffs.ConstPlaneRow(c, by + iy);
+          const float* row = src_dct.ConstPlaneRow(c, by + iy);
           int bx_actual = bx;
           for (size_t ix = 1; ix < kBlockDim * kBlockDim * 2; ix++) {
             // Skip the dc values at 0 and 64.
@@ -932,9 +974,15 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
     return AcStrategy::Type::DCT;
   };
   ImageB raw_ac_strategy(xsize_blocks, ysize_blocks);
-  RunOnPool(pool, 0, ysize_blocks, [&](int y, int _) {
-    for (size_t x = 0; x < xsize_blocks; x++) {
-      disable_large_transforms(x, y);
+  // One task per 4-row stripe: disable_large_transforms marks the top-left
+  // block of the enclosing 16x16/32x32, which is in the same stripe.
+  const size_t num_stripes = DivCeil(ysize_blocks, size_t(4));
+  RunOnPool(pool, 0, num_stripes, [&](int stripe, int _) {
+    const size_t y_end = std::min<size_t>(4 * stripe + 4, ysize_blocks);
+    for (size_t y = 4 * stripe; y < y_end; y++) {
+      for (size_t x = 0; x < xsize_blocks; x++) {
+        disable_large_transforms(x, y);
+      }
     }
   });
   RunOnPool(pool, 0, ysize_blocks, [&](int y, int _) {
@@ -188,6 +188,12 @@ class AcStrategy {
                                          size_t dc2x2_stride, float* block,
                                          size_t block_stride) const;
 
+  // Produces a 2x-downsampled block (4x4 pixels per 8x8 block) out of the
+  // frequencies up to block_size/2 of the image. Used for downsampled decoding.
+  SIMD_ATTR void DC4x4FromLowFrequencies(const float* block,
+                                         size_t block_stride, float* dc4x4,
+                                         size_t dc4x4_stride) const;
+
   AcStrategy(Type strategy, uint32_t block)
       : strategy_(strategy), block_(block) {
     PIK_ASSERT(strategy == Type::DCT16X16 || strategy == Type::DCT32X32 ||
@@ -257,10 +263,11 @@ class AcStrategyImage {
 };
 
 // `quant_field` is an initial quantization field for this image. `src` is the
-// input image in the XYB color space. `ac_strategy` is the output strategy.
+// input image in the XYB color space and `src_dct` its TransposedScaledDCT.
+// `ac_strategy` is the output strategy.
 SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
                                   const ImageF* quant_field, const Image3F& src,
-                                  ThreadPool* pool,
+                                  const Image3F& src_dct, ThreadPool* pool,
                                   AcStrategyImage* ac_strategy,
                                   PikInfo* aux_out);
 
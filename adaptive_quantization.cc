@@ -6,6 +6,7 @@
 
 #include "adaptive_quantization.h"
 
+#include <string.h>
 #include <algorithm>
 #include <cmath>
 #include <vector>
@@ -102,7 +103,8 @@ static const double kQuant64[64] = {
 };
 
 // Increase precision in 8x8 blocks that are complicated in DCT space.
-SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
+SIMD_ATTR void DctModulation(const ImageF& xyb, ThreadPool* pool,
+                             ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
   const int32_t* natural_coeff_order = NaturalCoeffOrder();
@@ -113,8 +115,9 @@ SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
       dct_rescale[i] = dct_scale[i / 8] * dct_scale[i % 8];
     }
   }
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) SIMD_ATTR {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       SIMD_ALIGN float dct[64] = {0};
       for (int dy = 0; dy < 8; ++dy) {
@@ -153,15 +156,17 @@ SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
       double kMul = 1.2932505590583181;
       row_out[x / 8] += kMul * v;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "DctModulation");
 }
 
 // Increase precision in 8x8 blocks that have high dynamic range.
-void RangeModulation(const ImageF& xyb, ImageF* out) {
+void RangeModulation(const ImageF& xyb, ThreadPool* pool, ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       float minval = 1e30;
       float maxval = -1e30;
@@ -181,15 +186,17 @@ void RangeModulation(const ImageF& xyb, ImageF* out) {
       static const double mul = 0.29271759124131524;
       row_out[x / 8] += mul * range;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "RangeModulation");
 }
 
 // Change precision in 8x8 blocks that have high frequency content.
-void HfModulation(const ImageF& xyb, ImageF* out) {
+void HfModulation(const ImageF& xyb, ThreadPool* pool, ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       float sum = 0;
       int n = 0;
@@ -217,18 +224,20 @@ void HfModulation(const ImageF& xyb, ImageF* out) {
       sum *= kMul;
       row_out[x / 8] += sum;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "HfModulation");
 }
 
 // We want multiplicative quantization field, so everything until this
 // point has been modulating the exponent.
-void Exp(ImageF* out) {
-  for (int y = 0; y < out->ysize(); ++y) {
+void Exp(ThreadPool* pool, ImageF* out) {
+  const auto process_row = [out](const int y, const int thread) {
     float* const PIK_RESTRICT row_out = out->Row(y);
     for (int x = 0; x < out->xsize(); ++x) {
       row_out[x] = exp(row_out[x]);
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "Exp");
 }
 
 static double SimpleGamma(double v) {
@@ -262,7 +271,7 @@ static double RatioOfCubicRootToSimpleGamma(double v) {
   return v / SimpleGamma(v * v * v);
 }
 
-ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
+ImageF DiffPrecompute(const ImageF& xyb, float cutoff, ThreadPool* pool) {
   PROFILER_ZONE("aq DiffPrecompute");
   PIK_ASSERT(xyb.xsize() > 1);
   PIK_ASSERT(xyb.ysize() > 1);
@@ -276,9 +285,10 @@ ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
   // for quantization uses.
   static const double match_gamma_offset = 1.4439853629568109;
   static const float kOverWeightBorders = 1.4;
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y + 1 < xyb.ysize(); ++y) {
+  const auto process_row = [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < xyb.ysize()) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -328,7 +338,8 @@ ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
       diff *= RatioOfCubicRootToSimpleGamma(row_in[x] + match_gamma_offset);
       row_out[x] = std::min(cutoff, diff);
     }
-  }
+  };
+  RunOnPool(pool, 0, xyb.ysize() - 1, process_row, "DiffPrecompute");
   // Last row.
   {
     const size_t y = xyb.ysize() - 1;
@@ -394,14 +405,14 @@ ImageF Expand(const ImageF& img, size_t out_xsize, size_t out_ysize) {
   return out;
 }
 
-ImageF ComputeMask(const ImageF& diffs) {
+ImageF ComputeMask(const ImageF& diffs, ThreadPool* pool) {
   static const float kBase = 1.1352029431638126;
   static const float kMul1 = 0.011134087946508579;
   static const float kOffset1 = 0.0070057082516685083;
   static const float kMul2 = -0.20545785980711334;
   static const float kOffset2 = 0.080407961356758706;
   ImageF out(diffs.xsize(), diffs.ysize());
-  for (int y = 0; y < diffs.ysize(); ++y) {
+  const auto process_row = [&](const int y, const int thread) {
     const float* const PIK_RESTRICT row_in = diffs.Row(y);
     float* const PIK_RESTRICT row_out = out.Row(y);
     for (int x = 0; x < diffs.xsize(); ++x) {
@@ -410,18 +421,21 @@ ImageF ComputeMask(const ImageF& diffs) {
       double div = std::max<double>(val + kOffset1, 1e-3);
       row_out[x] = kBase + kMul1 / div + kMul2 / (val * val + kOffset2);
     }
-  }
+  };
+  RunOnPool(pool, 0, diffs.ysize(), process_row, "ComputeMask");
   return out;
 }
 
 ImageF TileDistMap(const ImageF& distmap, int tile_size, int margin,
-                   const AcStrategyImage& ac_strategy) {
+                   const AcStrategyImage& ac_strategy, ThreadPool* pool) {
   PROFILER_FUNC;
   const int tile_xsize = (distmap.xsize() + tile_size - 1) / tile_size;
   const int tile_ysize = (distmap.ysize() + tile_size - 1) / tile_size;
   ImageF tile_distmap(tile_xsize, tile_ysize);
   size_t distmap_stride = tile_distmap.PixelsPerRow();
-  for (int tile_y = 0; tile_y < tile_ysize; ++tile_y) {
+  // Tiles of multi-block transforms also write the rows below, but only to
+  // blocks that are skipped by the tasks of those rows.
+  const auto process_row = [&](const int tile_y, const int thread) {
     AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(tile_y);
     float* PIK_RESTRICT dist_row = tile_distmap.Row(tile_y);
     for (int tile_x = 0; tile_x < tile_xsize; ++tile_x) {
@@ -475,7 +489,8 @@ ImageF TileDistMap(const ImageF& distmap, int tile_size, int margin,
         }
       }
     }
-  }
+  };
+  RunOnPool(pool, 0, tile_ysize, process_row, "TileDistMap");
   return tile_distmap;
 }
 
@@ -574,49 +589,89 @@ void AdjustQuantField(const AcStrategyImage& ac_strategy, ImageF* quant_field) {
   }
 }
 
+// State of the previous RoundtripImage call, which lets the next call only
+// reconstruct the groups whose quantization changed. Most groups are unchanged
+// in the later iterations of the quantization search.
+struct RoundtripCache {
+  // QuantDcKey of the previous quantizer; ~0u if there is none.
+  uint32_t quant_dc_key = ~0u;
+  PassEncCache pass_enc_cache;
+  // Biases exclude those of previous passes (see UpdateBiases), and
+  // raw_quant_field is that of the previous quantizer.
+  PassDecCache pass_dec_cache;
+  // Reconstructed groups, before RestoreOpsin.
+  Image3F idct;
+};
+
+// Returns whether "a" and "b" differ within "rect".
+bool QuantFieldChanged(const ImageI& a, const ImageI& b, const Rect& rect) {
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    if (memcmp(rect.ConstRow(a, y), rect.ConstRow(b, y),
+               rect.xsize() * sizeof(int32_t)) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 Image3F RoundtripImage(const CompressParams& cparams,
                        const PassHeader& pass_header, const GroupHeader& header,
                        const Image3F& opsin_orig, const Image3F& opsin,
                        const AcStrategyImage& ac_strategy,
                        const Quantizer& quantizer,
                        const ColorCorrelationMap& full_cmap, ThreadPool* pool,
-                       MultipassManager* multipass_manager) {
+                       MultipassManager* multipass_manager,
+                       RoundtripCache* roundtrip_cache) {
   PROFILER_ZONE("enc roundtrip");
-  PassDecCache pass_dec_cache;
-  pass_dec_cache.ac_strategy = ac_strategy.Copy();
   PIK_ASSERT(opsin.ysize() % kBlockDim == 0);
-  pass_dec_cache.biases =
-      Image3F(opsin.xsize() * kBlockDim, opsin.ysize() / kBlockDim);
-  pass_dec_cache.raw_quant_field = CopyImage(quantizer.RawQuantField());
+  PassEncCache& pass_enc_cache = roundtrip_cache->pass_enc_cache;
+  PassDecCache& pass_dec_cache = roundtrip_cache->pass_dec_cache;
+  // The DC, and thus the reconstruction of all groups, only depends on the
+  // quantizer via QuantDcKey.
+  const bool reuse_groups =
+      roundtrip_cache->quant_dc_key == quantizer.QuantDcKey();
+  if (!reuse_groups) {
+    roundtrip_cache->quant_dc_key = quantizer.QuantDcKey();
+    pass_dec_cache.ac_strategy = ac_strategy.Copy();
+    pass_dec_cache.biases =
+        Image3F(opsin.xsize() * kBlockDim, opsin.ysize() / kBlockDim);
+
+    InitializePassEncCache(pass_header, opsin,
+                           multipass_manager->OpsinDCT(opsin), ac_strategy,
+                           quantizer, full_cmap, pool, &pass_enc_cache);
+
+    pass_dec_cache.dc = CopyImage(pass_enc_cache.dc_dec);
+    pass_dec_cache.gradient = std::move(pass_enc_cache.gradient);
+    if (pass_header.flags & PassHeader::kGradientMap) {
+      ApplyGradientMap(pass_dec_cache.gradient, quantizer, &pass_dec_cache.dc);
+    }
+    roundtrip_cache->idct = Image3F(opsin.xsize(), opsin.ysize());
+  }
 
   const size_t xsize_groups = DivCeil(opsin.xsize(), kGroupWidth);
   const size_t ysize_groups = DivCeil(opsin.ysize(), kGroupHeight);
   const size_t num_groups = xsize_groups * ysize_groups;
 
-  PassEncCache pass_enc_cache;
-  InitializePassEncCache(pass_header, opsin, ac_strategy, quantizer, full_cmap,
-                         pool, &pass_enc_cache);
-
-  pass_dec_cache.dc = CopyImage(pass_enc_cache.dc_dec);
-  pass_dec_cache.gradient = std::move(pass_enc_cache.gradient);
-  if (pass_header.flags & PassHeader::kGradientMap) {
-    ApplyGradientMap(pass_dec_cache.gradient, quantizer, &pass_dec_cache.dc);
-  }
-
-  std::vector<MultipassHandler*> handlers(num_groups);
+  std::vector<MultipassHandler*> handlers;
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
     const size_t gx = group_index % xsize_groups;
     const size_t gy = group_index / xsize_groups;
     const Rect rect(gx * kGroupWidth, gy * kGroupHeight, kGroupWidth,
                     kGroupHeight, opsin.xsize(), opsin.ysize());
-    handlers[group_index] =
+    MultipassHandler* handler =
         multipass_manager->GetGroupHandler(group_index, rect);
+    if (reuse_groups &&
+        !QuantFieldChanged(pass_dec_cache.raw_quant_field,
+                           quantizer.RawQuantField(),
+                           handler->BlockGroupRect())) {
+      continue;
+    }
+    handlers.push_back(handler);
   }
+  pass_dec_cache.raw_quant_field = CopyImage(quantizer.RawQuantField());
 
-  Image3F idct(opsin.xsize(), opsin.ysize());
-
-  const auto process_group = [&](const int group_index, const int thread) {
-    MultipassHandler* handler = handlers[group_index];
+  const auto process_group = [&](const int task, const int thread) {
+    MultipassHandler* handler = handlers[task];
     const Rect& group_rect = handler->PaddedGroupRect();
     Rect block_group_rect = handler->BlockGroupRect();
     EncCache cache;
@@ -631,34 +686,42 @@ Image3F RoundtripImage(const CompressParams& cparams,
         DivCeil(block_group_rect.ysize(), kColorTileDimInBlocks));
 
     ColorCorrelationMap cmap = full_cmap.Copy(group_in_color_tiles);
-    ComputeCoefficients(quant, cmap, pool, &cache, multipass_manager);
+    // Groups already run in parallel and ThreadPool::Run is not reentrant.
+    ComputeCoefficients(quant, cmap, /*pool=*/nullptr, &cache,
+                        multipass_manager);
 
     DecCache dec_cache;
     InitializeDecCache(pass_dec_cache, group_rect, &dec_cache);
-    DequantImageAC(quant, cmap, cache.ac, pool, &dec_cache, &pass_dec_cache,
-                   group_rect);
+    DequantImageAC(quant, cmap, cache.ac, /*pool=*/nullptr, &dec_cache,
+                   &pass_dec_cache, group_rect);
     Image3F recon =
         ReconOpsinImage(pass_header, header, quant, block_group_rect,
                         &dec_cache, &pass_dec_cache);
     for (size_t c = 0; c < 3; c++) {
       for (size_t y = 0; y < group_rect.ysize(); y++) {
         const float* PIK_RESTRICT row = recon.ConstPlaneRow(c, y);
-        float* PIK_RESTRICT output_row = group_rect.PlaneRow(&idct, c, y);
+        float* PIK_RESTRICT output_row =
+            group_rect.PlaneRow(&roundtrip_cache->idct, c, y);
         for (size_t x = 0; x < group_rect.xsize(); x++) {
           output_row[x] = row[x];
         }
       }
     }
   };
-  RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
+  RunOnPool(pool, 0, handlers.size(), process_group, "RoundtripImage");
 
+  // Post-processing modifies its inputs, so it runs on copies of the cache.
+  Image3F idct = CopyImage(roundtrip_cache->idct);
   multipass_manager->RestoreOpsin(&idct);
-  multipass_manager->UpdateBiases(&pass_dec_cache.biases);
-  idct = FinalizePassDecoding(std::move(idct), pass_header, quantizer,
-                              &pass_dec_cache);
-
+  PassDecCache finalize_cache;
+  finalize_cache.ac_strategy = ac_strategy.Copy();
+  finalize_cache.raw_quant_field = CopyImage(quantizer.RawQuantField());
+  finalize_cache.biases = CopyImage(pass_dec_cache.biases);
+  multipass_manager->UpdateBiases(&finalize_cache.biases);
   Image3F linear(opsin_orig.xsize(), opsin_orig.ysize());
-  OpsinToLinear(idct, pool, &linear);
+  FinalizePassDecodingToLinear(std::move(idct), pass_header, quantizer,
+                               &finalize_cache, /*grayscale=*/false, pool,
+                               &linear);
   return linear;
 }
 
@@ -678,7 +741,7 @@ void FindBestQuantization(const Image3F& opsin_orig, const Image3F& opsin_arg,
   const float intensity_multiplier = cparams.GetIntensityMultiplier();
   const float intensity_multiplier3 = std::cbrt(intensity_multiplier);
   ButteraugliComparator comparator(opsin_orig, cparams.hf_asymmetry,
-                                   intensity_multiplier);
+                                   intensity_multiplier, pool);
   const float butteraugli_target_dc =
       std::min<float>(butteraugli_target, pow(butteraugli_target, kDcQuantPow));
   const float initial_quant_dc =
@@ -689,6 +752,7 @@ void FindBestQuantization(const Image3F& opsin_orig, const Image3F& opsin_arg,
   ImageF initial_quant_field = CopyImage(quant_field);
   ImageF last_quant_field = CopyImage(initial_quant_field);
   ImageF last_tile_distmap_localopt;
+  RoundtripCache roundtrip_cache;
 
   constexpr int kOriginalComparisonRound = 5;
   constexpr float kMaximumDistanceIncreaseFactor = 1.015;
@@ -705,16 +769,18 @@ void FindBestQuantization(const Image3F& opsin_orig, const Image3F& opsin_arg,
     }
 
     if (quantizer->SetQuantField(initial_quant_dc, QuantField(quant_field))) {
-      Image3F linear = RoundtripImage(cparams, pass_header, header, opsin_orig,
-                                      opsin_arg, ac_strategy, *quantizer, cmap,
-                                      pool, multipass_manager);
+      Image3F linear = RoundtripImage(
+          cparams, pass_header, header, opsin_orig, opsin_arg, ac_strategy,
+          *quantizer, cmap, pool, multipass_manager, &roundtrip_cache);
       PROFILER_ZONE("enc Butteraugli");
+      // Later iterations change most tiles, so CompareIncremental would only
+      // add the copy and diff of "linear" (it pays off in the HQ search).
       comparator.Compare(linear);
       static const int kMargins[100] = {0, 0, 0, 1, 2, 1, 1, 1, 0};
       tile_distmap =
-          TileDistMap(comparator.distmap(), 8, kMargins[i], ac_strategy);
+          TileDistMap(comparator.distmap(), 8, kMargins[i], ac_strategy, pool);
       tile_distmap_localopt =
-          TileDistMap(comparator.distmap(), 8, 2, ac_strategy);
+          TileDistMap(comparator.distmap(), 8, 2, ac_strategy, pool);
       if (WantDebugOutput(aux_out)) {
         DumpHeatmaps(aux_out, butteraugli_target, quant_field, tile_distmap);
         ++aux_out->num_butteraugli_iters;
@@ -838,7 +904,7 @@ void FindBestQuantizationHQ(
   const float intensity_multiplier = cparams.GetIntensityMultiplier();
   const float intensity_multiplier3 = std::cbrt(intensity_multiplier);
   ButteraugliComparator comparator(opsin_orig, cparams.hf_asymmetry,
-                                   intensity_multiplier);
+                                   intensity_multiplier, pool);
   AdjustQuantField(ac_strategy, &quant_field);
   ImageF best_quant_field = CopyImage(quant_field);
   float best_butteraugli = 1000.0f;
@@ -852,6 +918,7 @@ void FindBestQuantizationHQ(
   float best_quant_dc = quant_dc;
   int num_stalling_iters = 0;
   int max_iters = cparams.max_butteraugli_iters_guetzli_mode;
+  RoundtripCache roundtrip_cache;
 
   for (;;) {
     if (FLAGS_dump_quant_state) {
@@ -867,10 +934,10 @@ void FindBestQuantizationHQ(
     ImageMinMax(quant_field, &qmin, &qmax);
     ++butteraugli_iter;
     if (quantizer->SetQuantField(quant_dc, QuantField(quant_field))) {
-      Image3F linear = RoundtripImage(cparams, pass_header, header, opsin_orig,
-                                      opsin, ac_strategy, *quantizer, cmap,
-                                      pool, multipass_manager);
-      comparator.Compare(linear);
+      Image3F linear = RoundtripImage(
+          cparams, pass_header, header, opsin_orig, opsin, ac_strategy,
+          *quantizer, cmap, pool, multipass_manager, &roundtrip_cache);
+      comparator.CompareIncremental(linear);
       bool best_quant_updated = false;
       if (comparator.distance() <= best_butteraugli) {
         best_quant_field = CopyImage(quant_field);
@@ -881,7 +948,8 @@ void FindBestQuantizationHQ(
       } else if (outer_iter == 0) {
         ++num_stalling_iters;
       }
-      tile_distmap = TileDistMap(comparator.distmap(), 8, 0, ac_strategy);
+      tile_distmap =
+          TileDistMap(comparator.distmap(), 8, 0, ac_strategy, pool);
       if (WantDebugOutput(aux_out)) {
         DumpHeatmaps(aux_out, butteraugli_target, quant_field, tile_distmap);
       }
@@ -963,7 +1031,8 @@ void FindBestQuantizationHQ(
 }  // namespace
 
 ImageF AdaptiveQuantizationMap(const ImageF& img, const ImageF& img_ac,
-                               const CompressParams& cparams) {
+                               const CompressParams& cparams,
+                               ThreadPool* pool) {
   PROFILER_ZONE("aq AdaptiveQuantMap");
   static const int kResolution = 8;
   const size_t out_xsize = (img.xsize() + kResolution - 1) / kResolution;
@@ -982,30 +1051,30 @@ ImageF AdaptiveQuantizationMap(const ImageF& img, const ImageF& img_ac,
   static const int kRadius = static_cast<int>(2 * kSigma + 0.5f);
   std::vector<float> kernel = GaussianKernel(kRadius, kSigma);
   static const float kDiffCutoff = 0.11883287948847132;
-  ImageF out = DiffPrecompute(img, kDiffCutoff);
+  ImageF out = DiffPrecompute(img, kDiffCutoff, pool);
   out = Expand(out, kResolution * out_xsize, kResolution * out_ysize);
-  out = ConvolveAndSample(out, kernel, kResolution);
-  out = ComputeMask(out);
-  DctModulation(img_ac, &out);
-  RangeModulation(img_ac, &out);
-  HfModulation(img_ac, &out);
-  Exp(&out);
+  out = ConvolveAndSample(out, kernel, kResolution, pool);
+  out = ComputeMask(out, pool);
+  DctModulation(img_ac, pool, &out);
+  RangeModulation(img_ac, pool, &out);
+  HfModulation(img_ac, pool, &out);
+  Exp(pool, &out);
   return out;
 }
 
-// TODO(veluca): remove or use pool.
 ImageF IntensityAcEstimate(const ImageF& image, float multiplier,
                            ThreadPool* pool) {
   constexpr size_t N = kBlockDim;
   std::vector<float> blur = DCfiedGaussianKernel<N>(5.5);
-  ImageF retval = Convolve(image, blur);
-  for (size_t y = 0; y < retval.ysize(); y++) {
+  ImageF retval = Convolve(image, blur, pool);
+  const auto process_row = [&](const int y, const int thread) {
     float* PIK_RESTRICT retval_row = retval.Row(y);
     const float* PIK_RESTRICT image_row = image.ConstRow(y);
     for (size_t x = 0; x < retval.xsize(); ++x) {
       retval_row[x] = multiplier * (image_row[x] - retval_row[x]);
     }
-  }
+  };
+  RunOnPool(pool, 0, retval.ysize(), process_row, "IntensityAcEstimate");
   return retval;
 }
 
@@ -1019,7 +1088,8 @@ ImageF InitialQuantField(double butteraugli_target, double intensity_multiplier,
       IntensityAcEstimate(opsin_orig.Plane(1), intensity_multiplier3, pool);
   ImageF quant_field = ScaleImage(
       quant_ac * (float)rescale,
-      AdaptiveQuantizationMap(opsin_orig.Plane(1), intensity_ac, cparams));
+      AdaptiveQuantizationMap(opsin_orig.Plane(1), intensity_ac, cparams,
+                              pool));
   return quant_field;
 }
 
@@ -8,11 +8,13 @@
 #include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
 #include "ac_strategy.h"
 #include "block.h"
 #include "common.h"
 #include "dct.h"
+#include "data_parallel.h"
 #include "dct_util.h"
 #include "entropy_coder.h"
 #include "epf.h"
@@ -30,7 +32,8 @@ namespace {
 Image3F DoDenoise(const Image3F& opsin, const Image3F& opsin_sharp,
                   const Quantizer& quantizer, const ImageI& raw_quant_field,
                   const AcStrategyImage& ac_strategy,
-                  const EpfParams& epf_params, AdaptiveReconstructionAux* aux) {
+                  const EpfParams& epf_params, ThreadPool* pool,
+                  AdaptiveReconstructionAux* aux) {
   if (aux != nullptr) {
     aux->quant_scale = quantizer.Scale();
   }
@@ -41,16 +44,34 @@ Image3F DoDenoise(const Image3F& opsin, const Image3F& opsin_sharp,
   if (epf_params.enable_adaptive) {
     Dispatch(TargetBitfield().Best(), EdgePreservingFilter(), opsin,
              opsin_sharp, &raw_quant_field, quant_scale, ac_strategy,
-             epf_params, &smoothed, aux ? &aux->epf_stats : nullptr);
+             epf_params, pool, &smoothed, aux ? &aux->epf_stats : nullptr);
   } else {
     float stretch;
     Dispatch(TargetBitfield().Best(), EdgePreservingFilter(), opsin,
-             opsin_sharp, epf_params, aux ? &aux->stretch : &stretch,
+             opsin_sharp, epf_params, pool, aux ? &aux->stretch : &stretch,
              &smoothed);
   }
   return smoothed;
 }
 
+// Single-plane version of DoDenoise; requires epf_params.enable_adaptive.
+ImageF DoDenoise(const ImageF& opsin, const ImageF& opsin_sharp,
+                 const Quantizer& quantizer, const ImageI& raw_quant_field,
+                 const AcStrategyImage& ac_strategy,
+                 const EpfParams& epf_params, ThreadPool* pool,
+                 AdaptiveReconstructionAux* aux) {
+  PIK_CHECK(epf_params.enable_adaptive);
+  if (aux != nullptr) {
+    aux->quant_scale = quantizer.Scale();
+  }
+
+  ImageF smoothed(opsin.xsize(), opsin.ysize());
+  Dispatch(TargetBitfield().Best(), EdgePreservingFilter(), opsin, opsin_sharp,
+           &raw_quant_field, quantizer.Scale(), ac_strategy, epf_params, pool,
+           &smoothed, aux ? &aux->epf_stats : nullptr);
+  return smoothed;
+}
+
 using DF = SIMD_FULL(float);
 using DI = SIMD_FULL(int32_t);
 using DU = SIMD_FULL(uint32_t);
@@ -322,7 +343,7 @@ void ComputeResidualSlow(const Image3F& in, const Image3F& smoothed,
 SIMD_ATTR Image3F AdaptiveReconstruction(
     Image3F* in, const Image3F& non_smoothed, const Quantizer& quantizer,
     const ImageI& raw_quant_field, const AcStrategyImage& ac_strategy,
-    const Image3F& biases, const EpfParams& epf_params,
+    const Image3F& biases, const EpfParams& epf_params, ThreadPool* pool,
     AdaptiveReconstructionAux* aux) {
   PROFILER_FUNC;
   // Input image should have an integer number of blocks.
@@ -340,13 +361,14 @@ SIMD_ATTR Image3F AdaptiveReconstruction(
 
   // Modified below (clamped).
   Image3F filt = DoDenoise(*in, non_smoothed, quantizer, raw_quant_field,
-                           ac_strategy, epf_params, aux);
+                           ac_strategy, epf_params, pool, aux);
 
   const size_t stride = filt.PlaneRow(0, 1) - filt.PlaneRow(0, 0);
   const size_t biases_stride = biases.PixelsPerRow();
   PIK_ASSERT(stride == in->PlaneRow(0, 1) - in->PlaneRow(0, 0));
 
-  ARStats stats;
+  // Per-thread; merged after all rows are done.
+  std::vector<ARStats> thread_stats(NumThreads(pool));
 
   // Dequantization matrices.
   const float* PIK_RESTRICT dequant_matrices =
@@ -358,7 +380,11 @@ SIMD_ATTR Image3F AdaptiveReconstruction(
                                  kDCTBlockSize];
   }
 
-  for (size_t by = 0; by < ysize_blocks; ++by) {
+  // Each block (including multi-block transforms, handled by the row of their
+  // first block) only reads and writes its own pixels, so rows are independent.
+  const auto clamp_row = [&](const int task, const int thread) SIMD_ATTR {
+    const size_t by = task;
+    ARStats& stats = thread_stats[thread];
     const int32_t* PIK_RESTRICT row_quant = raw_quant_field.ConstRow(by);
     const AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(by);
 
@@ -443,9 +469,14 @@ SIMD_ATTR Image3F AdaptiveReconstruction(
                                lo_b, hi_b, acs, pos_original_b, pos_filt_b,
                                stride);
     }  // bx
-  }    // by
+  };
+  RunOnPool(pool, 0, ysize_blocks, clamp_row, "AR clamp");
 
 #if PIK_AR_PRINT_STATS
+  ARStats stats;
+  for (const ARStats& other : thread_stats) {
+    stats.Assimilate(other);
+  }
   printf("Lo/Hi clamped: %5u %5u; %5u %5u; %5u %5u (pixels: %zu)\n",
          ARStats::Total(stats.clamp_lo[0]), ARStats::Total(stats.clamp_hi[0]),
          ARStats::Total(stats.clamp_lo[1]), ARStats::Total(stats.clamp_hi[1]),
@@ -467,4 +498,89 @@ SIMD_ATTR Image3F AdaptiveReconstruction(
   return filt;
 }
 
+SIMD_ATTR ImageF AdaptiveReconstruction(
+    ImageF* in, const ImageF& non_smoothed, const Quantizer& quantizer,
+    const ImageI& raw_quant_field, const AcStrategyImage& ac_strategy,
+    const ImageF& biases, const EpfParams& epf_params, ThreadPool* pool,
+    AdaptiveReconstructionAux* aux) {
+  PROFILER_FUNC;
+  PIK_ASSERT(in->xsize() % kBlockDim == 0 && in->ysize() % kBlockDim == 0);
+  const size_t xsize_blocks = in->xsize() / kBlockDim;
+  const size_t ysize_blocks = in->ysize() / kBlockDim;
+  // The plane is dequantized like the Y channel.
+  constexpr size_t c = 1;
+
+  // Modified below (clamped).
+  ImageF filt = DoDenoise(*in, non_smoothed, quantizer, raw_quant_field,
+                          ac_strategy, epf_params, pool, aux);
+
+  const size_t stride = filt.PixelsPerRow();
+  const size_t biases_stride = biases.PixelsPerRow();
+  PIK_ASSERT(stride == in->PixelsPerRow());
+
+  // Per-thread; only used for PIK_AR_PRINT_STATS.
+  std::vector<ARStats> thread_stats(NumThreads(pool));
+
+  const float* PIK_RESTRICT dequant_matrices =
+      quantizer.DequantMatrix(0, kQuantKindDCT8);
+  const float dc_mul =
+      quantizer.inv_quant_dc() *
+      dequant_matrices[DequantMatrixOffset(0, kQuantKindDCT8, c) *
+                       kDCTBlockSize];
+
+  // As above, rows of blocks are independent.
+  const auto clamp_row = [&](const int task, const int thread) SIMD_ATTR {
+    const size_t by = task;
+    ARStats& stats = thread_stats[thread];
+    const int32_t* PIK_RESTRICT row_quant = raw_quant_field.ConstRow(by);
+    const AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(by);
+    const float* PIK_RESTRICT row_original =
+        non_smoothed.ConstRow(by * kBlockDim);
+    const float* PIK_RESTRICT row_biases = biases.ConstRow(by);
+    float* PIK_RESTRICT row_filt = filt.Row(by * kBlockDim);
+
+    for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+      const float inv_quant_ac = quantizer.inv_quant_ac(row_quant[bx]);
+      const AcStrategy acs = ac_strategy_row[bx];
+      if (!acs.IsFirstBlock()) continue;
+
+      const float* dequant_matrix =
+          dequant_matrices +
+          kDCTBlockSize * DequantMatrixOffset(0, acs.GetQuantKind(), c);
+      const size_t block_ofs = bx * kBlockDim;
+
+      SIMD_ALIGN float min_ratio[AcStrategy::kMaxCoeffArea];
+      const SIMD_FULL(float) df;
+      for (size_t k = 0; k < AcStrategy::kMaxCoeffArea; k += df.N) {
+        store(set1(df, 1.0f), df, min_ratio + k);
+      }
+
+      SIMD_ALIGN float block[AcStrategy::kMaxCoeffArea];
+      SIMD_ALIGN float lo[AcStrategy::kMaxCoeffArea];
+      SIMD_ALIGN float hi[AcStrategy::kMaxCoeffArea];
+      UpdateMinRatioOfClampToOriginalDCT<c>(
+          row_original + block_ofs, stride, row_biases + bx * kDCTBlockSize,
+          biases_stride, dequant_matrix, inv_quant_ac, dc_mul, acs,
+          row_filt + block_ofs, min_ratio, lo, hi, block, &stats);
+
+      const size_t block_width = kBlockDim * acs.covered_blocks_x();
+      const size_t block_height = kBlockDim * acs.covered_blocks_y();
+      ClampAndIDCT<true, true>(block, block_width, block_height, min_ratio, lo,
+                               hi, acs, row_original + block_ofs,
+                               row_filt + block_ofs, stride);
+    }  // bx
+  };
+  RunOnPool(pool, 0, ysize_blocks, clamp_row, "AR clamp plane");
+
+  if (aux != nullptr) {
+    if (aux->ac_quant != nullptr) {
+      CopyImageTo(raw_quant_field, aux->ac_quant);
+    }
+    if (aux->ac_strategy != nullptr) {
+      CopyImageTo(ac_strategy.ConstRaw(), aux->ac_strategy);
+    }
+  }
+  return filt;
+}
+
 }  // namespace pik
@@ -10,6 +10,7 @@
 // "In-loop" filter: edge-preserving filter + adaptive clamping to DCT interval.
 
 #include "adaptive_reconstruction_fwd.h"
+#include "data_parallel.h"
 #include "epf.h"
 #include "image.h"
 #include "multipass_handler.h"
@@ -20,14 +21,27 @@ namespace pik {
 // Edge-preserving smoothing plus clamping the result to the quantized interval
 // (which requires `quantizer` and `biases` to reconstruct the values that
 // were actually quantized). `in` is the image to filter:  opsin AFTER gaborish.
-// `non_smoothed` is BEFORE gaborish.
+// `non_smoothed` is BEFORE gaborish. Rows of blocks are processed in parallel
+// if `pool` is non-null; the result is independent of the number of threads.
 Image3F AdaptiveReconstruction(Image3F* in, const Image3F& non_smoothed,
                                const Quantizer& quantizer,
                                const ImageI& raw_quant_field,
                                const AcStrategyImage& ac_strategy,
                                const Image3F& biases, const EpfParams& params,
+                               ThreadPool* pool,
                                AdaptiveReconstructionAux* aux = nullptr);
 
+// Same, but for a single plane that was quantized like the Y channel (e.g. the
+// luminance of grayscale images). Requires params.enable_adaptive. Does not
+// compute aux->residual.
+ImageF AdaptiveReconstruction(ImageF* in, const ImageF& non_smoothed,
+                              const Quantizer& quantizer,
+                              const ImageI& raw_quant_field,
+                              const AcStrategyImage& ac_strategy,
+                              const ImageF& biases, const EpfParams& params,
+                              ThreadPool* pool,
+                              AdaptiveReconstructionAux* aux = nullptr);
+
 }  // namespace pik
 
 #endif  // ADAPTIVE_RECONSTRUCTION_H_
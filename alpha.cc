@@ -57,7 +57,7 @@ Status EncodeAlpha(const CompressParams& params, const ImageU& plane,
   }
   ImageS residuals(rect.xsize(), rect.ysize());
   ShrinkY(Rect(alpha_img), alpha_img, Rect(residuals), &residuals);
-  std::string best;
+  PaddedBytes best;
 
   const size_t rle_sym_start = kRleSymStart[alpha->bytes_per_alpha - 1];
 
@@ -92,15 +92,16 @@ Status EncodeAlpha(const CompressParams& params, const ImageU& plane,
 
     std::vector<ANSEncodingData> codes;
     std::vector<uint8_t> context_map;
-    std::string enc =
-        BuildAndEncodeHistograms(1, tokens, &codes, &context_map, nullptr);
-    enc += WriteTokens(tokens[0], codes, context_map, nullptr);
+    BitWriter writer;
+    BuildAndEncodeHistograms(1, tokens, &codes, &context_map, &writer,
+                             nullptr);
+    WriteTokens(tokens[0], codes, context_map, &writer, nullptr);
+    PaddedBytes enc = writer.TakeBytes();
     if (best.empty() || best.size() > enc.size()) {
       best = std::move(enc);
     }
   }
-  alpha->encoded.resize(best.size());
-  memcpy(alpha->encoded.data(), best.data(), best.size());
+  alpha->encoded = std::move(best);
   return true;
 }
 
@@ -14,21 +14,6 @@
 namespace pik {
 namespace {
 
-Status ANSBuildMapTable(const std::vector<int>& counts,
-                        ANSSymbolInfo map[ANS_TAB_SIZE]) {
-  int i;
-  int pos = 0;
-  for (i = 0; i < counts.size(); ++i) {
-    int j;
-    for (j = 0; j < counts[i]; ++j, ++pos) {
-      map[pos].symbol_ = i;
-      map[pos].freq_ = counts[i];
-      map[pos].offset_ = j;
-    }
-  }
-  return (pos == ANS_TAB_SIZE);
-}
-
 // Decodes a number in the range [0..65535], by reading 1 - 20 bits.
 inline int DecodeVarLenUint16(BitReader* input) {
   if (input->ReadBits(1)) {
@@ -164,9 +149,8 @@ Status ReadHistogram(int precision_bits, std::vector<int>* counts,
 
 bool DecodeANSCodes(const size_t num_histograms, const size_t max_alphabet_size,
                     BitReader* in, ANSCode* result) {
-  PIK_ASSERT(max_alphabet_size <= ANS_TAB_SIZE);
-  result->map.resize((num_histograms << ANS_LOG_TAB_SIZE) + 1);
-  result->info.resize(num_histograms << ANS_LOG_TAB_SIZE);
+  PIK_ASSERT(max_alphabet_size <= ANS_MAX_ALPHA_SIZE);
+  result->table.resize(num_histograms << ANS_LOG_TAB_SIZE);
   for (size_t c = 0; c < num_histograms; ++c) {
     std::vector<int> counts;
     if (!ReadHistogram(ANS_LOG_TAB_SIZE, &counts, in)) {
@@ -175,25 +159,19 @@ bool DecodeANSCodes(const size_t num_histograms, const size_t max_alphabet_size,
     if (counts.size() > max_alphabet_size) {
       return PIK_FAILURE("Alphabet size is too long.");
     }
-    const size_t histo_offset = c << ANS_LOG_TAB_SIZE;
+    uint32_t* PIK_RESTRICT table =
+        result->table.data() + (c << ANS_LOG_TAB_SIZE);
     uint32_t offset = 0;
-    for (size_t i = 0, pos = 0; i < counts.size(); ++i) {
-      const size_t symbol_idx = histo_offset + i;
-      const uint32_t freq = counts[i];
-#if PIK_BYTE_ORDER_LITTLE
-      const uint32_t s32 = offset + (freq << 16);
-      memcpy(&result->info[symbol_idx], &s32, sizeof(s32));
-#else
-      result->info[symbol_idx].offset = static_cast<uint16_t>(offset);
-      result->info[symbol_idx].freq = static_cast<uint16_t>(freq);
-#endif
-      offset += counts[i];
-      if (offset > ANS_TAB_SIZE) {
+    for (uint32_t symbol = 0; symbol < counts.size(); ++symbol) {
+      const uint32_t freq = counts[symbol];
+      if (freq > ANS_TAB_SIZE - offset) {
         return PIK_FAILURE("Invalid ANS histogram data.");
       }
-      for (size_t j = 0; j < counts[i]; ++j, ++pos) {
-        result->map[histo_offset + pos] = i;
+      for (uint32_t rank = 0; rank < freq; ++rank) {
+        table[offset + rank] = (freq << ANSCode::kFreqShift) |
+                               (rank << ANSCode::kRankShift) | symbol;
       }
+      offset += freq;
     }
   }
   return true;
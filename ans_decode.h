@@ -16,73 +16,93 @@
 
 #include "ans_params.h"
 #include "bit_reader.h"
-#include "byte_order.h"
 
 namespace pik {
 
-struct ANSSymbolInfo {
-  uint16_t offset_;
-  uint16_t freq_;
-  uint8_t symbol_;
-};
-
 struct ANSCode {
-  struct ANSSymbolInfo {
-    uint16_t offset;
-    uint16_t freq;
-  };
-  std::vector<uint16_t> map;
-  // indexed by (entropy_code_id << ANS_LOG_TAB_SIZE) + symbol.
-  std::vector<ANSSymbolInfo> info;
+  // One entry per state slot, indexed by
+  // (entropy_code_id << ANS_LOG_TAB_SIZE) + (state & ANS_TAB_MASK), so that
+  // decoding a symbol requires a single load. Each entry packs the symbol
+  // (lowest byte, so that it is available soonest), the rank of the slot
+  // among the slots of the symbol, and the frequency of the symbol.
+  static constexpr uint32_t kRankShift = ANS_LOG_MAX_ALPHA_SIZE;
+  static constexpr uint32_t kFreqShift = kRankShift + ANS_LOG_TAB_SIZE;
+  static_assert(kFreqShift + ANS_LOG_TAB_SIZE + 1 <= 32, "Freq must fit");
+
+  std::vector<uint32_t> table;
 };
 
 bool DecodeANSCodes(const size_t num_histograms, const size_t max_alphabet_size,
                     BitReader* in, ANSCode* result);
 
-class ANSSymbolReader {
+// Decodes symbols written by WriteTokens with "kNumStates" interleaved rANS
+// states: symbol i of each chunk of kANSBufferSize symbols uses state
+// i % kNumStates. Consecutive symbols thus have independent state updates
+// (multiply-add and renormalization) that the CPU can overlap. The states are
+// rotated after each symbol so that the current one is always states_[0];
+// copies of the reader that are local to a decoding loop can thus keep all
+// states in registers.
+template <size_t kNumStates>
+class ANSSymbolReaderT {
+  static_assert(kNumStates == 1 || kNumStates == 2 || kNumStates == 4,
+                "Unsupported number of ANS states");
+
  public:
-  ANSSymbolReader(const ANSCode* code) : code_(code) {}
+  ANSSymbolReaderT(const ANSCode* code) : code_(code) {
+    for (size_t i = 0; i < kNumStates; ++i) {
+      states_[i] = ANS_SIGNATURE << 16;
+    }
+  }
 
   PIK_INLINE int ReadSymbol(const int histo_idx, BitReader* PIK_RESTRICT br) {
     if (PIK_UNLIKELY(symbols_left_ == 0)) {
-      state_ = br->ReadBits(16);
-      state_ = (state_ << 16) | br->ReadBits(16);
+      for (size_t i = 0; i < kNumStates; ++i) {
+        uint32_t state = br->ReadBits(16);
+        state = (state << 16) | br->ReadBits(16);
+        Rotate(state);
+      }
       br->FillBitBuffer();
       symbols_left_ = kANSBufferSize;
     }
-    const uint32_t res = state_ & (ANS_TAB_SIZE - 1);
-    const int histo_offset = histo_idx << ANS_LOG_TAB_SIZE;
-
-#if PIK_BYTE_ORDER_LITTLE
-    uint32_t s32;
-    memcpy(&s32, &code_->map[histo_offset + res], sizeof(s32));
-    const size_t symbol = s32 & 0xFFFF;
-
-    memcpy(&s32, &code_->info[histo_offset + symbol], sizeof(s32));
-    const uint32_t offset = s32 & 0xFFFF;
-    const uint32_t freq = s32 >> 16;
-    state_ = freq * (state_ >> ANS_LOG_TAB_SIZE) + res - offset;
-#else
-    const uint16_t symbol = code_->map[histo_offset + res];
-    const ANSCode::ANSSymbolInfo s = code_->info[histo_offset + symbol];
-    state_ = s.freq * (state_ >> ANS_LOG_TAB_SIZE) + res - s.offset;
-#endif
+    uint32_t state = states_[0];
+    const uint32_t entry =
+        code_->table[(histo_idx << ANS_LOG_TAB_SIZE) + (state & ANS_TAB_MASK)];
+    const uint32_t symbol = entry & (ANS_MAX_ALPHA_SIZE - 1);
+    const uint32_t rank = (entry >> ANSCode::kRankShift) & ANS_TAB_MASK;
+    state = (entry >> ANSCode::kFreqShift) * (state >> ANS_LOG_TAB_SIZE) + rank;
     --symbols_left_;
-    if (PIK_UNLIKELY(state_ < (1u << 16))) {
-      state_ = (state_ << 16) | br->PeekFixedBits<16>();
+    if (PIK_UNLIKELY(state < (1u << 16))) {
+      state = (state << 16) | br->PeekFixedBits<16>();
       br->Advance(16);
     }
+    Rotate(state);
     return symbol;
   }
 
-  bool CheckANSFinalState() { return state_ == (ANS_SIGNATURE << 16); }
+  bool CheckANSFinalState() {
+    for (size_t i = 0; i < kNumStates; ++i) {
+      if (states_[i] != (ANS_SIGNATURE << 16)) return false;
+    }
+    return true;
+  }
 
  private:
+  // Removes states_[0] and appends "state". Only uses constant indices so that
+  // the compiler can replace the array with registers.
+  PIK_INLINE void Rotate(const uint32_t state) {
+    for (size_t i = 1; i < kNumStates; ++i) {
+      states_[i - 1] = states_[i];
+    }
+    states_[kNumStates - 1] = state;
+  }
+
   size_t symbols_left_ = 0;
-  uint32_t state_ = ANS_SIGNATURE << 16;
+  uint32_t states_[kNumStates];
   const ANSCode* code_;
 };
 
+using ANSSymbolReader = ANSSymbolReaderT<1>;
+
 }  // namespace pik
 
 #endif  // ANS_DECODE_H_
@@ -335,6 +335,13 @@ void BuildAndStoreANSEncodingData(const int* histogram, int alphabet_size,
   }
 }
 
+void ANSEncodingData::BuildFromNormalizedCounts(const int* counts,
+                                                size_t histo_size) {
+  PIK_ASSERT(histo_size <= ANS_TAB_SIZE);
+  ans_table.resize(histo_size);
+  ANSBuildInfoTable(counts, histo_size, ans_table.data());
+}
+
 float ANSPopulationCost(const int* data, int alphabet_size, int total_count) {
   if (total_count == 0) {
     return 7;
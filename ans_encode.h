@@ -59,6 +59,10 @@ struct ANSEncodingData {
     BuildAndStore(counts.data(), counts.size(), storage_ix, storage);
   }
 
+  // Builds the table of "counts" that are already normalized to ANS_TAB_SIZE,
+  // e.g. as read by DecodeANSCodes, without storing them.
+  void BuildFromNormalizedCounts(const int* counts, size_t histo_size);
+
   std::vector<ANSEncSymbolInfo> ans_table;
 };
 
@@ -21,6 +21,9 @@ static const int kANSBufferSize = 1 << 16;
 #define ANS_TAB_SIZE (1 << ANS_LOG_TAB_SIZE)
 #define ANS_TAB_MASK (ANS_TAB_SIZE - 1)
 #define ANS_SIGNATURE 0x13  // Initial state, used as CRC.
+// Upper bound on the alphabet size of all ANS histograms; see ANSCode.
+#define ANS_LOG_MAX_ALPHA_SIZE 8
+#define ANS_MAX_ALPHA_SIZE (1 << ANS_LOG_MAX_ALPHA_SIZE)
 
 }  // namespace pik
 
@@ -33,6 +33,9 @@
 #include <array>
 #include <atomic>
 
+#include "cache_aligned.h"
+#include "common.h"
+
 #define BUTTERAUGLI_RESTRICT PIK_RESTRICT
 
 #ifndef PROFILER_ENABLED
@@ -150,14 +153,29 @@ static void AddSupersampled2x(const ImageF &src, float w, ImageF &dest) {
 static const double kInternalGoodQualityThreshold = 33.23754765778804;
 static const double kGlobalScale = 1.0 / kInternalGoodQualityThreshold;
 
+// Sigmas of the blurs, which also determine kDiffmapRadius (see DiffmapRect).
+static constexpr double kSigmaOpsin = 1.2;
+static constexpr double kSigmaLf = 7.15593339443;
+static constexpr double kSigmaHf = 3.22489901262;
+static constexpr double kSigmaUhf = 1.56416327805;
+static constexpr double kSigmaMaskY0 = 1.63479141169;
+static constexpr double kSigmaMaskY1 = 8.0;
+static constexpr double kSigmaMaskX = 8.0;
+
 inline float DotProduct(const float u[3], const float v[3]) {
   return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
 }
 
+// Returns the radius of the kernel for a positive "sigma"; accuracy increases
+// when the factor 2.25 is increased.
+constexpr int KernelRadius(float sigma) {
+  return static_cast<int>(2.25f * sigma) < 1 ? 1
+                                             : static_cast<int>(2.25f * sigma);
+}
+
 std::vector<float> ComputeKernel(float sigma) {
-  const float m = 2.25;  // Accuracy increases when m is increased.
   const float scaler = -1.0 / (2 * sigma * sigma);
-  const int diff = std::max<int>(1, m * fabs(sigma));
+  const int diff = KernelRadius(fabs(sigma));
   std::vector<float> kernel(2 * diff + 1);
   for (int i = -diff; i <= diff; ++i) {
     kernel[i + diff] = exp(scaler * i * i);
@@ -168,6 +186,7 @@ std::vector<float> ComputeKernel(float sigma) {
 void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
                           const float weight_no_border,
                           const float border_ratio, const size_t x,
+                          const size_t y_begin, const size_t y_end,
                           float* BUTTERAUGLI_RESTRICT row_out) {
   const int offset = kernel.size() / 2;
   int minx = x < offset ? 0 : x - offset;
@@ -179,7 +198,7 @@ void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
   // Interpolate linearly between the no-border scaling and border scaling.
   weight = (1.0f - border_ratio) * weight + border_ratio * weight_no_border;
   float scale = 1.0f / weight;
-  for (size_t y = 0; y < in.ysize(); ++y) {
+  for (size_t y = y_begin; y < y_end; ++y) {
     const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
     float sum = 0.0f;
     for (int j = minx; j <= maxx; ++j) {
@@ -189,30 +208,23 @@ void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
   }
 }
 
-// Computes a horizontal convolution and transposes the result.
-ImageF Convolution(const ImageF& in,
-                   const std::vector<float>& kernel,
-                   const float border_ratio) {
-  PROFILER_FUNC;
-  ImageF out(in.ysize(), in.xsize());
+// Horizontal convolution of the input rows [y_begin, y_end); writes the
+// transposed result to the same columns of "out".
+static void ConvolutionStripe(const ImageF& in,
+                              const std::vector<float>& kernel,
+                              const float border_ratio,
+                              const float weight_no_border,
+                              const float* BUTTERAUGLI_RESTRICT scaled_kernel,
+                              const size_t y_begin, const size_t y_end,
+                              ImageF* BUTTERAUGLI_RESTRICT out) {
   const int len = kernel.size();
   const int offset = len / 2;
-  float weight_no_border = 0.0f;
-  for (int j = 0; j < len; ++j) {
-    weight_no_border += kernel[j];
-  }
-  const float scale_no_border = 1.0f / weight_no_border;
   const int border1 = in.xsize() <= offset ? in.xsize() : offset;
   const int border2 = in.xsize() - offset;
-  float* BUTTERAUGLI_RESTRICT scaled_kernel =
-      (float*)malloc((len / 2 + 1) * sizeof(float));
-  for (int i = 0; i <= len / 2; ++i) {
-    scaled_kernel[i] = kernel[i] * scale_no_border;
-  }
   // left border
   for (int x = 0; x < border1; ++x) {
     ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
-                         out.Row(x));
+                         y_begin, y_end, out->Row(x));
   }
   // middle
   switch (len) {
@@ -221,13 +233,13 @@ ImageF Convolution(const ImageF& in,
       const float sk0 = scaled_kernel[0];
       const float sk1 = scaled_kernel[1];
       const float sk2 = scaled_kernel[2];
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[4]) * sk0;
           sum += (row_in[1] + row_in[3]) * sk1;
           sum += (row_in[2]) * sk2;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
@@ -238,7 +250,7 @@ ImageF Convolution(const ImageF& in,
       const float sk2 = scaled_kernel[2];
       const float sk3 = scaled_kernel[3];
       const float sk4 = scaled_kernel[4];
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[8]) * sk0;
@@ -246,13 +258,13 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[2] + row_in[6]) * sk2;
           sum += (row_in[3] + row_in[5]) * sk3;
           sum += (row_in[4]) * sk4;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
     } break;
     case 17:
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[16]) * scaled_kernel[0];
@@ -264,13 +276,13 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[6] + row_in[10]) * scaled_kernel[6];
           sum += (row_in[7] + row_in[9]) * scaled_kernel[7];
           sum += (row_in[8]) * scaled_kernel[8];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
       break;
     case 33:
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[32]) * scaled_kernel[0];
@@ -290,13 +302,13 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[14] + row_in[18]) * scaled_kernel[14];
           sum += (row_in[15] + row_in[17]) * scaled_kernel[15];
           sum += (row_in[16]) * scaled_kernel[16];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
       break;
     case 11:
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[10]) * scaled_kernel[0];
@@ -305,13 +317,13 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[3] + row_in[7]) * scaled_kernel[3];
           sum += (row_in[4] + row_in[6]) * scaled_kernel[4];
           sum += (row_in[5]) * scaled_kernel[5];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
       break;
     case 41:
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[40]) * scaled_kernel[0];
@@ -335,13 +347,13 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[18] + row_in[22]) * scaled_kernel[18];
           sum += (row_in[19] + row_in[21]) * scaled_kernel[19];
           sum += (row_in[20]) * scaled_kernel[20];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
       break;
     case 47:
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
         for (int x = border1; x < border2; ++x, ++row_in) {
           float sum = (row_in[0] + row_in[46]) * scaled_kernel[0];
@@ -368,7 +380,7 @@ ImageF Convolution(const ImageF& in,
           sum += (row_in[21] + row_in[25]) * scaled_kernel[21];
           sum += (row_in[22] + row_in[24]) * scaled_kernel[22];
           sum += (row_in[23]) * scaled_kernel[23];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           row_out[y] = sum;
         }
       }
@@ -378,11 +390,11 @@ ImageF Convolution(const ImageF& in,
 #else
     default:
 #endif
-      for (size_t y = 0; y < in.ysize(); ++y) {
+      for (size_t y = y_begin; y < y_end; ++y) {
         const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
         for (int j, x = border1; x < border2; ++x) {
           const int d = x - offset;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
+          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
           float sum = 0.0f;
           for (j = 0; j <= len / 2; ++j) {
             sum += row_in[d + j] * scaled_kernel[j];
@@ -397,18 +409,52 @@ ImageF Convolution(const ImageF& in,
   // right border
   for (int x = border2; x < in.xsize(); ++x) {
     ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
-                         out.Row(x));
+                         y_begin, y_end, out->Row(x));
   }
+}
+
+// Number of input rows per ConvolutionStripe task. Each task writes
+// kConvolutionStripeRows consecutive floats of every output row, i.e. whole
+// cache lines, so that concurrent tasks do not share lines.
+static constexpr size_t kConvolutionStripeRows =
+    CacheAligned::kCacheLineSize / sizeof(float);
+
+// Computes a horizontal convolution and transposes the result.
+ImageF Convolution(const ImageF& in,
+                   const std::vector<float>& kernel,
+                   const float border_ratio, ThreadPool* pool) {
+  PROFILER_FUNC;
+  ImageF out(in.ysize(), in.xsize());
+  const int len = kernel.size();
+  float weight_no_border = 0.0f;
+  for (int j = 0; j < len; ++j) {
+    weight_no_border += kernel[j];
+  }
+  const float scale_no_border = 1.0f / weight_no_border;
+  float* BUTTERAUGLI_RESTRICT scaled_kernel =
+      (float*)malloc((len / 2 + 1) * sizeof(float));
+  for (int i = 0; i <= len / 2; ++i) {
+    scaled_kernel[i] = kernel[i] * scale_no_border;
+  }
+  const size_t num_stripes = DivCeil(in.ysize(), kConvolutionStripeRows);
+  RunOnPool(pool, 0, num_stripes, [&](const int task, const int thread) {
+    const size_t y_begin = task * kConvolutionStripeRows;
+    const size_t y_end =
+        std::min(y_begin + kConvolutionStripeRows, in.ysize());
+    ConvolutionStripe(in, kernel, border_ratio, weight_no_border,
+                      scaled_kernel, y_begin, y_end, &out);
+  }, "ButteraugliConvolution");
   free(scaled_kernel);
   return out;
 }
 
 // A blur somewhat similar to a 2D Gaussian blur.
 // See: https://en.wikipedia.org/wiki/Gaussian_blur
-ImageF Blur(const ImageF& in, float sigma, float border_ratio) {
+ImageF Blur(const ImageF& in, float sigma, float border_ratio,
+            ThreadPool* pool) {
   std::vector<float> kernel = ComputeKernel(sigma);
-  return Convolution(Convolution(in, kernel, border_ratio), kernel,
-                     border_ratio);
+  return Convolution(Convolution(in, kernel, border_ratio, pool), kernel,
+                     border_ratio, pool);
 }
 
 // Clamping linear interpolator.
@@ -466,14 +512,14 @@ static inline double Gamma(double v) {
   // return GammaPolynomial(v);
 }
 
-Image3F OpsinDynamicsImage(const Image3F& rgb) {
+Image3F OpsinDynamicsImage(const Image3F& rgb, ThreadPool* pool) {
   PROFILER_FUNC;
   Image3F xyb(rgb.xsize(), rgb.ysize());
-  const double kSigma = 1.2;
-  Image3F blurred(Blur(rgb.Plane(0), kSigma, 0.0),
-                  Blur(rgb.Plane(1), kSigma, 0.0),
-                  Blur(rgb.Plane(2), kSigma, 0.0));
-  for (size_t y = 0; y < rgb.ysize(); ++y) {
+  Image3F blurred(Blur(rgb.Plane(0), kSigmaOpsin, 0.0, pool),
+                  Blur(rgb.Plane(1), kSigmaOpsin, 0.0, pool),
+                  Blur(rgb.Plane(2), kSigmaOpsin, 0.0, pool));
+  RunOnPool(pool, 0, rgb.ysize(), [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row_r = rgb.ConstPlaneRow(0, y);
     const float* BUTTERAUGLI_RESTRICT row_g = rgb.ConstPlaneRow(1, y);
     const float* BUTTERAUGLI_RESTRICT row_b = rgb.ConstPlaneRow(2, y);
@@ -504,7 +550,7 @@ Image3F OpsinDynamicsImage(const Image3F& rgb) {
       RgbToXyb(cur_mixed0, cur_mixed1, cur_mixed2,
                &row_out_x[x], &row_out_y[x], &row_out_b[x]);
     }
-  }
+  }, "OpsinDynamicsImage");
   return xyb;
 }
 
@@ -598,10 +644,12 @@ static ImageF MaximumClamping(size_t xsize, size_t ysize, const ImageF& ix,
 }
 
 static ImageF SuppressXByY(size_t xsize, size_t ysize, const ImageF& ix,
-                           const ImageF& iy, const double yw) {
+                           const ImageF& iy, const double yw,
+                           ThreadPool* pool) {
   static const double s = 0.941388349694;
   ImageF inew(xsize, ysize);
-  for (size_t y = 0; y < ysize; ++y) {
+  RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+    const size_t y = task;
     const float* rowx = ix.Row(y);
     const float* rowy = iy.Row(y);
     float* rownew = inew.Row(y);
@@ -611,18 +659,15 @@ static ImageF SuppressXByY(size_t xsize, size_t ysize, const ImageF& ix,
       const double scaler = s + (yw * (1.0 - s)) / (yw + yval * yval);
       rownew[x] = scaler * xval;
     }
-  }
+  }, "SuppressXByY");
   return inew;
 }
 
 static void SeparateFrequencies(size_t xsize, size_t ysize,
-                                const Image3F& xyb,
+                                const Image3F& xyb, ThreadPool* pool,
                                 PsychoImage& ps) {
   PROFILER_FUNC;
   // Extract lf ...
-  static const double kSigmaLf = 7.15593339443;
-  static const double kSigmaHf = 3.22489901262;
-  static const double kSigmaUhf = 1.56416327805;
   // Border handling is complicated.
   static const double border_lf = 0.0;
   static const double border_mf = 0.0;
@@ -631,69 +676,75 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
   ps.hf[0] = ImageF(xsize, ysize);
   ps.hf[1] = ImageF(xsize, ysize);
   for (int i = 0; i < 3; ++i) {
-    *ps.lf.MutablePlane(i) = Blur(xyb.Plane(i), kSigmaLf, border_lf);
+    *ps.lf.MutablePlane(i) = Blur(xyb.Plane(i), kSigmaLf, border_lf, pool);
     // (Cannot CheckSizesSame - not all planes are initialized.)
 
     // ... and keep everything else in mf.
-    for (size_t y = 0; y < ysize; ++y) {
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       for (size_t x = 0; x < xsize; ++x) {
         ps.mf.PlaneRow(i, y)[x] =
             xyb.PlaneRow(i, y)[x] - ps.lf.ConstPlaneRow(i, y)[x];
       }
-    }
+    }, "SeparateFrequencies");
     if (i == 2) {
-      *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf);
+      *ps.mf.MutablePlane(i) =
+          Blur(ps.mf.Plane(i), kSigmaHf, border_mf, pool);
       ps.mf.CheckSizesSame();
       break;
     }
     // Divide mf into mf and hf.
-    for (size_t y = 0; y < ysize; ++y) {
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       float* BUTTERAUGLI_RESTRICT row_mf = ps.mf.PlaneRow(i, y);
       float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[i].Row(y);
       for (size_t x = 0; x < xsize; ++x) {
         row_hf[x] = row_mf[x];
       }
-    }
-    *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf);
+    }, "SeparateFrequencies");
+    *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf, pool);
     ps.mf.CheckSizesSame();
     static const double kRemoveMfRange = 0.3;
     static const double kAddMfRange = 0.1;
     if (i == 0) {
-      for (size_t y = 0; y < ysize; ++y) {
+      RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_mf = ps.mf.PlaneRow(0, y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[0].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
           row_hf[x] -= row_mf[x];
           row_mf[x] = RemoveRangeAroundZero(kRemoveMfRange, row_mf[x]);
         }
-      }
+      }, "SeparateFrequencies");
     } else {
-      for (size_t y = 0; y < ysize; ++y) {
+      RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_mf = ps.mf.PlaneRow(1, y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[1].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
           row_hf[x] -= row_mf[x];
           row_mf[x] = AmplifyRangeAroundZero(kAddMfRange, row_mf[x]);
         }
-      }
+      }, "SeparateFrequencies");
     }
   }
   // Suppress red-green by intensity change in the high freq channels.
   static const double suppress = 286.09942757;
-  ps.hf[0] = SuppressXByY(xsize, ysize, ps.hf[0], ps.hf[1], suppress);
+  ps.hf[0] = SuppressXByY(xsize, ysize, ps.hf[0], ps.hf[1], suppress, pool);
 
   ps.uhf[0] = ImageF(xsize, ysize);
   ps.uhf[1] = ImageF(xsize, ysize);
   for (int i = 0; i < 2; ++i) {
     // Divide hf into hf and uhf.
-    for (size_t y = 0; y < ysize; ++y) {
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       float* BUTTERAUGLI_RESTRICT row_uhf = ps.uhf[i].Row(y);
       float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[i].Row(y);
       for (size_t x = 0; x < xsize; ++x) {
         row_uhf[x] = row_hf[x];
       }
-    }
-    ps.hf[i] = Blur(ps.hf[i], kSigmaUhf, border_hf);
+    }, "SeparateFrequencies");
+    ps.hf[i] = Blur(ps.hf[i], kSigmaUhf, border_hf, pool);
     static const double kRemoveHfRange = 0.12;
     static const double kAddHfRange = 0.03;
     static const double kRemoveUhfRange = 0.08;
@@ -703,7 +754,8 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
     static double kMulYHf = 1.16155986803;
     static double kMulYUhf = 2.32552960949;
     if (i == 0) {
-      for (size_t y = 0; y < ysize; ++y) {
+      RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_uhf = ps.uhf[0].Row(y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[0].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
@@ -711,9 +763,10 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
           row_hf[x] = RemoveRangeAroundZero(kRemoveHfRange, row_hf[x]);
           row_uhf[x] = RemoveRangeAroundZero(kRemoveUhfRange, row_uhf[x]);
         }
-      }
+      }, "SeparateFrequencies");
     } else {
-      for (size_t y = 0; y < ysize; ++y) {
+      RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_uhf = ps.uhf[1].Row(y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[1].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
@@ -725,14 +778,15 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
           row_hf[x] = AmplifyRangeAroundZero(kAddHfRange, row_hf[x]);
           row_uhf[x] = AmplifyRangeAroundZero(kAddUhfRange, row_uhf[x]);
         }
-      }
+      }, "SeparateFrequencies");
     }
   }
   // Modify range around zero code only concerns the high frequency
   // planes and only the X and Y channels.
   // Convert low freq xyb to vals space so that we can do a simple squared sum
   // diff on the low frequencies later.
-  for (size_t y = 0; y < ysize; ++y) {
+  RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+    const size_t y = task;
     float* BUTTERAUGLI_RESTRICT row_x = ps.lf.PlaneRow(0, y);
     float* BUTTERAUGLI_RESTRICT row_y = ps.lf.PlaneRow(1, y);
     float* BUTTERAUGLI_RESTRICT row_b = ps.lf.PlaneRow(2, y);
@@ -743,15 +797,16 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
       row_y[x] = valy;
       row_b[x] = valb;
     }
-  }
+  }, "SeparateFrequencies");
 }
 
 static void L2Diff(const ImageF& i0, const ImageF& i1, const float w,
-                   ImageF* BUTTERAUGLI_RESTRICT diffmap) {
+                   ThreadPool* pool, ImageF* BUTTERAUGLI_RESTRICT diffmap) {
   if (w == 0) {
     return;
   }
-  for (size_t y = 0; y < i0.ysize(); ++y) {
+  RunOnPool(pool, 0, i0.ysize(), [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = i0.ConstRow(y);
     const float* BUTTERAUGLI_RESTRICT row1 = i1.ConstRow(y);
     float* BUTTERAUGLI_RESTRICT row_diff = diffmap->Row(y);
@@ -759,21 +814,22 @@ static void L2Diff(const ImageF& i0, const ImageF& i1, const float w,
       const float diff = row0[x] - row1[x];
       row_diff[x] += w * diff * diff;
     }
-  }
+  }, "L2Diff");
 }
 
 // i0 is the original image.
 // i1 is the deformed copy.
 static void L2DiffAsymmetric(const ImageF& i0, const ImageF& i1,
                              double w_0gt1,
-                             double w_0lt1,
+                             double w_0lt1, ThreadPool* pool,
                              ImageF* BUTTERAUGLI_RESTRICT diffmap) {
   if (w_0gt1 == 0 && w_0lt1 == 0) {
     return;
   }
   w_0gt1 *= 0.8;
   w_0lt1 *= 0.8;
-  for (size_t y = 0; y < i0.ysize(); ++y) {
+  RunOnPool(pool, 0, i0.ysize(), [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = i0.Row(y);
     const float* BUTTERAUGLI_RESTRICT row1 = i1.Row(y);
     float* BUTTERAUGLI_RESTRICT row_diff = diffmap->Row(y);
@@ -805,15 +861,16 @@ static void L2DiffAsymmetric(const ImageF& i0, const ImageF& i1,
         }
       }
     }
-  }
+  }, "L2DiffAsymmetric");
 }
 
-ImageF CalculateDiffmap(const ImageF& diffmap_in) {
+ImageF CalculateDiffmap(const ImageF& diffmap_in, ThreadPool* pool) {
   PROFILER_FUNC;
   // Take square root.
   ImageF diffmap(diffmap_in.xsize(), diffmap_in.ysize());
   static const float kInitialSlope = 100.0f;
-  for (size_t y = 0; y < diffmap.ysize(); ++y) {
+  RunOnPool(pool, 0, diffmap.ysize(), [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row_in = diffmap_in.Row(y);
     float* BUTTERAUGLI_RESTRICT row_out = diffmap.Row(y);
     for (size_t x = 0; x < diffmap.xsize(); ++x) {
@@ -824,7 +881,7 @@ ImageF CalculateDiffmap(const ImageF& diffmap_in) {
                         ? kInitialSlope * orig_val
                         : std::sqrt(orig_val));
     }
-  }
+  }, "CalculateDiffmap");
   return diffmap;
 }
 
@@ -832,7 +889,8 @@ void MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
                      const size_t xsize, const size_t ysize,
                      Image3F* BUTTERAUGLI_RESTRICT mask,
                      Image3F* BUTTERAUGLI_RESTRICT mask_dc,
-                     ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+                     ImageF* BUTTERAUGLI_RESTRICT diff_ac,
+                     ThreadPool* pool) {
   Image3F mask_xyb0(xsize, ysize);
   Image3F mask_xyb1(xsize, ysize);
   static const double muls[4] = {
@@ -844,7 +902,8 @@ void MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
   for (int i = 0; i < 2; ++i) {
     double a = muls[2 * i];
     double b = muls[2 * i + 1];
-    for (size_t y = 0; y < ysize; ++y) {
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       const float* BUTTERAUGLI_RESTRICT row_hf0 = pi0.hf[i].Row(y);
       const float* BUTTERAUGLI_RESTRICT row_hf1 = pi1.hf[i].Row(y);
       const float* BUTTERAUGLI_RESTRICT row_uhf0 = pi0.uhf[i].Row(y);
@@ -855,27 +914,44 @@ void MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
         row0[x] = a * row_uhf0[x] + b * row_hf0[x];
         row1[x] = a * row_uhf1[x] + b * row_hf1[x];
       }
-    }
+    }, "MaskPsychoImage");
   }
-  Mask(mask_xyb0, mask_xyb1, mask, mask_dc, diff_ac);
+  Mask(mask_xyb0, mask_xyb1, mask, mask_dc, diff_ac, pool);
 }
 
 ButteraugliComparator::ButteraugliComparator(const Image3F& rgb0,
-                                             double hf_asymmetry)
+                                             double hf_asymmetry,
+                                             ThreadPool* pool)
     : xsize_(rgb0.xsize()),
       ysize_(rgb0.ysize()),
       hf_asymmetry_(hf_asymmetry),
+      pool_(pool),
       sub_(nullptr) {
   if (xsize_ < 8 || ysize_ < 8) {
     return;
   }
-  Image3F xyb0 = OpsinDynamicsImage(rgb0);
-  SeparateFrequencies(xsize_, ysize_, xyb0, pi0_);
+  Image3F xyb0 = OpsinDynamicsImage(rgb0, pool_);
+  SeparateFrequencies(xsize_, ysize_, xyb0, pool_, pi0_);
 
   // Awful recursive construction of samples of different resolution.
   // This is an after-thought and possibly somewhat parallel in
   // functionality with the PsychoImage multi-resolution approach.
-  sub_ = new ButteraugliComparator(SubSample2x(rgb0), hf_asymmetry);
+  sub_ = new ButteraugliComparator(SubSample2x(rgb0), hf_asymmetry, pool_);
+}
+
+ButteraugliComparator::ButteraugliComparator(
+    const ButteraugliComparator& other, const Rect& rect)
+    : xsize_(rect.xsize()),
+      ysize_(rect.ysize()),
+      hf_asymmetry_(other.hf_asymmetry_),
+      pool_(other.pool_),
+      sub_(nullptr) {
+  for (int i = 0; i < 2; ++i) {
+    pi0_.uhf[i] = CopyImage(rect, other.pi0_.uhf[i]);
+    pi0_.hf[i] = CopyImage(rect, other.pi0_.hf[i]);
+  }
+  pi0_.mf = CopyImage(rect, other.pi0_.mf);
+  pi0_.lf = CopyImage(rect, other.pi0_.lf);
 }
 
 ButteraugliComparator::~ButteraugliComparator() {
@@ -885,7 +961,7 @@ ButteraugliComparator::~ButteraugliComparator() {
 
 void ButteraugliComparator::Mask(Image3F* BUTTERAUGLI_RESTRICT mask,
                                  Image3F* BUTTERAUGLI_RESTRICT mask_dc) const {
-  MaskPsychoImage(pi0_, pi0_, xsize_, ysize_, mask, mask_dc, nullptr);
+  MaskPsychoImage(pi0_, pi0_, xsize_, ysize_, mask, mask_dc, nullptr, pool_);
 }
 
 void ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result) const {
@@ -893,18 +969,74 @@ void ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result) const {
   if (xsize_ < 8 || ysize_ < 8) {
     return;
   }
-  DiffmapOpsinDynamicsImage(OpsinDynamicsImage(rgb1), result);
+  DiffmapOpsinDynamicsImage(OpsinDynamicsImage(rgb1, pool_), result);
   if (sub_) {
     if (sub_->xsize_ < 8 || sub_->ysize_ < 8) {
       return;
     }
     ImageF subresult;
     sub_->DiffmapOpsinDynamicsImage(
-        OpsinDynamicsImage(SubSample2x(rgb1)), subresult);
+        OpsinDynamicsImage(SubSample2x(rgb1), pool_), subresult);
     AddSupersampled2x(subresult, 0.5, result);
   }
 }
 
+// Support of the diffmap at one resolution: the opsin dynamics blur, the chain
+// of blurs in SeparateFrequencies, then the larger of the 9x9 Malta window and
+// the neighbors read by DiffPrecompute plus the widest masking blur.
+constexpr int kMaltaRadius = 4;
+constexpr int kMaskRadius =
+    1 + (KernelRadius(kSigmaMaskY1) > KernelRadius(kSigmaMaskX)
+             ? KernelRadius(kSigmaMaskY1)
+             : KernelRadius(kSigmaMaskX));
+static_assert(KernelRadius(kSigmaMaskY0) <= KernelRadius(kSigmaMaskY1),
+              "kMaskRadius assumes the Y0 blur is the narrower one");
+constexpr int kRadiusPerScale =
+    KernelRadius(kSigmaOpsin) + KernelRadius(kSigmaLf) +
+    KernelRadius(kSigmaHf) + KernelRadius(kSigmaUhf) +
+    (kMaskRadius > kMaltaRadius ? kMaskRadius : kMaltaRadius);
+// The sub-resolution comparator doubles that, plus one pixel for the 2x2
+// subsampling.
+static_assert(static_cast<int>(kDiffmapRadius) == 2 * kRadiusPerScale + 1,
+              "kDiffmapRadius must match the support of the filters");
+
+void ButteraugliComparator::DiffmapRect(const Image3F& rgb1, const Rect& rect,
+                                        ImageF& result) const {
+  PROFILER_FUNC;
+  if (xsize_ < 8 || ysize_ < 8) {
+    return;
+  }
+  // The region starts at even coordinates so that its 2x2 subsampling matches
+  // that of the whole image; it only has an odd size at the image border.
+  const auto begin = [](size_t pos) {
+    return pos > kDiffmapRadius ? (pos - kDiffmapRadius) & ~size_t(1) : 0;
+  };
+  const auto end = [](size_t pos, size_t size) {
+    const size_t padded = pos + kDiffmapRadius;
+    return padded < size ? std::min(size, (padded + 1) & ~size_t(1)) : size;
+  };
+  const size_t x0 = begin(rect.x0());
+  const size_t y0 = begin(rect.y0());
+  const Rect padded(x0, y0, end(rect.x0() + rect.xsize(), xsize_) - x0,
+                    end(rect.y0() + rect.ysize(), ysize_) - y0);
+
+  ButteraugliComparator region(*this, padded);
+  if (sub_ && sub_->xsize_ >= 8 && sub_->ysize_ >= 8) {
+    region.sub_ = new ButteraugliComparator(
+        *sub_, Rect(x0 / 2, y0 / 2, (padded.xsize() + 1) / 2,
+                    (padded.ysize() + 1) / 2));
+  }
+  ImageF region_result;
+  region.Diffmap(CopyImage(padded, rgb1), region_result);
+
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    const float* BUTTERAUGLI_RESTRICT row_in =
+        region_result.ConstRow(rect.y0() - y0 + y) + rect.x0() - x0;
+    float* BUTTERAUGLI_RESTRICT row_out = rect.Row(&result, y);
+    memcpy(row_out, row_in, rect.xsize() * sizeof(float));
+  }
+}
+
 void ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
                                                       ImageF& result) const {
   PROFILER_FUNC;
@@ -912,7 +1044,7 @@ void ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
     return;
   }
   PsychoImage pi1;
-  SeparateFrequencies(xsize_, ysize_, xyb1, pi1);
+  SeparateFrequencies(xsize_, ysize_, xyb1, pool_, pi1);
   result = ImageF(xsize_, ysize_);
   DiffmapPsychoImage(pi1, result);
 }
@@ -970,12 +1102,12 @@ void ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
     if (c < 2) {  // No blue channel error accumulated at HF.
       L2DiffAsymmetric(pi0_.hf[c], pi1.hf[c],
                        wmul[c] * hf_asymmetry_,
-                       wmul[c] / hf_asymmetry_,
+                       wmul[c] / hf_asymmetry_, pool_,
                        block_diff_ac.MutablePlane(c));
     }
-    L2Diff(pi0_.mf.Plane(c), pi1.mf.Plane(c), wmul[3 + c],
+    L2Diff(pi0_.mf.Plane(c), pi1.mf.Plane(c), wmul[3 + c], pool_,
            block_diff_ac.MutablePlane(c));
-    L2Diff(pi0_.lf.Plane(c), pi1.lf.Plane(c), wmul[6 + c],
+    L2Diff(pi0_.lf.Plane(c), pi1.lf.Plane(c), wmul[6 + c], pool_,
            block_diff_dc.MutablePlane(c));
   }
 
@@ -985,10 +1117,11 @@ void ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   Image3F mask_xyb;
   Image3F mask_xyb_dc;
   MaskPsychoImage(pi0_, pi1, xsize_, ysize_, &mask_xyb, &mask_xyb_dc,
-                  block_diff_ac.MutablePlane(1));
+                  block_diff_ac.MutablePlane(1), pool_);
 
   result = CalculateDiffmap(
-      CombineChannels(mask_xyb, mask_xyb_dc, block_diff_dc, block_diff_ac));
+      CombineChannels(mask_xyb, mask_xyb_dc, block_diff_dc, block_diff_ac),
+      pool_);
 }
 
 // Allows PaddedMaltaUnit to call either function via overloading.
@@ -1368,7 +1501,7 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
                              const double w_0lt1,
                              const double norm1,
                              const double len, const double mulli,
-                             ImageF* block_diff_ac) {
+                             ThreadPool* pool, ImageF* block_diff_ac) {
   const float kWeight0 = 0.5;
   const float kWeight1 = 0.33;
 
@@ -1378,10 +1511,11 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
   const float norm2_0lt1 = w_pre0lt1 * norm1;
 
   std::vector<float> diffs(ysize_ * xsize_);
-  for (size_t y = 0, ix = 0; y < ysize_; ++y) {
+  RunOnPool(pool, 0, ysize_, [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = lum0.Row(y);
     const float* BUTTERAUGLI_RESTRICT row1 = lum1.Row(y);
-    for (size_t x = 0; x < xsize_; ++x, ++ix) {
+    for (size_t x = 0, ix = y * xsize_; x < xsize_; ++x, ++ix) {
       const float absval = 0.5f * (std::abs(row0[x]) + std::abs(row1[x]));
       const float diff = row0[x] - row1[x];
       const float scaler = norm2_0gt1 / (static_cast<float>(norm1) + absval);
@@ -1430,21 +1564,22 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
         }
       }
     }
-  }
+  }, "MaltaDiffMap");
 
-  size_t y0 = 0;
-  // Top
-  for (; y0 < 4; ++y0) {
+  // Each row only reads "diffs", which is complete at this point.
+  RunOnPool(pool, 0, ysize_, [&](const int task, const int thread) {
+    const size_t y0 = task;
     float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
+    if (y0 < 4 || y0 >= ysize_ - 4) {
+      // Top and bottom
+      for (size_t x0 = 0; x0 < xsize_; ++x0) {
+        row_diff[x0] +=
+            PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
+      }
+      return;
     }
-  }
 
-  // Middle
-  for (; y0 < ysize_ - 4; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
+    // Middle
     size_t x0 = 0;
     for (; x0 < 4; ++x0) {
       row_diff[x0] +=
@@ -1459,16 +1594,7 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
       row_diff[x0] +=
           PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
     }
-  }
-
-  // Bottom
-  for (; y0 < ysize_; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-  }
+  }, "MaltaDiffMap");
 }
 
 void ButteraugliComparator::MaltaDiffMap(
@@ -1480,7 +1606,7 @@ void ButteraugliComparator::MaltaDiffMap(
   const double len = 3.75;
   static const double mulli = 0.371226387683;
   MaltaDiffMapImpl<MaltaTag>(lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1, norm1,
-                             len, mulli, block_diff_ac);
+                             len, mulli, pool_, block_diff_ac);
 }
 
 void ButteraugliComparator::MaltaDiffMapLF(
@@ -1492,7 +1618,7 @@ void ButteraugliComparator::MaltaDiffMapLF(
   const double len = 3.75;
   static const double mulli = 0.692743715861;
   MaltaDiffMapImpl<MaltaTagLF>(lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1,
-                               norm1, len, mulli, block_diff_ac);
+                               norm1, len, mulli, pool_, block_diff_ac);
 }
 
 ImageF ButteraugliComparator::CombineChannels(
@@ -1500,7 +1626,8 @@ ImageF ButteraugliComparator::CombineChannels(
     const Image3F& block_diff_dc, const Image3F& block_diff_ac) const {
   PROFILER_FUNC;
   ImageF result(xsize_, ysize_);
-  for (size_t y = 0; y < ysize_; ++y) {
+  RunOnPool(pool_, 0, ysize_, [&](const int task, const int thread) {
+    const size_t y = task;
     float* BUTTERAUGLI_RESTRICT row_out = result.Row(y);
     for (size_t x = 0; x < xsize_; ++x) {
       float mask[3];
@@ -1515,7 +1642,7 @@ ImageF ButteraugliComparator::CombineChannels(
       }
       row_out[x] = (DotProduct(diff_dc, dc_mask) + DotProduct(diff_ac, mask));
     }
-  }
+  }, "CombineChannels");
   return result;
 }
 
@@ -1593,14 +1720,15 @@ double MaskDcY(double delta) {
 }
 
 ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
-                       float mul, float cutoff) {
+                       float mul, float cutoff, ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
   ImageF result(xsize, ysize);
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y < ysize; ++y) {
+  RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < ysize) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -1671,7 +1799,7 @@ ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
         }
       }
     }
-  }
+  }, "DiffPrecomputeX");
   return result;
 }
 
@@ -1679,14 +1807,15 @@ ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
 // both images back so that they can be used for similarity comparisons
 // too.
 void DiffPrecomputeY(const ImageF& xyb0, const ImageF& xyb1,
-                     float mul, float mul2,
+                     float mul, float mul2, ThreadPool* pool,
                      ImageF *out0, ImageF *out1) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y < ysize; ++y) {
+  RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < ysize) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -1743,13 +1872,13 @@ void DiffPrecomputeY(const ImageF& xyb0, const ImageF& xyb1,
       row_out0[x] = mul * (log(sup0 * sup0 * mul2 + kBias) - log(kBias));
       row_out1[x] = mul * (log(sup1 * sup1 * mul2 + kBias) - log(kBias));
     }
-  }
+  }, "DiffPrecomputeY");
 }
 
 void Mask(const Image3F& xyb0, const Image3F& xyb1,
           Image3F* BUTTERAUGLI_RESTRICT mask,
           Image3F* BUTTERAUGLI_RESTRICT mask_dc,
-          ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+          ImageF* BUTTERAUGLI_RESTRICT diff_ac, ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
@@ -1762,22 +1891,21 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
   double normalizer = {
     1.0 / (muls[0] + muls[1]),
   };
-  static const double r0 = 1.63479141169;
-  static const double r1 = 8.0;
-  static const double r2 = 8.0;
   static const double border_ratio = 0;
 
   {
     // X component
     static const double mul = 0.533043878407;
     static const double cutoff = 0.5;
-    ImageF diff = DiffPrecomputeX(xyb0.Plane(0), xyb1.Plane(0), mul, cutoff);
-    ImageF blurred = Blur(diff, r2, border_ratio);
-    for (size_t y = 0; y < ysize; ++y) {
+    ImageF diff =
+        DiffPrecomputeX(xyb0.Plane(0), xyb1.Plane(0), mul, cutoff, pool);
+    ImageF blurred = Blur(diff, kSigmaMaskX, border_ratio, pool);
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       for (size_t x = 0; x < xsize; ++x) {
         mask->PlaneRow(0, y)[x] = blurred.Row(y)[x];
       }
-    }
+    }, "Mask");
   }
   {
     // Y component
@@ -1785,12 +1913,14 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
     static const double mul2 = 1.0;
     ImageF diff0(xyb0.xsize(), xyb0.ysize());
     ImageF diff1(xyb0.xsize(), xyb0.ysize());
-    DiffPrecomputeY(xyb0.Plane(1), xyb1.Plane(1), mul, mul2, &diff0, &diff1);
-    ImageF blurred0_a = Blur(diff0, r0, border_ratio);
-    ImageF blurred0_b = Blur(diff0, r1, border_ratio);
-    ImageF blurred1_a = Blur(diff1, r0, border_ratio);
-    ImageF blurred1_b = Blur(diff1, r1, border_ratio);
-    for (size_t y = 0; y < ysize; ++y) {
+    DiffPrecomputeY(xyb0.Plane(1), xyb1.Plane(1), mul, mul2, pool, &diff0,
+                    &diff1);
+    ImageF blurred0_a = Blur(diff0, kSigmaMaskY0, border_ratio, pool);
+    ImageF blurred0_b = Blur(diff0, kSigmaMaskY1, border_ratio, pool);
+    ImageF blurred1_a = Blur(diff1, kSigmaMaskY0, border_ratio, pool);
+    ImageF blurred1_b = Blur(diff1, kSigmaMaskY1, border_ratio, pool);
+    RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+      const size_t y = task;
       for (size_t x = 0; x < xsize; ++x) {
         const double val = normalizer * (
             muls[0] * blurred1_a.Row(y)[x] +
@@ -1805,7 +1935,7 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
           diff_ac->Row(y)[x] += wa * wa + wb * wb;
         }
       }
-    }
+    }, "Mask");
   }
   // B component
   static const double w00 = 425.68063445;
@@ -1814,7 +1944,8 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
   static const double w_ytob_lf = 30.6362338596;
   static const double p1_to_p0 = 0.0812601733358;
 
-  for (size_t y = 0; y < ysize; ++y) {
+  RunOnPool(pool, 0, ysize, [&](const int task, const int thread) {
+    const size_t y = task;
     for (size_t x = 0; x < xsize; ++x) {
       const double s0 = mask->PlaneRow(0, y)[x];
       const double s1 = mask->PlaneRow(1, y)[x];
@@ -1828,11 +1959,12 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
       mask_dc->PlaneRow(1, y)[x] = MaskDcY(p1);
       mask_dc->PlaneRow(2, y)[x] = w_ytob_lf * MaskDcY(p1);
     }
-  }
+  }, "Mask");
 }
 
 bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
-                        double hf_asymmetry, ImageF& result_image) {
+                        double hf_asymmetry, ImageF& result_image,
+                        ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = rgb0.xsize();
   const size_t ysize = rgb0.ysize();
@@ -1865,8 +1997,8 @@ bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
       }
     }
     ImageF diffmap_scaled;
-    const bool ok =
-        ButteraugliDiffmap(scaled0, scaled1, hf_asymmetry, diffmap_scaled);
+    const bool ok = ButteraugliDiffmap(scaled0, scaled1, hf_asymmetry,
+                                       diffmap_scaled, pool);
     result_image = ImageF(xsize, ysize);
     for (size_t y = 0; y < ysize; ++y) {
       for (size_t x = 0; x < xsize; ++x) {
@@ -1875,7 +2007,7 @@ bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
     }
     return ok;
   }
-  ButteraugliComparator butteraugli(rgb0, hf_asymmetry);
+  ButteraugliComparator butteraugli(rgb0, hf_asymmetry, pool);
   butteraugli.Diffmap(rgb1, result_image);
   return true;
 }
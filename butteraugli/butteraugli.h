@@ -20,6 +20,7 @@
 #include <memory>
 #include <vector>
 
+#include "data_parallel.h"
 #include "image.h"
 
 #define BUTTERAUGLI_ENABLE_CHECKS 0
@@ -175,6 +176,12 @@ static inline std::vector<std::vector<T>> PackedFromPlanes(
   return packed;
 }
 
+// Each pixel of a diffmap only depends on the pixels of both images within
+// this distance: the widest chain of filters at half resolution, doubled.
+// Derived from the blur sigmas and checked by a static_assert in
+// butteraugli.cc.
+constexpr size_t kDiffmapRadius = 95;
+
 struct PsychoImage {
   ImageF uhf[2];  // XY
   ImageF hf[2];   // XY
@@ -184,13 +191,23 @@ struct PsychoImage {
 
 class ButteraugliComparator {
  public:
-  ButteraugliComparator(const Image3F &rgb0, double hf_asymmetry);
+  // If "pool" is not null, it is also used by all subsequent Diffmap and Mask
+  // calls, so these must not be called from within a task of the same pool.
+  // The results do not depend on the number of threads.
+  ButteraugliComparator(const Image3F &rgb0, double hf_asymmetry,
+                        ThreadPool *pool = nullptr);
   virtual ~ButteraugliComparator();
 
   // Computes the butteraugli map between the original image given in the
   // constructor and the distorted image give here.
   void Diffmap(const Image3F &rgb1, ImageF &result) const;
 
+  // Same as above, but only recomputes the pixels of "result" (a diffmap of
+  // the same size) within "rect", which only reads rgb1 within kDiffmapRadius
+  // of "rect". The pixels are identical to those computed by Diffmap.
+  void DiffmapRect(const Image3F &rgb1, const Rect &rect,
+                   ImageF &result) const;
+
   // Same as above, but OpsinDynamicsImage() was already applied.
   void DiffmapOpsinDynamicsImage(const Image3F &xyb1, ImageF &result) const;
 
@@ -200,6 +217,10 @@ class ButteraugliComparator {
   void Mask(Image3F *PIK_RESTRICT mask, Image3F *PIK_RESTRICT mask_dc) const;
 
  private:
+  // Comparator for the region "rect" of the image of "other", reusing its
+  // frequency decomposition. Has no sub-resolution comparator.
+  ButteraugliComparator(const ButteraugliComparator &other, const Rect &rect);
+
   void MaltaDiffMapLF(const ImageF &y0, const ImageF &y1, double w_0gt1,
                       double w_0lt1, double normalization,
                       ImageF *PIK_RESTRICT block_diff_ac) const;
@@ -215,12 +236,14 @@ class ButteraugliComparator {
   const size_t xsize_;
   const size_t ysize_;
   float hf_asymmetry_;
+  ThreadPool *pool_;  // not owned
   PsychoImage pi0_;
   ButteraugliComparator *sub_;
 };
 
 bool ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
-                        double hf_asymmetry, ImageF &diffmap);
+                        double hf_asymmetry, ImageF &diffmap,
+                        ThreadPool *pool = nullptr);
 
 double ButteraugliScoreFromDiffmap(const ImageF& distmap);
 
@@ -231,7 +254,8 @@ Image3B CreateHeatMapImage(const ImageF &distmap, double good_threshold,
 // Compute values of local frequency and dc masking based on the activity
 // in the two images.
 void Mask(const Image3F &xyb0, const Image3F &xyb1, Image3F *PIK_RESTRICT mask,
-          Image3F *PIK_RESTRICT mask_dc, ImageF *diff_ac = nullptr);
+          Image3F *PIK_RESTRICT mask_dc, ImageF *diff_ac = nullptr,
+          ThreadPool *pool = nullptr);
 
 template <class V>
 BUTTERAUGLI_INLINE void RgbToXyb(const V &r, const V &g, const V &b,
@@ -279,9 +303,10 @@ BUTTERAUGLI_INLINE void OpsinAbsorbance(const V &in0, const V &in1,
   *out2 = mix8 * in0 + mix9 * in1 + mix10 * in2 + mix11;
 }
 
-Image3F OpsinDynamicsImage(const Image3F &rgb);
+Image3F OpsinDynamicsImage(const Image3F &rgb, ThreadPool *pool = nullptr);
 
-ImageF Blur(const ImageF& in, float sigma, float border_ratio);
+ImageF Blur(const ImageF& in, float sigma, float border_ratio,
+            ThreadPool *pool = nullptr);
 
 double SimpleGamma(double v);
 
@@ -6,7 +6,14 @@
 
 #include "butteraugli_comparator.h"
 
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "common.h"
 #include "opsin_inverse.h"
+#include "profiler.h"
 
 namespace pik {
 
@@ -18,22 +25,155 @@ Image3F LinearFromOpsin(const Image3F& opsin) {
   return linear;
 }
 
+// Granularity of the change detection in CompareIncremental.
+constexpr size_t kChangeTileDim = 32;
+
+// Returns whether each kChangeTileDim x kChangeTileDim tile of "a" differs from
+// "b" (bitwise).
+ImageB ChangedTiles(const Image3F& a, const Image3F& b, ThreadPool* pool) {
+  const size_t xsize_tiles = DivCeil(a.xsize(), kChangeTileDim);
+  const size_t ysize_tiles = DivCeil(a.ysize(), kChangeTileDim);
+  ImageB changed(xsize_tiles, ysize_tiles);
+  RunOnPool(pool, 0, ysize_tiles, [&](const int task, const int thread) {
+    const size_t ty = task;
+    const size_t y_begin = ty * kChangeTileDim;
+    const size_t y_end = std::min(a.ysize(), y_begin + kChangeTileDim);
+    uint8_t* PIK_RESTRICT row_changed = changed.Row(ty);
+    for (size_t tx = 0; tx < xsize_tiles; ++tx) {
+      const size_t x0 = tx * kChangeTileDim;
+      const size_t bytes =
+          (std::min(a.xsize(), x0 + kChangeTileDim) - x0) * sizeof(float);
+      bool differs = false;
+      for (size_t c = 0; c < 3 && !differs; ++c) {
+        for (size_t y = y_begin; y < y_end && !differs; ++y) {
+          differs = memcmp(a.ConstPlaneRow(c, y) + x0,
+                           b.ConstPlaneRow(c, y) + x0, bytes) != 0;
+        }
+      }
+      row_changed[tx] = differs;
+    }
+  }, "ChangedTiles");
+  return changed;
+}
+
+// Returns rects that cover all pixels within "radius" of a changed tile: the
+// bounding boxes of the connected regions of changed tiles after dilating them
+// by "radius".
+std::vector<Rect> RegionsAroundChanges(const ImageB& changed, size_t radius,
+                                       size_t xsize, size_t ysize) {
+  const int64_t xsize_tiles = changed.xsize();
+  const int64_t ysize_tiles = changed.ysize();
+  const int64_t r = DivCeil(radius, kChangeTileDim);
+  ImageB dilated(xsize_tiles, ysize_tiles);
+  FillImage<uint8_t>(0, &dilated);
+  for (int64_t ty = 0; ty < ysize_tiles; ++ty) {
+    for (int64_t tx = 0; tx < xsize_tiles; ++tx) {
+      if (!changed.ConstRow(ty)[tx]) continue;
+      for (int64_t y = std::max<int64_t>(0, ty - r);
+           y <= std::min(ysize_tiles - 1, ty + r); ++y) {
+        for (int64_t x = std::max<int64_t>(0, tx - r);
+             x <= std::min(xsize_tiles - 1, tx + r); ++x) {
+          dilated.Row(y)[x] = 1;
+        }
+      }
+    }
+  }
+
+  std::vector<Rect> rects;
+  std::vector<std::pair<int64_t, int64_t>> stack;
+  for (int64_t ty = 0; ty < ysize_tiles; ++ty) {
+    for (int64_t tx = 0; tx < xsize_tiles; ++tx) {
+      if (!dilated.Row(ty)[tx]) continue;
+      // Flood fill, clearing the tiles of the region.
+      int64_t x0 = tx, y0 = ty, x1 = tx, y1 = ty;
+      dilated.Row(ty)[tx] = 0;
+      stack.emplace_back(tx, ty);
+      while (!stack.empty()) {
+        const int64_t x = stack.back().first;
+        const int64_t y = stack.back().second;
+        stack.pop_back();
+        x0 = std::min(x0, x);
+        y0 = std::min(y0, y);
+        x1 = std::max(x1, x);
+        y1 = std::max(y1, y);
+        const std::pair<int64_t, int64_t> neighbors[4] = {
+            {x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1}};
+        for (const auto& n : neighbors) {
+          if (n.first < 0 || n.first >= xsize_tiles || n.second < 0 ||
+              n.second >= ysize_tiles || !dilated.Row(n.second)[n.first]) {
+            continue;
+          }
+          dilated.Row(n.second)[n.first] = 0;
+          stack.push_back(n);
+        }
+      }
+      rects.emplace_back(x0 * kChangeTileDim, y0 * kChangeTileDim,
+                         (x1 - x0 + 1) * kChangeTileDim,
+                         (y1 - y0 + 1) * kChangeTileDim, xsize, ysize);
+    }
+  }
+  return rects;
+}
+
 }  // namespace
 
 ButteraugliComparator::ButteraugliComparator(const Image3F& opsin,
                                              float hf_asymmetry,
-                                             float multiplier)
+                                             float multiplier,
+                                             ThreadPool* pool)
     : xsize_(opsin.xsize()),
       ysize_(opsin.ysize()),
-      comparator_(ScaleImage(multiplier, LinearFromOpsin(opsin)), hf_asymmetry),
+      comparator_(ScaleImage(multiplier, LinearFromOpsin(opsin)), hf_asymmetry,
+                  pool),
       distance_(0.0),
       multiplier_(multiplier),
+      pool_(pool),
       distmap_(xsize_, ysize_) {
   FillImage(0.0f, &distmap_);
 }
 
 void ButteraugliComparator::Compare(const Image3F& linear_rgb) {
   PIK_CHECK(SameSize(distmap_, linear_rgb));
+  last_linear_rgb_ = Image3F();
+  ComputeDistmap(linear_rgb);
+}
+
+void ButteraugliComparator::CompareIncremental(const Image3F& linear_rgb) {
+  PROFILER_FUNC;
+  PIK_CHECK(SameSize(distmap_, linear_rgb));
+  if (last_linear_rgb_.xsize() == 0) {
+    ComputeDistmap(linear_rgb);
+    last_linear_rgb_ = CopyImage(linear_rgb);
+    return;
+  }
+
+  const std::vector<Rect> rects = RegionsAroundChanges(
+      ChangedTiles(last_linear_rgb_, linear_rgb, pool_),
+      butteraugli::kDiffmapRadius, xsize_, ysize_);
+  // DiffmapRect also processes the kDiffmapRadius border around each rect.
+  size_t cost = 0;
+  for (const Rect& rect : rects) {
+    const size_t border = 2 * butteraugli::kDiffmapRadius;
+    cost += std::min<size_t>(xsize_, rect.xsize() + border) *
+            std::min<size_t>(ysize_, rect.ysize() + border);
+  }
+  if (cost >= static_cast<size_t>(xsize_) * ysize_) {
+    ComputeDistmap(linear_rgb);
+  } else if (!rects.empty()) {
+    Image3F scaled;
+    if (multiplier_ != 1) {
+      scaled = ScaleImage(multiplier_, linear_rgb);
+    }
+    const Image3F& rgb = multiplier_ == 1 ? linear_rgb : scaled;
+    for (const Rect& rect : rects) {
+      comparator_.DiffmapRect(rgb, rect, distmap_);
+    }
+    distance_ = butteraugli::ButteraugliScoreFromDiffmap(distmap_);
+  }
+  CopyImageTo(linear_rgb, &last_linear_rgb_);
+}
+
+void ButteraugliComparator::ComputeDistmap(const Image3F& linear_rgb) {
   if (multiplier_ == 1) {
     comparator_.Diffmap(linear_rgb, distmap_);
   } else {
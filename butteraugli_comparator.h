@@ -8,29 +8,45 @@
 #define BUTTERAUGLI_COMPARATOR_H_
 
 #include "butteraugli/butteraugli.h"
+#include "data_parallel.h"
 #include "image.h"
 
 namespace pik {
 
 class ButteraugliComparator {
  public:
+  // "pool" is used by all Compare/Mask calls (see butteraugli.h).
   ButteraugliComparator(const Image3F& opsin, float hf_asymmetry,
-                        float multiplier);
+                        float multiplier, ThreadPool* pool = nullptr);
 
   void Compare(const Image3F& linear_rgb);
 
+  // Same as Compare, but only recomputes the distmap around the tiles in which
+  // "linear_rgb" differs from that of the previous CompareIncremental call, or
+  // the whole distmap if they cover most of the image. The result is identical
+  // to Compare. Keeps a copy of "linear_rgb". Only worthwhile if most tiles
+  // are unchanged between calls, as in FindBestQuantizationHQ.
+  void CompareIncremental(const Image3F& linear_rgb);
+
   const ImageF& distmap() const { return distmap_; }
   float distance() const { return distance_; }
 
   void Mask(Image3F* mask, Image3F* mask_dc);
 
  private:
+  // Recomputes distmap_ and distance_ for the whole image.
+  void ComputeDistmap(const Image3F& linear_rgb);
+
   const int xsize_;
   const int ysize_;
   butteraugli::ButteraugliComparator comparator_;
   float distance_;
   float multiplier_;
+  ThreadPool* pool_;  // not owned
   ImageF distmap_;
+  // Input of the previous CompareIncremental; empty until its first call and
+  // after Compare.
+  Image3F last_linear_rgb_;
 };
 
 }  // namespace pik
@@ -19,10 +19,12 @@ namespace pik {
 namespace {
 
 float ButteraugliDistanceLinearSRGB(const Image3F& rgb0, const Image3F& rgb1,
-                                    float hf_asymmetry, ImageF* distmap_out) {
+                                    float hf_asymmetry, ImageF* distmap_out,
+                                    ThreadPool* pool) {
   ImageF distmap_tmp;
   ImageF& distmap = distmap_out == nullptr ? distmap_tmp : *distmap_out;
-  PIK_CHECK(butteraugli::ButteraugliDiffmap(rgb0, rgb1, hf_asymmetry, distmap));
+  PIK_CHECK(butteraugli::ButteraugliDiffmap(rgb0, rgb1, hf_asymmetry, distmap,
+                                            pool));
   return butteraugli::ButteraugliScoreFromDiffmap(distmap);
 }
 
@@ -96,7 +98,7 @@ float ButteraugliDistance(const CodecInOut* rgb0, const CodecInOut* rgb1,
   // No alpha: skip blending, only need a single call to Butteraugli.
   if (!rgb0->HasAlpha() && !rgb1->HasAlpha()) {
     return ButteraugliDistanceLinearSRGB(*linear_srgb0, *linear_srgb1,
-                                         hf_asymmetry, distmap);
+                                         hf_asymmetry, distmap, pool);
   }
 
   // Blend on black and white backgrounds
@@ -117,9 +119,9 @@ float ButteraugliDistance(const CodecInOut* rgb0, const CodecInOut* rgb1,
 
   ImageF distmap_black, distmap_white;
   const float dist_black = ButteraugliDistanceLinearSRGB(
-      *blended_black0, *blended_black1, hf_asymmetry, &distmap_black);
+      *blended_black0, *blended_black1, hf_asymmetry, &distmap_black, pool);
   const float dist_white = ButteraugliDistanceLinearSRGB(
-      *blended_white0, *blended_white1, hf_asymmetry, &distmap_white);
+      *blended_white0, *blended_white1, hf_asymmetry, &distmap_white, pool);
 
   // distmap and return values are the max of distmap_black/white.
   if (distmap != nullptr) {
@@ -5,19 +5,24 @@
 // https://opensource.org/licenses/MIT.
 
 #include <stdio.h>
+#include <string.h>
 
+#include "args.h"
 #include "butteraugli_distance.h"
 #include "codec.h"
+#include "data_parallel.h"
 #include "image.h"
+#include "os_specific.h"
 #include "status.h"
 
 namespace pik {
 namespace {
 
-Status RunButteraugli(const char* pathname1, const char* pathname2) {
+Status RunButteraugli(const char* pathname1, const char* pathname2,
+                      const size_t num_threads) {
   CodecContext codec_context;
   CodecInOut io1(&codec_context);
-  ThreadPool pool(4);
+  ThreadPool pool(num_threads);
   if (!io1.SetFromFile(pathname1, &pool)) {
     fprintf(stderr, "Failed to read image from %s\n", pathname1);
     return false;
@@ -45,13 +50,32 @@ Status RunButteraugli(const char* pathname1, const char* pathname2) {
   return true;
 }
 
+Status Run(int argc, char** argv) {
+  const char* pathnames[2] = {nullptr, nullptr};
+  size_t num_pathnames = 0;
+  size_t num_threads = AvailableCPUs().size();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--num_threads") == 0) {
+      PIK_RETURN_IF_ERROR(ParseUnsigned(argc, argv, &i, &num_threads));
+    } else if (argv[i][0] != '-' && num_pathnames < 2) {
+      pathnames[num_pathnames++] = argv[i];
+    } else {
+      num_pathnames = 0;
+      break;
+    }
+  }
+  if (num_pathnames != 2) {
+    fprintf(stderr,
+            "Usage: %s [--num_threads N] <reference> <distorted>\n"
+            "  --num_threads: number of worker threads (zero = none);\n"
+            "    defaults to the number of available CPUs.\n",
+            argv[0]);
+    return false;
+  }
+  return RunButteraugli(pathnames[0], pathnames[1], num_threads);
+}
+
 }  // namespace
 }  // namespace pik
 
-int main(int argc, char** argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <reference> <distorted>\n", argv[0]);
-    return 1;
-  }
-  return pik::RunButteraugli(argv[1], argv[2]) ? 0 : 1;
-}
+int main(int argc, char** argv) { return pik::Run(argc, argv) ? 0 : 1; }
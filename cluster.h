@@ -215,6 +215,9 @@ int HistogramCombine(HistogramType* out, int* cluster_size, float* bit_cost,
 // -----------------------------------------------------------------------------
 // Histogram refinement
 
+// HistogramRemap is only worthwhile (and affordable) for few clusters.
+static const int kMinClustersForHistogramRemap = 24;
+
 // What is the bit cost of moving histogram from cur_symbol to candidate.
 template <typename HistogramType>
 float HistogramBitCostDistance(const HistogramType& histogram,
@@ -315,8 +318,6 @@ void ClusterHistograms(const std::vector<HistogramType>& in, int num_contexts,
     }
   }
 
-  static const int kMinClustersForHistogramRemap = 24;
-
   int num_clusters = 0;
   if (block_group_offsets.size() > 1) {
     // Collapse similar histograms within block groups.
@@ -355,6 +356,97 @@ void ClusterHistograms(const std::vector<HistogramType>& in, int num_contexts,
   HistogramReindex(out, histogram_symbols);
 }
 
+// Number of HistogramRemap rounds in FastClusterHistograms.
+static const int kFastClusterRemapRounds = 2;
+
+// Same interface and result format as ClusterHistograms (with a single block
+// type), but avoids the quadratic pairwise search over all input histograms:
+// up to max_histograms seeds are chosen by farthest-point traversal (the next
+// seed is the histogram that is most expensive to encode with the statistics
+// of its nearest seed), every histogram joins its nearest seed, and only the
+// resulting clusters are combined as in ClusterHistograms and then remapped.
+// Requires O(in.size() * max_histograms) PopulationCost evaluations.
+template <typename HistogramType>
+void FastClusterHistograms(const std::vector<HistogramType>& in,
+                           int max_histograms, std::vector<HistogramType>* out,
+                           std::vector<uint32_t>* histogram_symbols) {
+  const int in_size = in.size();
+  std::vector<float> bit_cost(in_size);
+  for (int i = 0; i < in_size; ++i) {
+    bit_cost[i] = in[i].PopulationCost();
+  }
+
+  // Cost of encoding each histogram with its nearest seed so far; seeds are
+  // marked with lowest().
+  std::vector<float> dists(in_size, std::numeric_limits<float>::max());
+  std::vector<uint32_t> nearest(in_size, 0);
+  int next_seed = 0;
+  for (int i = 1; i < in_size; ++i) {
+    if (in[i].total_count_ > in[next_seed].total_count_) next_seed = i;
+  }
+  HistogramType combo;  // Reused to avoid allocations.
+  for (int num_seeds = 0; num_seeds < max_histograms; ++num_seeds) {
+    const int seed = next_seed;
+    dists[seed] = std::numeric_limits<float>::lowest();
+    nearest[seed] = seed;
+    float max_dist = 0.0f;
+    for (int i = 0; i < in_size; ++i) {
+      if (dists[i] == std::numeric_limits<float>::lowest()) continue;
+      float dist = 0.0f;
+      if (in[i].total_count_ != 0) {
+        combo = in[i];
+        combo.AddHistogram(in[seed]);
+        dist = combo.PopulationCost() - bit_cost[seed];
+      }
+      if (dist < dists[i]) {
+        dists[i] = dist;
+        nearest[i] = seed;
+      }
+      if (dists[i] > max_dist) {
+        max_dist = dists[i];
+        next_seed = i;
+      }
+    }
+    // Only empty histograms remain.
+    if (max_dist == 0.0f) break;
+  }
+
+  out->clear();
+  out->resize(in_size);
+  std::vector<int> cluster_size(in_size, 0);
+  *histogram_symbols = nearest;
+  for (int i = 0; i < in_size; ++i) {
+    (*out)[nearest[i]].AddHistogram(in[i]);
+    ++cluster_size[nearest[i]];
+  }
+  for (int i = 0; i < in_size; ++i) {
+    if (cluster_size[i] != 0) bit_cost[i] = (*out)[i].PopulationCost();
+  }
+
+  const int num_clusters =
+      HistogramCombine(&(*out)[0], &cluster_size[0], &bit_cost[0],
+                       &(*histogram_symbols)[0], in_size, max_histograms);
+  // Unlike ClusterHistograms, remap regardless of the number of clusters: it
+  // costs about as much as the seeding and recovers most of the size lost to
+  // the coarser clustering. A second round helps because the first one moves
+  // histograms between clusters and thus changes their statistics.
+  if (num_clusters >= 2) {
+    for (int round = 0; round < kFastClusterRemapRounds; ++round) {
+      if (round != 0) {
+        for (int i = 0; i < in_size; ++i) {
+          if ((*out)[i].total_count_ != 0) {
+            bit_cost[i] = (*out)[i].PopulationCost();
+          }
+        }
+      }
+      HistogramRemap(&in[0], in_size, &(*out)[0], &bit_cost[0],
+                     &(*histogram_symbols)[0]);
+    }
+  }
+
+  HistogramReindex(out, histogram_symbols);
+}
+
 }  // namespace pik
 
 #endif  // CLUSTER_H_
@@ -9,10 +9,11 @@
 #include "huffman_encode.h"
 #include "write_bits.h"
 
+#include <vector>
+
 #undef PROFILER_ENABLED
 #define PROFILER_ENABLED 1
 #include "common.h"
-#include "dct_util.h"
 #include "profiler.h"
 #include "quantizer.h"
 
@@ -38,9 +39,9 @@ inline void FindIndexOfSumMaximum(const V* array, const size_t len, R* idx,
 }
 
 template <int MAIN_CHANNEL, int SIDE_CHANNEL, int SCALE, int OFFSET>
-void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
-                         ImageF* PIK_RESTRICT tmp_map, int* PIK_RESTRICT dc,
-                         float acceptance) {
+void FindBestCorrelation(const Image3F& dct, ThreadPool* pool,
+                         ImageI* PIK_RESTRICT map, ImageF* PIK_RESTRICT tmp_map,
+                         int* PIK_RESTRICT dc, float acceptance) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
   constexpr float kScale = SCALE;
@@ -52,8 +53,11 @@ void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
   for (int k = 0; k < block_size; ++k) {
     qm[k] = 1.0f / kDequantMatrix[k];
   }
-  int32_t d_num_zeros_global[256] = {0};
-  for (int ty = 0; ty < map->ysize(); ++ty) {
+  // Per tile row, summed afterwards so that the result does not depend on
+  // the order in which rows are processed.
+  std::vector<int32_t> d_num_zeros_rows(map->ysize() * 256);
+  const auto process_row = [&](const int ty, const int thread) {
+    int32_t* PIK_RESTRICT d_num_zeros_row = &d_num_zeros_rows[ty * 256];
     int* PIK_RESTRICT row_out = map->Row(ty);
     float* PIK_RESTRICT row_tmp_out = tmp_map->Row(ty);
     for (int tx = 0; tx < map->xsize(); ++tx) {
@@ -111,11 +115,19 @@ void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
       int32_t best_sum = 0;
       FindIndexOfSumMaximum(d_num_zeros, 256, &best, &best_sum);
       for (size_t i = 0; i < 256; ++i) {
-        d_num_zeros_global[i] += d_num_zeros[i];
+        d_num_zeros_row[i] += d_num_zeros[i];
       }
       row_out[tx] = best;
       row_tmp_out[tx] = (float)best_sum / ((x1 - x0) * (y1 - y0));
     }
+  };
+  RunOnPool(pool, 0, map->ysize(), process_row, "FindBestCorrelation");
+
+  int32_t d_num_zeros_global[256] = {0};
+  for (size_t ty = 0; ty < map->ysize(); ++ty) {
+    for (size_t i = 0; i < 256; ++i) {
+      d_num_zeros_global[i] += d_num_zeros_rows[ty * 256 + i];
+    }
   }
 
   int global_best = 0;
@@ -211,18 +223,16 @@ template void ApplyColorCorrelationDC<true>(const ColorCorrelationMap&,
 template void ApplyColorCorrelationDC<false>(const ColorCorrelationMap&,
                                              const ImageF&, Image3F*);
 
-void FindBestColorCorrelationMap(const Image3F& opsin,
+void FindBestColorCorrelationMap(const Image3F& opsin_dct, ThreadPool* pool,
                                  ColorCorrelationMap* cmap) {
   PROFILER_ZONE("enc YTo* correlation");
 
   constexpr int block_size = kBlockDim * kBlockDim;
-  const size_t xsize_blocks = opsin.xsize() / kBlockDim;
-  const size_t ysize_blocks = opsin.ysize() / kBlockDim;
-  Image3F dct(xsize_blocks * block_size, ysize_blocks);
-  TransposedScaledDCT(opsin, &dct);
+  const size_t xsize_blocks = opsin_dct.xsize() / block_size;
+  const size_t ysize_blocks = opsin_dct.ysize();
 
-  ImageF tmp(DivCeil(opsin.xsize(), kColorTileDim),
-             DivCeil(opsin.ysize(), kColorTileDim));
+  ImageF tmp(DivCeil(xsize_blocks * kBlockDim, kColorTileDim),
+             DivCeil(ysize_blocks * kBlockDim, kColorTileDim));
 
   // These two coefficients are eligible for optimization.
   // Perhaps, they also could be made quality-dependent.
@@ -232,11 +242,11 @@ void FindBestColorCorrelationMap(const Image3F& opsin,
   float y_to_x_acceptance = -0.625f;
 
   FindBestCorrelation</* from Y */ 1, /* to B */ 2, kColorFactorB,
-                      kColorOffsetB>(dct, &cmap->ytob_map, &tmp, &cmap->ytob_dc,
-                                     y_to_b_acceptance);
+                      kColorOffsetB>(opsin_dct, pool, &cmap->ytob_map, &tmp,
+                                     &cmap->ytob_dc, y_to_b_acceptance);
   FindBestCorrelation</* from Y */ 1, /* to X */ 0, kColorFactorX,
-                      kColorOffsetX>(dct, &cmap->ytox_map, &tmp, &cmap->ytox_dc,
-                                     y_to_x_acceptance);
+                      kColorOffsetX>(opsin_dct, pool, &cmap->ytox_map, &tmp,
+                                     &cmap->ytox_dc, y_to_x_acceptance);
 }
 
 bool DecodeColorMap(BitReader* PIK_RESTRICT br, ImageI* PIK_RESTRICT ac_map,
@@ -259,14 +269,14 @@ bool DecodeColorMap(BitReader* PIK_RESTRICT br, ImageI* PIK_RESTRICT ac_map,
   return true;
 }
 
-std::string EncodeColorMap(const ImageI& ac_map, const Rect& rect,
-                           const int dc_val, PikImageSizeInfo* info) {
+void EncodeColorMap(const ImageI& ac_map, const Rect& rect, const int dc_val,
+                    BitWriter* writer, PikImageSizeInfo* info) {
   PIK_ASSERT(rect.IsInside(ac_map));
   const size_t max_out_size = rect.xsize() * rect.ysize() + 1024;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_out_size * kBitsPerByte);
+  size_t* storage_ix = writer->pos();
+  uint8_t* storage = writer->storage();
   std::vector<uint32_t> histogram(256);
   ++histogram[dc_val];
   for (int y = 0; y < rect.ysize(); ++y) {
@@ -277,25 +287,24 @@ std::string EncodeColorMap(const ImageI& ac_map, const Rect& rect,
   std::vector<uint8_t> bit_depths(256);
   std::vector<uint16_t> bit_codes(256);
   BuildAndStoreHuffmanTree(histogram.data(), histogram.size(),
-                           bit_depths.data(), bit_codes.data(), &storage_ix,
+                           bit_depths.data(), bit_codes.data(), storage_ix,
                            storage);
-  const size_t histo_bits = storage_ix;
-  WriteBits(bit_depths[dc_val], bit_codes[dc_val], &storage_ix, storage);
+  const size_t histo_bits = writer->BitsWritten() - bits_before;
+  WriteBits(bit_depths[dc_val], bit_codes[dc_val], storage_ix, storage);
   for (int y = 0; y < rect.ysize(); ++y) {
     const int* PIK_RESTRICT row = rect.ConstRow(ac_map, y);
     for (int x = 0; x < rect.xsize(); ++x) {
-      WriteBits(bit_depths[row[x]], bit_codes[row[x]], &storage_ix, storage);
+      WriteBits(bit_depths[row[x]], bit_codes[row[x]], storage_ix, storage);
     }
   }
-  WriteZeroesToByteBoundary(&storage_ix, storage);
-  PIK_ASSERT((storage_ix >> 3) <= output.size());
-  output.resize(storage_ix >> 3);
+  writer->ZeroPadToByte();
+  const size_t num_bits = writer->BitsWritten() - bits_before;
+  PIK_ASSERT(num_bits <= max_out_size * kBitsPerByte);
   if (info) {
     info->histogram_size += histo_bits >> 3;
-    info->entropy_coded_bits += storage_ix - histo_bits;
-    info->total_size += output.size();
+    info->entropy_coded_bits += num_bits - histo_bits;
+    info->total_size += num_bits >> 3;
   }
-  return output;
 }
 
 }  // namespace pik
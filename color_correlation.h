@@ -15,6 +15,7 @@
 #include "data_parallel.h"
 #include "image.h"
 #include "pik_info.h"
+#include "write_bits.h"
 
 namespace pik {
 
@@ -96,11 +97,13 @@ SIMD_ATTR void ApplyColorCorrelationDC(const ColorCorrelationMap& cmap,
                                        const ImageF& y_plane_dc,
                                        Image3F* coeffs_dc);
 
-void FindBestColorCorrelationMap(const Image3F& opsin,
+// "opsin_dct" is the TransposedScaledDCT of the opsin image.
+void FindBestColorCorrelationMap(const Image3F& opsin_dct, ThreadPool* pool,
                                  ColorCorrelationMap* cmap);
 
-std::string EncodeColorMap(const ImageI& ac_map, const Rect& rect,
-                           const int dc_val, PikImageSizeInfo* info);
+// Writes the "rect" of "ac_map" and "dc_val", zero-padded to a byte boundary.
+void EncodeColorMap(const ImageI& ac_map, const Rect& rect, const int dc_val,
+                    BitWriter* writer, PikImageSizeInfo* info);
 
 bool DecodeColorMap(BitReader* PIK_RESTRICT br, ImageI* PIK_RESTRICT ac_map,
                     int* PIK_RESTRICT dc_val);
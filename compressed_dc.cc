@@ -6,6 +6,8 @@
 
 #include "compressed_dc.h"
 
+#include <algorithm>
+
 #include "common.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
@@ -227,28 +229,26 @@ SIMD_ATTR void DequantDC(const Image3S& img_dc16, const Rect& rect,
   }
 }
 
-// `rect`: block units
-std::string CompressDCGroup(const Image3S& dc, const Rect& rect,
-                            bool use_new_dc, bool grayscale,
-                            PikImageSizeInfo* dc_info) {
-  std::string dc_code;
+// `rect`: block units. Appends the group code to `out`.
+void CompressDCGroup(const Image3S& dc, const Rect& rect, bool use_new_dc,
+                     bool grayscale, bool use_prefix_codes,
+                     PikImageSizeInfo* dc_info, PaddedBytes* out) {
   if (use_new_dc) {
-    PaddedBytes enc_dc;
-    Image3SCompress(dc, rect, grayscale, &enc_dc);
-    dc_code.assign(enc_dc.data(), enc_dc.data() + enc_dc.size());
+    Image3SCompress(dc, rect, grayscale, out);
   } else {
     Image3S tmp_dc_residuals(rect.xsize(), rect.ysize());
     ShrinkDC(rect, dc, &tmp_dc_residuals);
-    dc_code =
-        EncodeImageData(Rect(tmp_dc_residuals), tmp_dc_residuals, dc_info);
+    BitWriter writer(out);
+    EncodeImageData(Rect(tmp_dc_residuals), tmp_dc_residuals, &writer,
+                    dc_info, use_prefix_codes);
   }
-  return dc_code;
 }
 
 // `rect`: block units.
 Status DecodeDCGroup(BitReader* reader, const PaddedBytes& compressed,
                      const Rect& rect, bool use_new_dc, bool grayscale,
-                     const float* mul_dc, const float ytox_dc,
+                     bool use_prefix_codes, const float* mul_dc,
+                     const float ytox_dc,
                      const float ytob_dc, PassDecCache* pass_dec_cache) {
   Image3S quantized_dc(rect.xsize(), rect.ysize());
   if (use_new_dc) {
@@ -260,7 +260,8 @@ Status DecodeDCGroup(BitReader* reader, const PaddedBytes& compressed,
     ImageS dc_y(rect.xsize(), rect.ysize());
     ImageS dc_xz_residuals(rect.xsize() * 2, rect.ysize());
     ImageS dc_xz_expanded(rect.xsize() * 2, rect.ysize());
-    if (!DecodeImage(reader, Rect(quantized_dc), &quantized_dc)) {
+    if (!DecodeImage(reader, Rect(quantized_dc), &quantized_dc,
+                     use_prefix_codes)) {
       return PIK_FAILURE("Failed to decode DC image");
     }
 
@@ -277,11 +278,8 @@ using DCGroupSizeCoder = SizeCoderT<0x150F0E0C>;
 
 }  // namespace
 
-PaddedBytes EncodeDC(const Quantizer& quantizer,
-                     const PassEncCache& pass_enc_cache, ThreadPool* pool,
-                     PikImageSizeInfo* dc_info) {
-  PaddedBytes out;
-
+void EncodeDC(const Quantizer& quantizer, const PassEncCache& pass_enc_cache,
+              ThreadPool* pool, BitWriter* writer, PikImageSizeInfo* dc_info) {
   const size_t xsize_blocks = pass_enc_cache.dc.xsize();
   const size_t ysize_blocks = pass_enc_cache.dc.ysize();
   const size_t xsize_groups =
@@ -298,19 +296,29 @@ PaddedBytes EncodeDC(const Quantizer& quantizer,
     }
   }
 
-  std::vector<PaddedBytes> group_codes(num_groups);
+  // As in EncodePassData, each thread appends its groups to its own arena;
+  // they are gathered into the output after the TOC.
+  struct GroupSpan {
+    size_t arena;
+    size_t begin;  // [bytes]
+    size_t size;
+  };
+  std::vector<PaddedBytes> arenas(std::max<size_t>(NumThreads(pool), 1));
+  std::vector<GroupSpan> group_spans(num_groups);
   const auto process_group = [&](const int group_index, const int thread) {
-    size_t group_pos = 0;
     const size_t gx = group_index % xsize_groups;
     const size_t gy = group_index / xsize_groups;
     const Rect rect(gx * kDcGroupDimInBlocks, gy * kDcGroupDimInBlocks,
                     kDcGroupDimInBlocks, kDcGroupDimInBlocks, xsize_blocks,
                     ysize_blocks);
-    std::string group_code = CompressDCGroup(
-        pass_enc_cache.dc, rect, pass_enc_cache.use_new_dc,
-        pass_enc_cache.grayscale_opt, size_info[group_index].get());
-    group_codes[group_index].resize(group_code.size());
-    Append(group_code, &group_codes[group_index], &group_pos);
+    PaddedBytes* arena = &arenas[thread];
+    const size_t begin = arena->size();
+    CompressDCGroup(pass_enc_cache.dc, rect, pass_enc_cache.use_new_dc,
+                    pass_enc_cache.grayscale_opt,
+                    pass_enc_cache.use_prefix_codes,
+                    size_info[group_index].get(), arena);
+    group_spans[group_index] = {static_cast<size_t>(thread), begin,
+                                arena->size() - begin};
   };
   RunOnPool(pool, 0, num_groups, process_group, "EncodeDC");
 
@@ -321,45 +329,62 @@ PaddedBytes EncodeDC(const Quantizer& quantizer,
   }
 
   // Build TOC.
-  PaddedBytes group_toc(DCGroupSizeCoder::MaxSize(num_groups));
-  size_t group_toc_pos = 0;
-  uint8_t* group_toc_storage = group_toc.data();
   size_t total_groups_size = 0;
+  writer->Reserve(DCGroupSizeCoder::MaxSize(num_groups) * kBitsPerByte);
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    size_t group_size = group_codes[group_index].size();
-    DCGroupSizeCoder::Encode(group_size, &group_toc_pos, group_toc_storage);
+    const size_t group_size = group_spans[group_index].size;
+    DCGroupSizeCoder::Encode(group_size, writer->pos(), writer->storage());
     total_groups_size += group_size;
   }
-  WriteZeroesToByteBoundary(&group_toc_pos, group_toc_storage);
-  group_toc.resize(group_toc_pos / kBitsPerByte);
+  writer->ZeroPadToByte();
+
+  // Gather groups into the output.
+  writer->Reserve(total_groups_size * kBitsPerByte);
+  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+    const GroupSpan& span = group_spans[group_index];
+    writer->AppendBytes(arenas[span.arena].data() + span.begin, span.size);
+  }
 
-  PaddedBytes serialized_gradient_map;
   if (pass_enc_cache.use_gradient) {
+    PaddedBytes serialized_gradient_map;
     SerializeGradientMap(pass_enc_cache.gradient, Rect(pass_enc_cache.dc),
                          quantizer, &serialized_gradient_map);
+    writer->AppendBytes(serialized_gradient_map);
   }
+}
+
+Status BeginDecodeDC(BitReader* reader, size_t xsize_blocks,
+                     size_t ysize_blocks, std::vector<size_t>* group_offsets,
+                     PassDecCache* pass_dec_cache) {
+  pass_dec_cache->dc = Image3F(xsize_blocks, ysize_blocks);
 
-  // Push output.
-  size_t pos = 0;
-  out.reserve(group_toc.size() + total_groups_size +
-              serialized_gradient_map.size());
-  out.append(group_toc);
-  pos += group_toc.size() * kBitsPerByte;
+  const size_t xsize_groups = DivCeil(xsize_blocks, kDcGroupDimInBlocks);
+  const size_t ysize_groups = DivCeil(ysize_blocks, kDcGroupDimInBlocks);
+  const size_t num_groups = xsize_groups * ysize_groups;
+
+  // Read TOC.
+  group_offsets->clear();
+  group_offsets->reserve(num_groups + 1);
+  group_offsets->push_back(0);
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    const PaddedBytes& group_code = group_codes[group_index];
-    out.append(group_code);
-    pos += group_code.size() * kBitsPerByte;
+    const uint32_t size = DCGroupSizeCoder::Decode(reader);
+    group_offsets->push_back(group_offsets->back() + size);
   }
-  out.append(serialized_gradient_map);
-
-  return out;
+  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+  return true;
 }
 
-Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
-                const PassHeader& pass_header, size_t xsize_blocks,
-                size_t ysize_blocks, const Quantizer& quantizer,
-                const ColorCorrelationMap& cmap, ThreadPool* pool,
-                PassDecCache* pass_dec_cache) {
+Status DecodeDCGroups(const PaddedBytes& compressed, size_t group_codes_begin,
+                      const std::vector<size_t>& group_offsets,
+                      size_t begin_group, size_t end_group,
+                      const Rect& needed_blocks, const Quantizer& quantizer,
+                      const ColorCorrelationMap& cmap, ThreadPool* pool,
+                      PassDecCache* pass_dec_cache) {
+  PIK_ASSERT(begin_group <= end_group && end_group < group_offsets.size());
+  if (group_codes_begin + group_offsets[end_group] > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+
   const float* dequant_matrices = quantizer.DequantMatrix(0, kQuantKindDCT8);
   float mul_dc[3];
   for (int c = 0; c < 3; ++c) {
@@ -368,34 +393,13 @@ Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
                 quantizer.inv_quant_dc();
   }
 
-  pass_dec_cache->dc = Image3F(xsize_blocks, ysize_blocks);
-
   // Precompute DC inverse color transform.
   float ytox_dc = ColorCorrelationMap::YtoX(1.0f, cmap.ytox_dc);
   float ytob_dc = ColorCorrelationMap::YtoB(1.0f, cmap.ytob_dc);
 
+  const size_t xsize_blocks = pass_dec_cache->dc.xsize();
+  const size_t ysize_blocks = pass_dec_cache->dc.ysize();
   const size_t xsize_groups = DivCeil(xsize_blocks, kDcGroupDimInBlocks);
-  const size_t ysize_groups = DivCeil(ysize_blocks, kDcGroupDimInBlocks);
-  const size_t num_groups = xsize_groups * ysize_groups;
-
-  // Read TOC.
-  std::vector<size_t> group_offsets;
-  {
-    group_offsets.reserve(num_groups + 1);
-    group_offsets.push_back(0);
-    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-      const uint32_t size = DCGroupSizeCoder::Decode(reader);
-      group_offsets.push_back(group_offsets.back() + size);
-    }
-    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
-  }
-
-  // Pretend all groups are read.
-  size_t group_codes_begin = reader->Position();
-  reader->SkipBits(group_offsets.back() * kBitsPerByte);
-  if (reader->Position() > compressed.size()) {
-    return PIK_FAILURE("Group code extends after stream end");
-  }
 
   // Decode groups.
   std::atomic<int> num_errors{0};
@@ -414,26 +418,74 @@ Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
     const Rect rect(gx * kDcGroupDimInBlocks, gy * kDcGroupDimInBlocks,
                     kDcGroupDimInBlocks, kDcGroupDimInBlocks, xsize_blocks,
                     ysize_blocks);
+    if (rect.x0() >= needed_blocks.x0() + needed_blocks.xsize() ||
+        rect.y0() >= needed_blocks.y0() + needed_blocks.ysize() ||
+        needed_blocks.x0() >= rect.x0() + rect.xsize() ||
+        needed_blocks.y0() >= rect.y0() + rect.ysize()) {
+      return;
+    }
     if (!DecodeDCGroup(&group_reader, compressed, rect,
                        pass_dec_cache->use_new_dc, pass_dec_cache->grayscale,
-                       mul_dc, ytox_dc, ytob_dc, pass_dec_cache)) {
+                       pass_dec_cache->use_prefix_codes, mul_dc, ytox_dc,
+                       ytob_dc, pass_dec_cache)) {
       num_errors.fetch_add(1);
       return;
     }
   };
-  RunOnPool(pool, 0, num_groups, process_group, "DecodeDC");
+  RunOnPool(pool, begin_group, end_group, process_group, "DecodeDC");
 
   PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  return true;
+}
 
+Status ReadGradientMap(BitReader* reader, const PaddedBytes& compressed,
+                       const PassHeader& pass_header, const Quantizer& quantizer,
+                       PassDecCache* pass_dec_cache) {
   if (pass_header.flags & PassHeader::kGradientMap) {
     size_t byte_pos = reader->Position();
     PIK_RETURN_IF_ERROR(DeserializeGradientMap(
-        xsize_blocks, ysize_blocks,
+        pass_dec_cache->dc.xsize(), pass_dec_cache->dc.ysize(),
         pass_header.flags & PassHeader::kGrayscaleOpt, quantizer, compressed,
         &byte_pos, &pass_dec_cache->gradient));
     reader->SkipBits((byte_pos - reader->Position()) * 8);
+    if (!reader->Healthy()) {
+      return PIK_FAILURE("Gradient map extends after stream end");
+    }
+  }
+  return true;
+}
+
+void FinishDecodeDC(const PassHeader& pass_header, const Quantizer& quantizer,
+                    PassDecCache* pass_dec_cache) {
+  if (pass_header.flags & PassHeader::kGradientMap) {
     ApplyGradientMap(pass_dec_cache->gradient, quantizer, &pass_dec_cache->dc);
   }
+}
+
+Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
+                const PassHeader& pass_header, size_t xsize_blocks,
+                size_t ysize_blocks, const Quantizer& quantizer,
+                const ColorCorrelationMap& cmap, ThreadPool* pool,
+                PassDecCache* pass_dec_cache) {
+  std::vector<size_t> group_offsets;
+  PIK_RETURN_IF_ERROR(BeginDecodeDC(reader, xsize_blocks, ysize_blocks,
+                                    &group_offsets, pass_dec_cache));
+
+  // Pretend all groups are read.
+  size_t group_codes_begin = reader->Position();
+  reader->SkipBits(group_offsets.back() * kBitsPerByte);
+  if (reader->Position() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+
+  const size_t num_groups = group_offsets.size() - 1;
+  PIK_RETURN_IF_ERROR(DecodeDCGroups(compressed, group_codes_begin,
+                                     group_offsets, 0, num_groups,
+                                     Rect(pass_dec_cache->dc), quantizer, cmap,
+                                     pool, pass_dec_cache));
+  PIK_RETURN_IF_ERROR(ReadGradientMap(reader, compressed, pass_header,
+                                      quantizer, pass_dec_cache));
+  FinishDecodeDC(pass_header, quantizer, pass_dec_cache);
   return true;
 }
 
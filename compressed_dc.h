@@ -7,13 +7,18 @@
 #ifndef COMPRESSED_DC_H_
 #define COMPRESSED_DC_H_
 
+#include <stddef.h>
+#include <vector>
+
 #include "color_correlation.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
 #include "headers.h"
+#include "image.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
 #include "quantizer.h"
+#include "write_bits.h"
 
 // DC handling functions: encoding and decoding of DC to and from bitstream, and
 // related function to initialize the per-group decoder cache.
@@ -21,10 +26,9 @@
 namespace pik {
 
 // Encodes the DC-related information from pass_enc_cache: quantized dc itself
-// and gradient map.
-PaddedBytes EncodeDC(const Quantizer& quantizer,
-                     const PassEncCache& pass_enc_cache, ThreadPool* pool,
-                     PikImageSizeInfo* dc_info);
+// and gradient map. "writer" must be at a byte boundary.
+void EncodeDC(const Quantizer& quantizer, const PassEncCache& pass_enc_cache,
+              ThreadPool* pool, BitWriter* writer, PikImageSizeInfo* dc_info);
 
 // Decodes and dequantizes DC, and optionally decodes and applies the
 // gradient map if requested.
@@ -34,6 +38,38 @@ Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
                 const ColorCorrelationMap& cmap, ThreadPool* pool,
                 PassDecCache* pass_dec_cache);
 
+// DecodeDC split into steps, which allows decoding DC groups as soon as their
+// data is available:
+
+// Allocates pass_dec_cache->dc and reads the TOC of the DC groups. Group i
+// occupies bytes [group_offsets[i], group_offsets[i + 1]) relative to
+// reader->Position() after this returns.
+Status BeginDecodeDC(BitReader* reader, size_t xsize_blocks,
+                     size_t ysize_blocks, std::vector<size_t>* group_offsets,
+                     PassDecCache* pass_dec_cache);
+
+// Decodes and dequantizes DC groups [begin_group, end_group), whose data starts
+// at byte `group_codes_begin` of `compressed`. Groups that do not intersect
+// `needed_blocks` are skipped.
+Status DecodeDCGroups(const PaddedBytes& compressed, size_t group_codes_begin,
+                      const std::vector<size_t>& group_offsets,
+                      size_t begin_group, size_t end_group,
+                      const Rect& needed_blocks, const Quantizer& quantizer,
+                      const ColorCorrelationMap& cmap, ThreadPool* pool,
+                      PassDecCache* pass_dec_cache);
+
+// Decodes the gradient map, if any, into pass_dec_cache->gradient without
+// modifying DC, so it may be retried. `reader` must be positioned after the
+// last DC group.
+Status ReadGradientMap(BitReader* reader, const PaddedBytes& compressed,
+                       const PassHeader& pass_header, const Quantizer& quantizer,
+                       PassDecCache* pass_dec_cache);
+
+// Applies the gradient map from ReadGradientMap, if any, to the decoded DC.
+// Must be called exactly once per pass.
+void FinishDecodeDC(const PassHeader& pass_header, const Quantizer& quantizer,
+                    PassDecCache* pass_dec_cache);
+
 // Clamps the input coordinate `candidate` to the [0, size) interval, using 1 px
 // of border (extended by cloning, not mirroring).
 PIK_INLINE size_t SourceCoord(size_t candidate, size_t size) {
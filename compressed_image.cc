@@ -33,6 +33,7 @@
 #include "dct_util.h"
 #include "deconvolve.h"
 #include "entropy_coder.h"
+#include "entropy_presets.h"
 #include "fields.h"
 #include "gaborish.h"
 #include "gauss_blur.h"
@@ -51,6 +52,7 @@
 #include "resample.h"
 #include "simd/simd.h"
 #include "status.h"
+#include "tile_flow.h"
 #include "upscaler.h"
 
 namespace pik {
@@ -192,6 +194,7 @@ static const std::unique_ptr<GrayXyb> kGrayXyb(new GrayXyb);
 
 SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
                                       const Image3F& opsin_full,
+                                      const Image3F& opsin_dct,
                                       const AcStrategyImage& ac_strategy,
                                       const Quantizer& quantizer,
                                       const ColorCorrelationMap& cmap,
@@ -202,6 +205,8 @@ SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
   constexpr int block_size = N * N;
   pass_enc_cache->use_gradient = pass_header.flags & PassHeader::kGradientMap;
   pass_enc_cache->grayscale_opt = pass_header.flags & PassHeader::kGrayscaleOpt;
+  pass_enc_cache->num_ans_states = pass_header.num_ans_states;
+  pass_enc_cache->use_prefix_codes = pass_header.use_prefix_codes;
   const size_t xsize_blocks = opsin_full.xsize() / N;
   const size_t ysize_blocks = opsin_full.ysize() / N;
 
@@ -212,11 +217,16 @@ SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
     for (int c = 0; c < 3; ++c) {
       for (size_t bx = 0; bx < xsize_blocks; ++bx) {
         AcStrategy acs = ac_strategy.ConstRow(by)[bx];
-        acs.TransformFromPixels(
-            opsin_full.ConstPlaneRow(c, by * N) + bx * N,
-            opsin_full.PixelsPerRow(),
-            pass_enc_cache->coeffs.PlaneRow(c, by) + bx * block_size,
-            pass_enc_cache->coeffs.PixelsPerRow());
+        float* PIK_RESTRICT block =
+            pass_enc_cache->coeffs.PlaneRow(c, by) + bx * block_size;
+        if (acs.Strategy() == AcStrategy::Type::DCT) {
+          memcpy(block, opsin_dct.ConstPlaneRow(c, by) + bx * block_size,
+                 block_size * sizeof(float));
+        } else {
+          acs.TransformFromPixels(opsin_full.ConstPlaneRow(c, by * N) + bx * N,
+                                  opsin_full.PixelsPerRow(), block,
+                                  pass_enc_cache->coeffs.PixelsPerRow());
+        }
         acs.DCFromLowestFrequencies(
             pass_enc_cache->coeffs.ConstPlaneRow(c, by) + bx * block_size,
             pass_enc_cache->coeffs.PixelsPerRow(), dc.PlaneRow(c, by) + bx,
@@ -291,6 +301,8 @@ SIMD_ATTR void InitializeEncCache(const PassHeader& pass_header,
   enc_cache->predict_lf = pass_header.predict_lf;
   enc_cache->predict_hf = pass_header.predict_hf;
   enc_cache->grayscale_opt = pass_enc_cache.grayscale_opt;
+  enc_cache->num_ans_states = pass_enc_cache.num_ans_states;
+  enc_cache->use_prefix_codes = pass_enc_cache.use_prefix_codes;
 
   enc_cache->dc_dec =
       Image3F(enc_cache->xsize_blocks + 2, enc_cache->ysize_blocks + 2);
@@ -399,125 +411,303 @@ SIMD_ATTR void ComputeCoefficients(const Quantizer& quantizer,
   }
 }
 
-PaddedBytes EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
-                              const Quantizer& quantizer,
-                              const NoiseParams& noise_params,
-                              const ColorCorrelationMap& cmap, bool fast_mode,
-                              MultipassHandler* handler, PikInfo* info) {
-  PROFILER_FUNC;
+namespace {
+
+// Returns the rect of the quantized AC coefficients of the group "rect".
+Rect ACRect(const Rect& rect) {
+  return Rect(8 * rect.x0(), rect.y0() / 8, 8 * rect.xsize(), rect.ysize() / 8);
+}
+
+// Tokens of one group. AC tokens are the vast majority and use the compact
+// ACToken.
+struct GroupTokens {
+  std::vector<ACToken> ac;
+  std::vector<Token> ac_strategy_and_quant_field;
+};
+
+// Adds tokens [begin, end) to "histograms" (unless null) and discards them
+// unless "keep".
+template <class TokenT>
+void AddTileTokens(std::vector<TokenT>* tokens, size_t begin, bool keep,
+                   TokenHistograms* histograms) {
+  if (histograms != nullptr) {
+    histograms->Add(tokens->data() + begin, tokens->data() + tokens->size());
+  }
+  if (!keep) tokens->clear();
+}
+
+// Tokenizes the group "rect" and adds each tile's tokens to "histograms"
+// (unless null) while they are still in cache. Appends the tokens to
+// "group_tokens"; if it is null, only "histograms" are updated and the tokens
+// of each tile are discarded.
+void TokenizeGroup(const EncCache& enc_cache, const Rect& rect,
+                   const int32_t* PIK_RESTRICT order,
+                   MultipassHandler* handler, TokenHistograms* histograms,
+                   GroupTokens* group_tokens) {
+  PIK_ASSERT(histograms != nullptr || group_tokens != nullptr);
   constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
-  PIK_ASSERT(quantizer.block_dim() == N);
-  PIK_ASSERT(rect.x0() % kTileDim == 0);
-  PIK_ASSERT(rect.xsize() % N == 0);
-  PIK_ASSERT(rect.y0() % kTileDim == 0);
-  PIK_ASSERT(rect.ysize() % N == 0);
   const size_t xsize_blocks = rect.xsize() / N;
   const size_t ysize_blocks = rect.ysize() / N;
   const size_t xsize_tiles = DivCeil(xsize_blocks, kTileDimInBlocks);
   const size_t ysize_tiles = DivCeil(ysize_blocks, kTileDimInBlocks);
   const Rect group_acs_qf_area_rect(rect.x0() / N, rect.y0() / N, xsize_blocks,
                                     ysize_blocks);
-  const Rect tile_rect(rect.x0() / kTileDim, rect.y0() / kTileDim, xsize_tiles,
-                       ysize_tiles);
-
-  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
-  std::string noise_code = EncodeNoise(noise_params);
-
-  const Rect ac_rect(8 * rect.x0(), rect.y0() / 8, 8 * rect.xsize(),
-                     rect.ysize() / 8);
-
-  int32_t order[kOrderContexts * block_size];
-  std::vector<uint8_t> context_map;
-  ComputeCoeffOrder(enc_cache.ac, ac_rect, order);
-
-  std::string order_code = EncodeCoeffOrders(order, info);
 
-  std::vector<std::vector<Token>> all_tokens(2);
-  std::vector<Token>& ac_tokens = all_tokens[0];
-  std::vector<Token>& ac_strategy_and_quant_field_tokens = all_tokens[1];
+  const bool keep = group_tokens != nullptr;
+  GroupTokens tile_tokens;
+  if (!keep) group_tokens = &tile_tokens;
+  std::vector<ACToken>* ac_tokens = &group_tokens->ac;
+  std::vector<Token>* ac_strategy_and_quant_field_tokens =
+      &group_tokens->ac_strategy_and_quant_field;
 
   for (size_t y = 0; y < ysize_tiles; y++) {
     for (size_t x = 0; x < xsize_tiles; x++) {
       const Rect tile_rect(x * kTileDimInBlocks, y * kTileDimInBlocks,
                            kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
                            ysize_blocks);
-      TokenizeCoefficients(order, tile_rect, enc_cache.ac, &ac_tokens);
+      const size_t begin = ac_tokens->size();
+      TokenizeCoefficients(order, tile_rect, enc_cache.ac, ac_tokens);
+      AddTileTokens(ac_tokens, begin, keep, histograms);
     }
   }
 
+  const size_t begin = ac_strategy_and_quant_field_tokens->size();
   TokenizeAcStrategy(group_acs_qf_area_rect, enc_cache.ac_strategy,
                      handler->HintAcStrategy(),
-                     &ac_strategy_and_quant_field_tokens);
+                     ac_strategy_and_quant_field_tokens);
 
   TokenizeQuantField(group_acs_qf_area_rect, enc_cache.quant_field,
                      handler->HintQuantField(), enc_cache.ac_strategy,
-                     &ac_strategy_and_quant_field_tokens);
+                     ac_strategy_and_quant_field_tokens);
+  AddTileTokens(ac_strategy_and_quant_field_tokens, begin, keep, histograms);
+}
 
-  std::vector<ANSEncodingData> codes;
-  std::string histo_code = "";
+template <class Codes>
+void BuildAndEncodeGroupHistograms(const TokenHistograms& histograms,
+                                   bool fast_mode,
+                                   HistogramClustering clustering, Codes* codes,
+                                   std::vector<uint8_t>* context_map,
+                                   BitWriter* writer,
+                                   PikImageSizeInfo* ac_info) {
   if (fast_mode) {
-    histo_code =
-        BuildAndEncodeHistogramsFast(all_tokens, &codes, &context_map, ac_info);
+    BuildAndEncodeHistogramsFast(histograms, codes, context_map, writer,
+                                 ac_info);
   } else {
-    histo_code = BuildAndEncodeHistograms(kNumContexts, all_tokens, &codes,
-                                          &context_map, ac_info);
+    BuildAndEncodeHistograms(histograms, codes, context_map, writer, ac_info,
+                             clustering);
   }
+}
 
-  // TODO(user): consider either merging to AC or encoding separately.
-  std::string ac_strategy_and_quant_field_code = WriteTokens(
-      ac_strategy_and_quant_field_tokens, codes, context_map, ac_info);
-
-  std::string ac_code = WriteTokens(ac_tokens, codes, context_map, ac_info);
-
-  if (info) {
-    info->layers[kLayerHeader].total_size += noise_code.size();
+// Builds and stores ANS or prefix codes, depending on codes->use_prefix_codes.
+void BuildAndEncodeGroupHistograms(const TokenHistograms& histograms,
+                                   bool fast_mode,
+                                   HistogramClustering clustering,
+                                   EncoderEntropyCodes* codes,
+                                   BitWriter* writer,
+                                   PikImageSizeInfo* ac_info) {
+  if (codes->use_prefix_codes) {
+    BuildAndEncodeGroupHistograms(histograms, fast_mode, clustering,
+                                  &codes->huffman_codes, &codes->context_map,
+                                  writer, ac_info);
+  } else {
+    BuildAndEncodeGroupHistograms(histograms, fast_mode, clustering,
+                                  &codes->codes, &codes->context_map, writer,
+                                  ac_info);
   }
+}
 
-  PaddedBytes out(noise_code.size() + order_code.size() + histo_code.size() +
-                  ac_strategy_and_quant_field_code.size() + ac_code.size());
-  size_t byte_pos = 0;
-  Append(noise_code, &out, &byte_pos);
-  Append(order_code, &out, &byte_pos);
-  Append(histo_code, &out, &byte_pos);
-  Append(ac_strategy_and_quant_field_code, &out, &byte_pos);
-  Append(ac_code, &out, &byte_pos);
-
-  // TODO(veluca): fix this with DC supergroups.
-  float output_size_estimate = out.size() - ac_code.size() - histo_code.size();
-  std::vector<std::array<size_t, 256>> counts(kNumContexts);
-  size_t extra_bits = 0;
-  for (const auto& token_list : all_tokens) {
-    for (const auto& token : token_list) {
-      counts[token.context][token.symbol]++;
-      extra_bits += token.nbits;
-    }
+// "num_ans_states" is ignored for prefix codes.
+// "TokenT" is Token or ACToken.
+template <class TokenT>
+void WriteGroupTokens(const std::vector<TokenT>& tokens,
+                      const EncoderEntropyCodes& codes, size_t num_ans_states,
+                      BitWriter* writer, PikImageSizeInfo* ac_info) {
+  if (codes.use_prefix_codes) {
+    WriteTokens(tokens, codes.huffman_codes, codes.context_map, writer,
+                ac_info);
+  } else {
+    WriteTokens(tokens, codes.codes, codes.context_map, writer, ac_info,
+                num_ans_states);
   }
+}
+
+// Returns the estimated size [bytes] of the tokens counted in "histograms":
+// their extra bits plus the Shannon entropy of each context's symbols.
+float EstimateTokensSize(const TokenHistograms& histograms) {
   float entropy_coded_bits = 0;
-  for (size_t ctx = 0; ctx < kNumContexts; ctx++) {
-    size_t total =
-        std::accumulate(counts[ctx].begin(), counts[ctx].end(), size_t(0));
+  for (size_t ctx = 0; ctx < histograms.num_contexts; ctx++) {
+    const uint32_t* counts = histograms.Counts(ctx);
+    size_t total = std::accumulate(counts, counts + 256, size_t(0));
     if (total == 0) continue;  // Prevent div by zero.
     double entropy = 0;
     for (size_t i = 0; i < 256; i++) {
-      double p = 1.0 * counts[ctx][i] / total;
+      double p = 1.0 * counts[i] / total;
       if (p > 1e-4) {
         entropy -= p * std::log(p);
       }
     }
     entropy_coded_bits += entropy * total / std::log(2);
   }
-  output_size_estimate +=
-      static_cast<float>(extra_bits + entropy_coded_bits) / kBitsPerByte;
-  if (info != nullptr) info->entropy_estimate = output_size_estimate;
-  return out;
+  return static_cast<float>(histograms.extra_bits + entropy_coded_bits) /
+         kBitsPerByte;
+}
+
+}  // namespace
+
+void CountNaturalOrderTokens(const EncCache& enc_cache, const Rect& rect,
+                             MultipassHandler* handler,
+                             TokenHistograms* histograms) {
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  int32_t order[kOrderContexts * block_size];
+  for (size_t c = 0; c < kOrderContexts; ++c) {
+    std::copy(NaturalCoeffOrder(), NaturalCoeffOrder() + block_size,
+              order + c * block_size);
+  }
+  TokenizeGroup(enc_cache, rect, order, handler, histograms,
+                /*group_tokens=*/nullptr);
+}
+
+size_t SelectPresetEntropyCodes(const EncCache& enc_cache, const Rect& rect,
+                                MultipassHandler* handler,
+                                bool use_prefix_codes) {
+  PROFILER_FUNC;
+  // Larger groups amortize their own codes and rarely benefit from presets.
+  constexpr size_t kMaxPresetPixels = 128 * 128;
+  if (rect.xsize() * rect.ysize() > kMaxPresetPixels) return 0;
+
+  TokenHistograms histograms(kNumContexts);
+  CountNaturalOrderTokens(enc_cache, rect, handler, &histograms);
+  return SelectEntropyPreset(histograms, use_prefix_codes);
+}
+
+float EstimateGroupSize(const EncCache& enc_cache, const Rect& rect,
+                        MultipassHandler* handler) {
+  PROFILER_FUNC;
+  int32_t order[kOrderContexts * kBlockDim * kBlockDim];
+  ComputeCoeffOrder(enc_cache.ac, ACRect(rect), order);
+  TokenHistograms histograms(kNumContexts);
+  TokenizeGroup(enc_cache, rect, order, handler, &histograms,
+                /*group_tokens=*/nullptr);
+  return EstimateTokensSize(histograms);
+}
+
+void EncodeSharedEntropyCodes(const std::vector<EncCache>& enc_caches,
+                              const std::vector<MultipassHandler*>& handlers,
+                              bool fast_mode, EncoderEntropyCodes* shared_codes,
+                              BitWriter* writer, PikInfo* info) {
+  PROFILER_FUNC;
+  PIK_ASSERT(enc_caches.size() == handlers.size());
+  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
+
+  // Group rects as in PixelsToPikGroup: each EncCache covers one padded group.
+  std::vector<Rect> rects;
+  rects.reserve(handlers.size());
+  for (MultipassHandler* handler : handlers) {
+    const Rect& padded_rect = handler->PaddedGroupRect();
+    rects.emplace_back(0, 0, padded_rect.xsize(), padded_rect.ysize());
+  }
+
+  int32_t num_zeros[kOrderContexts * kBlockDim * kBlockDim] = {0};
+  for (size_t i = 0; i < enc_caches.size(); ++i) {
+    CountZeroCoefficients(enc_caches[i].ac, ACRect(rects[i]), num_zeros);
+  }
+  ComputeCoeffOrderFromZeros(num_zeros, shared_codes->order);
+  EncodeCoeffOrders(shared_codes->order, writer, info);
+
+  // Only the counts are needed here; groups tokenize again when encoding.
+  TokenHistograms histograms(kNumContexts);
+  for (size_t i = 0; i < enc_caches.size(); ++i) {
+    TokenizeGroup(enc_caches[i], rects[i], shared_codes->order, handlers[i],
+                  &histograms, /*group_tokens=*/nullptr);
+  }
+  // All groups of a pass use the same clustering setting.
+  const HistogramClustering clustering =
+      enc_caches.empty() ? HistogramClustering::kBest
+                         : enc_caches[0].histogram_clustering;
+  shared_codes->use_prefix_codes =
+      !enc_caches.empty() && enc_caches[0].use_prefix_codes;
+  BuildAndEncodeGroupHistograms(histograms, fast_mode, clustering,
+                                shared_codes, writer, ac_info);
+}
+
+void EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
+                       const Quantizer& quantizer,
+                       const NoiseParams& noise_params,
+                       const ColorCorrelationMap& cmap, bool fast_mode,
+                       MultipassHandler* handler,
+                       const EncoderEntropyCodes* shared_codes,
+                       BitWriter* writer, PikInfo* info) {
+  PROFILER_FUNC;
+  constexpr size_t N = kBlockDim;
+  PIK_ASSERT(quantizer.block_dim() == N);
+  PIK_ASSERT(rect.x0() % kTileDim == 0);
+  PIK_ASSERT(rect.xsize() % N == 0);
+  PIK_ASSERT(rect.y0() % kTileDim == 0);
+  PIK_ASSERT(rect.ysize() % N == 0);
+
+  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
+  const size_t bits_before = writer->BitsWritten();
+  EncodeNoise(noise_params, writer);
+  const size_t noise_bytes =
+      (writer->BitsWritten() - bits_before) / kBitsPerByte;
+
+  // Without shared codes, the group stores its own order and histograms.
+  EncoderEntropyCodes group_codes;
+  const EncoderEntropyCodes* codes = shared_codes;
+  if (shared_codes == nullptr) {
+    group_codes.use_prefix_codes = enc_cache.use_prefix_codes;
+    ComputeCoeffOrder(enc_cache.ac, ACRect(rect), group_codes.order);
+    EncodeCoeffOrders(group_codes.order, writer, info);
+    codes = &group_codes;
+  }
+
+  GroupTokens group_tokens;
+  // Counts are needed for the group's own histograms or the size estimate.
+  std::unique_ptr<TokenHistograms> histograms;
+  if (shared_codes == nullptr || info != nullptr) {
+    histograms = make_unique<TokenHistograms>(kNumContexts);
+  }
+  TokenizeGroup(enc_cache, rect, codes->order, handler, histograms.get(),
+                &group_tokens);
+
+  const size_t histo_bits_before = writer->BitsWritten();
+  if (shared_codes == nullptr) {
+    BuildAndEncodeGroupHistograms(*histograms, fast_mode,
+                                  enc_cache.histogram_clustering, &group_codes,
+                                  writer, ac_info);
+  }
+  const size_t histo_bits = writer->BitsWritten() - histo_bits_before;
+
+  // TODO(user): consider either merging to AC or encoding separately.
+  WriteGroupTokens(group_tokens.ac_strategy_and_quant_field, *codes,
+                   /*num_ans_states=*/1, writer, ac_info);
+
+  const size_t ac_bits_before = writer->BitsWritten();
+  WriteGroupTokens(group_tokens.ac, *codes, enc_cache.num_ans_states, writer,
+                   ac_info);
+  const size_t ac_bits = writer->BitsWritten() - ac_bits_before;
+
+  if (info) {
+    info->layers[kLayerHeader].total_size += noise_bytes;
+
+    // TODO(veluca): fix this with DC supergroups.
+    const float output_size_estimate =
+        (writer->BitsWritten() - bits_before - ac_bits - histo_bits) /
+            kBitsPerByte +
+        EstimateTokensSize(*histograms);
+    info->entropy_estimate = output_size_estimate;
+  }
 }
 
 class Dequant {
  public:
-  void Init(const ColorCorrelationMap& cmap, const Quantizer& quantizer) {
+  // If "y_only", DoAC leaves X and B (and their biases) untouched; see
+  // PassHeader::gray_from_y.
+  void Init(const ColorCorrelationMap& cmap, const Quantizer& quantizer,
+            bool y_only = false) {
     dequant_matrices_ = quantizer.DequantMatrix(0, kQuantKindDCT8);
     inv_global_scale_ = quantizer.InvGlobalScale();
+    y_only_ = y_only;
   }
 
   // Dequantizes and inverse color-transforms one tile, i.e. the window
@@ -553,7 +743,10 @@ class Dequant {
     const size_t x0_cmap = rect.x0() / kColorTileDimInBlocks;
     const size_t y0_cmap = rect.y0() / kColorTileDimInBlocks;
     const size_t x0_dct = rect.x0() * block_size;
-    const size_t x0_dct_group = block_tile_group_rect.x0() * block_size;
+    const size_t x0_dct_group =
+        (block_tile_group_rect.x0() - pass_dec_cache->biases_x0) * block_size;
+    const size_t y0_biases =
+        block_tile_group_rect.y0() - pass_dec_cache->biases_y0;
     const size_t x0_dct16 = rect16.x0() * block_size;
 
     for (size_t by = 0; by < ysize; ++by) {
@@ -564,8 +757,7 @@ class Dequant {
       float* PIK_RESTRICT row_y =
           dec_cache->ac.PlaneRow(1, rect.y0() + by) + x0_dct;
       float* PIK_RESTRICT row_y_biases =
-          pass_dec_cache->biases.PlaneRow(1, block_tile_group_rect.y0() + by) +
-          x0_dct_group;
+          pass_dec_cache->biases.PlaneRow(1, y0_biases + by) + x0_dct_group;
       AcStrategyRow ac_strategy_row =
           pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
       for (size_t bx = 0; bx < xsize; ++bx) {
@@ -594,6 +786,7 @@ class Dequant {
         }
       }
     }
+    if (y_only_) return;
 
     for (int c = 0; c < 3; c += 2) {  // === for c in {0, 2}
       const ImageI& img_cmap = (c == 0) ? img_ytox : img_ytob;
@@ -610,9 +803,7 @@ class Dequant {
         float* PIK_RESTRICT row_xb =
             dec_cache->ac.PlaneRow(c, rect.y0() + by) + x0_dct;
         float* PIK_RESTRICT row_xb_biases =
-            pass_dec_cache->biases.PlaneRow(c,
-                                            block_tile_group_rect.y0() + by) +
-            x0_dct_group;
+            pass_dec_cache->biases.PlaneRow(c, y0_biases + by) + x0_dct_group;
 
         AcStrategyRow ac_strategy_row =
             pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
@@ -680,6 +871,7 @@ class Dequant {
   // AC dequant
   const float* PIK_RESTRICT dequant_matrices_;
   float inv_global_scale_;
+  bool y_only_;
 };
 
 // Temporary storage; one per thread, for one tile.
@@ -707,47 +899,62 @@ struct DecoderBuffers {
   Image3I num_nzeroes;
 };
 
-bool DecodeCoefficientsAndDequantize(
-    const PassHeader& pass_header, const GroupHeader& header,
-    const Rect& group_rect, MultipassHandler* handler,
-    const size_t xsize_blocks, const size_t ysize_blocks,
-    const PaddedBytes& compressed, BitReader* reader,
-    const ColorCorrelationMap& cmap, DecCache* dec_cache,
-    PassDecCache* pass_dec_cache, const Quantizer& quantizer) {
-  PROFILER_FUNC;
-  constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
-
-  PIK_ASSERT(group_rect.x0() % kBlockDim == 0);
-  PIK_ASSERT(group_rect.y0() % kBlockDim == 0);
-  const size_t x0_blocks = DivCeil(group_rect.x0(), kBlockDim);
-  const size_t y0_blocks = DivCeil(group_rect.y0(), kBlockDim);
-  const Rect group_acs_qf_rect(x0_blocks, y0_blocks, xsize_blocks,
-                               ysize_blocks);
-
+// Decodes the AC tokens of all tiles of a group with "ac_decoder" and
+// dequantizes each tile right after decoding it.
+template <class ACReader>
+bool DecodeAndDequantizeTiles(ACReader* PIK_RESTRICT ac_decoder,
+                              const ACDecoderContexts& contexts,
+                              const int* PIK_RESTRICT coeff_order,
+                              const Rect& group_acs_qf_rect,
+                              const ColorCorrelationMap& cmap,
+                              const Dequant& dequant, BitReader* reader,
+                              DecoderBuffers* PIK_RESTRICT tmp,
+                              DecCache* dec_cache,
+                              PassDecCache* pass_dec_cache) {
+  const size_t xsize_blocks = group_acs_qf_rect.xsize();
+  const size_t ysize_blocks = group_acs_qf_rect.ysize();
   const size_t xsize_tiles = DivCeil(xsize_blocks, kTileDimInBlocks);
   const size_t ysize_tiles = DivCeil(ysize_blocks, kTileDimInBlocks);
   const size_t num_tiles = xsize_tiles * ysize_tiles;
 
-  DecoderBuffers tmp;
-  tmp.InitOnce();
+  for (size_t task = 0; task < num_tiles; ++task) {
+    const size_t tile_x = task % xsize_tiles;
+    const size_t tile_y = task / xsize_tiles;
+    const Rect rect(tile_x * kTileDimInBlocks, tile_y * kTileDimInBlocks,
+                    kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
+                    ysize_blocks);
+    const Rect quantized_rect(0, 0, rect.xsize(), rect.ysize());
 
-  int coeff_order[kOrderContexts * block_size];
-  for (size_t c = 0; c < kOrderContexts; ++c) {
-    DecodeCoeffOrder(&coeff_order[c * block_size], reader);
+    if (!DecodeAC(contexts, coeff_order, reader, ac_decoder,
+                  &tmp->quantized_ac, rect, &tmp->num_nzeroes)) {
+      return PIK_FAILURE("Failed to decode AC.");
+    }
+
+    dequant.DoAC(quantized_rect, tmp->quantized_ac, rect, group_acs_qf_rect,
+                 cmap.ytox_map, cmap.ytob_map, dec_cache, pass_dec_cache);
   }
-  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+  if (!ac_decoder->CheckANSFinalState()) {
+    return PIK_FAILURE("ANS checksum failure.");
+  }
+  return true;
+}
 
-  ANSCode code;
-  std::vector<uint8_t> context_map;
-  // Histogram data size is small and does not require parallelization.
-  PIK_RETURN_IF_ERROR(
-      DecodeHistograms(reader, kNumContexts, 256, &code, &context_map));
-  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+// Decodes the AC strategy, quant field and AC tokens of a group, reading the
+// former with "SymbolReader" and the latter with "ac_decoder".
+template <class SymbolReader, class ACReader>
+Status DecodeGroupTokens(const DecoderEntropyCodes& codes,
+                         SymbolReader* PIK_RESTRICT
+                             ac_strategy_and_quant_field_decoder,
+                         ACReader* PIK_RESTRICT ac_decoder,
+                         const Rect& group_acs_qf_rect,
+                         MultipassHandler* handler,
+                         const ColorCorrelationMap& cmap,
+                         const Quantizer& quantizer, BitReader* reader,
+                         DecCache* dec_cache, PassDecCache* pass_dec_cache) {
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  const std::vector<uint8_t>& context_map = codes.context_map;
 
-  ANSSymbolReader ac_strategy_and_quant_field_decoder(&code);
-  ANSSymbolReader strategy_decoder(&code);
-  if (!DecodeAcStrategy(reader, &ac_strategy_and_quant_field_decoder,
+  if (!DecodeAcStrategy(reader, ac_strategy_and_quant_field_decoder,
                         context_map, group_acs_qf_rect,
                         &pass_dec_cache->ac_strategy,
                         handler->HintAcStrategy())) {
@@ -755,45 +962,117 @@ bool DecodeCoefficientsAndDequantize(
   }
 
   if (!DecodeQuantField(
-          reader, &ac_strategy_and_quant_field_decoder, context_map,
+          reader, ac_strategy_and_quant_field_decoder, context_map,
           group_acs_qf_rect, pass_dec_cache->ac_strategy,
           &pass_dec_cache->raw_quant_field, handler->HintQuantField())) {
     return PIK_FAILURE("Failed to decode QuantField.");
   }
-  if (!ac_strategy_and_quant_field_decoder.CheckANSFinalState()) {
+  if (!ac_strategy_and_quant_field_decoder->CheckANSFinalState()) {
     return PIK_FAILURE("QuantField: ANS checksum failure.");
   }
   PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
   Dequant dequant;
-  dequant.Init(cmap, quantizer);
-  dec_cache->ac = Image3F(xsize_blocks * block_size, ysize_blocks);
-
-  ANSSymbolReader ac_decoder(&code);
-  for (size_t task = 0; task < num_tiles; ++task) {
-    const size_t tile_x = task % xsize_tiles;
-    const size_t tile_y = task / xsize_tiles;
-    const Rect rect(tile_x * kTileDimInBlocks, tile_y * kTileDimInBlocks,
-                    kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
-                    ysize_blocks);
-    const Rect quantized_rect(0, 0, rect.xsize(), rect.ysize());
+  dequant.Init(cmap, quantizer, pass_dec_cache->gray_from_y);
+  dec_cache->ac = Image3F(group_acs_qf_rect.xsize() * block_size,
+                          group_acs_qf_rect.ysize());
 
-    if (!DecodeAC(context_map, coeff_order, reader, &ac_decoder,
-                  &tmp.quantized_ac, rect, &tmp.num_nzeroes)) {
-      return PIK_FAILURE("Failed to decode AC.");
-    }
+  DecoderBuffers tmp;
+  tmp.InitOnce();
+  PIK_RETURN_IF_ERROR(DecodeAndDequantizeTiles(
+      ac_decoder, *codes.ac_contexts, codes.coeff_order, group_acs_qf_rect,
+      cmap, dequant, reader, &tmp, dec_cache, pass_dec_cache));
+  return reader->JumpToByteBoundary();
+}
 
-    dequant.DoAC(quantized_rect, tmp.quantized_ac, rect, group_acs_qf_rect,
-                 cmap.ytox_map, cmap.ytob_map, dec_cache, pass_dec_cache);
+Status DecodeEntropyCodes(BitReader* reader, bool use_prefix_codes,
+                          DecoderEntropyCodes* codes) {
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  for (size_t c = 0; c < kOrderContexts; ++c) {
+    DecodeCoeffOrder(&codes->coeff_order[c * block_size], reader);
   }
-  if (!ac_decoder.CheckANSFinalState()) {
-    return PIK_FAILURE("ANS checksum failure.");
+  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+
+  // Histogram data size is small and does not require parallelization.
+  if (use_prefix_codes) {
+    PIK_RETURN_IF_ERROR(DecodeHistograms(reader, kNumContexts, 256,
+                                         &codes->huffman_codes,
+                                         &codes->context_map));
+  } else {
+    PIK_RETURN_IF_ERROR(DecodeHistograms(reader, kNumContexts, 256,
+                                         &codes->code, &codes->context_map));
   }
   PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
+  codes->ac_contexts.reset(new ACDecoderContexts(codes->context_map));
   return true;
 }
 
+bool DecodeCoefficientsAndDequantize(
+    const PassHeader& pass_header, const GroupHeader& header,
+    const Rect& group_rect, MultipassHandler* handler,
+    const size_t xsize_blocks, const size_t ysize_blocks,
+    const PaddedBytes& compressed, BitReader* reader,
+    const ColorCorrelationMap& cmap, DecCache* dec_cache,
+    PassDecCache* pass_dec_cache, const Quantizer& quantizer) {
+  PROFILER_FUNC;
+  PIK_ASSERT(group_rect.x0() % kBlockDim == 0);
+  PIK_ASSERT(group_rect.y0() % kBlockDim == 0);
+  const size_t x0_blocks = DivCeil(group_rect.x0(), kBlockDim);
+  const size_t y0_blocks = DivCeil(group_rect.y0(), kBlockDim);
+  const Rect group_acs_qf_rect(x0_blocks, y0_blocks, xsize_blocks,
+                               ysize_blocks);
+
+  const DecoderEntropyCodes* codes = pass_dec_cache->shared_codes.get();
+  DecoderEntropyCodes group_codes;
+  if (header.preset_entropy_codes != 0) {
+    if (header.preset_entropy_codes > kNumEntropyPresets) {
+      return PIK_FAILURE("Invalid entropy code preset.");
+    }
+    codes = &PresetDecoderEntropyCodes(header.preset_entropy_codes,
+                                       pass_header.use_prefix_codes);
+  } else if (pass_header.shared_entropy_codes) {
+    if (codes == nullptr) return PIK_FAILURE("Missing shared entropy codes.");
+  } else {
+    PIK_RETURN_IF_ERROR(DecodeEntropyCodes(
+        reader, pass_header.use_prefix_codes, &group_codes));
+    codes = &group_codes;
+  }
+
+  if (pass_header.use_prefix_codes) {
+    HuffmanSymbolReader ac_strategy_and_quant_field_decoder(
+        &codes->huffman_codes);
+    HuffmanSymbolReader ac_decoder(&codes->huffman_codes);
+    return DecodeGroupTokens(*codes, &ac_strategy_and_quant_field_decoder,
+                             &ac_decoder, group_acs_qf_rect, handler, cmap,
+                             quantizer, reader, dec_cache, pass_dec_cache);
+  }
+
+  ANSSymbolReader ac_strategy_and_quant_field_decoder(&codes->code);
+  switch (pass_header.num_ans_states) {
+    case 1: {
+      ANSSymbolReaderT<1> ac_decoder(&codes->code);
+      return DecodeGroupTokens(*codes, &ac_strategy_and_quant_field_decoder,
+                               &ac_decoder, group_acs_qf_rect, handler, cmap,
+                               quantizer, reader, dec_cache, pass_dec_cache);
+    }
+    case 2: {
+      ANSSymbolReaderT<2> ac_decoder(&codes->code);
+      return DecodeGroupTokens(*codes, &ac_strategy_and_quant_field_decoder,
+                               &ac_decoder, group_acs_qf_rect, handler, cmap,
+                               quantizer, reader, dec_cache, pass_dec_cache);
+    }
+    case 4: {
+      ANSSymbolReaderT<4> ac_decoder(&codes->code);
+      return DecodeGroupTokens(*codes, &ac_strategy_and_quant_field_decoder,
+                               &ac_decoder, group_acs_qf_rect, handler, cmap,
+                               quantizer, reader, dec_cache, pass_dec_cache);
+    }
+    default:
+      return PIK_FAILURE("Invalid number of ANS states.");
+  }
+}
+
 bool DecodeFromBitstream(const PassHeader& pass_header,
                          const GroupHeader& header,
                          const PaddedBytes& compressed, BitReader* reader,
@@ -859,32 +1138,35 @@ void DequantImageAC(const Quantizer& quantizer, const ColorCorrelationMap& cmap,
   RunOnPool(pool, 0, num_tiles, dequant_tile, "DequantImage");
 }
 
+// Writes (kBlockDim / downsample)^2 pixels per block; downsample is 1, 2 or 4.
 static SIMD_ATTR void InverseIntegralTransform(
     const size_t xsize_blocks, const size_t ysize_blocks,
-    const Image3F& ac_image, const AcStrategyImage& ac_strategy,
-    const Rect& acs_rect, Image3F* PIK_RESTRICT idct) {
+    const ImageF& ac_plane, const AcStrategyImage& ac_strategy,
+    const Rect& acs_rect, const size_t downsample,
+    ImageF* PIK_RESTRICT idct_plane) {
   PROFILER_ZONE("IDCT");
 
-  constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
-  const size_t idct_stride = idct->PixelsPerRow();
-
-  for (int c = 0; c < 3; ++c) {
-    const ImageF& ac_plane = ac_image.Plane(c);
-    const size_t ac_per_row = ac_plane.PixelsPerRow();
-    ImageF* PIK_RESTRICT idct_plane = idct->MutablePlane(c);
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  const size_t N = kBlockDim / downsample;
+  const size_t idct_stride = idct_plane->PixelsPerRow();
+  const size_t ac_per_row = ac_plane.PixelsPerRow();
 
-    for (size_t by = 0; by < ysize_blocks; ++by) {
-      const float* PIK_RESTRICT ac_row = ac_plane.ConstRow(by);
-      const AcStrategyRow& acs_row = ac_strategy.ConstRow(acs_rect, by);
-      float* PIK_RESTRICT idct_row = idct_plane->Row(by * N);
+  for (size_t by = 0; by < ysize_blocks; ++by) {
+    const float* PIK_RESTRICT ac_row = ac_plane.ConstRow(by);
+    const AcStrategyRow& acs_row = ac_strategy.ConstRow(acs_rect, by);
+    float* PIK_RESTRICT idct_row = idct_plane->Row(by * N);
 
-      for (size_t bx = 0; bx < xsize_blocks; ++bx) {
-        const float* PIK_RESTRICT ac_pos = ac_row + bx * block_size;
-        const AcStrategy& acs = acs_row[bx];
-        float* PIK_RESTRICT idct_pos = idct_row + bx * N;
+    for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+      const float* PIK_RESTRICT ac_pos = ac_row + bx * block_size;
+      const AcStrategy& acs = acs_row[bx];
+      float* PIK_RESTRICT idct_pos = idct_row + bx * N;
 
+      if (downsample == 1) {
         acs.TransformToPixels(ac_pos, ac_per_row, idct_pos, idct_stride);
+      } else if (downsample == 2) {
+        acs.DC4x4FromLowFrequencies(ac_pos, ac_per_row, idct_pos, idct_stride);
+      } else {
+        acs.DC2x2FromLowFrequencies(ac_pos, ac_per_row, idct_pos, idct_stride);
       }
     }
   }
@@ -893,8 +1175,10 @@ static SIMD_ATTR void InverseIntegralTransform(
 Image3F ReconOpsinImage(const PassHeader& pass_header,
                         const GroupHeader& header, const Quantizer& quantizer,
                         const Rect& block_group_rect, DecCache* dec_cache,
-                        PassDecCache* pass_dec_cache, PikInfo* pik_info) {
+                        PassDecCache* pass_dec_cache, PikInfo* pik_info,
+                        size_t downsample) {
   PROFILER_ZONE("ReconOpsinImage");
+  PIK_ASSERT(downsample == 1 || downsample == 2 || downsample == 4);
   constexpr size_t N = kBlockDim;
   const size_t xsize_blocks = block_group_rect.xsize();
   const size_t ysize_blocks = block_group_rect.ysize();
@@ -902,6 +1186,9 @@ Image3F ReconOpsinImage(const PassHeader& pass_header,
   const size_t ysize_tiles = DivCeil(ysize_blocks, kTileDimInBlocks);
   const bool predict_lf = pass_header.predict_lf;
   const bool predict_hf = pass_header.predict_hf;
+  // Planes whose AC is predicted and inverse-transformed.
+  const size_t c_begin = pass_header.gray_from_y ? 1 : 0;
+  const size_t c_end = pass_header.gray_from_y ? 2 : 3;
 
   // TODO(veluca): this should probably happen upon dequantization of DC. Also,
   // we should consider doing something similar for AC.
@@ -998,7 +1285,7 @@ Image3F ReconOpsinImage(const PassHeader& pass_header,
   // * 0-th bit for calculation or lf2x2 / pred2x2 & initial LF AC update;
   ImageB tile_stage(xsize_tiles + 1, ysize_tiles + 1);
 
-  for (size_t c = 0; c < dec_cache->ac.kNumPlanes; c++) {
+  for (size_t c = c_begin; c < c_end; c++) {
     // Reset tile stages.
     for (size_t ty = 0; ty < ysize_tiles + 1; ++ty) {
       uint8_t* tile_stage_row = tile_stage.Row(ty);
@@ -1037,14 +1324,23 @@ Image3F ReconOpsinImage(const PassHeader& pass_header,
 
   if (predict_hf) {
     // TODO(user): make UpSample4x4BlurDCT tile-wise-able.
-    AddPredictions(pred2x2, pass_dec_cache->ac_strategy, block_group_rect,
-                   &dec_cache->ac);
+    for (size_t c = c_begin; c < c_end; c++) {
+      AddPredictions(pred2x2.Plane(c), pass_dec_cache->ac_strategy,
+                     block_group_rect, dec_cache->ac.MutablePlane(c));
+    }
   }
 
-  Image3F idct(xsize_blocks * N, ysize_blocks * N);
-  InverseIntegralTransform(xsize_blocks, ysize_blocks, dec_cache->ac,
-                           pass_dec_cache->ac_strategy, block_group_rect,
-                           &idct);
+  Image3F idct(xsize_blocks * N / downsample, ysize_blocks * N / downsample);
+  for (size_t c = c_begin; c < c_end; c++) {
+    InverseIntegralTransform(xsize_blocks, ysize_blocks, dec_cache->ac.Plane(c),
+                             pass_dec_cache->ac_strategy, block_group_rect,
+                             downsample, idct.MutablePlane(c));
+  }
+  if (pass_header.gray_from_y) {
+    // Noise, upsampling and the three-plane post-processing still read X/B.
+    PROFILER_ZONE("GrayscaleRestoreXB");
+    kGrayXyb->RestoreXB(&idct);
+  }
 
   if (pik_info && pik_info->testing_aux.ac_prediction != nullptr) {
     PROFILER_ZONE("Subtract ac_prediction");
@@ -1056,36 +1352,197 @@ Image3F ReconOpsinImage(const PassHeader& pass_header,
   return idct;
 }
 
-Image3F FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
-                             const Quantizer& quantizer,
-                             PassDecCache* pass_dec_cache, PikInfo* pik_info) {
-  Image3F copy;
+// kGrayscaleOpt passes only encode the Y channel of the DC, and X/B of gray
+// pixels are a function of Y, so decoding can skip X and B entirely (their AC
+// is negligible). Adaptive reconstruction with a fixed sigma has no
+// single-plane implementation.
+bool CanFinalizeGray(const PassHeader& pass_header) {
+  return (pass_header.flags & PassHeader::kGrayscaleOpt) &&
+         (!pass_header.have_adaptive_reconstruction ||
+          pass_header.epf_params.enable_adaptive);
+}
+
+namespace {
+
+// Runs the per-pass post processing except for the final smoothing.
+Image3F ReconstructBeforeSmoothing(Image3F&& idct,
+                                   const PassHeader& pass_header,
+                                   const Quantizer& quantizer,
+                                   PassDecCache* pass_dec_cache,
+                                   ThreadPool* pool, PikInfo* pik_info) {
+  if (!pass_header.have_adaptive_reconstruction) return std::move(idct);
+
+  // AdaptiveReconstruction needs the image before smoothing. Moving it aside
+  // avoids a copy because ConvolveGaborish allocates its output anyway.
+  Image3F original;
   const Image3F* non_smoothed = &idct;
   if (pass_header.gaborish != GaborishStrength::kOff) {
-    // AdaptiveReconstruction needs a copy before smoothing.
-    // TODO(janwas): remove
-    if (pass_header.have_adaptive_reconstruction) {
-      PROFILER_ZONE("CopyForAR");
-      copy = CopyImage(idct);
-      non_smoothed = &copy;
-
-      idct = ConvolveGaborish(std::move(idct), pass_header.gaborish,
-                              /*pool=*/nullptr);
-    }
+    original = std::move(idct);
+    idct = ConvolveGaborish(original, pass_header.gaborish, pool);
+    non_smoothed = &original;
+  }
+
+  AdaptiveReconstructionAux* ar_aux =
+      pik_info ? &pik_info->adaptive_reconstruction_aux : nullptr;
+  return AdaptiveReconstruction(
+      &idct, *non_smoothed, quantizer, pass_dec_cache->raw_quant_field,
+      pass_dec_cache->ac_strategy, pass_dec_cache->biases,
+      pass_header.epf_params, pool, ar_aux);
+}
+
+// Adds a node that replaces all channels of "rgb" with their luma.
+TFNode* AddLuma(TFNode* rgb, TFBuilder* builder) {
+  return builder->AddClosure(
+      "grayscale", Borders(), Scale(), {rgb}, 3, TFType::kF32,
+      [](const ConstImageViewF* in, const OutputRegion& output_region,
+         const MutableImageViewF* PIK_RESTRICT out) {
+        for (size_t y = 0; y < output_region.ysize; ++y) {
+          const float* PIK_RESTRICT row_r = in[0].ConstRow(y);
+          const float* PIK_RESTRICT row_g = in[1].ConstRow(y);
+          const float* PIK_RESTRICT row_b = in[2].ConstRow(y);
+          float* PIK_RESTRICT out_r = out[0].Row(y);
+          float* PIK_RESTRICT out_g = out[1].Row(y);
+          float* PIK_RESTRICT out_b = out[2].Row(y);
+          for (size_t x = 0; x < output_region.xsize; ++x) {
+            const float gray =
+                row_r[x] * 0.299 + row_g[x] * 0.587 + row_b[x] * 0.114;
+            out_r[x] = out_g[x] = out_b[x] = gray;
+          }
+        }
+      });
+}
+
+// 3 planes x (64 + 2)^2 floats per buffer; all buffers fit in L2.
+void RunLinearGraph(TFBuilder* builder, ThreadPool* pool,
+                    Image3F* PIK_RESTRICT linear) {
+  const ImageSize tile_size = ImageSize::Make(64, 64);
+  const TFGraphPtr graph = builder->Finalize(
+      ImageSize::Make(linear->xsize(), linear->ysize()), tile_size, pool);
+  graph->Run();
+}
+
+// Smoothing (unless "gaborish" is kOff), OpsinToLinear and optional grayscale
+// conversion of "opsin", run as a TFGraph on cache-sized tiles.
+void OpsinToLinearGraph(const Image3F& opsin, GaborishStrength gaborish,
+                        bool grayscale, ThreadPool* pool,
+                        Image3F* PIK_RESTRICT linear) {
+  PROFILER_ZONE("FinalizePass graph");
+  TFBuilder builder;
+  // Mirroring at the (padded) image edges matches ConvolveGaborish.
+  TFNode* xyb = builder.AddSource("opsin", 3, TFType::kF32, TFWrap::kMirror);
+  builder.SetSource(xyb, &opsin);
+  TFNode* smoothed = AddGaborish(xyb, gaborish, &builder);
+  TFNode* rgb = AddOpsinToLinear(smoothed, &builder);
+  if (grayscale) {
+    rgb = AddLuma(rgb, &builder);
   }
+  builder.SetSink(rgb, linear);
+  RunLinearGraph(&builder, pool, linear);
+}
+
+// Same as ReconstructBeforeSmoothing, for the Y plane of a grayscale pass.
+ImageF ReconstructGrayBeforeSmoothing(ImageF&& idct_y,
+                                      const PassHeader& pass_header,
+                                      const Quantizer& quantizer,
+                                      PassDecCache* pass_dec_cache,
+                                      ThreadPool* pool, PikInfo* pik_info) {
+  if (!pass_header.have_adaptive_reconstruction) return std::move(idct_y);
 
-  if (pass_header.have_adaptive_reconstruction) {
-    AdaptiveReconstructionAux* ar_aux =
-        pik_info ? &pik_info->adaptive_reconstruction_aux : nullptr;
-    idct = AdaptiveReconstruction(
-        &idct, *non_smoothed, quantizer, pass_dec_cache->raw_quant_field,
-        pass_dec_cache->ac_strategy, pass_dec_cache->biases,
-        pass_header.epf_params, ar_aux);
+  ImageF original;
+  const ImageF* non_smoothed = &idct_y;
+  if (pass_header.gaborish != GaborishStrength::kOff) {
+    original = std::move(idct_y);
+    idct_y = ConvolveGaborish(original, pass_header.gaborish, pool);
+    non_smoothed = &original;
   }
 
-  idct = ConvolveGaborish(std::move(idct), pass_header.gaborish,
-                          /*pool=*/nullptr);
+  AdaptiveReconstructionAux* ar_aux =
+      pik_info ? &pik_info->adaptive_reconstruction_aux : nullptr;
+  return AdaptiveReconstruction(
+      &idct_y, *non_smoothed, quantizer, pass_dec_cache->raw_quant_field,
+      pass_dec_cache->ac_strategy, pass_dec_cache->biases.Plane(1),
+      pass_header.epf_params, pool, ar_aux);
+}
+
+// Same as OpsinToLinearGraph with grayscale = true, but only reads Y; X and B
+// are reconstructed from the smoothed Y within each tile.
+void GrayToLinearGraph(const ImageF& opsin_y, GaborishStrength gaborish,
+                       ThreadPool* pool, Image3F* PIK_RESTRICT linear) {
+  PROFILER_ZONE("FinalizePass gray graph");
+  TFBuilder builder;
+  TFNode* y = builder.AddSource("opsin_y", 1, TFType::kF32, TFWrap::kMirror);
+  builder.SetSource(y, &opsin_y);
+  TFNode* smoothed = AddGaborish(y, gaborish, &builder);
+  TFNode* xyb = builder.AddClosure(
+      "gray_to_xyb", Borders(), Scale(), {smoothed}, 3, TFType::kF32,
+      [](const ConstImageViewF* in, const OutputRegion& output_region,
+         const MutableImageViewF* PIK_RESTRICT out) {
+        for (size_t y = 0; y < output_region.ysize; ++y) {
+          const float* PIK_RESTRICT row_in = in[0].ConstRow(y);
+          float* PIK_RESTRICT row_x = out[0].Row(y);
+          float* PIK_RESTRICT row_y = out[1].Row(y);
+          float* PIK_RESTRICT row_b = out[2].Row(y);
+          for (size_t x = 0; x < output_region.xsize; ++x) {
+            row_y[x] = row_in[x];
+            kGrayXyb->YToXyb(row_in[x], &row_x[x], &row_b[x]);
+          }
+        }
+      });
+  TFNode* rgb = AddLuma(AddOpsinToLinear(xyb, &builder), &builder);
+  builder.SetSink(rgb, linear);
+  RunLinearGraph(&builder, pool, linear);
+}
+
+}  // namespace
+
+Image3F FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
+                             const Quantizer& quantizer,
+                             PassDecCache* pass_dec_cache, ThreadPool* pool,
+                             PikInfo* pik_info) {
+  idct = ReconstructBeforeSmoothing(std::move(idct), pass_header, quantizer,
+                                    pass_dec_cache, pool, pik_info);
+  idct = ConvolveGaborish(std::move(idct), pass_header.gaborish, pool);
   return std::move(idct);
 }
 
+void FinalizePassDecodingToLinear(Image3F&& idct, const PassHeader& pass_header,
+                                  const Quantizer& quantizer,
+                                  PassDecCache* pass_dec_cache, bool grayscale,
+                                  ThreadPool* pool, Image3F* PIK_RESTRICT linear,
+                                  PikInfo* pik_info) {
+  PIK_CHECK(linear->xsize() <= idct.xsize() && linear->ysize() <= idct.ysize());
+  if (grayscale && pass_header.gray_from_y && CanFinalizeGray(pass_header)) {
+    ImageF idct_y = std::move(*idct.MutablePlane(1));
+    // Frees X and B before allocating any post-processing buffers.
+    idct = Image3F();
+    const ImageF opsin_y =
+        ReconstructGrayBeforeSmoothing(std::move(idct_y), pass_header,
+                                       quantizer, pass_dec_cache, pool,
+                                       pik_info);
+    GrayToLinearGraph(opsin_y, pass_header.gaborish, pool, linear);
+    return;
+  }
+  const Image3F opsin =
+      ReconstructBeforeSmoothing(std::move(idct), pass_header, quantizer,
+                                 pass_dec_cache, pool, pik_info);
+  OpsinToLinearGraph(opsin, pass_header.gaborish, grayscale, pool, linear);
+}
+
+Image3F DownsampledOpsinFromDC(const PassHeader& pass_header,
+                               const PassDecCache& pass_dec_cache,
+                               const Rect& block_rect) {
+  Image3F opsin = CopyImage(block_rect, pass_dec_cache.dc);
+  if (pass_header.flags & PassHeader::kGrayscaleOpt) {
+    kGrayXyb->RestoreXB(&opsin);
+  }
+  return opsin;
+}
+
+void DownsampledPassToLinear(const Image3F& opsin, bool grayscale,
+                             ThreadPool* pool, Image3F* PIK_RESTRICT linear) {
+  PIK_CHECK(linear->xsize() <= opsin.xsize() &&
+            linear->ysize() <= opsin.ysize());
+  OpsinToLinearGraph(opsin, GaborishStrength::kOff, grayscale, pool, linear);
+}
+
 }  // namespace pik
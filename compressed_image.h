@@ -9,6 +9,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <memory>
+#include <vector>
 
 #include "adaptive_reconstruction.h"
 #include "bit_reader.h"
@@ -16,6 +18,7 @@
 #include "common.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
+#include "entropy_coder.h"
 #include "headers.h"
 #include "image.h"
 #include "multipass_handler.h"
@@ -24,6 +27,7 @@
 #include "pik_info.h"
 #include "pik_params.h"
 #include "quantizer.h"
+#include "write_bits.h"
 
 // Methods to encode (decode) an image into (from) the bit stream:
 // initialization of per-pass information and per-group information, actual
@@ -34,9 +38,11 @@ namespace pik {
 
 struct GradientMap;
 
-// Initialize per-pass information.
+// Initialize per-pass information. "opsin_dct" is the TransposedScaledDCT of
+// "opsin_full", which is reused for the blocks with AcStrategy::Type::DCT.
 SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
                                       const Image3F& opsin_full,
+                                      const Image3F& opsin_dct,
                                       const AcStrategyImage& ac_strategy,
                                       const Quantizer& quantizer,
                                       const ColorCorrelationMap& cmap,
@@ -58,13 +64,73 @@ SIMD_ATTR void ComputeCoefficients(const Quantizer& quantizer,
                                    MultipassManager* manager,
                                    const PikInfo* aux_out = nullptr);
 
-// Encodes AC quantized coefficients from the given encoder cache.
-PaddedBytes EncodeToBitstream(const EncCache& cache, const Rect& rect,
-                              const Quantizer& quantizer,
-                              const NoiseParams& noise_params,
-                              const ColorCorrelationMap& cmap, bool fast_mode,
-                              MultipassHandler* handler,
-                              PikInfo* info = nullptr);
+// Coefficient order and entropy codes (histograms and context map) for the AC
+// strategy, quant field and AC tokens of all groups of a pass, see
+// PassHeader::shared_entropy_codes.
+struct EncoderEntropyCodes {
+  int32_t order[kOrderContexts * kBlockDim * kBlockDim];
+  // Only one of "codes" and "huffman_codes" is used, depending on
+  // "use_prefix_codes" (see PassHeader::use_prefix_codes).
+  bool use_prefix_codes = false;
+  std::vector<ANSEncodingData> codes;
+  std::vector<HuffmanEncodingData> huffman_codes;
+  std::vector<uint8_t> context_map;
+};
+
+// Computes and encodes entropy codes for the groups whose caches (as passed to
+// EncodeToBitstream) and handlers are given. The result is stored once per
+// pass, after the DC.
+void EncodeSharedEntropyCodes(const std::vector<EncCache>& enc_caches,
+                              const std::vector<MultipassHandler*>& handlers,
+                              bool fast_mode, EncoderEntropyCodes* shared_codes,
+                              BitWriter* writer, PikInfo* info = nullptr);
+
+// Adds the tokens of the group, in the natural coefficient order of the preset
+// entropy codes, to "histograms" (of kNumContexts contexts).
+void CountNaturalOrderTokens(const EncCache& enc_cache, const Rect& rect,
+                             MultipassHandler* handler,
+                             TokenHistograms* histograms);
+
+// Returns the (1-based) preset entropy codes with which EncodeToBitstream
+// should encode the group (see GroupHeader::preset_entropy_codes), or 0 if
+// the group should store its own codes. "use_prefix_codes" selects the kind
+// of codes, see PassHeader::use_prefix_codes.
+size_t SelectPresetEntropyCodes(const EncCache& enc_cache, const Rect& rect,
+                                MultipassHandler* handler,
+                                bool use_prefix_codes);
+
+// Returns the estimated size [bytes] of the tokens EncodeToBitstream would
+// write for the group with its own codes, excluding the codes themselves (cf.
+// PikInfo::entropy_estimate). Much cheaper than EncodeToBitstream because it
+// neither stores tokens nor builds entropy codes.
+float EstimateGroupSize(const EncCache& enc_cache, const Rect& rect,
+                        MultipassHandler* handler);
+
+// Encodes AC quantized coefficients from the given encoder cache. If
+// "shared_codes" is null, the group's own order and histograms are computed
+// and stored, otherwise "shared_codes" are used.
+void EncodeToBitstream(const EncCache& cache, const Rect& rect,
+                       const Quantizer& quantizer,
+                       const NoiseParams& noise_params,
+                       const ColorCorrelationMap& cmap, bool fast_mode,
+                       MultipassHandler* handler,
+                       const EncoderEntropyCodes* shared_codes,
+                       BitWriter* writer, PikInfo* info = nullptr);
+
+// Decoder counterpart of EncoderEntropyCodes, for one group or (if stored in
+// PassDecCache::shared_codes) all groups of a pass.
+struct DecoderEntropyCodes {
+  int32_t coeff_order[kOrderContexts * kBlockDim * kBlockDim];
+  ANSCode code;                                    // Unless prefix codes.
+  std::vector<HuffmanDecodingData> huffman_codes;  // Only for prefix codes.
+  std::vector<uint8_t> context_map;
+  std::unique_ptr<ACDecoderContexts> ac_contexts;
+};
+
+// Reads coefficient orders and histograms as written by EncodeToBitstream or
+// EncodeSharedEntropyCodes.
+Status DecodeEntropyCodes(BitReader* reader, bool use_prefix_codes,
+                          DecoderEntropyCodes* codes);
 
 // Decodes AC coefficients from the bit stream, populating the AC
 // fields of the decoder cache, and the corresponding rectangles in the global
@@ -86,20 +152,50 @@ void DequantImageAC(const Quantizer& quantizer, const ColorCorrelationMap& cmap,
                     const Rect& group_rect);
 
 // Applies predictions to de-quantized AC coefficients, copies DC coefficients
-// into AC, and does IDCT.
+// into AC, and does IDCT. If "downsample" is 2 or 4, only the corresponding
+// low frequencies are transformed, yielding a downsampled image.
 Image3F ReconOpsinImage(const PassHeader& pass_header,
                         const GroupHeader& header, const Quantizer& quantizer,
                         const Rect& block_group_rect, DecCache* cache,
                         PassDecCache* pass_dec_cache,
-                        PikInfo* pik_info = nullptr);
+                        PikInfo* pik_info = nullptr, size_t downsample = 1);
+
+// Returns whether the pass can be decoded and post-processed on the Y plane
+// only; if so, the encoder sets PassHeader::gray_from_y for the last pass.
+bool CanFinalizeGray(const PassHeader& pass_header);
 
 // Finalizes the decoding of a pass by running per-pass post processing:
-// smoothing and adaptive reconstruction.
+// smoothing and adaptive reconstruction. Uses "pool" (if non-null) for all
+// stages; the result does not depend on the number of threads.
 Image3F FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
                              const Quantizer& quantizer,
-                             PassDecCache* pass_dec_cache,
+                             PassDecCache* pass_dec_cache, ThreadPool* pool,
                              PikInfo* pik_info = nullptr);
 
+// Same as FinalizePassDecoding followed by OpsinToLinear and, if "grayscale",
+// replacing all channels with their luma. The final smoothing and all
+// subsequent per-pixel stages run as a TFGraph on cache-sized tiles, so the
+// smoothed opsin image is never materialized. "linear" may be smaller than
+// "idct" (e.g. to exclude the block padding) but must be allocated.
+void FinalizePassDecodingToLinear(Image3F&& idct, const PassHeader& pass_header,
+                                  const Quantizer& quantizer,
+                                  PassDecCache* pass_dec_cache, bool grayscale,
+                                  ThreadPool* pool, Image3F* PIK_RESTRICT linear,
+                                  PikInfo* pik_info = nullptr);
+
+// Returns the DC of the blocks in "block_rect", i.e. the opsin image of that
+// region downsampled by kBlockDim. Requires DecodeDC.
+Image3F DownsampledOpsinFromDC(const PassHeader& pass_header,
+                               const PassDecCache& pass_dec_cache,
+                               const Rect& block_rect);
+
+// Converts a downsampled pass (see DecompressParams::downsample) to linear
+// sRGB, optionally replacing all channels with their luma. Unlike
+// FinalizePassDecodingToLinear, this skips adaptive reconstruction and
+// smoothing, which operate on full-resolution pixels.
+void DownsampledPassToLinear(const Image3F& opsin, bool grayscale,
+                             ThreadPool* pool, Image3F* PIK_RESTRICT linear);
+
 }  // namespace pik
 
 #endif  // COMPRESSED_IMAGE_H_
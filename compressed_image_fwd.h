@@ -7,14 +7,19 @@
 #ifndef COMPRESSED_IMAGE_FWD_H_
 #define COMPRESSED_IMAGE_FWD_H_
 
+#include <memory>
+
 #include "ac_strategy.h"
 #include "common.h"
 #include "data_parallel.h"
 #include "gauss_blur.h"
 #include "image.h"
+#include "pik_params.h"
 
 namespace pik {
 
+struct DecoderEntropyCodes;  // compressed_image.h
+
 struct GradientMap {
   Image3F gradient;  // corners of the gradient map tiles
 
@@ -45,6 +50,10 @@ struct PassEncCache {
 
   bool use_gradient;
   bool grayscale_opt = false;
+  // Interleaved rANS states for AC tokens, see PassHeader::num_ans_states.
+  size_t num_ans_states = 1;
+  // See PassHeader::use_prefix_codes.
+  bool use_prefix_codes = false;
   // Gradient map, if used.
   GradientMap gradient;
 };
@@ -54,6 +63,8 @@ struct EncCache {
   bool initialized = false;
 
   bool grayscale_opt = false;
+  size_t num_ans_states = 1;
+  bool use_prefix_codes = false;
 
   size_t xsize_blocks;
   size_t ysize_blocks;
@@ -67,6 +78,8 @@ struct EncCache {
   // AC strategy.
   AcStrategyImage ac_strategy;
 
+  HistogramClustering histogram_clustering = HistogramClustering::kBest;
+
   // Every cell with saliency > threshold will be considered as 'salient'.
   float saliency_threshold;
   // Debug parameter: If true, drop non-salient AC part in progressive encoding.
@@ -100,10 +113,20 @@ struct PassDecCache {
 
   bool grayscale;
 
+  // See PassHeader::use_prefix_codes.
+  bool use_prefix_codes = false;
+
+  // See PassHeader::gray_from_y.
+  bool gray_from_y = false;
+
   // Bias that was used for dequantization of the corresponding coefficient.
   // Note that the code that stores the biases relies on the fact that DC biases
   // are 0.
   Image3F biases;
+  // Block coordinates of the first bias; nonzero if biases only cover a region
+  // of the image (see DecompressParams::crop).
+  size_t biases_x0 = 0;
+  size_t biases_y0 = 0;
 
   // Full DC of the pass. Note that this will be split in *AC* group sized
   // chunks for AC predictions (DC group size != AC group size).
@@ -115,6 +138,10 @@ struct PassDecCache {
   ImageI raw_quant_field;
 
   AcStrategyImage ac_strategy;
+
+  // Read-only entropy codes of all groups if PassHeader::shared_entropy_codes,
+  // otherwise null.
+  std::shared_ptr<const DecoderEntropyCodes> shared_codes;
 };
 
 template <size_t N>
@@ -96,15 +96,27 @@ struct CompressArgs {
           }
           got_distance = true;
         } else if (arg == "--target_size") {
-          printf("Warning: target_size does not set all flags/modes.\n");
           PIK_RETURN_IF_ERROR(
               ParseUnsigned(argc, argv, &i, &params.target_size));
           got_target_size = true;
         } else if (arg == "--target_bpp") {
-          printf("Warning: target_bpp does not set all flags/modes.\n");
           PIK_RETURN_IF_ERROR(
               ParseFloat(argc, argv, &i, &params.target_bitrate));
           got_target_bpp = true;
+        } else if (arg == "--preview") {
+          PIK_RETURN_IF_ERROR(
+              ParseUnsigned(argc, argv, &i, &params.preview_size));
+        } else if (arg == "--ans_states") {
+          PIK_RETURN_IF_ERROR(
+              ParseUnsigned(argc, argv, &i, &params.ans_states));
+        } else if (arg == "--shared_codes") {
+          params.shared_entropy_codes = true;
+        } else if (arg == "--prefix_codes") {
+          params.use_prefix_codes = true;
+        } else if (arg == "--no_preset_codes") {
+          params.use_preset_entropy_codes = false;
+        } else if (arg == "--fast_clustering") {
+          params.histogram_clustering = HistogramClustering::kFast;
         } else if (arg == "--intensity_target") {
           PIK_RETURN_IF_ERROR(
               ParseFloat(argc, argv, &i, &params.intensity_target));
@@ -175,18 +187,26 @@ struct CompressArgs {
   static const char* HelpFormatString() {
     return "Usage: %s in out.pik [--distance <maxError>] [--fast] [-v]\n"
            "[--num_threads <0..N>] [--print_profile <0,1>] [-x key value]\n"
-           "[--resampleX2 N]\n"
+           "[--resampleX2 N] [--preview N] [--ans_states <1,2,4>]\n"
+           "[--fast_clustering] [--shared_codes] [--prefix_codes]\n"
+           "[--no_preset_codes]\n"
            "[--noise <0,1>] [--smooth <0,1>] [--gradient <0,1>]\n"
            "[--adaptive_reconstruction <0,1>] [--gaborish <0..7>]\n"
            " in can be PNG, PNM or PFM.\n"
            " --distance: Max. butteraugli distance, lower = higher quality.\n"
            "     Good default: 1.0. Supported range: 0.5 .. 3.0.\n"
            " --target_bpp N. Aim at file size that has N bits per pixel.\n"
-           "     Compresses to 1 % of the target BPP in ideal conditions.\n"
+           "     Usually at most, and within a few %% of, the target.\n"
            " --target_size N. Aim at file size of N bytes.\n"
-           "     Compresses to 1 % of the target size in ideal conditions.\n"
+           "     Usually at most, and within a few %% of, the target.\n"
            "     Runs the same algorithm as --target_bpp\n"
            " --resampleX2 is twice the downsampling factor, 3 for 1.5x.\n"
+           " --preview N: also store a preview of at most N pixels per side.\n"
+           " --ans_states: interleaved entropy decoder states (faster).\n"
+           " --fast_clustering: faster, inexact histogram clustering.\n"
+           " --shared_codes: one set of entropy codes for all groups.\n"
+           " --prefix_codes: Huffman instead of ANS (larger, faster decode).\n"
+           " --no_preset_codes: small groups always store their own codes.\n"
            " --fast: Use fast encoding mode (less dense).\n"
            " --noise: force enable/disable noise generation.\n"
            " --smooth: force enable/disable smooth predictor.\n"
@@ -212,12 +232,6 @@ struct CompressArgs {
   Override print_profile = Override::kDefault;
 };
 
-// Proposes a distance to try for a given bpp target. This could depend
-// on the entropy in the image, too, but let's start with something.
-static double ApproximateDistanceForBPP(double bpp) {
-  return 1.704 * pow(bpp, -0.804);
-}
-
 Status Compress(ThreadPool* pool, CompressArgs& args,
                 PaddedBytes* compressed) {
   double t0, t1;
@@ -235,59 +249,17 @@ Status Compress(ThreadPool* pool, CompressArgs& args,
 
   const size_t xsize = io.xsize();
   const size_t ysize = io.ysize();
-  if (args.params.target_size > 0 || args.params.target_bitrate > 0) {
-    // Search algorithm for target bpp / size.
-    CompressArgs s = args;  // Args for search.
-    if (s.params.target_size > 0) {
-      s.params.target_bitrate = s.params.target_size * 8.0 /
-                                (io.xsize() * io.ysize());
-      s.params.target_size = 0;
-    }
-    double dist = ApproximateDistanceForBPP(s.params.target_bitrate);
-    s.params.butteraugli_distance = dist;
-    double target_size =
-        s.params.target_bitrate * (1 / 8.) * io.xsize() * io.ysize();
-    s.params.target_bitrate = 0;
-    double best_dist = 1.0;
-    double best_loss = 1e99;
-    for (int i = 0; i < 12; ++i) {
-      s.params.butteraugli_distance = dist;
-      PaddedBytes candidate;
-      bool ok = Compress(pool, s, &candidate);
-      if (!ok) {
-        printf("Compression error occured during the search for best size."
-               " Trying with butteraugli distance %.15g\n", best_dist);
-        break;
-      }
-      printf("Butteraugli distance %g gives to %zu bytes, %g bpp.\n",
-             best_dist, candidate.size(),
-             candidate.size() * 8.0 / (io.xsize() * io.ysize()));
-      const double ratio = static_cast<double>(candidate.size()) /
-                           target_size;
-      const double loss = std::max(ratio, 1.0 / std::max(ratio, 1e-30));
-      if (best_loss > loss) {
-        best_dist = dist;
-        best_loss = loss;
-      }
-      dist *= ratio;
-      if (dist < 0.01) {
-        dist = 0.01;
-      }
-      if (dist >= 16.0) {
-        dist = 16.0;
-      }
-    }
-    printf("Choosing butteraugli distance %.15g\n", best_dist);
-    args.params.butteraugli_distance = best_dist;
-    args.params.target_bitrate = 0;
-    args.params.target_size = 0;
-  }
   char mode[200];
   if (args.params.fast_mode) {
     strcpy(mode, "in fast mode ");
   }
-  snprintf(mode, sizeof(mode), "with maximum Butteraugli distance %f",
-           args.params.butteraugli_distance);
+  const size_t target_size = args.params.TargetSize(Rect(io.color()));
+  if (target_size != 0) {
+    snprintf(mode, sizeof(mode), "to a target of %zu bytes", target_size);
+  } else {
+    snprintf(mode, sizeof(mode), "with maximum Butteraugli distance %f",
+             args.params.butteraugli_distance);
+  }
   fprintf(stderr,
           "Read %zu bytes (%zux%zu, %.1f MP/s); compressing %s, %zu threads.\n",
           io.enc_size, xsize, ysize, decode_mps, mode, NumWorkerThreads(pool));
@@ -306,6 +278,10 @@ Status Compress(ThreadPool* pool, CompressArgs& args,
                      (xsize * ysize);
   fprintf(stderr, "Compressed to %zu bytes (%.2f bpp, %.2f MB/s).\n",
           compressed->size(), bpp, bytes * 1E-6 / (t1 - t0));
+  if (target_size != 0 && compressed->size() > target_size) {
+    fprintf(stderr, "Warning: exceeded the target of %zu bytes.\n",
+            target_size);
+  }
 
   if (args.params.verbose) {
     aux_out.Print(1);
@@ -18,7 +18,7 @@
 
 namespace pik {
 
-SIMD_ATTR void TransposedScaledDCT(const Image3F& img,
+SIMD_ATTR void TransposedScaledDCT(const Image3F& img, ThreadPool* pool,
                                    Image3F* PIK_RESTRICT dct) {
   const constexpr size_t N = kBlockDim;
   constexpr int block_size = N * N;
@@ -31,7 +31,7 @@ SIMD_ATTR void TransposedScaledDCT(const Image3F& img,
 
   {
     PROFILER_ZONE("dct TransposedScaled2");
-    for (size_t by = 0; by < ysize_blocks; ++by) {
+    const auto transform_row = [&](const int by, const int thread) SIMD_ATTR {
       const size_t stride = img.PixelsPerRow();
       for (int c = 0; c < 3; ++c) {
         const float* PIK_RESTRICT row_in = img.PlaneRow(c, by * N);
@@ -43,7 +43,8 @@ SIMD_ATTR void TransposedScaledDCT(const Image3F& img,
               ScaleToBlock<N>(row_out + bx * block_size));
         }
       }
-    }
+    };
+    RunOnPool(pool, 0, ysize_blocks, transform_row, "TransposedScaledDCT");
   }
 }
 
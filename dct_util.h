@@ -55,7 +55,7 @@ void GatherBlock(const float* PIK_RESTRICT row, size_t stride,
 // afterwards, so that ComputeTransposedScaledIDCT() applied to each block will
 // return exactly the input image block.
 // REQUIRES: img.xsize() == N*W, img.ysize() == N*H
-SIMD_ATTR void TransposedScaledDCT(const Image3F& img,
+SIMD_ATTR void TransposedScaledDCT(const Image3F& img, ThreadPool* pool,
                                    Image3F* PIK_RESTRICT dct);
 
 }  // namespace pik
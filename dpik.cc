@@ -65,6 +65,8 @@ struct DecompressArgs {
           size_t strength;
           PIK_RETURN_IF_ERROR(ParseUnsigned(argc, argv, &i, &strength));
           params.gaborish = static_cast<GaborishStrength>(strength);
+        } else if (strcmp(argv[i], "--preview") == 0) {
+          preview = true;
         } else if (strcmp(argv[i], "--print_profile") == 0) {
           PIK_RETURN_IF_ERROR(ParseOverride(argc, argv, &i, &print_profile));
         } else {
@@ -98,7 +100,7 @@ struct DecompressArgs {
     return "Usage: %s [--bits_per_sample N] [--num_threads N]\n"
            "[--color_space RGB_D65_SRG_Rel_Lin] [--gaborish N]\n"
            "[--noise 0] [--gradient 0] [--adaptive_reconstruction <0,1>]\n"
-           "[--num_reps N] [--print_profile B] in.pik [out]\n"
+           "[--num_reps N] [--print_profile B] [--preview] in.pik [out]\n"
            "  B is a boolean (0/1), N an unsigned integer.\n"
            "  --bits_per_sample defaults to original (input) bit depth.\n"
            "  --noise 0 disables noise generation.\n"
@@ -106,6 +108,7 @@ struct DecompressArgs {
            "  --adaptive_reconstruction 1/0 enables/disables extra filtering.\n"
            "  --gaborish 0..7 chooses deblocking strength (4=normal).\n"
            "  --color_space defaults to original (input) color space.\n"
+           "  --preview decodes only the preview stored by cpik --preview.\n"
            "  --print_profile 1: print timing information before exiting.\n"
            "  out is PNG with ICC, or PPM/PFM.\n";
   }
@@ -118,6 +121,7 @@ struct DecompressArgs {
   std::string color_space;  // description
   DecompressParams params;
   size_t num_reps = 1;
+  bool preview = false;
   Override print_profile = Override::kDefault;
 };
 
@@ -202,11 +206,15 @@ class DecompressStats {
 
 // Called num_reps times.
 Status Decompress(CodecContext* codec_context, const PaddedBytes& compressed,
-                  const DecompressParams& params, CodecInOut* PIK_RESTRICT io,
+                  const DecompressParams& params, bool preview,
+                  CodecInOut* PIK_RESTRICT io,
                   DecompressStats* PIK_RESTRICT stats) {
   PikInfo info;
   const double t0 = Now();
-  if (!PikToPixels(params, compressed, io, &info)) {
+  const Status ok = preview
+                        ? PikPreviewToPixels(params, compressed, io, &info)
+                        : PikToPixels(params, compressed, io, &info);
+  if (!ok) {
     fprintf(stderr, "Failed to decompress.\n");
     return false;
   }
@@ -277,7 +285,8 @@ int Decompress(int argc, char* argv[]) {
 
   CodecInOut io(&codec_context);
   for (size_t i = 0; i < args.num_reps; ++i) {
-    if (!Decompress(&codec_context, compressed, args.params, &io, &stats)) {
+    if (!Decompress(&codec_context, compressed, args.params, args.preview,
+                    &io, &stats)) {
       return 1;
     }
   }
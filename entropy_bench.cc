@@ -0,0 +1,225 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Microbenchmark for the AC entropy decoder: encodes synthetic quantized
+// coefficients of one group and measures the throughput of DecodeAC with ANS
+// and prefix codes.
+//
+// NOTE: this does not read group bitstreams of encoded images. Their AC tokens
+// are interleaved with AC strategy and quant field tokens and are only
+// decodable after the pass headers, so DecodeAC cannot be timed in isolation
+// without duplicating most of PikGroupToPixels. RandomCoefficients instead
+// approximates the statistics of a photo; the absolute ns/token may thus
+// differ from real images, so use it to compare decoder variants.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "ans_decode.h"
+#include "bit_reader.h"
+#include "common.h"
+#include "entropy_coder.h"
+#include "huffman_decode.h"
+#include "huffman_encode.h"
+#include "image.h"
+#include "os_specific.h"
+#include "padded_bytes.h"
+#include "write_bits.h"
+
+namespace pik {
+namespace {
+
+constexpr size_t kBlockSize = kBlockDim * kBlockDim;
+
+// Returns quantized AC coefficients resembling those of a photo at moderate
+// quality: the probability of nonzero coefficients varies per block and
+// decreases with frequency; X and B have fewer than Y.
+Image3S RandomCoefficients(const size_t xsize_blocks,
+                           const size_t ysize_blocks) {
+  std::mt19937 rng(129);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::geometric_distribution<int> magnitude(0.4);
+
+  Image3S ac(xsize_blocks * kBlockSize, ysize_blocks);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t by = 0; by < ysize_blocks; ++by) {
+      int16_t* PIK_RESTRICT row = ac.PlaneRow(c, by);
+      for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+        const float u = uniform(rng);
+        const float activity = u * (c == 1 ? 2.0f : 0.6f);
+        int16_t* PIK_RESTRICT block = row + bx * kBlockSize;
+        block[0] = 0;  // DC is encoded separately.
+        for (size_t k = 1; k < kBlockSize; ++k) {
+          const float freq = k % kBlockDim + k / kBlockDim;
+          int16_t coeff = 0;
+          if (uniform(rng) < activity * std::exp(-freq / 3.0f)) {
+            coeff = 1 + magnitude(rng);
+            if (uniform(rng) < 0.5f) coeff = -coeff;
+          }
+          block[k] = coeff;
+        }
+      }
+    }
+  }
+  return ac;
+}
+
+struct EncodedAC {
+  int32_t order[kOrderContexts * kBlockSize];
+  PaddedBytes histograms;
+  PaddedBytes tokens;
+  size_t num_tokens;
+};
+
+// "num_ans_states" == 0 selects prefix codes.
+EncodedAC Encode(const Image3S& ac, const size_t num_ans_states) {
+  const size_t xsize_blocks = ac.xsize() / kBlockSize;
+  const size_t ysize_blocks = ac.ysize();
+  EncodedAC encoded;
+  ComputeCoeffOrder(ac, Rect(ac), encoded.order);
+
+  std::vector<ACToken> tokens;
+  for (size_t y = 0; y < DivCeil(ysize_blocks, kTileDimInBlocks); ++y) {
+    for (size_t x = 0; x < DivCeil(xsize_blocks, kTileDimInBlocks); ++x) {
+      const Rect tile_rect(x * kTileDimInBlocks, y * kTileDimInBlocks,
+                           kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
+                           ysize_blocks);
+      TokenizeCoefficients(encoded.order, tile_rect, ac, &tokens);
+    }
+  }
+  encoded.num_tokens = tokens.size();
+
+  std::vector<uint8_t> context_map;
+  BitWriter histo_writer;
+  BitWriter token_writer;
+  if (num_ans_states == 0) {
+    TokenHistograms histograms(kNumContexts);
+    histograms.Add(tokens);
+    std::vector<HuffmanEncodingData> codes;
+    BuildAndEncodeHistograms(histograms, &codes, &context_map, &histo_writer,
+                             nullptr);
+    WriteTokens(tokens, codes, context_map, &token_writer, nullptr);
+  } else {
+    TokenHistograms histograms(kNumContexts);
+    histograms.Add(tokens);
+    std::vector<ANSEncodingData> codes;
+    BuildAndEncodeHistograms(histograms, &codes, &context_map, &histo_writer,
+                             nullptr);
+    WriteTokens(tokens, codes, context_map, &token_writer, nullptr,
+                num_ans_states);
+  }
+  encoded.histograms = histo_writer.TakeBytes();
+  encoded.tokens = token_writer.TakeBytes();
+  return encoded;
+}
+
+// Decodes all tiles "reps" times; returns the fastest time [s] or -1 if the
+// decoded coefficients differ from "ac". "Code" is ANSCode or
+// std::vector<HuffmanDecodingData>, "Reader" the matching symbol reader.
+template <class Code, class Reader>
+double TimeDecodeAC(const Image3S& ac, const EncodedAC& encoded,
+                    const size_t reps) {
+  const size_t xsize_blocks = ac.xsize() / kBlockSize;
+  const size_t ysize_blocks = ac.ysize();
+
+  BitReader histo_reader(encoded.histograms.data(), encoded.histograms.size());
+  Code code;
+  std::vector<uint8_t> context_map;
+  if (!DecodeHistograms(&histo_reader, kNumContexts, 256, &code,
+                        &context_map)) {
+    return -1.0;
+  }
+  const ACDecoderContexts contexts(context_map);
+
+  Image3S tile(kTileDimInBlocks * kBlockSize, kTileDimInBlocks);
+  Image3I num_nzeroes(kTileDimInBlocks, kTileDimInBlocks);
+  double best = 1E10;
+  for (size_t rep = 0; rep < reps; ++rep) {
+    BitReader reader(encoded.tokens.data(), encoded.tokens.size());
+    Reader decoder(&code);
+    bool ok = true;
+    const double start = Now();
+    for (size_t y = 0; y < DivCeil(ysize_blocks, kTileDimInBlocks); ++y) {
+      for (size_t x = 0; x < DivCeil(xsize_blocks, kTileDimInBlocks); ++x) {
+        const Rect rect(x * kTileDimInBlocks, y * kTileDimInBlocks,
+                        kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
+                        ysize_blocks);
+        ok &= DecodeAC(contexts, encoded.order, &reader, &decoder, &tile,
+                       rect, &num_nzeroes);
+        // The first repetition is a warmup and also verifies the result.
+        if (rep != 0) continue;
+        for (int c = 0; c < 3; ++c) {
+          for (size_t by = 0; by < rect.ysize(); ++by) {
+            const int16_t* row_expected =
+                ac.ConstPlaneRow(c, rect.y0() + by) + rect.x0() * kBlockSize;
+            const int16_t* row_actual = tile.ConstPlaneRow(c, by);
+            for (size_t i = 0; i < rect.xsize() * kBlockSize; ++i) {
+              // DecodeAC leaves the DC coefficients zero.
+              ok &= (i % kBlockSize == 0 || row_actual[i] == row_expected[i]);
+            }
+          }
+        }
+      }
+    }
+    const double elapsed = Now() - start;
+    ok &= decoder.CheckANSFinalState();
+    if (!ok) return -1.0;
+    if (rep != 0) best = std::min(best, elapsed);
+  }
+  return best;
+}
+
+int Run(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Args: [repetitions]\n");
+    return 1;
+  }
+  const size_t reps = std::max(2, argc == 2 ? atoi(argv[1]) : 20);
+
+  const Image3S ac =
+      RandomCoefficients(kGroupWidthInBlocks, kGroupWidthInBlocks);
+
+  using HuffmanCodes = std::vector<HuffmanDecodingData>;
+  for (size_t num_ans_states : {1, 2, 4, 0}) {
+    const EncodedAC encoded = Encode(ac, num_ans_states);
+    double elapsed;
+    if (num_ans_states == 1) {
+      elapsed = TimeDecodeAC<ANSCode, ANSSymbolReaderT<1>>(ac, encoded, reps);
+    } else if (num_ans_states == 2) {
+      elapsed = TimeDecodeAC<ANSCode, ANSSymbolReaderT<2>>(ac, encoded, reps);
+    } else if (num_ans_states == 4) {
+      elapsed = TimeDecodeAC<ANSCode, ANSSymbolReaderT<4>>(ac, encoded, reps);
+    } else {
+      elapsed =
+          TimeDecodeAC<HuffmanCodes, HuffmanSymbolReader>(ac, encoded, reps);
+    }
+    char name[32];
+    if (num_ans_states == 0) {
+      snprintf(name, sizeof(name), "prefix codes");
+    } else {
+      snprintf(name, sizeof(name), "%zu ANS state(s)", num_ans_states);
+    }
+    if (elapsed < 0.0) {
+      fprintf(stderr, "DecodeAC mismatch (%s)\n", name);
+      return 1;
+    }
+    printf("DecodeAC %s: %zu tokens, %zu bytes, %.2f ns/token "
+           "(%.1f M tokens/s)\n",
+           name, encoded.num_tokens, encoded.tokens.size(),
+           elapsed * 1E9 / encoded.num_tokens,
+           encoded.num_tokens * 1E-6 / elapsed);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::Run(argc, argv); }
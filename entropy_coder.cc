@@ -32,81 +32,6 @@
 
 namespace pik {
 
-// Reorder the skip+bits symbols by decreasing population-count
-// (keeping the first end-of-block symbol in place).
-// Round-trip:
-//  skip_and_bits = (SKIP << 4) | BITS
-//  symbol = kSkipAndBitsSymbol[skip_and_bits]
-//  SKIP = kSkipLut[symbol]
-//  BITS = kBitsLut[symbol]
-constexpr uint8_t kSkipAndBitsSymbol[256] = {
-    0,   1,   2,   3,   5,   10,  17,  32,  68,  83,  84,  85,  86,  87,  88,
-    89,  90,  4,   7,   12,  22,  31,  43,  60,  91,  92,  93,  94,  95,  96,
-    97,  98,  99,  6,   14,  26,  36,  48,  66,  100, 101, 102, 103, 104, 105,
-    106, 107, 108, 109, 8,   19,  34,  44,  57,  78,  110, 111, 112, 113, 114,
-    115, 116, 117, 118, 119, 9,   27,  39,  52,  61,  79,  120, 121, 122, 123,
-    124, 125, 126, 127, 128, 129, 11,  28,  41,  53,  64,  80,  130, 131, 132,
-    133, 134, 135, 136, 137, 138, 139, 13,  33,  46,  63,  72,  140, 141, 142,
-    143, 144, 145, 146, 147, 148, 149, 150, 15,  35,  47,  65,  69,  151, 152,
-    153, 154, 155, 156, 157, 158, 159, 160, 161, 16,  37,  51,  62,  74,  162,
-    163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 18,  38,  50,  59,  75,
-    173, 174, 175, 176, 177, 178, 179, 180, 181, 182, 183, 20,  40,  54,  76,
-    82,  184, 185, 186, 187, 188, 189, 190, 191, 192, 193, 194, 23,  42,  55,
-    77,  195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 24,  45,
-    56,  70,  207, 208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 25,
-    49,  58,  71,  219, 220, 221, 222, 223, 224, 225, 226, 227, 228, 229, 230,
-    29,  67,  81,  231, 232, 233, 234, 235, 236, 237, 238, 239, 240, 241, 242,
-    21,  30,  73,  243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254,
-    255,
-};
-
-constexpr uint8_t kSkipLut[256] = {
-    0x0, 0x0, 0x0, 0x0, 0x1, 0x0, 0x2, 0x1, 0x3, 0x4, 0x0, 0x5, 0x1, 0x6, 0x2,
-    0x7, 0x8, 0x0, 0x9, 0x3, 0xa, 0xf, 0x1, 0xb, 0xc, 0xd, 0x2, 0x4, 0x5, 0xe,
-    0xf, 0x1, 0x0, 0x6, 0x3, 0x7, 0x2, 0x8, 0x9, 0x4, 0xa, 0x5, 0xb, 0x1, 0x3,
-    0xc, 0x6, 0x7, 0x2, 0xd, 0x9, 0x8, 0x4, 0x5, 0xa, 0xb, 0xc, 0x3, 0xd, 0x9,
-    0x1, 0x4, 0x8, 0x6, 0x5, 0x7, 0x2, 0xe, 0x0, 0x7, 0xc, 0xd, 0x6, 0xf, 0x8,
-    0x9, 0xa, 0xb, 0x3, 0x4, 0x5, 0xe, 0xa, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-    0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x2, 0x2, 0x2, 0x2, 0x2, 0x2,
-    0x2, 0x2, 0x2, 0x2, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x4,
-    0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x5, 0x5, 0x5, 0x5, 0x5, 0x5,
-    0x5, 0x5, 0x5, 0x5, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6,
-    0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x8, 0x8, 0x8, 0x8,
-    0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9,
-    0x9, 0x9, 0x9, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xb,
-    0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xc, 0xc, 0xc, 0xc,
-    0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xd, 0xd, 0xd, 0xd, 0xd, 0xd, 0xd,
-    0xd, 0xd, 0xd, 0xd, 0xd, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe,
-    0xe, 0xe, 0xe, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
-    0xf,
-};
-
-constexpr uint8_t kBitsLut[256] = {
-    0x0, 0x1, 0x2, 0x3, 0x1, 0x4, 0x1, 0x2, 0x1, 0x1, 0x5, 0x1, 0x3, 0x1, 0x2,
-    0x1, 0x1, 0x6, 0x1, 0x2, 0x1, 0x0, 0x4, 0x1, 0x1, 0x1, 0x3, 0x2, 0x2, 0x1,
-    0x1, 0x5, 0x7, 0x2, 0x3, 0x2, 0x4, 0x2, 0x2, 0x3, 0x2, 0x3, 0x2, 0x6, 0x4,
-    0x2, 0x3, 0x3, 0x5, 0x2, 0x3, 0x3, 0x4, 0x4, 0x3, 0x3, 0x3, 0x5, 0x3, 0x4,
-    0x7, 0x5, 0x4, 0x4, 0x5, 0x4, 0x6, 0x2, 0x8, 0x5, 0x4, 0x4, 0x5, 0x2, 0x5,
-    0x5, 0x4, 0x4, 0x6, 0x6, 0x6, 0x3, 0x5, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,
-    0x0, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb,
-    0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0,
-    0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb,
-    0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,
-    0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8,
-    0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc,
-    0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0,
-    0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x5, 0x6, 0x7,
-    0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa,
-    0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc,
-    0xd, 0xe, 0xf, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe,
-    0xf,
-};
-
-// REQUIRED: 0 <= skip, bits <= 15
-constexpr uint8_t SkipAndBitsSymbol(int skip, int bits) {
-  return kSkipAndBitsSymbol[(skip << 4) | bits];
-}
-
 // Size of batch of Lehmer-transformed order of coefficients.
 // If all codes in the batch are zero, then span is encoded with a single bit.
 constexpr int32_t kCoeffOrderCodeSpan = 16;
@@ -199,16 +124,13 @@ void ExpandDC(const Rect& rect_dc, Image3S* PIK_RESTRICT dc,
   }
 }
 
-void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
-                       int32_t* PIK_RESTRICT order) {
+void CountZeroCoefficients(const Image3S& ac, const Rect& rect,
+                           int32_t* PIK_RESTRICT num_zeros) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
   size_t xsize_blocks = rect.xsize() / block_size;
   size_t ysize_blocks = rect.ysize();
-  const int32_t* natural_coeff_order = NaturalCoeffOrder();
 
-  // Count number of zero coefficients, separately for each DCT band.
-  int32_t num_zeros[block_size * kOrderContexts] = {0};
   for (int c = 0; c < 3; ++c) {
     for (size_t by = 0; by < ysize_blocks; ++by) {
       const int16_t* PIK_RESTRICT row = rect.ConstPlaneRow(ac, c, by);
@@ -221,6 +143,13 @@ void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
       }
     }
   }
+}
+
+void ComputeCoeffOrderFromZeros(const int32_t* PIK_RESTRICT num_zeros,
+                                int32_t* PIK_RESTRICT order) {
+  constexpr int N = kBlockDim;
+  constexpr int block_size = N * N;
+  const int32_t* natural_coeff_order = NaturalCoeffOrder();
 
   for (uint8_t ctx = 0; ctx < kOrderContexts; ++ctx) {
     struct PosAndCount {
@@ -253,6 +182,14 @@ void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
   }
 }
 
+void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
+                       int32_t* PIK_RESTRICT order) {
+  // Count number of zero coefficients, separately for each DCT band.
+  int32_t num_zeros[kBlockDim * kBlockDim * kOrderContexts] = {0};
+  CountZeroCoefficients(ac, rect, num_zeros);
+  ComputeCoeffOrderFromZeros(num_zeros, order);
+}
+
 void EncodeCoeffOrder(const int32_t* PIK_RESTRICT order,
                       size_t* PIK_RESTRICT storage_ix, uint8_t* storage) {
   constexpr int N = kBlockDim;
@@ -315,21 +252,22 @@ void ExtractNumNZeroes(const Rect& rect, const ImageS& coeffs,
   }
 }
 
-std::string EncodeCoeffOrders(const int32_t* order, PikInfo* pik_info) {
+void EncodeCoeffOrders(const int32_t* order, BitWriter* writer,
+                       PikInfo* pik_info) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
-  std::string encoded_coeff_order(kOrderContexts * 1024, 0);
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&encoded_coeff_order[0]);
-  size_t storage_ix = 0;
+  const size_t max_bits = kOrderContexts * 1024 * kBitsPerByte;
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_bits);
   for (size_t c = 0; c < kOrderContexts; c++) {
-    EncodeCoeffOrder(&order[c * block_size], &storage_ix, storage);
+    EncodeCoeffOrder(&order[c * block_size], writer->pos(), writer->storage());
   }
-  PIK_CHECK(storage_ix < encoded_coeff_order.size() * kBitsPerByte);
-  encoded_coeff_order.resize((storage_ix + 7) / kBitsPerByte);
+  PIK_CHECK(writer->BitsWritten() - bits_before < max_bits);
+  writer->ZeroPadToByte();
   if (pik_info) {
-    pik_info->layers[kLayerOrder].total_size += encoded_coeff_order.size();
+    pik_info->layers[kLayerOrder].total_size +=
+        (writer->BitsWritten() - bits_before) / kBitsPerByte;
   }
-  return encoded_coeff_order;
 }
 
 // Number of clusters is encoded with VarLenUint8 - see EncodeContextMap and
@@ -341,11 +279,6 @@ constexpr size_t kMaxClusters = 256;
 // TODO(user): find image that would require more clusters.
 // TODO(user): revise this number when non-DCT-8x8 contexts are added / used.
 static const size_t kClustersLimit = 64;
-static const size_t kNumStaticZdensContexts = 7;
-static const size_t kNumStaticOrderFreeContexts = 5;
-// Should depend on N.
-static const size_t kNumStaticContexts =
-    kNumStaticOrderFreeContexts + 3 * kNumStaticZdensContexts;
 
 std::vector<uint8_t> StaticContextMap() {
   constexpr int N = kBlockDim;
@@ -449,7 +382,7 @@ void TokenizeQuantField(const Rect& rect, const ImageI& quant_field,
 
 void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
                           const Image3S& coeffs,
-                          std::vector<Token>* PIK_RESTRICT output) {
+                          std::vector<ACToken>* PIK_RESTRICT output) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
   const size_t xsize_blocks = rect.xsize();
@@ -459,8 +392,13 @@ void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
                        xsize_blocks * block_size, ysize_blocks);
 
   // TODO(user): update the estimate: usually less coefficients are used.
-  output->reserve(output->size() +
-                  3 * xsize_blocks * ysize_blocks * block_size);
+  // Callers append tile by tile, so grow geometrically: reserving exactly
+  // would reallocate and copy all previous tokens for every tile.
+  const size_t max_tokens = 3 * xsize_blocks * ysize_blocks * block_size;
+  if (output->size() + max_tokens > output->capacity()) {
+    output->reserve(
+        std::max(output->size() + max_tokens, 2 * output->capacity()));
+  }
 
   ImageI tmp_num_nzeros(xsize_blocks, ysize_blocks);
   for (int c = 0; c < 3; ++c) {
@@ -478,7 +416,7 @@ void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
         const int32_t* order = &orders[bctx * block_size];
         int32_t nzero_ctx = NonZeroContext(predicted_nzeros, bctx);
         size_t num_nzeros = row_nzeros[bx];
-        output->emplace_back(nzero_ctx, num_nzeros, 0, 0);
+        output->emplace_back(nzero_ctx, num_nzeros, 0);
         if (num_nzeros == 0) continue;
         const int16_t* PIK_RESTRICT block = row + bx * block_size;
         int r = 0;
@@ -491,7 +429,7 @@ void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
             if (++r == 16) {
               output->emplace_back(
                   histo_offset + ZeroDensityContext(num_nzeros, last_k),
-                  SkipAndBitsSymbol(15, 0), 0, 0);
+                  SkipAndBitsSymbol(15, 0), 0);
               // Skip 15, encode 0-bit coefficient -> 16 zeros in total.
               r = 0;
               last_k = k;
@@ -503,9 +441,10 @@ void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
           PIK_ASSERT(nbits > 0);
           PIK_ASSERT(nbits <= 15);
           int symbol = SkipAndBitsSymbol(r, nbits);
+          PIK_ASSERT(kBitsLut[symbol] == nbits);
           output->emplace_back(
               histo_offset + ZeroDensityContext(num_nzeros, last_k), symbol,
-              nbits, bits);
+              bits);
           r = 0;
           last_k = k;
           if (--num_nzeros == 0) break;
@@ -552,18 +491,30 @@ class HistogramBuilder {
     histograms_[histo_idx].Add(symbol);
   }
 
+  // Equivalent to VisitSymbol for each of the counts[0, 256) symbols.
+  void AddCounts(const uint32_t* PIK_RESTRICT counts, int histo_idx) {
+    PIK_ASSERT(histo_idx < histograms_.size());
+    histograms_[histo_idx].AddCounts(counts);
+  }
+
   template <class EntropyEncodingData>
   void BuildAndStoreEntropyCodes(std::vector<EntropyEncodingData>* codes,
                                  std::vector<uint8_t>* context_map,
                                  size_t* storage_ix, uint8_t* storage,
-                                 PikImageSizeInfo* info) const {
+                                 PikImageSizeInfo* info,
+                                 HistogramClustering clustering) const {
     std::vector<Histogram> clustered_histograms(histograms_);
     context_map->resize(histograms_.size());
     if (histograms_.size() > 1) {
       std::vector<uint32_t> histogram_symbols;
-      ClusterHistograms(histograms_, histograms_.size(), 1, std::vector<int>(),
-                        kClustersLimit, &clustered_histograms,
-                        &histogram_symbols);
+      if (clustering == HistogramClustering::kFast) {
+        FastClusterHistograms(histograms_, kClustersLimit,
+                              &clustered_histograms, &histogram_symbols);
+      } else {
+        ClusterHistograms(histograms_, histograms_.size(), 1,
+                          std::vector<int>(), kClustersLimit,
+                          &clustered_histograms, &histogram_symbols);
+      }
       for (size_t c = 0; c < histograms_.size(); ++c) {
         (*context_map)[c] = static_cast<uint8_t>(histogram_symbols[c]);
       }
@@ -603,6 +554,17 @@ class HistogramBuilder {
       ++data_[symbol];
       ++total_count_;
     }
+    void AddCounts(const uint32_t* PIK_RESTRICT counts) {
+      size_t size = 256;
+      while (size != 0 && counts[size - 1] == 0) --size;
+      if (size > data_.size()) {
+        data_.resize(size);
+      }
+      for (size_t i = 0; i < size; ++i) {
+        data_[i] += counts[i];
+        total_count_ += counts[i];
+      }
+    }
     void AddHistogram(const Histogram& other) {
       if (other.data_.size() > data_.size()) {
         data_.resize(other.data_.size());
@@ -613,11 +575,9 @@ class HistogramBuilder {
       total_count_ += other.total_count_;
     }
     float PopulationCost() const {
-      std::vector<int> counts(data_.size());
-      for (size_t i = 0; i < data_.size(); ++i) {
-        counts[i] = data_[i];
-      }
-      return ANSPopulationCost(counts.data(), counts.size(), total_count_);
+      // Counts are far below 2^31; signed and unsigned may alias.
+      return ANSPopulationCost(reinterpret_cast<const int*>(data_.data()),
+                               data_.size(), total_count_);
     }
     double ShannonEntropy() const {
       return pik::ShannonEntropy(data_.data(), data_.size());
@@ -631,53 +591,66 @@ class HistogramBuilder {
 
 }  // namespace
 
-std::string BuildAndEncodeHistograms(
+void BuildAndEncodeHistograms(
     size_t num_contexts, const std::vector<std::vector<Token>>& tokens,
     std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info) {
+    BitWriter* writer, PikImageSizeInfo* info,
+    HistogramClustering clustering) {
+  TokenHistograms histograms(num_contexts);
+  for (const std::vector<Token>& token_list : tokens) {
+    histograms.Add(token_list);
+  }
+  BuildAndEncodeHistograms(histograms, codes, context_map, writer, info,
+                           clustering);
+}
+
+namespace {
+
+// "EntropyEncodingData" is ANSEncodingData or HuffmanEncodingData.
+template <class EntropyEncodingData>
+void BuildAndEncodeHistogramsT(const TokenHistograms& histograms,
+                               std::vector<EntropyEncodingData>* codes,
+                               std::vector<uint8_t>* context_map,
+                               BitWriter* writer, PikImageSizeInfo* info,
+                               HistogramClustering clustering) {
+  const size_t num_contexts = histograms.num_contexts;
   // Build histograms.
   HistogramBuilder builder(num_contexts);
-  for (size_t i = 0; i < tokens.size(); ++i) {
-    for (size_t j = 0; j < tokens[i].size(); ++j) {
-      const Token token = tokens[i][j];
-      builder.VisitSymbol(token.symbol, token.context);
-    }
+  for (size_t c = 0; c < num_contexts; ++c) {
+    builder.AddCounts(histograms.Counts(c), c);
   }
   // Encode histograms.
   const size_t max_out_size = 1024 * (num_contexts + 4);
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
-  builder.BuildAndStoreEntropyCodes(codes, context_map, &storage_ix, storage,
-                                    info);
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_out_size * kBitsPerByte);
+  builder.BuildAndStoreEntropyCodes(codes, context_map, writer->pos(),
+                                    writer->storage(), info, clustering);
   // Close the histogram bit stream.
-  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
-  WriteBits(jump_bits, 0, &storage_ix, storage);
-  PIK_ASSERT(storage_ix % kBitsPerByte == 0);
-  const size_t histo_bytes = storage_ix >> 3;
+  writer->ZeroPadToByte();
+  const size_t histo_bytes =
+      (writer->BitsWritten() - bits_before) / kBitsPerByte;
   PIK_CHECK(histo_bytes <= max_out_size);
-  output.resize(histo_bytes);
   if (info) {
     info->num_clustered_histograms += codes->size();
     info->histogram_size += histo_bytes;
     info->total_size += histo_bytes;
   }
-  return output;
 }
 
-std::string BuildAndEncodeHistogramsFast(
-    const std::vector<std::vector<Token>>& tokens,
-    std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info) {
+template <class EntropyEncodingData>
+void BuildAndEncodeHistogramsFastT(const TokenHistograms& token_histograms,
+                                   std::vector<EntropyEncodingData>* codes,
+                                   std::vector<uint8_t>* context_map,
+                                   BitWriter* writer, PikImageSizeInfo* info) {
+  PIK_ASSERT(token_histograms.num_contexts == kNumContexts);
   *context_map = StaticContextMap();
-  // Build histograms from tokens.
+  // Merge the per-context counts into the static clusters.
   std::vector<uint32_t> histograms(kNumStaticContexts << 8);
-  for (size_t i = 0; i < tokens.size(); ++i) {
-    for (size_t j = 0; j < tokens[i].size(); ++j) {
-      const Token token = tokens[i][j];
-      const uint32_t histo_idx = (*context_map)[token.context];
-      ++histograms[(histo_idx << 8) + token.symbol];
+  for (size_t c = 0; c < kNumContexts; ++c) {
+    uint32_t* PIK_RESTRICT histogram = &histograms[(*context_map)[c] << 8];
+    const uint32_t* PIK_RESTRICT counts = token_histograms.Counts(c);
+    for (size_t i = 0; i < 256; ++i) {
+      histogram[i] += counts[i];
     }
   }
   if (info) {
@@ -686,80 +659,194 @@ std::string BuildAndEncodeHistogramsFast(
     }
   }
   const size_t max_out_size = kNumStaticContexts * 1024;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_out_size * kBitsPerByte);
   // Encode the histograms.
-  EncodeContextMap(*context_map, kNumStaticContexts, &storage_ix, storage);
+  EncodeContextMap(*context_map, kNumStaticContexts, writer->pos(),
+                   writer->storage());
   for (size_t c = 0; c < kNumStaticContexts; ++c) {
-    ANSEncodingData code;
-    code.BuildAndStore(&histograms[c << 8], 256, &storage_ix, storage);
+    EntropyEncodingData code;
+    code.BuildAndStore(&histograms[c << 8], 256, writer->pos(),
+                       writer->storage());
     codes->emplace_back(std::move(code));
   }
   // Close the histogram bit stream.
-  WriteZeroesToByteBoundary(&storage_ix, storage);
-  const size_t histo_bytes = (storage_ix >> 3);
+  writer->ZeroPadToByte();
+  const size_t histo_bytes =
+      (writer->BitsWritten() - bits_before) / kBitsPerByte;
   PIK_CHECK(histo_bytes <= max_out_size);
-  output.resize(histo_bytes);
   if (info) {
     info->num_clustered_histograms += codes->size();
     info->histogram_size += histo_bytes;
   }
-  return output;
 }
 
-std::string WriteTokens(const std::vector<Token>& tokens,
-                        const std::vector<ANSEncodingData>& codes,
-                        const std::vector<uint8_t>& context_map,
-                        PikImageSizeInfo* pik_info) {
+}  // namespace
+
+void BuildAndEncodeHistograms(const TokenHistograms& histograms,
+                              std::vector<ANSEncodingData>* codes,
+                              std::vector<uint8_t>* context_map,
+                              BitWriter* writer, PikImageSizeInfo* info,
+                              HistogramClustering clustering) {
+  BuildAndEncodeHistogramsT(histograms, codes, context_map, writer, info,
+                            clustering);
+}
+
+void BuildAndEncodeHistograms(const TokenHistograms& histograms,
+                              std::vector<HuffmanEncodingData>* codes,
+                              std::vector<uint8_t>* context_map,
+                              BitWriter* writer, PikImageSizeInfo* info,
+                              HistogramClustering clustering) {
+  BuildAndEncodeHistogramsT(histograms, codes, context_map, writer, info,
+                            clustering);
+}
+
+void BuildAndEncodeHistogramsFast(
+    const std::vector<std::vector<Token>>& tokens,
+    std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
+    BitWriter* writer, PikImageSizeInfo* info) {
+  TokenHistograms token_histograms(kNumContexts);
+  for (const std::vector<Token>& token_list : tokens) {
+    token_histograms.Add(token_list);
+  }
+  BuildAndEncodeHistogramsFast(token_histograms, codes, context_map, writer,
+                               info);
+}
+
+void BuildAndEncodeHistogramsFast(const TokenHistograms& histograms,
+                                  std::vector<ANSEncodingData>* codes,
+                                  std::vector<uint8_t>* context_map,
+                                  BitWriter* writer, PikImageSizeInfo* info) {
+  BuildAndEncodeHistogramsFastT(histograms, codes, context_map, writer, info);
+}
+
+void BuildAndEncodeHistogramsFast(const TokenHistograms& histograms,
+                                  std::vector<HuffmanEncodingData>* codes,
+                                  std::vector<uint8_t>* context_map,
+                                  BitWriter* writer, PikImageSizeInfo* info) {
+  BuildAndEncodeHistogramsFastT(histograms, codes, context_map, writer, info);
+}
+
+namespace {
+
+// "TokenT" is Token or ACToken.
+template <class TokenT>
+void WriteTokensT(const std::vector<TokenT>& tokens,
+                  const std::vector<ANSEncodingData>& codes,
+                  const std::vector<uint8_t>& context_map, BitWriter* writer,
+                  PikImageSizeInfo* pik_info, size_t num_ans_states) {
+  PIK_ASSERT(num_ans_states == 1 || num_ans_states == 2 ||
+             num_ans_states == 4);
   const size_t max_out_size = 4 * tokens.size() + 4096;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_out_size * kBitsPerByte);
+  BufferedBitWriter buffered(writer->pos(), writer->storage());
   size_t num_extra_bits = 0;
   PIK_ASSERT(kANSBufferSize <= (1 << 16));
+  std::vector<uint32_t> out;
+  out.reserve(std::min<size_t>(kANSBufferSize, tokens.size()));
   for (int start = 0; start < tokens.size(); start += kANSBufferSize) {
-    std::vector<uint32_t> out;
-    out.reserve(kANSBufferSize);
+    out.clear();
     const int end = std::min<int>(start + kANSBufferSize, tokens.size());
-    ANSCoder ans;
+    // See ANSSymbolReaderT for the assignment of symbols to states.
+    ANSCoder ans[4];
     for (int i = end - 1; i >= start; --i) {
       const Token token = tokens[i];
       const uint8_t histo_idx = context_map[token.context];
       const ANSEncSymbolInfo info = codes[histo_idx].ans_table[token.symbol];
       uint8_t nbits = 0;
-      uint32_t bits = ans.PutSymbol(info, &nbits);
+      uint32_t bits = ans[(i - start) % num_ans_states].PutSymbol(info, &nbits);
       if (nbits == 16) {
         out.push_back(((i - start) << 16) | bits);
       }
     }
-    const uint32_t state = ans.GetState();
-    WriteBits(16, (state >> 16) & 0xffff, &storage_ix, storage);
-    WriteBits(16, state & 0xffff, &storage_ix, storage);
+    for (size_t s = 0; s < num_ans_states; ++s) {
+      const uint32_t state = ans[s].GetState();
+      buffered.Write(16, (state >> 16) & 0xffff);
+      buffered.Write(16, state & 0xffff);
+    }
     int tokenidx = start;
     for (int i = out.size(); i >= 0; --i) {
       int nextidx = i > 0 ? start + (out[i - 1] >> 16) : end;
       for (; tokenidx < nextidx; ++tokenidx) {
         const Token token = tokens[tokenidx];
-        WriteBits(token.nbits, token.bits, &storage_ix, storage);
+        buffered.Write(token.nbits, token.bits);
         num_extra_bits += token.nbits;
       }
       if (i > 0) {
-        WriteBits(16, out[i - 1] & 0xffff, &storage_ix, storage);
+        buffered.Write(16, out[i - 1] & 0xffff);
       }
     }
   }
-  const size_t out_size = (storage_ix + 7) >> 3;
+  buffered.Flush();
+  const size_t num_bits = writer->BitsWritten() - bits_before;
+  writer->ZeroPadToByte();
+  const size_t out_size = (num_bits + 7) >> 3;
   PIK_CHECK(out_size <= max_out_size);
-  output.resize(out_size);
   if (pik_info) {
-    pik_info->entropy_coded_bits += storage_ix - num_extra_bits;
+    pik_info->entropy_coded_bits += num_bits - num_extra_bits;
     pik_info->extra_bits += num_extra_bits;
     pik_info->total_size += out_size;
   }
-  return output;
+}
+
+template <class TokenT>
+void WriteTokensT(const std::vector<TokenT>& tokens,
+                  const std::vector<HuffmanEncodingData>& codes,
+                  const std::vector<uint8_t>& context_map, BitWriter* writer,
+                  PikImageSizeInfo* pik_info) {
+  // At most 15 bits per symbol plus 32 extra bits.
+  const size_t max_out_size = 6 * tokens.size() + 4096;
+  const size_t bits_before = writer->BitsWritten();
+  writer->Reserve(max_out_size * kBitsPerByte);
+  BufferedBitWriter buffered(writer->pos(), writer->storage());
+  size_t num_extra_bits = 0;
+  for (const Token token : tokens) {
+    const HuffmanEncodingData& code = codes[context_map[token.context]];
+    buffered.Write(code.depth[token.symbol], code.bits[token.symbol]);
+    buffered.Write(token.nbits, token.bits);
+    num_extra_bits += token.nbits;
+  }
+  buffered.Flush();
+  const size_t num_bits = writer->BitsWritten() - bits_before;
+  writer->ZeroPadToByte();
+  const size_t out_size = (num_bits + 7) >> 3;
+  PIK_CHECK(out_size <= max_out_size);
+  if (pik_info) {
+    pik_info->entropy_coded_bits += num_bits - num_extra_bits;
+    pik_info->extra_bits += num_extra_bits;
+    pik_info->total_size += out_size;
+  }
+}
+
+}  // namespace
+
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states) {
+  WriteTokensT(tokens, codes, context_map, writer, pik_info, num_ans_states);
+}
+
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<HuffmanEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info) {
+  WriteTokensT(tokens, codes, context_map, writer, pik_info);
+}
+
+void WriteTokens(const std::vector<ACToken>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states) {
+  WriteTokensT(tokens, codes, context_map, writer, pik_info, num_ans_states);
+}
+
+void WriteTokens(const std::vector<ACToken>& tokens,
+                 const std::vector<HuffmanEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info) {
+  WriteTokensT(tokens, codes, context_map, writer, pik_info);
 }
 
 namespace {
@@ -767,13 +854,18 @@ namespace {
 const constexpr int kRleSymStart = 18;
 }  // namespace
 
-std::string EncodeImageData(const Rect& rect, const Image3S& img,
-                            PikImageSizeInfo* info) {
+void EncodeImageData(const Rect& rect, const Image3S& img, BitWriter* writer,
+                     PikImageSizeInfo* info, bool use_prefix_codes) {
   const size_t xsize = rect.xsize();
   const size_t ysize = rect.ysize();
+  PIK_ASSERT(writer->BitsWritten() % kBitsPerByte == 0);
 
-  std::string best;
-  PikImageSizeInfo best_info;
+  // The RLE variant is written directly to "writer"; the other one only
+  // replaces it if smaller.
+  const size_t begin = writer->BitsWritten();
+  BitWriter alternative;
+  PikImageSizeInfo rle_info;
+  PikImageSizeInfo alternative_info;
 
   for (bool rle : {true, false}) {
     std::vector<std::vector<Token>> tokens(1);
@@ -807,21 +899,33 @@ std::string EncodeImageData(const Rect& rect, const Image3S& img,
       encode_cnt(c);
     }
 
-    std::vector<ANSEncodingData> codes;
     std::vector<uint8_t> context_map;
-    PikImageSizeInfo info;
-    std::string enc =
-        BuildAndEncodeHistograms(3, tokens, &codes, &context_map, &info);
-    enc += WriteTokens(tokens[0], codes, context_map, &info);
-    if (best.empty() || best.size() > enc.size()) {
-      best = std::move(enc);
-      best_info = info;
+    BitWriter* out = rle ? writer : &alternative;
+    PikImageSizeInfo* out_info = rle ? &rle_info : &alternative_info;
+    if (use_prefix_codes) {
+      TokenHistograms histograms(3);
+      histograms.Add(tokens[0]);
+      std::vector<HuffmanEncodingData> codes;
+      BuildAndEncodeHistograms(histograms, &codes, &context_map, out,
+                               out_info);
+      WriteTokens(tokens[0], codes, context_map, out, out_info);
+    } else {
+      std::vector<ANSEncodingData> codes;
+      BuildAndEncodeHistograms(3, tokens, &codes, &context_map, out, out_info);
+      WriteTokens(tokens[0], codes, context_map, out, out_info);
     }
+    out->ZeroPadToByte();
+  }
+
+  const PikImageSizeInfo* best_info = &rle_info;
+  if (alternative.BitsWritten() < writer->BitsWritten() - begin) {
+    writer->Rewind(begin);
+    writer->AppendBytes(alternative.TakeBytes());
+    best_info = &alternative_info;
   }
   if (info) {
-    info->Assimilate(best_info);
+    info->Assimilate(*best_info);
   }
-  return best;
 }
 
 bool DecodeHistograms(BitReader* br, const size_t num_contexts,
@@ -839,10 +943,30 @@ bool DecodeHistograms(BitReader* br, const size_t num_contexts,
   return true;
 }
 
+bool DecodeHistograms(BitReader* br, const size_t num_contexts,
+                      const size_t max_alphabet_size,
+                      std::vector<HuffmanDecodingData>* codes,
+                      std::vector<uint8_t>* context_map) {
+  size_t num_histograms = 1;
+  context_map->resize(num_contexts);
+  if (num_contexts > 1) {
+    PIK_RETURN_IF_ERROR(DecodeContextMap(context_map, &num_histograms, br));
+  }
+  codes->resize(num_histograms);
+  for (HuffmanDecodingData& code : *codes) {
+    if (!code.ReadFromBitStream(br, max_alphabet_size)) {
+      return PIK_FAILURE("Histo ReadFromBitStream");
+    }
+  }
+  PIK_RETURN_IF_ERROR(br->JumpToByteBoundary());
+  return true;
+}
+
 // See also EncodeImageData.
+template <class SymbolReader>
 bool DecodeImageData(BitReader* PIK_RESTRICT br,
                      const std::vector<uint8_t>& context_map,
-                     ANSSymbolReader* PIK_RESTRICT decoder, const Rect& rect,
+                     SymbolReader* PIK_RESTRICT decoder, const Rect& rect,
                      Image3S* PIK_RESTRICT img) {
   const size_t xsize = rect.xsize();
   const size_t ysize = rect.ysize();
@@ -920,9 +1044,20 @@ bool DecodeCoeffOrder(int32_t* order, BitReader* br) {
   return true;
 }
 
+template bool DecodeImageData(BitReader*, const std::vector<uint8_t>&,
+                              ANSSymbolReader*, const Rect&, Image3S*);
+template bool DecodeImageData(BitReader*, const std::vector<uint8_t>&,
+                              HuffmanSymbolReader*, const Rect&, Image3S*);
+
 bool DecodeImage(BitReader* PIK_RESTRICT br, const Rect& rect,
-                 Image3S* PIK_RESTRICT img) {
+                 Image3S* PIK_RESTRICT img, bool use_prefix_codes) {
   std::vector<uint8_t> context_map;
+  if (use_prefix_codes) {
+    std::vector<HuffmanDecodingData> codes;
+    PIK_RETURN_IF_ERROR(DecodeHistograms(br, 3, 40, &codes, &context_map));
+    HuffmanSymbolReader decoder(&codes);
+    return DecodeImageData(br, context_map, &decoder, rect, img);
+  }
   ANSCode code;
   PIK_RETURN_IF_ERROR(DecodeHistograms(br, 3, 40, &code, &context_map));
   ANSSymbolReader decoder(&code);
@@ -937,8 +1072,9 @@ bool DecodeImage(BitReader* PIK_RESTRICT br, const Rect& rect,
 // decode to inside the `quant_field` image, and the location we should read the
 // AC strategy from inside `ac_strategy`. It does *not* apply to the `hint`
 // argument.
+template <class SymbolReader>
 bool DecodeQuantField(BitReader* PIK_RESTRICT br,
-                      ANSSymbolReader* PIK_RESTRICT decoder,
+                      SymbolReader* PIK_RESTRICT decoder,
                       const std::vector<uint8_t>& context_map,
                       const Rect& rect_qf,
                       const AcStrategyImage& PIK_RESTRICT ac_strategy,
@@ -1004,6 +1140,13 @@ bool DecodeQuantField(BitReader* PIK_RESTRICT br,
   return true;
 }
 
+template bool DecodeQuantField(BitReader*, ANSSymbolReader*,
+                               const std::vector<uint8_t>&, const Rect&,
+                               const AcStrategyImage&, ImageI*, const ImageI*);
+template bool DecodeQuantField(BitReader*, HuffmanSymbolReader*,
+                               const std::vector<uint8_t>&, const Rect&,
+                               const AcStrategyImage&, ImageI*, const ImageI*);
+
 void TokenizeAcStrategy(const Rect& rect, const AcStrategyImage& ac_strategy,
                         const AcStrategyImage* hint,
                         std::vector<Token>* PIK_RESTRICT output) {
@@ -1037,8 +1180,9 @@ void TokenizeAcStrategy(const Rect& rect, const AcStrategyImage& ac_strategy,
   }
 }
 
+template <class SymbolReader>
 bool DecodeAcStrategy(BitReader* PIK_RESTRICT br,
-                      ANSSymbolReader* PIK_RESTRICT decoder,
+                      SymbolReader* PIK_RESTRICT decoder,
                       const std::vector<uint8_t>& context_map, const Rect& rect,
                       AcStrategyImage* PIK_RESTRICT ac_strategy,
                       const AcStrategyImage* PIK_RESTRICT hint) {
@@ -1101,18 +1245,56 @@ bool DecodeAcStrategy(BitReader* PIK_RESTRICT br,
   return true;
 }
 
-bool DecodeAC(const std::vector<uint8_t>& context_map,
+template bool DecodeAcStrategy(BitReader*, ANSSymbolReader*,
+                               const std::vector<uint8_t>&, const Rect&,
+                               AcStrategyImage*, const AcStrategyImage*);
+template bool DecodeAcStrategy(BitReader*, HuffmanSymbolReader*,
+                               const std::vector<uint8_t>&, const Rect&,
+                               AcStrategyImage*, const AcStrategyImage*);
+
+ACDecoderContexts::ACDecoderContexts(const std::vector<uint8_t>& context_map) {
+  constexpr int kBlockSize = kBlockDim * kBlockDim;
+  for (uint32_t c = 0; c < kOrderContexts; ++c) {
+    for (uint32_t i = 0; i < kNonZeroBuckets; ++i) {
+      num_nzeros[c][i] = context_map[NonZeroContext(2 * i, c)];
+    }
+    const uint32_t histo_offset = ZeroDensityContextsOffset(c);
+    for (int nzeros_left = 0; nzeros_left < kBlockSize; ++nzeros_left) {
+      for (int k = 0; k < kBlockSize; ++k) {
+        const bool valid = nzeros_left > 0 && nzeros_left + k <= kBlockSize;
+        zero_density[c][nzeros_left][k] = context_map[
+            histo_offset + (valid ? ZeroDensityContext(nzeros_left, k) : 0)];
+      }
+    }
+  }
+}
+
+template <class ANSReader>
+bool DecodeAC(const ACDecoderContexts& contexts,
               const int32_t* PIK_RESTRICT coeff_order,
-              BitReader* PIK_RESTRICT br, ANSSymbolReader* decoder,
+              BitReader* PIK_RESTRICT br, ANSReader* decoder,
               Image3S* PIK_RESTRICT ac, const Rect& rect,
               Image3I* PIK_RESTRICT tmp_num_nzeroes) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
+  // A zero run may advance the scan position by up to 15 beyond the block.
+  constexpr int kMaxScanPos = block_size + 15;
 
   const size_t xsize_blocks = rect.xsize();
   const size_t ysize_blocks = rect.ysize();
 
+  // Local copy enables keeping the ANS state(s) in registers.
+  ANSReader ans = *decoder;
+
+  int32_t order[kMaxScanPos + 1];
+
   for (int c = 0; c < 3; ++c) {
+    const uint8_t* PIK_RESTRICT nzeros_ctx = contexts.num_nzeros[c];
+    const uint8_t(*PIK_RESTRICT zero_density_ctx)[block_size] =
+        contexts.zero_density[c];
+    memcpy(order, coeff_order + c * block_size, sizeof(int32_t) * block_size);
+    // Zero-valued stores past the end go to the (unused) DC coefficient.
+    std::fill(order + block_size, order + kMaxScanPos + 1, 0);
     for (size_t by = 0; by < ysize_blocks; ++by) {
       int16_t* PIK_RESTRICT row_ac = ac->PlaneRow(c, by);
       int32_t* PIK_RESTRICT row_nzeros = tmp_num_nzeroes->PlaneRow(c, by);
@@ -1121,50 +1303,51 @@ bool DecodeAC(const std::vector<uint8_t>& context_map,
 
       for (size_t bx = 0; bx < xsize_blocks; ++bx) {
         int16_t* PIK_RESTRICT block_ac = row_ac + bx * block_size;
-        memset(block_ac, 0, block_size * sizeof(row_ac[0]));
-        int32_t predicted_nzeros =
+        const int32_t predicted_nzeros =
             PredictFromTopAndLeft(row_nzeros_top, row_nzeros, bx, 32);
-        const size_t block_ctx = c;
-        const size_t nzero_ctx = NonZeroContext(predicted_nzeros, block_ctx);
         br->FillBitBuffer();
-        row_nzeros[bx] = decoder->ReadSymbol(context_map[nzero_ctx], br);
-        size_t num_nzeros = row_nzeros[bx];
-        if (num_nzeros > block_size) {
+        int num_nzeros = ans.ReadSymbol(nzeros_ctx[predicted_nzeros >> 1], br);
+        row_nzeros[bx] = num_nzeros;
+        // At most block_size - 1 AC coefficients can be nonzero.
+        if (PIK_UNLIKELY(num_nzeros >= block_size)) {
           return PIK_FAILURE("Invalid AC: nzeros too large");
         }
+        memset(block_ac, 0, block_size * sizeof(row_ac[0]));
         if (num_nzeros == 0) continue;
-        const int histo_offset = ZeroDensityContextsOffset(block_ctx);
-        const size_t order_offset = block_ctx * block_size;
-        const int* PIK_RESTRICT block_order = &coeff_order[order_offset];
-        PIK_ASSERT(block_ctx < kOrderContexts);
-        for (size_t k = 1; k < block_size && num_nzeros > 0; ++k) {
-          int context = histo_offset + ZeroDensityContext(num_nzeros, k - 1);
+
+        // Branch-free except for the loop condition: zero runs also store
+        // (zero) values, and the position is validated after the loop.
+        int k = 1;
+        do {
           br->FillBitBuffer();
-          int symbol = decoder->ReadSymbol(context_map[context], br);
-          int nbits = kBitsLut[symbol];
-          int skip = kSkipLut[symbol];
-          k += skip;
-          if (nbits == 0) {
-            // NB: currently format does not prohibit unoptimal code.
-            // PIK_ASSERT(skip == 15);
-            continue;
-          }
-          if (PIK_UNLIKELY(k + num_nzeros > block_size)) {
-            return PIK_FAILURE("Invalid AC data.");
-          }
-          int32_t bits = br->PeekBits(nbits);
+          const int symbol =
+              ans.ReadSymbol(zero_density_ctx[num_nzeros][k - 1], br);
+          const int nbits = kBitsLut[symbol];
+          k += kSkipLut[symbol];
+          const int32_t bits = br->PeekBits(nbits);
           br->Advance(nbits);
-          int32_t coeff = DecodeVarLenInt(nbits, bits);
-          --num_nzeros;
-          block_ac[block_order[k]] = coeff;
-        }
-        if (num_nzeros != 0) {
-          return PIK_FAILURE("Invalid AC: nzeros not 0.");
+          block_ac[order[k]] = DecodeVarLenInt(nbits, bits);
+          num_nzeros -= (nbits != 0);
+          ++k;
+        } while (num_nzeros != 0 && k < block_size);
+        // The last nonzero coefficient must be within the block.
+        if (PIK_UNLIKELY(num_nzeros != 0 || k > block_size)) {
+          return PIK_FAILURE("Invalid AC data.");
         }
       }
     }
   }
+  *decoder = ans;
   return true;
 }
 
+template bool DecodeAC(const ACDecoderContexts&, const int32_t*, BitReader*,
+                       ANSSymbolReaderT<1>*, Image3S*, const Rect&, Image3I*);
+template bool DecodeAC(const ACDecoderContexts&, const int32_t*, BitReader*,
+                       ANSSymbolReaderT<2>*, Image3S*, const Rect&, Image3I*);
+template bool DecodeAC(const ACDecoderContexts&, const int32_t*, BitReader*,
+                       ANSSymbolReaderT<4>*, Image3S*, const Rect&, Image3I*);
+template bool DecodeAC(const ACDecoderContexts&, const int32_t*, BitReader*,
+                       HuffmanSymbolReader*, Image3S*, const Rect&, Image3I*);
+
 }  // namespace pik
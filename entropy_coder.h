@@ -27,11 +27,15 @@
 #include "compiler_specific.h"
 #include "context_map_encode.h"
 #include "fast_log.h"
+#include "huffman_decode.h"
+#include "huffman_encode.h"
 #include "image.h"
 #include "lehmer_code.h"
 #include "multipass_handler.h"
 #include "pik_info.h"
+#include "pik_params.h"
 #include "status.h"
+#include "write_bits.h"
 
 // Entropy coding and context modeling of DC and AC coefficients, as well as AC
 // strategy and quantization field.
@@ -174,6 +178,81 @@ constexpr uint32_t ZeroDensityContextsOffset(uint32_t block_ctx) {
          kZeroDensityContextCount * block_ctx;
 }
 
+// Reorder the skip+bits symbols by decreasing population-count
+// (keeping the first end-of-block symbol in place).
+// Round-trip:
+//  skip_and_bits = (SKIP << 4) | BITS
+//  symbol = kSkipAndBitsSymbol[skip_and_bits]
+//  SKIP = kSkipLut[symbol]
+//  BITS = kBitsLut[symbol]
+constexpr uint8_t kSkipAndBitsSymbol[256] = {
+    0,   1,   2,   3,   5,   10,  17,  32,  68,  83,  84,  85,  86,  87,  88,
+    89,  90,  4,   7,   12,  22,  31,  43,  60,  91,  92,  93,  94,  95,  96,
+    97,  98,  99,  6,   14,  26,  36,  48,  66,  100, 101, 102, 103, 104, 105,
+    106, 107, 108, 109, 8,   19,  34,  44,  57,  78,  110, 111, 112, 113, 114,
+    115, 116, 117, 118, 119, 9,   27,  39,  52,  61,  79,  120, 121, 122, 123,
+    124, 125, 126, 127, 128, 129, 11,  28,  41,  53,  64,  80,  130, 131, 132,
+    133, 134, 135, 136, 137, 138, 139, 13,  33,  46,  63,  72,  140, 141, 142,
+    143, 144, 145, 146, 147, 148, 149, 150, 15,  35,  47,  65,  69,  151, 152,
+    153, 154, 155, 156, 157, 158, 159, 160, 161, 16,  37,  51,  62,  74,  162,
+    163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 18,  38,  50,  59,  75,
+    173, 174, 175, 176, 177, 178, 179, 180, 181, 182, 183, 20,  40,  54,  76,
+    82,  184, 185, 186, 187, 188, 189, 190, 191, 192, 193, 194, 23,  42,  55,
+    77,  195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 24,  45,
+    56,  70,  207, 208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 25,
+    49,  58,  71,  219, 220, 221, 222, 223, 224, 225, 226, 227, 228, 229, 230,
+    29,  67,  81,  231, 232, 233, 234, 235, 236, 237, 238, 239, 240, 241, 242,
+    21,  30,  73,  243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254,
+    255,
+};
+
+constexpr uint8_t kSkipLut[256] = {
+    0x0, 0x0, 0x0, 0x0, 0x1, 0x0, 0x2, 0x1, 0x3, 0x4, 0x0, 0x5, 0x1, 0x6, 0x2,
+    0x7, 0x8, 0x0, 0x9, 0x3, 0xa, 0xf, 0x1, 0xb, 0xc, 0xd, 0x2, 0x4, 0x5, 0xe,
+    0xf, 0x1, 0x0, 0x6, 0x3, 0x7, 0x2, 0x8, 0x9, 0x4, 0xa, 0x5, 0xb, 0x1, 0x3,
+    0xc, 0x6, 0x7, 0x2, 0xd, 0x9, 0x8, 0x4, 0x5, 0xa, 0xb, 0xc, 0x3, 0xd, 0x9,
+    0x1, 0x4, 0x8, 0x6, 0x5, 0x7, 0x2, 0xe, 0x0, 0x7, 0xc, 0xd, 0x6, 0xf, 0x8,
+    0x9, 0xa, 0xb, 0x3, 0x4, 0x5, 0xe, 0xa, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+    0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x2, 0x2, 0x2, 0x2, 0x2, 0x2,
+    0x2, 0x2, 0x2, 0x2, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x4,
+    0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x5, 0x5, 0x5, 0x5, 0x5, 0x5,
+    0x5, 0x5, 0x5, 0x5, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6, 0x6,
+    0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0x8, 0x8, 0x8, 0x8,
+    0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9,
+    0x9, 0x9, 0x9, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xb,
+    0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xb, 0xc, 0xc, 0xc, 0xc,
+    0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xc, 0xd, 0xd, 0xd, 0xd, 0xd, 0xd, 0xd,
+    0xd, 0xd, 0xd, 0xd, 0xd, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe, 0xe,
+    0xe, 0xe, 0xe, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+    0xf,
+};
+
+constexpr uint8_t kBitsLut[256] = {
+    0x0, 0x1, 0x2, 0x3, 0x1, 0x4, 0x1, 0x2, 0x1, 0x1, 0x5, 0x1, 0x3, 0x1, 0x2,
+    0x1, 0x1, 0x6, 0x1, 0x2, 0x1, 0x0, 0x4, 0x1, 0x1, 0x1, 0x3, 0x2, 0x2, 0x1,
+    0x1, 0x5, 0x7, 0x2, 0x3, 0x2, 0x4, 0x2, 0x2, 0x3, 0x2, 0x3, 0x2, 0x6, 0x4,
+    0x2, 0x3, 0x3, 0x5, 0x2, 0x3, 0x3, 0x4, 0x4, 0x3, 0x3, 0x3, 0x5, 0x3, 0x4,
+    0x7, 0x5, 0x4, 0x4, 0x5, 0x4, 0x6, 0x2, 0x8, 0x5, 0x4, 0x4, 0x5, 0x2, 0x5,
+    0x5, 0x4, 0x4, 0x6, 0x6, 0x6, 0x3, 0x5, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,
+    0x0, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb,
+    0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0,
+    0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x7, 0x8, 0x9, 0xa, 0xb,
+    0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,
+    0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8,
+    0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc,
+    0xd, 0xe, 0xf, 0x0, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0,
+    0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x5, 0x6, 0x7,
+    0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa,
+    0xb, 0xc, 0xd, 0xe, 0xf, 0x0, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc,
+    0xd, 0xe, 0xf, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe,
+    0xf,
+};
+
+// REQUIRED: 0 <= skip, bits <= 15
+constexpr uint8_t SkipAndBitsSymbol(int skip, int bits) {
+  return kSkipAndBitsSymbol[(skip << 4) | bits];
+}
+
 // Predicts |rect_dc| (typically a "group" of DC values, or less on the borders)
 // within |dc| and stores residuals in |tmp_residuals| starting at 0,0.
 void ShrinkDC(const Rect& rect_dc, const Image3S& dc,
@@ -193,24 +272,38 @@ void ExpandDC(const Rect& rect_dc, Image3S* PIK_RESTRICT dc,
 void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
                        int32_t* PIK_RESTRICT order);
 
-std::string EncodeCoeffOrders(const int32_t* PIK_RESTRICT order,
-                              PikInfo* PIK_RESTRICT pik_info);
-
-// Encodes the `rect` area of `img`.
-// Typically used for DC.
+// The two steps of ComputeCoeffOrder, for computing one order from several
+// groups: adds the number of zero coefficients in "rect" of "ac" to
+// "num_zeros" (kOrderContexts * 64 counters, one per channel and DCT band) ...
+void CountZeroCoefficients(const Image3S& ac, const Rect& rect,
+                           int32_t* PIK_RESTRICT num_zeros);
+// ... and sorts the bands by their counts.
+void ComputeCoeffOrderFromZeros(const int32_t* PIK_RESTRICT num_zeros,
+                                int32_t* PIK_RESTRICT order);
+
+// Writes the coefficient orders of all kOrderContexts and zero-pads to a byte
+// boundary.
+void EncodeCoeffOrders(const int32_t* PIK_RESTRICT order, BitWriter* writer,
+                       PikInfo* PIK_RESTRICT pik_info);
+
+// Encodes the `rect` area of `img` with ANS or, if `use_prefix_codes`, prefix
+// codes, and appends it to `writer`, which must be at a byte boundary. Pads
+// to a byte boundary. Typically used for DC.
 // See also DecodeImageData.
-std::string EncodeImageData(const Rect& rect, const Image3S& img,
-                            PikImageSizeInfo* info);
+void EncodeImageData(const Rect& rect, const Image3S& img, BitWriter* writer,
+                     PikImageSizeInfo* info, bool use_prefix_codes = false);
 
-// See also EncodeImageData.
+// See also EncodeImageData. "SymbolReader" is ANSSymbolReader or
+// HuffmanSymbolReader.
+template <class SymbolReader>
 bool DecodeImageData(BitReader* PIK_RESTRICT br,
                      const std::vector<uint8_t>& context_map,
-                     ANSSymbolReader* PIK_RESTRICT decoder, const Rect& rect,
+                     SymbolReader* PIK_RESTRICT decoder, const Rect& rect,
                      Image3S* PIK_RESTRICT img);
 
 // Decodes into "rect" within "img". Calls DecodeImageData.
 bool DecodeImage(BitReader* PIK_RESTRICT br, const Rect& rect,
-                 Image3S* PIK_RESTRICT img);
+                 Image3S* PIK_RESTRICT img, bool use_prefix_codes = false);
 
 // Token to be encoded by the ANS. Uses context c (16 bits), writing symbol s
 // (8 bits), and adds up to 32 (nb) extra bits (b) that are interleaved in the
@@ -229,6 +322,66 @@ struct Token {
   uint8_t symbol;
 };
 
+// AC coefficient token packed into 4 bytes, half the size of Token: AC
+// tokens are by far the most numerous, and a group's are all kept until its
+// histograms are built. Context (9 bits), symbol (8 bits) and extra bits
+// (15 bits); nbits is implied by the context and symbol (see kBitsLut).
+class ACToken {
+ public:
+  ACToken(uint32_t c, uint32_t s, uint32_t b)
+      : packed_(c | (s << kContextBits) | (b << (kContextBits + 8))) {
+    static_assert(kNumContexts <= (1u << kContextBits), "Context too large");
+    static_assert(sizeof(ACToken) == 4, "ACToken must be a 4 byte struct!");
+    PIK_ASSERT(c < kNumContexts && s < 256 && b < (1u << 15));
+  }
+
+  uint32_t context() const { return packed_ & ((1u << kContextBits) - 1); }
+  uint32_t symbol() const { return (packed_ >> kContextBits) & 0xFF; }
+  uint32_t bits() const { return packed_ >> (kContextBits + 8); }
+  // Number of non-zeros (in NonZeroContext) have no extra bits.
+  uint32_t nbits() const {
+    return context() < ZeroDensityContextsOffset(0) ? 0 : kBitsLut[symbol()];
+  }
+
+  operator Token() const { return Token(context(), symbol(), nbits(), bits()); }
+
+ private:
+  static constexpr uint32_t kContextBits = 9;
+  uint32_t packed_;
+};
+
+// Per-context symbol counts and total number of extra bits of a set of
+// tokens. Tokenizers' callers add each chunk of tokens while it is still in
+// cache, so building histograms and estimating sizes need not revisit them.
+struct TokenHistograms {
+  explicit TokenHistograms(const size_t num_contexts)
+      : num_contexts(num_contexts), counts(num_contexts << 8) {}
+
+  // "TokenT" is Token or ACToken.
+  template <class TokenT>
+  void Add(const TokenT* PIK_RESTRICT begin, const TokenT* PIK_RESTRICT end) {
+    for (const TokenT* PIK_RESTRICT it = begin; it != end; ++it) {
+      const Token token = *it;
+      PIK_ASSERT(token.context < num_contexts);
+      ++counts[(token.context << 8) + token.symbol];
+      extra_bits += token.nbits;
+    }
+  }
+  template <class TokenT>
+  void Add(const std::vector<TokenT>& tokens) {
+    Add(tokens.data(), tokens.data() + tokens.size());
+  }
+
+  // Returns the 256 symbol counts of "context".
+  const uint32_t* Counts(const size_t context) const {
+    return &counts[context << 8];
+  }
+
+  size_t num_contexts;
+  std::vector<uint32_t> counts;
+  size_t extra_bits = 0;
+};
+
 // Generate AC strategy tokens.
 // Only the subset "rect" [in units of blocks] within all images.
 // Appends one token per pixel to output.
@@ -253,55 +406,131 @@ void TokenizeQuantField(const Rect& rect, const ImageI& quant_field,
 // See also DecodeCoefficients.
 void TokenizeCoefficients(const int32_t* orders, const Rect& rect,
                           const Image3S& coeffs,
-                          std::vector<Token>* PIK_RESTRICT output);
+                          std::vector<ACToken>* PIK_RESTRICT output);
 
 // Decode AC strategy. The `rect` argument does *not* apply to the hint!
 // See also TokenizeAcStrategy.
+template <class SymbolReader>
 bool DecodeAcStrategy(BitReader* PIK_RESTRICT br,
-                      ANSSymbolReader* PIK_RESTRICT decoder,
+                      SymbolReader* PIK_RESTRICT decoder,
                       const std::vector<uint8_t>& context_map, const Rect& rect,
                       AcStrategyImage* PIK_RESTRICT ac_strategy,
                       const AcStrategyImage* PIK_RESTRICT hint);
 
-// Apply context clustering, compute histograms and encode them.
-std::string BuildAndEncodeHistograms(
+// Apply context clustering, compute histograms and encode them (zero-padded to
+// a byte boundary).
+void BuildAndEncodeHistograms(
     size_t num_contexts, const std::vector<std::vector<Token> >& tokens,
     std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info);
+    BitWriter* writer, PikImageSizeInfo* info,
+    HistogramClustering clustering = HistogramClustering::kBest);
+// Same, from counts collected during tokenization.
+void BuildAndEncodeHistograms(
+    const TokenHistograms& histograms, std::vector<ANSEncodingData>* codes,
+    std::vector<uint8_t>* context_map, BitWriter* writer,
+    PikImageSizeInfo* info,
+    HistogramClustering clustering = HistogramClustering::kBest);
+// Same, but with prefix codes.
+void BuildAndEncodeHistograms(
+    const TokenHistograms& histograms, std::vector<HuffmanEncodingData>* codes,
+    std::vector<uint8_t>* context_map, BitWriter* writer,
+    PikImageSizeInfo* info,
+    HistogramClustering clustering = HistogramClustering::kBest);
+
+// Number of clusters of StaticContextMap. Should depend on N.
+constexpr size_t kNumStaticZdensContexts = 7;
+constexpr size_t kNumStaticOrderFreeContexts = 5;
+constexpr size_t kNumStaticContexts =
+    kNumStaticOrderFreeContexts + 3 * kNumStaticZdensContexts;
+
+// Returns a fixed mapping of the kNumContexts contexts to kNumStaticContexts
+// clusters, used instead of clustering by BuildAndEncodeHistogramsFast and by
+// the preset entropy codes.
+std::vector<uint8_t> StaticContextMap();
 
 // Same as BuildAndEncodeHistograms, but with static context clustering.
-std::string BuildAndEncodeHistogramsFast(
+void BuildAndEncodeHistogramsFast(
     const std::vector<std::vector<Token> >& tokens,
     std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info);
-
-// Write the tokens to a string.
-std::string WriteTokens(const std::vector<Token>& tokens,
-                        const std::vector<ANSEncodingData>& codes,
-                        const std::vector<uint8_t>& context_map,
-                        PikImageSizeInfo* pik_info);
+    BitWriter* writer, PikImageSizeInfo* info);
+// Same, from counts of kNumContexts contexts.
+void BuildAndEncodeHistogramsFast(const TokenHistograms& histograms,
+                                  std::vector<ANSEncodingData>* codes,
+                                  std::vector<uint8_t>* context_map,
+                                  BitWriter* writer, PikImageSizeInfo* info);
+// Same, but with prefix codes.
+void BuildAndEncodeHistogramsFast(const TokenHistograms& histograms,
+                                  std::vector<HuffmanEncodingData>* codes,
+                                  std::vector<uint8_t>* context_map,
+                                  BitWriter* writer, PikImageSizeInfo* info);
+
+// Write the tokens (zero-padded to a byte boundary). "num_ans_states" (1, 2
+// or 4) rANS states are interleaved; decode with the matching
+// ANSSymbolReaderT.
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states = 1);
+// Same, but with prefix codes: each symbol is directly followed by its extra
+// bits. Decode with HuffmanSymbolReader.
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<HuffmanEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info);
+// Same as the above, for AC tokens.
+void WriteTokens(const std::vector<ACToken>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states = 1);
+void WriteTokens(const std::vector<ACToken>& tokens,
+                 const std::vector<HuffmanEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info);
 
 bool DecodeCoeffOrder(int32_t* order, BitReader* br);
 
 bool DecodeHistograms(BitReader* br, const size_t num_contexts,
                       const size_t max_alphabet_size, ANSCode* code,
                       std::vector<uint8_t>* context_map);
+// Same, for prefix codes.
+bool DecodeHistograms(BitReader* br, const size_t num_contexts,
+                      const size_t max_alphabet_size,
+                      std::vector<HuffmanDecodingData>* codes,
+                      std::vector<uint8_t>* context_map);
 
 // See TokenizeQuantField.
+template <class SymbolReader>
 bool DecodeQuantField(BitReader* PIK_RESTRICT br,
-                      ANSSymbolReader* PIK_RESTRICT decoder,
+                      SymbolReader* PIK_RESTRICT decoder,
                       const std::vector<uint8_t>& context_map,
                       const Rect& rect_qf,
                       const AcStrategyImage& PIK_RESTRICT ac_strategy,
                       ImageI* PIK_RESTRICT quant_field,
                       const ImageI* PIK_RESTRICT hint);
 
+// Histogram indices of all AC contexts, i.e. context_map composed with
+// NonZeroContext and ZeroDensityContext, so that DecodeAC needs a single lookup
+// per symbol. Computed once per group.
+struct ACDecoderContexts {
+  explicit ACDecoderContexts(const std::vector<uint8_t>& context_map);
+
+  // Indexed by [block_ctx][predicted_nzeros >> 1].
+  uint8_t num_nzeros[kOrderContexts][kNonZeroBuckets];
+  // Indexed by [block_ctx][nzeros_left][k], where k is the scan position of
+  // the previous coefficient. Entries with nzeros_left + k > kBlockDim^2 are
+  // only reached by invalid bitstreams and hold an arbitrary valid index.
+  uint8_t zero_density[kOrderContexts][kBlockDim * kBlockDim]
+                      [kBlockDim * kBlockDim];
+};
+
 // Decode DCT NxN quantized AC values.
 // DC component in ac's DCT blocks is invalid.
 // Decodes to ac; `rect` is used only for size information.
-bool DecodeAC(const std::vector<uint8_t>& context_map,
+// "ANSReader" is ANSSymbolReaderT<1, 2 or 4> or HuffmanSymbolReader.
+template <class ANSReader>
+bool DecodeAC(const ACDecoderContexts& contexts,
               const int32_t* PIK_RESTRICT coeff_order,
-              BitReader* PIK_RESTRICT br, ANSSymbolReader* decoder,
+              BitReader* PIK_RESTRICT br, ANSReader* decoder,
               Image3S* PIK_RESTRICT ac, const Rect& rect,
               Image3I* PIK_RESTRICT tmp_num_nzeroes);
 
@@ -0,0 +1,524 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "entropy_presets.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "ans_decode.h"
+#include "ans_encode.h"
+#include "ans_params.h"
+#include "bit_reader.h"
+#include "huffman_decode.h"
+#include "huffman_encode.h"
+#include "status.h"
+#include "write_bits.h"
+
+namespace pik {
+namespace {
+
+// Entropy codes of each preset as stored by BuildAndEncodeHistogramsFast (the
+// context map, which is StaticContextMap(), followed by the histograms), for
+// ANS and prefix codes. The codes of preset p are
+// kPreset*CodesBytes[kPreset*CodesBegin[p], kPreset*CodesBegin[p + 1]).
+//
+// The tables are in the format printed by entropy_presets_train, which
+// compresses a set of small training images at the distance of each preset
+// and stores their token counts. The training images are not part of the
+// repository. To regenerate the tables, run it on a similar set and replace
+// the tables below with its output. These bytes are part of the format:
+// existing files that use presets no longer decode correctly after a change.
+const uint8_t kPresetAnsCodesBytes[2407] = {
+    153, 131, 40, 32, 118, 119, 219, 108, 125, 5, 0, 112, 62, 233, 25, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 92, 230, 216, 215, 112, 11, 247, 221, 105, 104, 232,
+    238, 52, 52, 60, 36, 65, 120, 220, 157, 134, 238, 238, 78, 67, 87, 119, 167,
+    225, 120, 154, 231, 253, 18, 94, 195, 219, 238, 52, 52, 116, 119, 26, 26,
+    222, 147, 32, 124, 236, 78, 67, 119, 119, 167, 161, 171, 187, 211, 112, 124,
+    206, 215, 254, 14, 63, 225, 119, 119, 26, 26, 186, 59, 13, 13, 127, 73, 16,
+    254, 119, 167, 161, 187, 187, 211, 208, 213, 221, 105, 56, 178, 246, 247,
+    53, 177, 165, 187, 221, 221, 221, 157, 249, 55, 188, 121, 243, 230, 205,
+    204, 155, 183, 111, 102, 223, 190, 121, 243, 230, 205, 27, 160, 226, 203,
+    133, 73, 219, 6, 91, 186, 219, 221, 157, 249, 47, 188, 247, 38, 210, 211,
+    130, 213, 1, 140, 49, 182, 109, 219, 182, 109, 219, 182, 45, 91, 146, 36,
+    73, 146, 164, 187, 187, 187, 221, 153, 63, 66, 161, 117, 68, 21, 81, 64, 68,
+    193, 224, 170, 39, 1, 19, 156, 128, 116, 59, 127, 131, 14, 12, 223, 251, 52,
+    59, 107, 189, 86, 125, 128, 159, 238, 238, 238, 237, 173, 230, 180, 111,
+    103, 231, 253, 13, 230, 253, 15, 150, 156, 175, 255, 146, 130, 133, 94, 217,
+    190, 0, 47, 131, 224, 105, 197, 187, 187, 119, 186, 125, 239, 102, 223, 205,
+    123, 111, 60, 51, 47, 6, 98, 9, 40, 237, 120, 229, 58, 49, 60, 159, 177, 31,
+    7, 207, 230, 238, 164, 247, 118, 244, 246, 230, 86, 239, 237, 187, 119, 243,
+    222, 123, 243, 254, 17, 251, 48, 207, 129, 212, 112, 65, 149, 80, 44, 246,
+    234, 215, 7, 225, 101, 57, 120, 24, 63, 163, 167, 187, 123, 239, 158, 222,
+    234, 237, 123, 239, 105, 25, 87, 67, 79, 8, 142, 119, 101, 89, 235, 125, 95,
+    114, 142, 245, 176, 180, 243, 86, 187, 51, 59, 115, 218, 55, 111, 246, 189,
+    247, 246, 253, 11, 38, 64, 203, 1, 1, 0, 146, 190, 182, 177, 227, 59, 113,
+    126, 247, 158, 222, 219, 247, 222, 157, 220, 178, 80, 33, 71, 142, 94, 191,
+    143, 60, 158, 252, 168, 218, 166, 160, 29, 175, 109, 44, 162, 147, 111, 102,
+    223, 48, 203, 237, 204, 220, 206, 189, 209, 219, 121, 251, 222, 190, 55,
+    239, 175, 48, 239, 175, 48, 239, 95, 48, 15, 154, 38, 105, 9, 5, 154, 241,
+    90, 106, 192, 135, 108, 235, 157, 102, 119, 103, 238, 60, 51, 239, 78, 123,
+    179, 163, 153, 157, 189, 153, 217, 217, 153, 55, 239, 189, 121, 51, 243,
+    230, 205, 123, 35, 141, 75, 120, 145, 113, 201, 168, 242, 226, 175, 109, 32,
+    150, 142, 243, 221, 158, 118, 124, 187, 186, 157, 217, 217, 219, 219, 221,
+    153, 157, 157, 191, 194, 206, 95, 225, 205, 255, 224, 189, 153, 247, 222,
+    188, 127, 220, 188, 255, 197, 188, 255, 194, 188, 255, 194, 40, 144, 80,
+    113, 0, 34, 12, 2, 47, 254, 90, 122, 9, 94, 219, 150, 230, 116, 187, 123,
+    123, 186, 153, 153, 219, 153, 157, 217, 249, 67, 188, 55, 239, 205, 188,
+    121, 243, 222, 188, 55, 239, 205, 251, 155, 142, 164, 130, 27, 18, 249, 1,
+    163, 69, 175, 109, 2, 150, 229, 209, 206, 141, 103, 180, 55, 39, 205, 104,
+    71, 115, 51, 55, 154, 189, 153, 153, 121, 111, 247, 205, 236, 123, 51, 239,
+    205, 123, 51, 239, 253, 17, 230, 189, 247, 38, 39, 129, 234, 68, 68, 7, 48,
+    180, 232, 181, 165, 226, 150, 97, 52, 163, 119, 239, 249, 189, 119, 59, 239,
+    221, 204, 206, 206, 204, 155, 55, 251, 102, 230, 189, 153, 121, 243, 230,
+    189, 153, 55, 111, 230, 205, 123, 127, 131, 121, 127, 131, 97, 149, 72, 14,
+    0, 64, 139, 94, 90, 117, 61, 211, 241, 219, 55, 188, 121, 207, 239, 189,
+    157, 121, 79, 122, 243, 230, 189, 121, 243, 102, 222, 188, 121, 239, 205,
+    123, 239, 205, 123, 243, 222, 188, 247, 222, 190, 127, 194, 188, 247, 222,
+    52, 223, 144, 159, 194, 90, 175, 81, 223, 89, 126, 167, 55, 183, 207, 111,
+    246, 61, 251, 205, 123, 127, 136, 189, 125, 148, 224, 180, 224, 133, 215, 7,
+    240, 34, 137, 60, 63, 249, 249, 221, 123, 126, 239, 61, 61, 191, 191, 193,
+    189, 63, 198, 153, 223, 103, 148, 138, 22, 194, 122, 47, 121, 121, 81, 120,
+    188, 51, 239, 97, 252, 32, 239, 30, 122, 239, 189, 123, 239, 222, 95, 65,
+    129, 158, 174, 196, 169, 75, 98, 142, 95, 223, 227, 205, 123, 60, 94, 95,
+    219, 118, 70, 89, 235, 125, 95, 178, 138, 245, 86, 214, 189, 231, 121, 111,
+    247, 244, 222, 189, 247, 158, 222, 123, 111, 223, 223, 64, 114, 39, 113,
+    216, 125, 24, 222, 107, 203, 28, 153, 131, 40, 32, 118, 119, 219, 108, 125,
+    5, 0, 112, 62, 233, 25, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 92, 230, 216, 215,
+    112, 11, 247, 221, 105, 104, 232, 238, 52, 52, 60, 36, 65, 120, 220, 157,
+    134, 238, 238, 78, 67, 87, 119, 167, 225, 120, 154, 231, 253, 18, 94, 195,
+    219, 238, 52, 52, 116, 119, 26, 26, 222, 147, 32, 124, 236, 78, 67, 119,
+    119, 167, 161, 171, 187, 211, 112, 124, 206, 215, 254, 14, 63, 225, 119,
+    119, 26, 26, 186, 59, 13, 13, 127, 73, 16, 254, 119, 167, 161, 187, 187,
+    211, 208, 213, 221, 105, 56, 178, 246, 247, 21, 75, 119, 187, 59, 127, 138,
+    55, 111, 222, 188, 153, 121, 243, 230, 205, 204, 219, 119, 239, 222, 188,
+    121, 19, 178, 131, 129, 180, 9, 190, 219, 157, 249, 71, 188, 247, 166, 32,
+    88, 61, 9, 0, 96, 219, 182, 109, 219, 182, 37, 73, 210, 221, 221, 221, 237,
+    206, 252, 45, 132, 66, 96, 242, 175, 91, 1, 168, 1, 142, 56, 177, 111, 231,
+    143, 0, 12, 223, 251, 60, 10, 107, 189, 102, 251, 0, 191, 155, 157, 185,
+    183, 55, 154, 209, 189, 153, 219, 247, 254, 5, 243, 254, 7, 35, 60, 70, 36,
+    101, 161, 87, 205, 247, 2, 60, 134, 51, 79, 43, 222, 233, 222, 173, 230,
+    189, 153, 121, 51, 239, 189, 209, 131, 172, 224, 55, 146, 104, 199, 171, 38,
+    83, 193, 243, 216, 232, 177, 228, 97, 207, 157, 244, 222, 142, 222, 236,
+    204, 232, 189, 125, 243, 102, 222, 123, 111, 222, 63, 98, 136, 182, 152,
+    111, 9, 58, 221, 101, 177, 215, 121, 125, 197, 126, 30, 38, 60, 143, 252,
+    20, 61, 205, 248, 189, 121, 243, 102, 222, 188, 247, 158, 38, 73, 183, 165,
+    58, 87, 177, 214, 107, 201, 58, 232, 33, 237, 236, 155, 91, 207, 236, 204,
+    238, 190, 121, 51, 239, 189, 55, 239, 95, 48, 29, 7, 160, 116, 20, 73, 95,
+    191, 102, 128, 153, 127, 193, 155, 247, 242, 222, 188, 247, 102, 38, 11, 0,
+    192, 209, 155, 223, 111, 230, 205, 155, 121, 3, 104, 199, 107, 137, 68, 60,
+    230, 246, 230, 141, 231, 116, 183, 51, 187, 51, 111, 246, 205, 188, 121,
+    111, 222, 155, 247, 87, 152, 247, 87, 152, 247, 47, 152, 84, 209, 171, 64,
+    146, 52, 227, 181, 84, 128, 7, 217, 246, 91, 237, 237, 206, 220, 121, 119,
+    158, 206, 115, 179, 115, 243, 47, 184, 153, 217, 153, 153, 55, 239, 189,
+    121, 51, 243, 230, 205, 123, 35, 134, 190, 200, 107, 44, 71, 40, 188, 248,
+    107, 233, 17, 60, 182, 44, 141, 116, 183, 119, 167, 187, 221, 153, 187, 157,
+    189, 221, 189, 153, 157, 157, 157, 63, 196, 155, 255, 193, 123, 51, 239,
+    189, 121, 255, 184, 121, 255, 139, 121, 255, 133, 121, 255, 133, 169, 74,
+    43, 113, 6, 118, 13, 3, 242, 226, 175, 185, 78, 8, 195, 33, 123, 36, 223,
+    72, 55, 119, 187, 51, 55, 59, 59, 179, 51, 51, 55, 255, 133, 247, 230, 189,
+    153, 55, 111, 222, 155, 247, 230, 189, 121, 127, 211, 193, 149, 179, 200,
+    88, 228, 207, 104, 209, 107, 27, 28, 91, 242, 250, 118, 199, 51, 154, 25,
+    157, 103, 118, 70, 179, 51, 55, 55, 179, 243, 47, 120, 111, 247, 205, 204,
+    123, 51, 239, 205, 123, 59, 239, 253, 17, 230, 189, 247, 102, 33, 22, 208,
+    6, 76, 196, 161, 69, 175, 95, 19, 231, 86, 203, 106, 102, 222, 189, 167,
+    247, 222, 237, 190, 55, 51, 55, 59, 51, 111, 222, 204, 155, 153, 247, 102,
+    230, 205, 155, 247, 102, 222, 188, 153, 55, 239, 253, 13, 230, 253, 13, 166,
+    17, 10, 39, 20, 160, 69, 175, 253, 220, 245, 78, 134, 119, 111, 244, 230,
+    61, 191, 247, 110, 230, 189, 157, 55, 111, 223, 155, 55, 111, 230, 205, 155,
+    247, 222, 188, 247, 222, 188, 55, 239, 205, 123, 239, 205, 251, 39, 204,
+    123, 239, 141, 108, 121, 2, 3, 107, 189, 102, 250, 46, 210, 155, 121, 51,
+    243, 244, 230, 222, 179, 222, 188, 247, 135, 152, 226, 116, 159, 22, 60,
+    230, 229, 49, 153, 199, 48, 241, 243, 155, 121, 243, 230, 189, 121, 239,
+    189, 121, 243, 254, 6, 243, 254, 24, 99, 219, 246, 179, 222, 107, 222, 60,
+    166, 125, 243, 152, 121, 111, 102, 250, 152, 121, 243, 102, 222, 123, 111,
+    222, 155, 247, 87, 24, 82, 144, 66, 142, 223, 188, 55, 239, 123, 111, 222,
+    188, 121, 243, 43, 214, 122, 223, 55, 76, 198, 243, 102, 152, 121, 111, 252,
+    222, 140, 231, 189, 121, 239, 189, 121, 239, 189, 121, 127, 131, 41, 123,
+    191, 0, 5, 153, 131, 40, 32, 118, 119, 219, 108, 125, 5, 0, 112, 62, 233,
+    25, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 92, 230, 216, 215, 112, 11, 247, 221,
+    105, 104, 232, 238, 52, 52, 60, 36, 65, 120, 220, 157, 134, 238, 238, 78,
+    67, 87, 119, 167, 225, 120, 154, 231, 253, 18, 94, 195, 219, 238, 52, 52,
+    116, 119, 26, 26, 222, 147, 32, 124, 236, 78, 67, 119, 119, 167, 161, 171,
+    187, 211, 112, 124, 206, 215, 254, 14, 63, 225, 119, 119, 26, 26, 186, 59,
+    13, 13, 127, 73, 16, 254, 119, 167, 161, 187, 187, 211, 208, 213, 221, 105,
+    56, 178, 246, 247, 213, 214, 237, 237, 238, 206, 252, 37, 222, 188, 121,
+    243, 102, 230, 205, 155, 55, 51, 111, 222, 190, 123, 243, 230, 13, 192, 178,
+    145, 180, 176, 59, 127, 139, 247, 222, 36, 86, 79, 18, 2, 128, 109, 91, 210,
+    221, 237, 237, 238, 204, 159, 164, 201, 225, 78, 89, 101, 89, 224, 228, 110,
+    254, 10, 24, 190, 247, 105, 112, 214, 122, 159, 239, 123, 50, 126, 55, 51,
+    51, 111, 102, 52, 51, 243, 102, 110, 222, 251, 23, 204, 251, 31, 204, 10,
+    128, 176, 208, 235, 204, 247, 102, 38, 47, 195, 12, 111, 102, 242, 102, 230,
+    205, 204, 188, 55, 51, 111, 230, 189, 55, 152, 147, 161, 29, 207, 51, 76,
+    103, 230, 121, 102, 234, 151, 33, 47, 243, 55, 200, 123, 51, 243, 230, 111,
+    240, 222, 188, 121, 51, 239, 189, 55, 239, 31, 49, 82, 49, 100, 194, 98,
+    175, 243, 190, 55, 51, 243, 230, 111, 240, 50, 51, 111, 50, 111, 102, 230,
+    189, 121, 243, 102, 222, 188, 247, 222, 204, 145, 172, 245, 218, 201, 12,
+    227, 231, 153, 233, 188, 25, 230, 159, 240, 230, 205, 188, 247, 222, 188,
+    127, 193, 136, 0, 0, 1, 18, 32, 218, 241, 90, 119, 76, 60, 246, 221, 237,
+    27, 175, 70, 119, 115, 123, 51, 111, 246, 205, 188, 121, 111, 222, 187, 247,
+    87, 152, 247, 87, 152, 247, 47, 24, 144, 238, 118, 24, 84, 104, 198, 107,
+    221, 9, 48, 156, 141, 223, 234, 52, 123, 187, 210, 238, 60, 141, 70, 51,
+    179, 243, 119, 120, 243, 222, 155, 55, 51, 111, 222, 188, 55, 114, 132, 194,
+    26, 188, 163, 68, 240, 226, 175, 81, 39, 192, 112, 182, 61, 182, 53, 182,
+    86, 119, 59, 115, 123, 179, 55, 59, 59, 179, 51, 179, 243, 135, 120, 243,
+    63, 120, 111, 230, 189, 55, 239, 31, 55, 239, 127, 49, 239, 191, 48, 239,
+    191, 48, 130, 212, 6, 26, 132, 35, 12, 43, 47, 254, 234, 233, 196, 97, 24,
+    206, 12, 103, 143, 241, 204, 74, 51, 55, 51, 59, 179, 51, 51, 59, 255, 133,
+    247, 230, 189, 153, 55, 111, 222, 155, 247, 230, 189, 121, 127, 211, 17, 25,
+    216, 26, 176, 104, 34, 180, 232, 181, 137, 137, 181, 230, 188, 59, 235, 153,
+    155, 221, 59, 205, 191, 224, 102, 118, 118, 118, 254, 8, 239, 205, 188, 153,
+    121, 111, 230, 189, 121, 111, 230, 189, 63, 194, 188, 247, 222, 180, 73,
+    164, 132, 2, 140, 105, 209, 251, 190, 130, 115, 123, 227, 209, 204, 188,
+    123, 239, 222, 123, 183, 243, 222, 204, 31, 225, 205, 155, 121, 51, 243,
+    222, 204, 188, 121, 243, 222, 204, 155, 55, 243, 230, 189, 191, 193, 188,
+    191, 193, 208, 185, 64, 7, 180, 232, 245, 251, 220, 241, 140, 135, 167, 55,
+    243, 230, 189, 123, 239, 221, 204, 123, 59, 111, 222, 188, 55, 111, 222,
+    204, 155, 55, 239, 189, 121, 239, 189, 121, 111, 222, 155, 247, 222, 155,
+    247, 79, 152, 247, 222, 155, 146, 198, 144, 89, 235, 125, 204, 247, 102,
+    102, 222, 204, 155, 153, 55, 111, 230, 189, 153, 55, 239, 253, 33, 6, 75,
+    11, 222, 204, 155, 55, 179, 243, 102, 254, 5, 111, 222, 204, 155, 55, 239,
+    205, 123, 239, 205, 155, 247, 55, 152, 247, 199, 24, 1, 18, 32, 214, 122,
+    51, 243, 63, 120, 243, 47, 120, 111, 230, 189, 153, 153, 247, 230, 189, 247,
+    230, 189, 247, 230, 253, 13, 70, 128, 2,
+};
+
+const uint16_t kPresetAnsCodesBegin[kNumEntropyPresets + 1] = {
+    0, 857, 1682, 2407,
+};
+
+const uint8_t kPresetPrefixCodesBytes[1847] = {
+    153, 131, 40, 32, 118, 119, 219, 108, 125, 5, 0, 112, 62, 233, 25, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 92, 230, 216, 215, 112, 11, 247, 221, 105, 104, 232,
+    238, 52, 52, 60, 36, 65, 120, 220, 157, 134, 238, 238, 78, 67, 87, 119, 167,
+    225, 120, 154, 231, 253, 18, 94, 195, 219, 238, 52, 52, 116, 119, 26, 26,
+    222, 147, 32, 124, 236, 78, 67, 119, 119, 167, 161, 171, 187, 211, 112, 124,
+    206, 215, 254, 14, 63, 225, 119, 119, 26, 26, 186, 59, 13, 13, 127, 73, 16,
+    254, 119, 167, 161, 187, 187, 211, 208, 213, 221, 105, 56, 194, 255, 239,
+    249, 255, 114, 63, 198, 156, 107, 237, 115, 238, 173, 234, 234, 238, 124,
+    140, 255, 32, 34, 26, 164, 137, 69, 17, 68, 30, 143, 34, 163, 239, 53, 35,
+    171, 186, 103, 118, 31, 73, 73, 103, 159, 127, 0, 108, 17, 206, 170, 34,
+    171, 88, 0, 108, 201, 50, 55, 204, 236, 193, 3, 170, 68, 224, 228, 244, 126,
+    12, 104, 195, 88, 200, 211, 107, 161, 133, 120, 213, 133, 79, 18, 45, 217,
+    134, 189, 138, 53, 216, 108, 110, 57, 14, 132, 19, 208, 250, 103, 188, 131,
+    44, 163, 83, 108, 178, 49, 237, 178, 233, 65, 255, 209, 15, 60, 168, 52,
+    201, 10, 81, 157, 87, 44, 130, 22, 37, 208, 36, 40, 218, 110, 1, 123, 141,
+    245, 121, 27, 48, 12, 223, 103, 31, 239, 49, 39, 178, 184, 113, 36, 41, 249,
+    216, 146, 181, 44, 67, 21, 68, 94, 30, 96, 15, 245, 86, 248, 90, 136, 120,
+    201, 202, 106, 84, 147, 50, 68, 105, 44, 207, 167, 176, 88, 93, 124, 26,
+    168, 54, 196, 152, 217, 211, 179, 141, 149, 66, 224, 129, 126, 96, 108, 34,
+    106, 17, 63, 131, 255, 252, 158, 178, 165, 115, 110, 252, 140, 72, 231, 47,
+    176, 8, 250, 149, 153, 177, 41, 77, 170, 71, 45, 181, 196, 158, 61, 43, 160,
+    127, 35, 210, 20, 245, 254, 235, 255, 123, 182, 119, 166, 23, 220, 147, 228,
+    144, 109, 31, 200, 17, 173, 108, 162, 28, 157, 156, 149, 192, 0, 14, 231,
+    67, 16, 32, 240, 255, 189, 255, 169, 89, 107, 237, 115, 239, 121, 221, 125,
+    241, 0, 161, 169, 7, 178, 193, 49, 135, 16, 68, 73, 180, 70, 99, 105, 198,
+    150, 173, 241, 79, 229, 127, 149, 29, 56, 8, 99, 39, 161, 43, 119, 229, 134,
+    239, 237, 251, 74, 197, 137, 140, 190, 113, 115, 43, 171, 186, 53, 213, 243,
+    216, 233, 33, 165, 89, 106, 73, 74, 54, 229, 199, 75, 128, 1, 27, 134, 1, 3,
+    6, 252, 243, 247, 103, 168, 252, 127, 236, 85, 84, 245, 204, 57, 151, 135,
+    87, 43, 175, 175, 76, 173, 151, 148, 249, 76, 111, 242, 194, 104, 157, 56,
+    192, 19, 18, 1, 17, 32, 32, 249, 206, 79, 224, 255, 247, 255, 124, 159, 99,
+    142, 177, 231, 93, 213, 43, 59, 87, 139, 7, 231, 163, 58, 80, 177, 109, 13,
+    33, 141, 10, 42, 34, 40, 162, 248, 233, 159, 240, 255, 123, 3, 170, 241,
+    238, 169, 211, 53, 123, 253, 52, 62, 22, 42, 24, 133, 42, 100, 64, 100, 68,
+    38, 48, 17, 4, 147, 142, 77, 150, 254, 25, 137, 26, 243, 253, 136, 44, 98,
+    154, 32, 182, 32, 177, 135, 115, 225, 115, 26, 126, 140, 120, 200, 50, 147,
+    196, 98, 201, 98, 62, 108, 19, 220, 93, 211, 158, 109, 38, 114, 34, 246,
+    130, 172, 129, 196, 16, 101, 164, 159, 193, 254, 5, 221, 25, 137, 228, 62,
+    168, 223, 39, 147, 153, 221, 250, 190, 52, 81, 72, 161, 53, 224, 37, 151,
+    222, 204, 97, 44, 4, 153, 131, 40, 32, 118, 119, 219, 108, 125, 5, 0, 112,
+    62, 233, 25, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 92, 230, 216, 215, 112, 11,
+    247, 221, 105, 104, 232, 238, 52, 52, 60, 36, 65, 120, 220, 157, 134, 238,
+    238, 78, 67, 87, 119, 167, 225, 120, 154, 231, 253, 18, 94, 195, 219, 238,
+    52, 52, 116, 119, 26, 26, 222, 147, 32, 124, 236, 78, 67, 119, 119, 167,
+    161, 171, 187, 211, 112, 124, 206, 215, 254, 14, 63, 225, 119, 119, 26, 26,
+    186, 59, 13, 13, 127, 73, 16, 254, 119, 167, 161, 187, 187, 211, 208, 213,
+    221, 105, 56, 82, 177, 232, 235, 75, 243, 200, 172, 158, 153, 247, 246, 110,
+    239, 171, 207, 23, 33, 132, 180, 8, 113, 90, 30, 195, 32, 196, 97, 37, 104,
+    37, 171, 71, 218, 123, 199, 4, 192, 190, 72, 179, 234, 159, 36, 219, 50, 96,
+    113, 42, 212, 73, 195, 204, 238, 221, 125, 68, 166, 2, 56, 210, 233, 111,
+    195, 88, 72, 79, 214, 163, 149, 136, 156, 135, 202, 250, 208, 206, 78, 163,
+    181, 180, 73, 216, 234, 155, 143, 134, 112, 18, 21, 70, 117, 10, 217, 66,
+    241, 90, 244, 181, 153, 25, 246, 38, 144, 132, 60, 240, 80, 89, 81, 209,
+    228, 125, 113, 214, 153, 74, 170, 162, 149, 19, 161, 200, 100, 166, 75, 26,
+    74, 44, 208, 210, 10, 193, 135, 199, 27, 248, 126, 18, 66, 99, 142, 199, 36,
+    75, 238, 223, 15, 123, 13, 157, 82, 93, 16, 81, 4, 168, 60, 189, 21, 217,
+    255, 116, 34, 195, 117, 179, 149, 93, 254, 22, 158, 2, 195, 248, 9, 193,
+    134, 21, 132, 77, 0, 71, 46, 191, 182, 219, 84, 132, 7, 1, 21, 163, 93, 191,
+    35, 17, 248, 127, 235, 201, 100, 58, 167, 110, 247, 187, 159, 95, 30, 71,
+    20, 110, 219, 97, 38, 136, 17, 40, 18, 82, 246, 236, 89, 1, 255, 111, 72,
+    229, 79, 231, 190, 219, 175, 170, 254, 179, 93, 214, 122, 123, 55, 153, 118,
+    130, 122, 76, 147, 204, 39, 100, 128, 16, 16, 146, 16, 124, 33, 36, 224,
+    255, 203, 127, 237, 181, 214, 62, 27, 231, 116, 235, 54, 26, 16, 46, 72,
+    128, 0, 102, 36, 130, 34, 103, 134, 210, 104, 196, 39, 219, 178, 159, 255,
+    229, 127, 149, 29, 56, 8, 99, 39, 161, 43, 119, 229, 134, 200, 190, 175,
+    106, 50, 111, 59, 119, 15, 162, 35, 51, 169, 202, 162, 178, 183, 123, 6,
+    250, 134, 89, 134, 133, 57, 56, 222, 18, 18, 8, 33, 33, 33, 241, 243, 247,
+    7, 252, 191, 188, 84, 57, 157, 115, 223, 243, 179, 171, 60, 238, 93, 188,
+    169, 36, 213, 14, 75, 42, 19, 154, 38, 19, 32, 210, 172, 0, 9, 36, 164, 229,
+    155, 31, 224, 255, 247, 61, 85, 63, 214, 218, 103, 191, 19, 25, 117, 235,
+    125, 155, 132, 24, 68, 21, 180, 166, 165, 205, 71, 81, 65, 69, 4, 69, 20,
+    135, 206, 132, 143, 189, 207, 247, 223, 168, 181, 78, 245, 126, 83, 179,
+    105, 188, 12, 156, 160, 21, 254, 71, 30, 136, 40, 131, 129, 137, 32, 152,
+    24, 155, 72, 253, 143, 30, 31, 22, 117, 108, 114, 19, 20, 149, 224, 135, 23,
+    102, 177, 30, 158, 154, 62, 208, 216, 227, 177, 55, 18, 227, 132, 143, 34,
+    130, 141, 216, 217, 180, 66, 181, 127, 128, 107, 46, 157, 157, 116, 20, 182,
+    71, 226, 71, 249, 71, 225, 205, 152, 39, 73, 199, 63, 191, 122, 128, 235,
+    92, 207, 51, 98, 40, 83, 124, 101, 99, 99, 39, 135, 177, 16, 0, 153, 131,
+    40, 32, 118, 119, 219, 108, 125, 5, 0, 112, 62, 233, 25, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 92, 230, 216, 215, 112, 11, 247, 221, 105, 104, 232, 238, 52,
+    52, 60, 36, 65, 120, 220, 157, 134, 238, 238, 78, 67, 87, 119, 167, 225,
+    120, 154, 231, 253, 18, 94, 195, 219, 238, 52, 52, 116, 119, 26, 26, 222,
+    147, 32, 124, 236, 78, 67, 119, 119, 167, 161, 171, 187, 211, 112, 124, 206,
+    215, 254, 14, 63, 225, 119, 119, 26, 26, 186, 59, 13, 13, 127, 73, 16, 254,
+    119, 167, 161, 187, 187, 211, 208, 213, 221, 105, 56, 242, 255, 44, 168, 79,
+    61, 247, 85, 117, 255, 101, 70, 150, 109, 121, 91, 48, 38, 36, 38, 132, 68,
+    136, 161, 17, 193, 20, 45, 90, 86, 207, 222, 155, 198, 129, 64, 69, 180,
+    172, 50, 15, 76, 40, 104, 210, 104, 233, 30, 16, 217, 0, 113, 184, 124, 180,
+    97, 44, 228, 159, 86, 41, 96, 188, 210, 103, 186, 26, 57, 17, 198, 1, 91,
+    190, 237, 113, 137, 90, 0, 108, 172, 14, 234, 177, 158, 62, 213, 81, 81, 5,
+    21, 5, 68, 212, 170, 128, 198, 172, 109, 168, 140, 154, 67, 217, 69, 121,
+    22, 168, 220, 32, 162, 31, 31, 111, 249, 255, 63, 32, 154, 59, 142, 89, 180,
+    122, 149, 126, 54, 146, 18, 20, 143, 88, 31, 176, 229, 149, 194, 48, 249,
+    64, 137, 142, 203, 22, 163, 23, 79, 238, 13, 180, 119, 74, 68, 56, 206, 3,
+    212, 147, 102, 240, 255, 26, 100, 223, 116, 174, 207, 248, 61, 99, 39, 105,
+    141, 187, 168, 10, 233, 12, 154, 47, 70, 72, 72, 217, 179, 103, 5, 84, 70,
+    149, 37, 204, 211, 55, 34, 243, 178, 243, 1, 107, 74, 156, 101, 23, 41, 244,
+    150, 122, 87, 212, 247, 66, 0, 132, 7, 130, 0, 65, 95, 217, 87, 255, 51,
+    143, 62, 47, 34, 146, 156, 204, 42, 178, 170, 200, 234, 237, 238, 133, 217,
+    102, 154, 101, 97, 129, 225, 251, 177, 203, 215, 12, 4, 4, 81, 70, 17, 49,
+    29, 211, 129, 74, 255, 255, 255, 107, 138, 53, 73, 173, 42, 170, 235, 216,
+    248, 216, 44, 155, 238, 189, 225, 208, 220, 225, 50, 112, 129, 225, 45, 33,
+    129, 16, 18, 18, 18, 63, 127, 127, 192, 255, 219, 247, 95, 54, 173, 181, 79,
+    198, 137, 116, 68, 101, 123, 58, 237, 154, 118, 221, 235, 49, 174, 193, 83,
+    20, 188, 37, 208, 67, 2, 9, 201, 124, 243, 3, 68, 235, 251, 250, 87, 34, 34,
+    171, 115, 119, 111, 105, 36, 177, 176, 31, 123, 46, 72, 87, 79, 132, 205, 3,
+    30, 24, 131, 141, 177, 241, 167, 255, 12, 61, 203, 231, 31, 28, 51, 115, 79,
+    54, 185, 89, 30, 9, 194, 47, 158, 194, 23, 17, 36, 40, 98, 97, 35, 8, 54,
+    214, 54, 210, 63, 35, 184, 154, 239, 5, 17, 18, 69, 123, 56, 47, 2, 155, 67,
+    17, 157, 168, 22, 81, 68, 208, 19, 125, 61, 111, 123, 139, 108, 230, 50, 21,
+    151, 67, 234, 19, 253, 243, 56, 41, 213, 8, 76, 39, 105, 55, 117, 128, 194,
+    2, 31, 31, 63, 115, 24, 11, 1,
+};
+
+const uint16_t kPresetPrefixCodesBegin[kNumEntropyPresets + 1] = {
+    0, 648, 1282, 1847,
+};
+
+struct PresetEntropyCodes {
+  EncoderEntropyCodes encoder;
+  DecoderEntropyCodes decoder;
+  // Cost [bits] of each symbol of each histogram, or a negative value if the
+  // codes cannot represent the symbol.
+  std::vector<float> symbol_costs;
+};
+
+// Sets "code" and "costs" (of 256 symbols) to the ANS code of the "histogram"
+// of "decoded".
+void ANSFromDecoded(const ANSCode& decoded, const size_t histogram,
+                    ANSEncodingData* code, float* PIK_RESTRICT costs) {
+  std::vector<int> counts(ANS_MAX_ALPHA_SIZE);
+  const uint32_t* PIK_RESTRICT table =
+      decoded.table.data() + (histogram << ANS_LOG_TAB_SIZE);
+  for (size_t i = 0; i < ANS_TAB_SIZE; ++i) {
+    // The first slot of each symbol.
+    if (((table[i] >> ANSCode::kRankShift) & ANS_TAB_MASK) != 0) continue;
+    counts[table[i] & (ANS_MAX_ALPHA_SIZE - 1)] =
+        table[i] >> ANSCode::kFreqShift;
+  }
+  code->BuildFromNormalizedCounts(counts.data(), counts.size());
+  for (size_t s = 0; s < ANS_MAX_ALPHA_SIZE; ++s) {
+    costs[s] = counts[s] == 0 ? -1.0f
+                              : std::log2(static_cast<float>(ANS_TAB_SIZE) /
+                                          counts[s]);
+  }
+}
+
+// Sets "code" and "costs" (of 256 symbols) to the prefix code of "decoded".
+// The code of each symbol is the key of its entry in the decoding table (see
+// HuffmanDecoder::ReadSymbol), limited to its length.
+void PrefixFromDecoded(const HuffmanDecodingData& decoded,
+                       HuffmanEncodingData* code, float* PIK_RESTRICT costs) {
+  memset(code->depth, 0, sizeof(code->depth));
+  memset(code->bits, 0, sizeof(code->bits));
+  std::fill(costs, costs + 256, -1.0f);
+  const auto set = [code, costs](const HuffmanCode& entry, size_t depth,
+                                 uint32_t key) {
+    PIK_CHECK(entry.value < 256 && depth <= kHuffmanMaxLength);
+    code->depth[entry.value] = depth;
+    code->bits[entry.value] = key & ((1u << depth) - 1);
+    costs[entry.value] = depth;
+  };
+  const HuffmanCode* PIK_RESTRICT table = decoded.table_.data();
+  for (uint32_t key = 0; key < (1u << kHuffmanTableBits); ++key) {
+    const HuffmanCode& entry = table[key];
+    if (entry.bits <= kHuffmanTableBits) {
+      set(entry, entry.bits, key);
+      continue;
+    }
+    // Second-level table, indexed by the following bits.
+    const size_t sub_bits = entry.bits - kHuffmanTableBits;
+    for (uint32_t sub_key = 0; sub_key < (1u << sub_bits); ++sub_key) {
+      const HuffmanCode& sub_entry = table[key + entry.value + sub_key];
+      set(sub_entry, kHuffmanTableBits + sub_entry.bits,
+          key | (sub_key << kHuffmanTableBits));
+    }
+  }
+}
+
+// Reads the stored codes of all presets as the decoder of a group would, and
+// derives the encoder codes from them.
+std::vector<PresetEntropyCodes> BuildPresets(const bool use_prefix_codes) {
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  const uint8_t* bytes =
+      use_prefix_codes ? kPresetPrefixCodesBytes : kPresetAnsCodesBytes;
+  const uint16_t* begin =
+      use_prefix_codes ? kPresetPrefixCodesBegin : kPresetAnsCodesBegin;
+  std::vector<PresetEntropyCodes> presets(kNumEntropyPresets);
+  for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+    EncoderEntropyCodes* encoder = &presets[preset].encoder;
+    DecoderEntropyCodes* decoder = &presets[preset].decoder;
+    for (size_t c = 0; c < kOrderContexts; ++c) {
+      std::copy(NaturalCoeffOrder(), NaturalCoeffOrder() + block_size,
+                encoder->order + c * block_size);
+      std::copy(NaturalCoeffOrder(), NaturalCoeffOrder() + block_size,
+                decoder->coeff_order + c * block_size);
+    }
+
+    const size_t size = begin[preset + 1] - begin[preset];
+    BitReader reader(bytes + begin[preset], size);
+    if (use_prefix_codes) {
+      PIK_CHECK(DecodeHistograms(&reader, kNumContexts, 256,
+                                 &decoder->huffman_codes,
+                                 &decoder->context_map));
+    } else {
+      PIK_CHECK(DecodeHistograms(&reader, kNumContexts, 256, &decoder->code,
+                                 &decoder->context_map));
+    }
+    PIK_CHECK(reader.Position() == size);
+    decoder->ac_contexts.reset(new ACDecoderContexts(decoder->context_map));
+
+    const size_t num_histograms =
+        *std::max_element(decoder->context_map.begin(),
+                          decoder->context_map.end()) +
+        1;
+    std::vector<float>* costs = &presets[preset].symbol_costs;
+    costs->resize(num_histograms << 8);
+    encoder->use_prefix_codes = use_prefix_codes;
+    encoder->context_map = decoder->context_map;
+    if (use_prefix_codes) {
+      encoder->huffman_codes.resize(num_histograms);
+      for (size_t i = 0; i < num_histograms; ++i) {
+        PrefixFromDecoded(decoder->huffman_codes[i],
+                          &encoder->huffman_codes[i], &(*costs)[i << 8]);
+      }
+    } else {
+      encoder->codes.resize(num_histograms);
+      for (size_t i = 0; i < num_histograms; ++i) {
+        ANSFromDecoded(decoder->code, i, &encoder->codes[i],
+                       &(*costs)[i << 8]);
+      }
+    }
+  }
+  return presets;
+}
+
+const PresetEntropyCodes& GetPreset(const size_t preset,
+                                    const bool use_prefix_codes) {
+  PIK_CHECK(preset >= 1 && preset <= kNumEntropyPresets);
+  if (use_prefix_codes) {
+    static const std::vector<PresetEntropyCodes> prefix_presets =
+        BuildPresets(true);
+    return prefix_presets[preset - 1];
+  }
+  static const std::vector<PresetEntropyCodes> ans_presets =
+      BuildPresets(false);
+  return ans_presets[preset - 1];
+}
+
+// Returns the estimated cost [bits] of the tokens counted in "histograms" if
+// the group instead stored its own codes with the static context map.
+float OwnCodesCost(const TokenHistograms& histograms,
+                   const std::vector<uint8_t>& context_map) {
+  std::vector<uint32_t> clusters(kNumStaticContexts << 8);
+  for (size_t ctx = 0; ctx < kNumContexts; ++ctx) {
+    uint32_t* PIK_RESTRICT cluster = &clusters[context_map[ctx] << 8];
+    const uint32_t* PIK_RESTRICT counts = histograms.Counts(ctx);
+    for (size_t i = 0; i < 256; ++i) cluster[i] += counts[i];
+  }
+  float cost = 0.0f;
+  for (size_t c = 0; c < kNumStaticContexts; ++c) {
+    const uint32_t* PIK_RESTRICT cluster = &clusters[c << 8];
+    float total = 0.0f;
+    for (size_t i = 0; i < 256; ++i) total += cluster[i];
+    for (size_t i = 0; i < 256; ++i) {
+      if (cluster[i] != 0) cost += cluster[i] * std::log2(total / cluster[i]);
+    }
+  }
+
+  std::vector<ANSEncodingData> codes;
+  std::vector<uint8_t> own_context_map;
+  BitWriter writer;
+  BuildAndEncodeHistogramsFast(histograms, &codes, &own_context_map, &writer,
+                               nullptr);
+  return cost + writer.BitsWritten();
+}
+
+}  // namespace
+
+size_t SelectEntropyPreset(const TokenHistograms& histograms,
+                           const bool use_prefix_codes) {
+  PIK_ASSERT(histograms.num_contexts == kNumContexts);
+  static const std::vector<uint8_t> context_map = StaticContextMap();
+
+  size_t best_preset = 0;
+  float best_cost = 0.0f;
+  for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+    const PresetEntropyCodes& codes = GetPreset(preset + 1, use_prefix_codes);
+    float cost = 0.0f;
+    bool ok = true;
+    for (size_t ctx = 0; ok && ctx < kNumContexts; ++ctx) {
+      const uint32_t* PIK_RESTRICT counts = histograms.Counts(ctx);
+      const float* PIK_RESTRICT symbol_costs =
+          &codes.symbol_costs[codes.decoder.context_map[ctx] << 8];
+      for (size_t i = 0; i < 256; ++i) {
+        if (counts[i] == 0) continue;
+        if (symbol_costs[i] < 0.0f) {
+          ok = false;
+          break;
+        }
+        cost += counts[i] * symbol_costs[i];
+      }
+    }
+    if (ok && (best_preset == 0 || cost < best_cost)) {
+      best_preset = preset + 1;
+      best_cost = cost;
+    }
+  }
+  // Own codes also benefit from full clustering and an adapted coefficient
+  // order, which the estimate ignores; on small training images, presets
+  // only paid off if they were expected to be at least 10% cheaper.
+  if (best_preset != 0 &&
+      best_cost > 0.9f * OwnCodesCost(histograms, context_map)) {
+    return 0;
+  }
+  return best_preset;
+}
+
+const EncoderEntropyCodes& PresetEncoderEntropyCodes(
+    const size_t preset, const bool use_prefix_codes) {
+  return GetPreset(preset, use_prefix_codes).encoder;
+}
+
+const DecoderEntropyCodes& PresetDecoderEntropyCodes(
+    const size_t preset, const bool use_prefix_codes) {
+  return GetPreset(preset, use_prefix_codes).decoder;
+}
+
+}  // namespace pik
@@ -0,0 +1,46 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef ENTROPY_PRESETS_H_
+#define ENTROPY_PRESETS_H_
+
+// Built-in entropy codes for small groups. Instead of storing its coefficient
+// orders, context map and histograms, a group may reference one of the
+// presets by index (GroupHeader::preset_entropy_codes). This saves both the
+// clustering time and the bytes of the stored codes, which dominate the
+// output for images of up to about 128x128 pixels.
+
+#include <stddef.h>
+
+#include "compressed_image.h"
+#include "entropy_coder.h"
+
+namespace pik {
+
+// Presets use the natural coefficient order and StaticContextMap(). Their
+// histograms were trained on small images compressed at butteraugli distances
+// 1, 2 and 4, respectively (see entropy_presets_train).
+constexpr size_t kNumEntropyPresets = 3;
+
+// Returns the (1-based) preset whose ANS or prefix codes (see
+// PassHeader::use_prefix_codes) are expected to encode the tokens counted in
+// "histograms" (tokenized in the natural coefficient order) with the fewest
+// bits, or 0 if no preset can represent all of their symbols or storing the
+// group's own codes is expected to be cheaper.
+size_t SelectEntropyPreset(const TokenHistograms& histograms,
+                           bool use_prefix_codes);
+
+// Returns the codes of the (1-based) "preset" for ANS or prefix codes. They
+// are built on first use: the decoder codes are read from fixed bytes with
+// DecodeHistograms, and the encoder codes are derived from those.
+const EncoderEntropyCodes& PresetEncoderEntropyCodes(size_t preset,
+                                                     bool use_prefix_codes);
+const DecoderEntropyCodes& PresetDecoderEntropyCodes(size_t preset,
+                                                     bool use_prefix_codes);
+
+}  // namespace pik
+
+#endif  // ENTROPY_PRESETS_H_
@@ -0,0 +1,167 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Generates the tables of entropy_presets.cc: compresses each of the given
+// images at the butteraugli distance of each preset (see kNumEntropyPresets),
+// counts the tokens of all groups in the natural coefficient order, merges
+// them into the clusters of StaticContextMap(), scales the counts to a sum of
+// about 4096 per cluster and prints the ANS and prefix codes of these counts
+// as stored by BuildAndEncodeHistogramsFast. Symbols seen at any distance get
+// a count of at least 1 in all presets, so that every preset can represent
+// them.
+//
+// Usage: entropy_presets_train image1.png image2.png ... > tables.txt
+// The presets target small images (groups of up to 128x128 pixels, see
+// SelectPresetEntropyCodes), so the training images should be of that size;
+// images used to evaluate the presets should not be among them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "common.h"
+#include "entropy_coder.h"
+#include "entropy_presets.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_info.h"
+#include "pik_params.h"
+#include "write_bits.h"
+
+namespace pik {
+namespace {
+
+// Butteraugli distance of each preset.
+constexpr float kPresetDistances[kNumEntropyPresets] = {1.0f, 2.0f, 4.0f};
+
+// Sum of the scaled counts of each cluster.
+constexpr double kScaledTotal = 4096.0;
+
+// Prints "values" as the body of a C array, wrapped to 80 columns.
+template <typename T>
+void PrintValues(const std::vector<T>& values, const char* indent) {
+  std::string line = indent;
+  for (const T value : values) {
+    const std::string item = std::to_string(value) + ",";
+    if (line.size() + 1 + item.size() > 80) {
+      printf("%s\n", line.c_str());
+      line = indent;
+    }
+    if (line.size() != strlen(indent)) line += " ";
+    line += item;
+  }
+  if (line.size() != strlen(indent)) printf("%s\n", line.c_str());
+}
+
+int Run(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Args: image1 [image2 ...]\n");
+    return 1;
+  }
+
+  // Counts of each preset, merged into the static clusters.
+  const std::vector<uint8_t> context_map = StaticContextMap();
+  std::vector<std::vector<uint64_t>> cluster_counts(
+      kNumEntropyPresets, std::vector<uint64_t>(kNumStaticContexts << 8));
+  for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+    TokenHistograms histograms(kNumContexts);
+    for (int i = 1; i < argc; ++i) {
+      CodecContext codec_context;
+      CodecInOut io(&codec_context);
+      if (!io.SetFromFile(argv[i])) {
+        fprintf(stderr, "Failed to read image %s.\n", argv[i]);
+        return 1;
+      }
+      CompressParams params;
+      params.butteraugli_distance = kPresetDistances[preset];
+      // Only the counts are needed, not the choice of the current presets.
+      params.use_preset_entropy_codes = false;
+      PikInfo info;
+      info.testing_aux.natural_order_histograms = &histograms;
+      PaddedBytes compressed;
+      // Single-threaded: groups add to "histograms" without synchronization.
+      if (!PixelsToPik(params, &io, &compressed, &info, /*pool=*/nullptr)) {
+        fprintf(stderr, "Failed to compress %s.\n", argv[i]);
+        return 1;
+      }
+    }
+    for (size_t ctx = 0; ctx < kNumContexts; ++ctx) {
+      const uint32_t* counts = histograms.Counts(ctx);
+      uint64_t* cluster = &cluster_counts[preset][context_map[ctx] << 8];
+      for (size_t s = 0; s < 256; ++s) cluster[s] += counts[s];
+    }
+  }
+
+  // Scaled counts of each preset, attributed to the first context of each
+  // cluster (BuildAndEncodeHistogramsFast merges them again).
+  std::vector<TokenHistograms> scaled(kNumEntropyPresets,
+                                      TokenHistograms(kNumContexts));
+  for (size_t cluster = 0; cluster < kNumStaticContexts; ++cluster) {
+    const size_t context =
+        std::find(context_map.begin(), context_map.end(), cluster) -
+        context_map.begin();
+    if (context == kNumContexts) continue;
+    std::vector<uint64_t> totals(kNumEntropyPresets);
+    for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+      for (size_t s = 0; s < 256; ++s) {
+        totals[preset] += cluster_counts[preset][(cluster << 8) + s];
+      }
+    }
+    for (size_t s = 0; s < 256; ++s) {
+      bool seen = false;
+      for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+        seen |= cluster_counts[preset][(cluster << 8) + s] != 0;
+      }
+      if (!seen) continue;
+      for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+        const uint64_t count = cluster_counts[preset][(cluster << 8) + s];
+        const double share =
+            totals[preset] == 0 ? 0.0 : count * kScaledTotal / totals[preset];
+        scaled[preset].counts[(context << 8) + s] =
+            std::max(1, static_cast<int>(share + 0.5));
+      }
+    }
+  }
+
+  for (const bool use_prefix_codes : {false, true}) {
+    const char* name =
+        use_prefix_codes ? "kPresetPrefixCodes" : "kPresetAnsCodes";
+    std::vector<uint32_t> bytes;
+    std::vector<uint32_t> begin = {0};
+    for (size_t preset = 0; preset < kNumEntropyPresets; ++preset) {
+      BitWriter writer;
+      std::vector<uint8_t> unused_context_map;
+      if (use_prefix_codes) {
+        std::vector<HuffmanEncodingData> codes;
+        BuildAndEncodeHistogramsFast(scaled[preset], &codes,
+                                     &unused_context_map, &writer, nullptr);
+      } else {
+        std::vector<ANSEncodingData> codes;
+        BuildAndEncodeHistogramsFast(scaled[preset], &codes,
+                                     &unused_context_map, &writer, nullptr);
+      }
+      const PaddedBytes stored = writer.TakeBytes();
+      bytes.insert(bytes.end(), stored.data(), stored.data() + stored.size());
+      begin.push_back(bytes.size());
+    }
+    printf("const uint8_t %sBytes[%zu] = {\n", name, bytes.size());
+    PrintValues(bytes, "    ");
+    printf("};\n\n");
+    printf("const uint16_t %sBegin[kNumEntropyPresets + 1] = {\n", name);
+    PrintValues(begin, "    ");
+    printf("};\n%s", use_prefix_codes ? "" : "\n");
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::Run(argc, argv); }
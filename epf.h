@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include "ac_strategy.h"
+#include "data_parallel.h"
 #include "field_encodings.h"
 #include "image.h"
 
@@ -63,7 +64,8 @@ struct InitEdgePreservingFilter {
 
 // Adaptive smoothing based on quantization intervals. "sigma" must be in
 // [kMinSigma, kMaxSigma]. Fills each pixel of "smoothed", which must be
-// pre-allocated. Call via Dispatch.
+// pre-allocated. Call via Dispatch. Rows of blocks are filtered in parallel if
+// "pool" is non-null; the result does not depend on the number of threads.
 struct EdgePreservingFilter {
   // The "sigma" parameter is the SCALED half-width at half-maximum, i.e. the
   // SAD value for which the weight is 0.5, times the scaling factor of
@@ -86,16 +88,25 @@ struct EdgePreservingFilter {
   void operator()(const Image3F& in_guide, const Image3F& in,
                   const ImageI* ac_quant, float quant_scale,
                   const AcStrategyImage& ac_strategy,
-                  const EpfParams& epf_params, Image3F* smoothed,
-                  EpfStats* epf_stats) const;
+                  const EpfParams& epf_params, ThreadPool* pool,
+                  Image3F* smoothed, EpfStats* epf_stats) const;
+
+  // Same, but for a single plane (e.g. the luminance of grayscale images).
+  // The guide range, and thus the sigma stretch, is that of the plane alone.
+  template <class Target>
+  void operator()(const ImageF& in_guide, const ImageF& in,
+                  const ImageI* ac_quant, float quant_scale,
+                  const AcStrategyImage& ac_strategy,
+                  const EpfParams& epf_params, ThreadPool* pool,
+                  ImageF* smoothed, EpfStats* epf_stats) const;
 
   // Fixed sigma in [kMinSigma, kMaxSigma] for generating training data;
   // sigma == 0 skips filtering and copies "in" to "smoothed".
   // "stretch" is returned for use by AdaptiveReconstructionAux.
   template <class Target>
   void operator()(const Image3F& in_guide, const Image3F& in,
-                  const EpfParams& params, float* PIK_RESTRICT stretch,
-                  Image3F* smoothed) const;
+                  const EpfParams& params, ThreadPool* pool,
+                  float* PIK_RESTRICT stretch, Image3F* smoothed) const;
 };
 
 }  // namespace pik
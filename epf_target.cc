@@ -543,13 +543,7 @@ class WeightedSum {
     SIMD_ALIGN float weights[kNeighbors];
     ComputeWeights(guide_m4_r, guide_m4_g, guide_m4_b, guide_stride,
                    weight_func, weights);
-
-    const auto kMinWeight = set1(df, kFlushWeightToZeroIfBelow);
-    for (size_t i = 0; i < kNeighbors; i += df.N) {
-      auto v = load(df, weights + i);
-      v &= v >= kMinWeight;
-      store(v, df, weights + i);
-    }
+    FlushSmallWeights(weights);
 
     // Joint weights are better than per-channel!
     FromWeights(in_m3_r, in_stride, weights, out_r);
@@ -557,6 +551,20 @@ class WeightedSum {
     FromWeights(in_m3_b, in_stride, weights, out_b);
   }
 
+  // Single-plane version (grayscale): the weights only depend on one guide.
+  template <class WeightFunc>
+  static SIMD_ATTR SIMD_INLINE void Compute(
+      const uint8_t* SIMD_RESTRICT guide_m4, const size_t guide_stride,
+      const float* SIMD_RESTRICT in_m3, const size_t in_stride,
+      const WeightFunc& weight_func, float* SIMD_RESTRICT out) {
+    SIMD_ALIGN int16_t sad[64];
+    Distance::SumsOfAbsoluteDifferences(guide_m4, guide_stride, &sad[0]);
+    SIMD_ALIGN float weights[kNeighbors];
+    WeightsFromSAD(&sad[0], weight_func, weights);
+    FlushSmallWeights(weights);
+    FromWeights(in_m3, in_stride, weights, out);
+  }
+
   static SIMD_INLINE void CopyOriginalBlock(const Image3F& in, const size_t x,
                                             const size_t y,
                                             Image3F* SIMD_RESTRICT out) {
@@ -567,7 +575,25 @@ class WeightedSum {
     }
   }
 
+  static SIMD_INLINE void CopyOriginalBlock(const ImageF& in, const size_t x,
+                                            const size_t y,
+                                            ImageF* SIMD_RESTRICT out) {
+    for (size_t iy = 0; iy < kBlockDim; ++iy) {
+      CopyBlockRow(in, x, y + iy, out);
+    }
+  }
+
  private:
+  static SIMD_ATTR SIMD_INLINE void FlushSmallWeights(
+      float* SIMD_RESTRICT weights) {
+    const auto kMinWeight = set1(df, kFlushWeightToZeroIfBelow);
+    for (size_t i = 0; i < kNeighbors; i += df.N) {
+      auto v = load(df, weights + i);
+      v &= v >= kMinWeight;
+      store(v, df, weights + i);
+    }
+  }
+
   static SIMD_INLINE void CopyBlockRow(const ImageF& in, const size_t x,
                                        const size_t y,
                                        ImageF* SIMD_RESTRICT out) {
@@ -835,15 +861,60 @@ class WeightedSum {
   }
 };
 
+// Allows sharing the padding and guide code between three-plane images and
+// single planes (grayscale).
+template <typename T>
+size_t NumPlanes(const Image3<T>& image) {
+  return image.kNumPlanes;
+}
+template <typename T>
+size_t NumPlanes(const Image<T>& image) {
+  return 1;
+}
+template <typename T>
+const Image<T>& PlaneOf(const Image3<T>& image, const size_t c) {
+  return image.Plane(c);
+}
+template <typename T>
+const Image<T>& PlaneOf(const Image<T>& image, const size_t c) {
+  return image;
+}
+template <typename T>
+Image<T>* MutablePlaneOf(Image3<T>* image, const size_t c) {
+  return image->MutablePlane(c);
+}
+template <typename T>
+Image<T>* MutablePlaneOf(Image<T>* image, const size_t c) {
+  return image;
+}
+
+// u8 guide corresponding to each (float) image type.
+template <class Image>
+struct GuideFor;
+template <>
+struct GuideFor<Image3F> {
+  using type = Image3B;
+};
+template <>
+struct GuideFor<ImageF> {
+  using type = ImageB;
+};
+
 // POD
 class SIMD_ALIGN MinMaxWorker {
  public:
-  SIMD_ATTR void Init(const Image3F* SIMD_RESTRICT in,
-                      Image3F* SIMD_RESTRICT padded) {
-    in_ = in;
-    padded_ = padded;
-    xsize_ = in->xsize();
-    ysize_ = in->ysize();
+  // "in" and "padded" point to "num_planes" planes.
+  SIMD_ATTR void Init(const ImageF* const* SIMD_RESTRICT in,
+                      ImageF* const* SIMD_RESTRICT padded,
+                      const size_t num_planes) {
+    PIK_ASSERT(num_planes <= 3);
+    num_planes_ = num_planes;
+    for (size_t c = 0; c < num_planes; ++c) {
+      in_[c] = in[c];
+      padded_[c] = padded[c];
+    }
+    xsize_ = in[0]->xsize();
+    ysize_ = in[0]->ysize();
     aligned_x_end_ = xsize_ - (xsize_ % df.N);
 
     for (int c = 0; c < 3; ++c) {
@@ -858,11 +929,11 @@ class SIMD_ALIGN MinMaxWorker {
   SIMD_ATTR void Run(int64_t iy) {
     const size_t y = (static_cast<size_t>(iy));  // assumes 2's complement
     if (PIK_LIKELY(y < ysize_)) {
-      for (size_t c = 0; c < 3; ++c) {
+      for (size_t c = 0; c < num_planes_; ++c) {
         PadAndUpdate(c, y);
       }
     } else {
-      for (size_t c = 0; c < 3; ++c) {
+      for (size_t c = 0; c < num_planes_; ++c) {
         PadTopBottomRow(c, iy);
       }
     }
@@ -881,9 +952,10 @@ class SIMD_ALIGN MinMaxWorker {
     }
   }
 
+  // Only the first num_planes entries of "min" and "max" are valid.
   SIMD_ATTR void Finalize(std::array<float, 3>* PIK_RESTRICT min,
                           std::array<float, 3>* PIK_RESTRICT max) const {
-    for (int c = 0; c < 3; ++c) {
+    for (size_t c = 0; c < num_planes_; ++c) {
       (*min)[c] =
           std::min(scalar_min_[c], *std::min_element(min_[c], min_[c] + df.N));
       (*max)[c] =
@@ -894,8 +966,8 @@ class SIMD_ALIGN MinMaxWorker {
  private:
   // Interior, y is valid.
   SIMD_ATTR void PadAndUpdate(const size_t c, const size_t y) {
-    const float* SIMD_RESTRICT row_in = in_->ConstPlaneRow(c, y);
-    float* SIMD_RESTRICT row_out = padded_->PlaneRow(c, y + kBorder) + kBorder;
+    const float* SIMD_RESTRICT row_in = in_[c]->ConstRow(y);
+    float* SIMD_RESTRICT row_out = padded_[c]->Row(y + kBorder) + kBorder;
 
     // Ensure store alignment (faster than loading aligned)
     constexpr int64_t aligned_begin = (kBorder + df.N - 1) & ~(df.N - 1);
@@ -944,8 +1016,8 @@ class SIMD_ALIGN MinMaxWorker {
   // Border, no need to update min/max from mirrored values.
   SIMD_ATTR void PadTopBottomRow(const size_t c, const int64_t iy) {
     const int64_t clamped_y = WrapMirror()(iy, ysize_);
-    const float* SIMD_RESTRICT row_in = in_->ConstPlaneRow(c, clamped_y);
-    float* SIMD_RESTRICT row_out = padded_->PlaneRow(c, iy + kBorder) + kBorder;
+    const float* SIMD_RESTRICT row_in = in_[c]->ConstRow(clamped_y);
+    float* SIMD_RESTRICT row_out = padded_[c]->Row(iy + kBorder) + kBorder;
 
     // Ensure store alignment (faster than loading aligned)
     constexpr int64_t aligned_begin = (kBorder + df.N - 1) & ~(df.N - 1);
@@ -972,8 +1044,9 @@ class SIMD_ALIGN MinMaxWorker {
 
   SIMD_ALIGN float min_[3][df.N];
   SIMD_ALIGN float max_[3][df.N];
-  const Image3F* SIMD_RESTRICT in_;  // not owned
-  Image3F* SIMD_RESTRICT padded_;    // not owned
+  const ImageF* in_[3];  // not owned
+  ImageF* padded_[3];    // not owned
+  size_t num_planes_;
   size_t xsize_;
   size_t ysize_;
   size_t aligned_x_end_;
@@ -983,18 +1056,27 @@ class SIMD_ALIGN MinMaxWorker {
 static_assert(sizeof(MinMaxWorker) % sizeof(DF::V) == 0, "Align");
 
 // Returns a new image with kBorder additional pixels on each side initialized
-// by mirroring.
-SIMD_ATTR void MinMax(const Image3F& in, ThreadPool* pool,
+// by mirroring. "Image" is Image3F or ImageF.
+template <class Image>
+SIMD_ATTR void MinMax(const Image& in, ThreadPool* pool,
                       std::array<float, 3>* SIMD_RESTRICT min,
                       std::array<float, 3>* SIMD_RESTRICT max,
-                      Image3F* SIMD_RESTRICT padded) {
+                      Image* SIMD_RESTRICT padded) {
   PROFILER_FUNC;
+  const size_t num_planes = NumPlanes(in);
+  const ImageF* in_planes[3];
+  ImageF* padded_planes[3];
+  for (size_t c = 0; c < num_planes; ++c) {
+    in_planes[c] = &PlaneOf(in, c);
+    padded_planes[c] = MutablePlaneOf(padded, c);
+  }
+
   // A bit too large for the stack. Must be aligned for min_/max_ members.
   const size_t num_workers = NumThreads(pool);
   auto workers_mem = AllocateArray(num_workers * sizeof(MinMaxWorker));
   MinMaxWorker* workers = reinterpret_cast<MinMaxWorker*>(workers_mem.get());
   for (size_t i = 0; i < num_workers; ++i) {
-    workers[i].Init(&in, padded);
+    workers[i].Init(in_planes, padded_planes, num_planes);
   }
 
   // Includes padding. ThreadPool requires task >= 0.
@@ -1013,12 +1095,14 @@ SIMD_ATTR void MinMax(const Image3F& in, ThreadPool* pool,
 // Returns a guide image for "in" (padded). u8 is required for the SAD
 // hardware acceleration; precomputing is faster than converting a window for
 // each pixel.
-SIMD_ATTR Image3B MakeGuide(const Image3F& padded,
-                            const std::array<float, 3>& min,
-                            const std::array<float, 3>& max) {
+template <class Image>
+SIMD_ATTR typename GuideFor<Image>::type MakeGuide(
+    const Image& padded, const std::array<float, 3>& min,
+    const std::array<float, 3>& max, ThreadPool* pool) {
   const size_t xsize = padded.xsize();
   const size_t ysize = padded.ysize();
-  Image3B guide(xsize, ysize);
+  const size_t num_planes = NumPlanes(padded);
+  typename GuideFor<Image>::type guide(xsize, ysize);
 
   const SIMD_FULL(int32_t) di;
   const SIMD_FULL(uint32_t) du;
@@ -1027,14 +1111,16 @@ SIMD_ATTR Image3B MakeGuide(const Image3F& padded,
 #if EPF_INDEP_RANGE
   const float channel_scale[3] = {1.0f / 16, 1.0f / 4, 1.0f};
 #else
-  const float all_max = *std::max_element(max.begin(), max.end());
-  const float all_min = *std::min_element(min.begin(), min.end());
+  const float all_max =
+      *std::max_element(max.begin(), max.begin() + num_planes);
+  const float all_min =
+      *std::min_element(min.begin(), min.begin() + num_planes);
   const float range = all_max - all_min;
   const auto vmul = set1(df, 255.0f / range);
   const auto vmin = set1(df, all_min);
 #endif
 
-  for (size_t c = 0; c < 3; ++c) {
+  for (size_t c = 0; c < num_planes; ++c) {
     PIK_CHECK(max[c] >= min[c]);
 #if EPF_INDEP_RANGE
     float range = max[c] - min[c];
@@ -1046,27 +1132,31 @@ SIMD_ATTR Image3B MakeGuide(const Image3F& padded,
     const auto vmin = set1(df, min[c]);
 #endif
 
-    const ImageF& padded_plane = padded.Plane(c);
-    ImageB* PIK_RESTRICT guide_plane = guide.MutablePlane(c);
-
-    for (size_t y = 0; y < ysize; ++y) {
-      const float* SIMD_RESTRICT padded_row = padded_plane.ConstRow(y);
-      uint8_t* SIMD_RESTRICT guide_row = guide_plane->Row(y);
-
-      size_t x = 0;
-      for (; x < xsize; x += df.N) {
-        const auto scaled = (load(df, padded_row + x) - vmin) * vmul;
-        const auto i32 = convert_to(di, scaled);
-        const auto bytes = u8_from_u32(cast_to(du, i32));
-        store(bytes, d8, guide_row + x);
-      }
+    const ImageF& padded_plane = PlaneOf(padded, c);
+    ImageB* PIK_RESTRICT guide_plane = MutablePlaneOf(&guide, c);
+
+    RunOnPool(
+        pool, 0, ysize,
+        [&](const int task, const int thread) SIMD_ATTR {
+          const size_t y = task;
+          const float* SIMD_RESTRICT padded_row = padded_plane.ConstRow(y);
+          uint8_t* SIMD_RESTRICT guide_row = guide_plane->Row(y);
+
+          size_t x = 0;
+          for (; x < xsize; x += df.N) {
+            const auto scaled = (load(df, padded_row + x) - vmin) * vmul;
+            const auto i32 = convert_to(di, scaled);
+            const auto bytes = u8_from_u32(cast_to(du, i32));
+            store(bytes, d8, guide_row + x);
+          }
 
-      // MPSADBW will read 16 bytes but only 11 need be valid;
-      // zero-initialize the rest.
-      for (; x < xsize + 16 - 11; x += df.N) {
-        store(setzero(d8), d8, guide_row + x);
-      }
-    }
+          // MPSADBW will read 16 bytes but only 11 need be valid;
+          // zero-initialize the rest.
+          for (; x < xsize + 16 - 11; x += df.N) {
+            store(setzero(d8), d8, guide_row + x);
+          }
+        },
+        "EPF MakeGuide");
   }
 
   return guide;
@@ -1117,11 +1207,66 @@ static PIK_INLINE int SigmaFromQuant(float signal, float stretch,
   return std::min(sigma, kMaxSigma);
 }
 
-SIMD_ATTR void AdaptiveFilter(const Image3F& in_guide, const Image3F& in,
+// Filters the kBlockDim pixels starting at "bx" in row "y" of "smoothed".
+// "guide" and "padded_in" have kBorder pixels on each side.
+SIMD_ATTR SIMD_INLINE void FilterBlockRow(const Image3B& guide,
+                                          const Image3F& padded_in,
+                                          const WeightFast& weight_func,
+                                          const size_t bx, const size_t y,
+                                          Image3F* smoothed) {
+  const size_t guide_stride = guide.Plane(0).bytes_per_row();
+  const size_t padded_in_stride = padded_in.Plane(0).bytes_per_row();
+  // "guide_m4" and "in_m3" are 4 and 3 rows above the current pixel.
+  const uint8_t* SIMD_RESTRICT guide_m4_r =
+      guide.ConstPlaneRow(0, y + kBorder - 4) + kBorder;
+  const uint8_t* SIMD_RESTRICT guide_m4_g =
+      guide.ConstPlaneRow(1, y + kBorder - 4) + kBorder;
+  const uint8_t* SIMD_RESTRICT guide_m4_b =
+      guide.ConstPlaneRow(2, y + kBorder - 4) + kBorder;
+  const float* SIMD_RESTRICT in_m3_r =
+      padded_in.ConstPlaneRow(0, y - 3 + kBorder) + kBorder;
+  const float* SIMD_RESTRICT in_m3_g =
+      padded_in.ConstPlaneRow(1, y - 3 + kBorder) + kBorder;
+  const float* SIMD_RESTRICT in_m3_b =
+      padded_in.ConstPlaneRow(2, y - 3 + kBorder) + kBorder;
+  float* SIMD_RESTRICT out_r = smoothed->PlaneRow(0, y);
+  float* SIMD_RESTRICT out_g = smoothed->PlaneRow(1, y);
+  float* SIMD_RESTRICT out_b = smoothed->PlaneRow(2, y);
+
+  for (size_t ix = 0; ix < kBlockDim; ++ix) {
+    const size_t x = bx + ix;
+    WeightedSum::Compute(guide_m4_r + x, guide_m4_g + x, guide_m4_b + x,
+                         guide_stride, in_m3_r + x, in_m3_g + x, in_m3_b + x,
+                         padded_in_stride, weight_func, out_r + x, out_g + x,
+                         out_b + x);
+  }
+}
+
+SIMD_ATTR SIMD_INLINE void FilterBlockRow(const ImageB& guide,
+                                          const ImageF& padded_in,
+                                          const WeightFast& weight_func,
+                                          const size_t bx, const size_t y,
+                                          ImageF* smoothed) {
+  const uint8_t* SIMD_RESTRICT guide_m4 =
+      guide.ConstRow(y + kBorder - 4) + kBorder;
+  const float* SIMD_RESTRICT in_m3 =
+      padded_in.ConstRow(y - 3 + kBorder) + kBorder;
+  float* SIMD_RESTRICT out = smoothed->Row(y);
+
+  for (size_t ix = 0; ix < kBlockDim; ++ix) {
+    const size_t x = bx + ix;
+    WeightedSum::Compute(guide_m4 + x, guide.bytes_per_row(), in_m3 + x,
+                         padded_in.bytes_per_row(), weight_func, out + x);
+  }
+}
+
+// "Image" is Image3F or ImageF (single plane, e.g. grayscale).
+template <class Image>
+SIMD_ATTR void AdaptiveFilter(const Image& in_guide, const Image& in,
                               const ImageI* ac_quant, float quant_scale,
                               const AcStrategyImage& ac_strategy,
-                              const EpfParams& epf_params, Image3F* smoothed,
-                              EpfStats* epf_stats) {
+                              const EpfParams& epf_params, ThreadPool* pool,
+                              Image* smoothed, EpfStats* epf_stats) {
   PIK_ASSERT(SameSize(in, *smoothed));
   const size_t xsize = smoothed->xsize();
   const size_t ysize = smoothed->ysize();
@@ -1132,31 +1277,38 @@ SIMD_ATTR void AdaptiveFilter(const Image3F& in_guide, const Image3F& in,
 
   PIK_ASSERT(epf_params.enable_adaptive);
 
+  const size_t num_planes = NumPlanes(in);
   std::array<float, 3> min, max;
 
-  Image3F padded_in(xsize + 2 * kBorder, ysize + 2 * kBorder);
-  MinMax(in, /*pool=*/nullptr, &min, &max, &padded_in);
+  Image padded_in(xsize + 2 * kBorder, ysize + 2 * kBorder);
+  MinMax(in, pool, &min, &max, &padded_in);
 
-  const size_t padded_in_stride = padded_in.Plane(0).bytes_per_row();
-  PIK_CHECK(padded_in_stride == padded_in.Plane(1).bytes_per_row());
-  PIK_CHECK(padded_in_stride == padded_in.Plane(2).bytes_per_row());
+  // FilterBlockRow assumes all planes have the same stride.
+  const size_t padded_in_stride = PlaneOf(padded_in, 0).bytes_per_row();
+  for (size_t c = 1; c < num_planes; ++c) {
+    PIK_CHECK(padded_in_stride == PlaneOf(padded_in, c).bytes_per_row());
+  }
 
-  Image3F padded_guide(xsize + 2 * kBorder, ysize + 2 * kBorder);
-  MinMax(epf_params.use_sharpened ? in : in_guide, /*pool=*/nullptr, &min, &max,
+  Image padded_guide(xsize + 2 * kBorder, ysize + 2 * kBorder);
+  MinMax(epf_params.use_sharpened ? in : in_guide, pool, &min, &max,
          &padded_guide);
   if (epf_stats != nullptr) {
-    for (int c = 0; c < 3; ++c) {
+    for (size_t c = 0; c < num_planes; ++c) {
       epf_stats->s_ranges[c].Notify(max[c] - min[c]);
     }
   }
-  const float all_max = *std::max_element(max.begin(), max.end());
-  const float all_min = *std::min_element(min.begin(), min.end());
+  const float all_max =
+      *std::max_element(max.begin(), max.begin() + num_planes);
+  const float all_min =
+      *std::min_element(min.begin(), min.begin() + num_planes);
   const float stretch = 255.0f / (all_max - all_min);
 
-  Image3B guide = MakeGuide(padded_guide, min, max);
-  const size_t guide_stride = guide.Plane(0).bytes_per_row();
-  PIK_CHECK(guide_stride == guide.Plane(1).bytes_per_row());
-  PIK_CHECK(guide_stride == guide.Plane(2).bytes_per_row());
+  const typename GuideFor<Image>::type guide =
+      MakeGuide(padded_guide, min, max, pool);
+  const size_t guide_stride = PlaneOf(guide, 0).bytes_per_row();
+  for (size_t c = 1; c < num_planes; ++c) {
+    PIK_CHECK(guide_stride == PlaneOf(guide, c).bytes_per_row());
+  }
 
 #if DUMP_SIGMA
   ImageB dump(DivCeil(xsize, kBlockDim), ysize_blocks);
@@ -1166,9 +1318,15 @@ SIMD_ATTR void AdaptiveFilter(const Image3F& in_guide, const Image3F& in,
   quant_scale = 0.039324273f;
 #endif
 
-  WeightFast weight_func;
-  EpfStats stats;
-  for (size_t by = 0; by < ysize_blocks; ++by) {
+  // Per-thread; merged after all rows are done.
+  std::vector<EpfStats> thread_stats(NumThreads(pool));
+
+  // Blocks only write their own pixels of "smoothed" and read from the padded
+  // copies, so rows of blocks are independent.
+  const auto filter_row = [&](const int task, const int thread) SIMD_ATTR {
+    const size_t by = task;
+    EpfStats& stats = thread_stats[thread];
+    WeightFast weight_func;
     const int* SIMD_RESTRICT ac_quant_row = ac_quant->Row(by);
     AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(by);
 #if DUMP_SIGMA
@@ -1197,37 +1355,17 @@ SIMD_ATTR void AdaptiveFilter(const Image3F& in_guide, const Image3F& in,
       weight_func.SetSigma(sigma);
 
       for (size_t iy = 0; iy < kBlockDim; ++iy) {
-        const size_t y = by * kBlockDim + iy;
-        // "guide_m4" and "in_m3" are 4 and 3 rows above the current pixel.
-        const uint8_t* SIMD_RESTRICT guide_m4_r =
-            guide.ConstPlaneRow(0, y + kBorder - 4) + kBorder;
-        const uint8_t* SIMD_RESTRICT guide_m4_g =
-            guide.ConstPlaneRow(1, y + kBorder - 4) + kBorder;
-        const uint8_t* SIMD_RESTRICT guide_m4_b =
-            guide.ConstPlaneRow(2, y + kBorder - 4) + kBorder;
-        const float* SIMD_RESTRICT in_m3_r =
-            padded_in.ConstPlaneRow(0, y - 3 + kBorder) + kBorder;
-        const float* SIMD_RESTRICT in_m3_g =
-            padded_in.ConstPlaneRow(1, y - 3 + kBorder) + kBorder;
-        const float* SIMD_RESTRICT in_m3_b =
-            padded_in.ConstPlaneRow(2, y - 3 + kBorder) + kBorder;
-        float* SIMD_RESTRICT out_r = smoothed->PlaneRow(0, y);
-        float* SIMD_RESTRICT out_g = smoothed->PlaneRow(1, y);
-        float* SIMD_RESTRICT out_b = smoothed->PlaneRow(2, y);
-
-        for (size_t ix = 0; ix < kBlockDim; ++ix) {
-          const size_t x = bx + ix;
-          WeightedSum::Compute(guide_m4_r + x, guide_m4_g + x, guide_m4_b + x,
-                               guide_stride, in_m3_r + x, in_m3_g + x,
-                               in_m3_b + x, padded_in_stride, weight_func,
-                               out_r + x, out_g + x, out_b + x);
-        }  // ix
-      }    // iy
-    }      // bx
-  }        // by
+        FilterBlockRow(guide, padded_in, weight_func, bx, by * kBlockDim + iy,
+                       smoothed);
+      }  // iy
+    }    // bx
+  };
+  RunOnPool(pool, 0, ysize_blocks, filter_row, "EPF AdaptiveFilter");
 
   if (epf_stats != nullptr) {
-    epf_stats->Assimilate(stats);
+    for (const EpfStats& stats : thread_stats) {
+      epf_stats->Assimilate(stats);
+    }
   }
 
 #if DUMP_SIGMA
@@ -1305,8 +1443,8 @@ class FilterWorkers {
 };
 
 void Filter(const Image3F& in_guide, const Image3F& in,
-            const EpfParams& epf_params, float* PIK_RESTRICT stretch,
-            Image3F* smoothed) {
+            const EpfParams& epf_params, ThreadPool* pool,
+            float* PIK_RESTRICT stretch, Image3F* smoothed) {
   PIK_ASSERT(SameSize(in, *smoothed));
   const size_t xsize = smoothed->xsize();
   const size_t ysize = smoothed->ysize();
@@ -1324,22 +1462,26 @@ void Filter(const Image3F& in_guide, const Image3F& in,
 
   std::array<float, 3> min, max;
   Image3F padded_in(xsize + 2 * kBorder, ysize + 2 * kBorder);
-  MinMax(in, /*pool=*/nullptr, &min, &max, &padded_in);
+  MinMax(in, pool, &min, &max, &padded_in);
 
   Image3F padded_guide(xsize + 2 * kBorder, ysize + 2 * kBorder);
-  MinMax(epf_params.use_sharpened ? in : in_guide, /*pool=*/nullptr, &min, &max,
+  MinMax(epf_params.use_sharpened ? in : in_guide, pool, &min, &max,
          &padded_guide);
 
   const float all_max = *std::max_element(max.begin(), max.end());
   const float all_min = *std::min_element(min.begin(), min.end());
   *stretch = 255.0f / (all_max - all_min);
 
-  Image3B guide = MakeGuide(padded_guide, min, max);
+  Image3B guide = MakeGuide(padded_guide, min, max, pool);
 
-  FilterWorkers workers(1, guide, padded_in, epf_params.sigma, smoothed);
-  for (size_t y = 0; y < ysize_blocks; ++y) {
-    workers.Run(y, /*thread=*/0);
-  }
+  FilterWorkers workers(NumThreads(pool), guide, padded_in, epf_params.sigma,
+                        smoothed);
+  RunOnPool(
+      pool, 0, ysize_blocks,
+      [&workers](const int task, const int thread) SIMD_ATTR {
+        workers.Run(task, thread);
+      },
+      "EPF Filter");
 }
 
 }  // namespace
@@ -1354,18 +1496,30 @@ template <>
 void EdgePreservingFilter::operator()<SIMD_TARGET>(
     const Image3F& in_guide, const Image3F& in, const ImageI* ac_quant,
     float sigma_mul, const AcStrategyImage& ac_strategy,
-    const EpfParams& epf_params, Image3F* smoothed, EpfStats* epf_stats) const {
+    const EpfParams& epf_params, ThreadPool* pool, Image3F* smoothed,
+    EpfStats* epf_stats) const {
+  SIMD_NAMESPACE::AdaptiveFilter(in_guide, in, ac_quant, sigma_mul, ac_strategy,
+                                 epf_params, pool, smoothed, epf_stats);
+}
+
+template <>
+void EdgePreservingFilter::operator()<SIMD_TARGET>(
+    const ImageF& in_guide, const ImageF& in, const ImageI* ac_quant,
+    float sigma_mul, const AcStrategyImage& ac_strategy,
+    const EpfParams& epf_params, ThreadPool* pool, ImageF* smoothed,
+    EpfStats* epf_stats) const {
   SIMD_NAMESPACE::AdaptiveFilter(in_guide, in, ac_quant, sigma_mul, ac_strategy,
-                                 epf_params, smoothed, epf_stats);
+                                 epf_params, pool, smoothed, epf_stats);
 }
 
 template <>
 void EdgePreservingFilter::operator()<SIMD_TARGET>(const Image3F& in_guide,
                                                    const Image3F& in,
                                                    const EpfParams& epf_params,
+                                                   ThreadPool* pool,
                                                    float* PIK_RESTRICT stretch,
                                                    Image3F* smoothed) const {
-  SIMD_NAMESPACE::Filter(in_guide, in, epf_params, stretch, smoothed);
+  SIMD_NAMESPACE::Filter(in_guide, in, epf_params, pool, stretch, smoothed);
 }
 
 template <>
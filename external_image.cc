@@ -781,7 +781,7 @@ class Transformer {
         rect_(rect),
         alpha_(alpha),
         external_(external),
-        want_alpha_(has_alpha && external->HasAlpha()) {
+        want_alpha_(has_alpha && alpha != nullptr && external->HasAlpha()) {
     PIK_ASSERT(rect.IsInside(color));
     PIK_ASSERT(SameSize(rect, *external));
   }
@@ -862,7 +862,7 @@ class Transformer {
 #endif
 
     const uint16_t* PIK_RESTRICT row_alpha =
-        want_alpha_ ? alpha_->ConstRow(y) : nullptr;
+        want_alpha_ ? rect_.ConstRow(*alpha_, y) : nullptr;
     Demux::AlphaToExternal(Type(), Order(), Channels(), rect_.xsize(),
                            row_alpha, row_external);
   }
@@ -893,7 +893,7 @@ class Transformer {
 #endif
 
     const uint16_t* PIK_RESTRICT row_alpha =
-        want_alpha_ ? alpha_->ConstRow(y) : nullptr;
+        want_alpha_ ? rect_.ConstRow(*alpha_, y) : nullptr;
     Demux::AlphaToExternal(Type(), Order(), Channels(), rect_.xsize(),
                            row_alpha, row_external);
   }
@@ -1112,7 +1112,8 @@ ExternalImage::ExternalImage(const size_t xsize, const size_t ysize,
                              const ColorEncoding& c_current,
                              const bool has_alpha, const size_t bits_per_alpha,
                              const size_t bits_per_sample,
-                             const bool big_endian)
+                             const bool big_endian, uint8_t* caller_bytes,
+                             const size_t stride)
     : xsize_(xsize),
       ysize_(ysize),
       c_current_(c_current),
@@ -1120,10 +1121,16 @@ ExternalImage::ExternalImage(const size_t xsize, const size_t ysize,
       bits_per_alpha_(bits_per_alpha),
       bits_per_sample_(bits_per_sample),
       big_endian_(big_endian),
-      row_size_(xsize * channels_ * DivCeil(bits_per_sample, kBitsPerByte)) {
+      row_size_(xsize * channels_ * DivCeil(bits_per_sample, kBitsPerByte)),
+      stride_(caller_bytes == nullptr ? row_size_ : stride),
+      caller_bytes_(caller_bytes) {
   PIK_ASSERT(1 <= channels_ && channels_ <= 4);
   PIK_ASSERT(1 <= bits_per_sample && bits_per_sample <= 32);
   if (has_alpha) PIK_ASSERT(1 <= bits_per_alpha && bits_per_alpha <= 32);
+  if (caller_bytes_ != nullptr) {
+    is_healthy_ = stride_ >= row_size_;
+    return;
+  }
   bytes_.resize(ysize_ * row_size_);
   is_healthy_ = !bytes_.empty();
 }
@@ -1152,21 +1159,41 @@ ExternalImage::ExternalImage(ThreadPool* pool, const Image3F& color,
     : ExternalImage(rect.xsize(), rect.ysize(), c_desired, has_alpha,
                     bits_per_alpha, bits_per_sample, big_endian) {
   if (!is_healthy_) return;
-  Transformer transformer(pool, color, rect, has_alpha, alpha, this);
-  if (!transformer.Init(c_current, c_desired)) {
+  Transform(pool, color, rect, c_current, alpha, temp_intervals);
+}
+
+ExternalImage::ExternalImage(ThreadPool* pool, const Image3F& color,
+                             const Rect& rect, const ColorEncoding& c_current,
+                             const ColorEncoding& c_desired,
+                             const bool has_alpha, const ImageU* alpha,
+                             size_t bits_per_alpha, size_t bits_per_sample,
+                             bool big_endian, uint8_t* bytes, size_t stride)
+    : ExternalImage(rect.xsize(), rect.ysize(), c_desired, has_alpha,
+                    bits_per_alpha, bits_per_sample, big_endian, bytes,
+                    stride) {
+  if (!is_healthy_) return;
+  Transform(pool, color, rect, c_current, alpha, nullptr);
+}
+
+void ExternalImage::Transform(ThreadPool* pool, const Image3F& color,
+                              const Rect& rect, const ColorEncoding& c_current,
+                              const ImageU* alpha,
+                              CodecIntervals* temp_intervals) {
+  Transformer transformer(pool, color, rect, HasAlpha(), alpha, this);
+  if (!transformer.Init(c_current, c_current_)) {
     is_healthy_ = false;
     return;
   }
 
-  const CodecInterval ext_interval = GetInterval(bits_per_sample);
+  const CodecInterval ext_interval = GetInterval(bits_per_sample_);
 
-  if (bits_per_sample == 32) {
+  if (bits_per_sample_ == 32) {
     ExtentsStatic extents;
     const CastFloat01 cast(ext_interval);  // only multiply by const
     is_healthy_ = transformer.Run<ToExternal>(&extents, cast);
   } else if (temp_intervals != nullptr) {
     // Store temp to separate image and obtain per-channel intervals.
-    ExtentsDynamic extents(xsize_, ysize_, NumThreads(pool), c_desired);
+    ExtentsDynamic extents(xsize_, ysize_, NumThreads(pool), c_current_);
     const CastUnused unused;
     is_healthy_ = transformer.Run<ToExternal1>(&extents, unused);
     if (!is_healthy_) return;
@@ -39,6 +39,17 @@ class ExternalImage {
                 size_t bits_per_sample, bool big_endian,
                 CodecIntervals* temp_intervals);
 
+  // As above (without temp_intervals, i.e. clamping), but writes to caller-
+  // allocated rows that are "stride" bytes apart, starting at "bytes", instead
+  // of allocating. Avoids a copy when decoding into client memory. Bytes() is
+  // then empty; use Row() instead. If has_alpha but alpha == nullptr, the
+  // alpha samples are opaque.
+  ExternalImage(ThreadPool* pool, const Image3F& color, const Rect& rect,
+                const ColorEncoding& c_current, const ColorEncoding& c_desired,
+                bool has_alpha, const ImageU* alpha, size_t bits_per_alpha,
+                size_t bits_per_sample, bool big_endian, uint8_t* bytes,
+                size_t stride);
+
   // Indicates whether the ctor succeeded; if not, do not use this instance.
   Status IsHealthy() const { return is_healthy_; }
 
@@ -62,15 +73,26 @@ class ExternalImage {
   size_t BitsPerSample() const { return bits_per_sample_; }
   bool BigEndian() const { return big_endian_; }
 
-  uint8_t* Row(size_t y) { return bytes_.data() + y * row_size_; }
+  uint8_t* Row(size_t y) {
+    return (caller_bytes_ != nullptr ? caller_bytes_ : bytes_.data()) +
+           y * stride_;
+  }
   const uint8_t* ConstRow(size_t y) const {
-    return bytes_.data() + y * row_size_;
+    return (caller_bytes_ != nullptr ? caller_bytes_ : bytes_.data()) +
+           y * stride_;
   }
 
  private:
+  // Allocates bytes_ unless "caller_bytes" is non-null.
   ExternalImage(size_t xsize, size_t ysize, const ColorEncoding& c_current,
                 bool has_alpha, size_t bits_per_alpha, size_t bits_per_sample,
-                bool big_endian);
+                bool big_endian, uint8_t* caller_bytes = nullptr,
+                size_t stride = 0);
+
+  // Converts "color" into Row(); called by the color converting ctors.
+  void Transform(ThreadPool* pool, const Image3F& color, const Rect& rect,
+                 const ColorEncoding& c_current, const ImageU* alpha,
+                 CodecIntervals* temp_intervals);
 
   size_t xsize_;
   size_t ysize_;
@@ -82,7 +104,10 @@ class ExternalImage {
   size_t bits_per_sample_;
   bool big_endian_;
   size_t row_size_;
+  // Distance between rows; row_size_ unless writing to caller_bytes_.
+  size_t stride_;
   PaddedBytes bytes_;
+  uint8_t* caller_bytes_ = nullptr;  // not owned
   bool is_healthy_;
 };
 
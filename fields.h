@@ -116,27 +116,34 @@ class U32Coder {
 
   // Returns false if the value is too large to encode.
   static Status Write(const uint32_t distribution, const uint32_t value,
-                      size_t* pos, uint8_t* storage) {
+                      BufferedBitWriter* PIK_RESTRICT writer) {
     int selector;
     size_t total_bits;
     PIK_RETURN_IF_ERROR(
         ChooseEncoding(distribution, value, &selector, &total_bits));
 
     if (IsRaw(distribution)) {
-      WriteBits(RawBits(distribution), value, pos, storage);
+      writer->Write(RawBits(distribution), value);
       return true;
     }
-    WriteBits(2, selector, pos, storage);
+    writer->Write(2, selector);
 
     const size_t b = Lookup(distribution, selector);
     if ((b & kDirect) == 0) {  // Nothing more to write for direct encoding
       uint32_t offset = GetOffset(b);
       PIK_ASSERT(value >= offset);
-      WriteBits(total_bits - 2, value - offset, pos, storage);
+      writer->Write(total_bits - 2, value - offset);
     }
 
     return true;
   }
+  static Status Write(const uint32_t distribution, const uint32_t value,
+                      size_t* pos, uint8_t* storage) {
+    BufferedBitWriter writer(pos, storage);
+    const Status ok = Write(distribution, value, &writer);
+    writer.Flush();
+    return ok;
+  }
 
  private:
   static PIK_INLINE bool IsRaw(const uint32_t distribution) {
@@ -278,44 +285,50 @@ class U64Coder {
   }
 
   // Returns false if the value is too large to encode.
-  static Status Write(uint64_t value, size_t* pos, uint8_t* storage) {
+  static Status Write(uint64_t value, BufferedBitWriter* PIK_RESTRICT writer) {
     if (value == 0) {
       // Selector: use 0 bits, value 0
-      WriteBits(2, 0, pos, storage);
+      writer->Write(2, 0);
     } else if (value <= 16) {
       // Selector: use 4 bits, value 1..16
-      WriteBits(2, 1, pos, storage);
-      WriteBits(4, value - 1, pos, storage);
+      writer->Write(2, 1);
+      writer->Write(4, value - 1);
     } else if (value <= 272) {
       // Selector: use 8 bits, value 17..272
-      WriteBits(2, 2, pos, storage);
-      WriteBits(8, value - 17, pos, storage);
+      writer->Write(2, 2);
+      writer->Write(8, value - 17);
     } else {
       // Selector: varint, first a 12-bit group, after that per 8-bit group.
-      WriteBits(2, 3, pos, storage);
-      WriteBits(12, value & 4095, pos, storage);
+      writer->Write(2, 3);
+      writer->Write(12, value & 4095);
       value >>= 12;
       int shift = 12;
       while (value > 0 && shift < 60) {
         // Indicate varint not done
-        WriteBits(1, 1, pos, storage);
-        WriteBits(8, value & 255, pos, storage);
+        writer->Write(1, 1);
+        writer->Write(8, value & 255);
         value >>= 8;
         shift += 8;
       }
       if (value > 0) {
         // This only could happen if shift == 60.
-        WriteBits(1, 1, pos, storage);
-        WriteBits(4, value & 15, pos, storage);
+        writer->Write(1, 1);
+        writer->Write(4, value & 15);
         // Implicitly closed sequence, no extra stop bit is required.
       } else {
         // Indicate end of varint
-        WriteBits(1, 0, pos, storage);
+        writer->Write(1, 0);
       }
     }
 
     return true;
   }
+  static Status Write(uint64_t value, size_t* pos, uint8_t* storage) {
+    BufferedBitWriter writer(pos, storage);
+    const Status ok = Write(value, &writer);
+    writer.Flush();
+    return ok;
+  }
 
   // Can always encode, but useful because it also returns bit size.
   static Status CanEncode(uint64_t value, size_t* PIK_RESTRICT encoded_bits) {
@@ -449,13 +462,13 @@ class BytesCoder {
   }
 
   static Status Write(BytesEncoding encoding, const PaddedBytes& value,
-                      size_t* PIK_RESTRICT pos, uint8_t* storage) {
+                      BufferedBitWriter* PIK_RESTRICT writer) {
     PIK_ASSERT(encoding == BytesEncoding::kRaw ||
                encoding == BytesEncoding::kBrotli);
     if (value.empty()) {
       return U32Coder::Write(kU32Direct3Plus8,
-                             static_cast<uint32_t>(BytesEncoding::kNone), pos,
-                             storage);
+                             static_cast<uint32_t>(BytesEncoding::kNone),
+                             writer);
     }
 
     PaddedBytes compressed;
@@ -471,9 +484,8 @@ class BytesCoder {
     }
 
     PIK_RETURN_IF_ERROR(U32Coder::Write(
-        kU32Direct3Plus8, static_cast<uint32_t>(encoding), pos, storage));
-    PIK_RETURN_IF_ERROR(
-        U64Coder::Write(store_what->size(), pos, storage));
+        kU32Direct3Plus8, static_cast<uint32_t>(encoding), writer));
+    PIK_RETURN_IF_ERROR(U64Coder::Write(store_what->size(), writer));
 
     size_t i = 0;
 #if PIK_BYTE_ORDER_LITTLE
@@ -481,13 +493,13 @@ class BytesCoder {
     uint32_t buf;
     for (; i + 4 <= store_what->size(); i += 4) {
       memcpy(&buf, store_what->data() + i, 4);
-      WriteBits(32, buf, pos, storage);
+      writer->Write(32, buf);
     }
 #endif
 
     // Write remaining bytes
     for (; i < store_what->size(); ++i) {
-      WriteBits(8, store_what->data()[i], pos, storage);
+      writer->Write(8, store_what->data()[i]);
     }
     return true;
   }
@@ -590,7 +602,9 @@ class Bundle {
                       size_t* PIK_RESTRICT pos, uint8_t* storage) {
     Trace("Write");
     WriteVisitor visitor(extension_bits, pos, storage);
-    PIK_RETURN_IF_ERROR(visitor.VisitConst(t));
+    const Status visited = visitor.VisitConst(t);
+    visitor.Flush();
+    PIK_RETURN_IF_ERROR(visited);
     return visitor.OK();
   }
 
@@ -979,15 +993,15 @@ class Bundle {
   class WriteVisitor : public VisitorBase<WriteVisitor> {
    public:
     WriteVisitor(const size_t extension_bits, size_t* pos, uint8_t* storage)
-        : extension_bits_(extension_bits), pos_(pos), storage_(storage) {}
+        : extension_bits_(extension_bits), writer_(pos, storage) {}
 
     void U32(const uint32_t distribution, const uint32_t default_value,
              const uint32_t* PIK_RESTRICT value) {
-      ok_ &= U32Coder::Write(distribution, *value, pos_, storage_);
+      ok_ &= U32Coder::Write(distribution, *value, &writer_);
     }
 
     void U64(const uint64_t default_value, const uint64_t* PIK_RESTRICT value) {
-      ok_ &= U64Coder::Write(*value, pos_, storage_);
+      ok_ &= U64Coder::Write(*value, &writer_);
     }
 
     template <typename T>
@@ -1004,7 +1018,7 @@ class Bundle {
 
     void Bytes(const BytesEncoding encoding,
                const PaddedBytes* PIK_RESTRICT value) {
-      ok_ &= BytesCoder::Write(encoding, *value, pos_, storage_);
+      ok_ &= BytesCoder::Write(encoding, *value, &writer_);
     }
 
     void BeginExtensions(uint64_t* PIK_RESTRICT extensions) {
@@ -1014,17 +1028,19 @@ class Bundle {
       } else {
         // NOTE: extension_bits_ can be zero if the extensions do not require
         // any additional fields.
-        ok_ &= U64Coder::Write(extension_bits_, pos_, storage_);
+        ok_ &= U64Coder::Write(extension_bits_, &writer_);
       }
     }
     // EndExtensions = default.
 
+    // Must be called before accessing *pos or the storage.
+    void Flush() { writer_.Flush(); }
+
     Status OK() const { return ok_; }
 
    private:
     const size_t extension_bits_;
-    size_t* PIK_RESTRICT pos_;
-    uint8_t* storage_;
+    BufferedBitWriter writer_;
     bool ok_ = true;
   };
 };
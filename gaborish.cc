@@ -6,6 +6,7 @@
 
 #include "gaborish.h"
 
+#include "bits.h"
 #include "convolve.h"
 
 namespace pik {
@@ -117,12 +118,15 @@ Image3F GaborishInverse(const Image3F& in, double mul) {
   return sharpened;
 }
 
-SIMD_ATTR Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
-                                   ThreadPool* pool) {
-  if (strength == GaborishStrength::kOff) return std::move(in);
+namespace {
 
+// "Image" is Image3F or ImageF.
+template <class Image>
+SIMD_ATTR Image ConvolveGaborishT(const Image& in, GaborishStrength strength,
+                                  ThreadPool* pool) {
+  PIK_CHECK(strength != GaborishStrength::kOff);
   PROFILER_FUNC;
-  Image3F out(in.xsize(), in.ysize());
+  Image out(in.xsize(), in.ysize());
   using Conv3 = ConvolveT<strategy::Symmetric3>;
   const BorderNeverUsed border;
   const ExecutorPool executor(pool);
@@ -137,8 +141,77 @@ SIMD_ATTR Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
   } else {
     PIK_ASSERT(false);
   }
+  return out;
+}
+
+}  // namespace
+
+SIMD_ATTR Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
+                                   ThreadPool* pool) {
+  if (strength == GaborishStrength::kOff) return std::move(in);
+  const Image3F& const_in = in;
+  return ConvolveGaborish(const_in, strength, pool);
+}
+
+SIMD_ATTR Image3F ConvolveGaborish(const Image3F& in, GaborishStrength strength,
+                                   ThreadPool* pool) {
+  Image3F out = ConvolveGaborishT(in, strength, pool);
   out.CheckSizesSame();
   return out;
 }
 
+SIMD_ATTR ImageF ConvolveGaborish(ImageF&& in, GaborishStrength strength,
+                                  ThreadPool* pool) {
+  if (strength == GaborishStrength::kOff) return std::move(in);
+  const ImageF& const_in = in;
+  return ConvolveGaborish(const_in, strength, pool);
+}
+
+SIMD_ATTR ImageF ConvolveGaborish(const ImageF& in, GaborishStrength strength,
+                                  ThreadPool* pool) {
+  return ConvolveGaborishT(in, strength, pool);
+}
+
+namespace {
+
+// Inputs have a one-pixel border (mirrored at the image edges), hence
+// LeftRightValid; the arithmetic matches ConvolveT's LeftRightInvalid path.
+template <class Kernel>
+TFNode* AddGaborishT(TFNode* xyb, TFBuilder* builder) {
+  const size_t num_planes = PopCount(AllPorts(xyb));
+  return builder->AddClosure(
+      "gaborish", Borders(strategy::Symmetric3::kRadius), Scale(), {xyb},
+      num_planes, TFType::kF32,
+      [num_planes](const ConstImageViewF* in, const OutputRegion& output_region,
+                   const MutableImageViewF* PIK_RESTRICT out) SIMD_ATTR {
+        const Weights3x3& weights = Kernel().Weights();
+        for (size_t c = 0; c < num_planes; ++c) {
+          const int64_t stride = in[c].bytes_per_row() / sizeof(float);
+          for (size_t y = 0; y < output_region.ysize; ++y) {
+            strategy::Symmetric3::ConvolveRow<0>(
+                LeftRightValid(), in[c].ConstRow(y), output_region.xsize,
+                stride, WrapRowUnchanged(), weights, out[c].Row(y));
+          }
+        }
+      });
+}
+
+}  // namespace
+
+TFNode* AddGaborish(TFNode* xyb, GaborishStrength strength,
+                    TFBuilder* builder) {
+  PIK_CHECK(OutType(xyb) == TFType::kF32);
+  if (strength == GaborishStrength::k1000) {
+    return AddGaborishT<kernel::Gaborish3_1000>(xyb, builder);
+  } else if (strength == GaborishStrength::k875) {
+    return AddGaborishT<kernel::Gaborish3_875>(xyb, builder);
+  } else if (strength == GaborishStrength::k750) {
+    return AddGaborishT<kernel::Gaborish3_750>(xyb, builder);
+  } else if (strength == GaborishStrength::k500) {
+    return AddGaborishT<kernel::Gaborish3_500>(xyb, builder);
+  }
+  PIK_ASSERT(strength == GaborishStrength::kOff);
+  return xyb;
+}
+
 }  // namespace pik
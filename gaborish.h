@@ -11,6 +11,7 @@
 
 #include "data_parallel.h"
 #include "image.h"
+#include "tile_flow.h"
 
 namespace pik {
 
@@ -34,6 +35,23 @@ Image3F GaborishInverse(const Image3F& opsin, double mul);
 Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
                          ThreadPool* pool);
 
+// Returns a smoothed copy of "in", which is left unchanged. Requires strength
+// != kOff.
+Image3F ConvolveGaborish(const Image3F& in, GaborishStrength strength,
+                         ThreadPool* pool);
+
+// Single-plane versions of the above (e.g. for grayscale images).
+ImageF ConvolveGaborish(ImageF&& in, GaborishStrength strength,
+                        ThreadPool* pool);
+ImageF ConvolveGaborish(const ImageF& in, GaborishStrength strength,
+                        ThreadPool* pool);
+
+// Adds a node to "builder" that smoothes all planes of "xyb", which must be a
+// TFWrap::kMirror source (or a node whose source is). Same result as
+// ConvolveGaborish. Returns "xyb" (i.e. adds no node) if strength == kOff.
+TFNode* AddGaborish(TFNode* xyb, GaborishStrength strength,
+                    TFBuilder* builder);
+
 }  // namespace pik
 
 #endif  // GABORISH_H_
@@ -31,17 +31,19 @@ inline void ExtrapolateBorders(const float* const PIK_RESTRICT row_in,
 
 ImageF ConvolveXSampleAndTranspose(const ImageF& in,
                                    const std::vector<float>& kernel,
-                                   const size_t res) {
+                                   const size_t res, ThreadPool* pool) {
   PIK_ASSERT(kernel.size() % 2 == 1);
   PIK_ASSERT(in.xsize() % res == 0);
   const int offset = res / 2;
   const int out_xsize = in.xsize() / res;
   ImageF out(in.ysize(), out_xsize);
   const int r = kernel.size() / 2;
-  std::vector<float> row_tmp(in.xsize() + 2 * r);
-  float* const PIK_RESTRICT rowp = &row_tmp[r];
+  std::vector<std::vector<float>> row_tmp(
+      std::max<size_t>(NumThreads(pool), 1),
+      std::vector<float>(in.xsize() + 2 * r));
   const float* const kernelp = &kernel[r];
-  for (int y = 0; y < in.ysize(); ++y) {
+  const auto convolve_row = [&](const int y, const int thread) {
+    float* const PIK_RESTRICT rowp = &row_tmp[thread][r];
     ExtrapolateBorders(in.Row(y), rowp, in.xsize(), r);
     for (int x = offset, ox = 0; x < in.xsize(); x += res, ++ox) {
       float sum = 0.0f;
@@ -50,7 +52,8 @@ ImageF ConvolveXSampleAndTranspose(const ImageF& in,
       }
       out.Row(ox)[y] = sum;
     }
-  }
+  };
+  RunOnPool(pool, 0, in.ysize(), convolve_row, "ConvolveXSampleAndTranspose");
   return out;
 }
 
@@ -63,14 +66,15 @@ Image3F ConvolveXSampleAndTranspose(const Image3F& in,
 }
 
 ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel_x,
-                         const std::vector<float>& kernel_y, const size_t res) {
-  ImageF tmp = ConvolveXSampleAndTranspose(in, kernel_x, res);
-  return ConvolveXSampleAndTranspose(tmp, kernel_y, res);
+                         const std::vector<float>& kernel_y, const size_t res,
+                         ThreadPool* pool) {
+  ImageF tmp = ConvolveXSampleAndTranspose(in, kernel_x, res, pool);
+  return ConvolveXSampleAndTranspose(tmp, kernel_y, res, pool);
 }
 
 ImageF Convolve(const ImageF& in, const std::vector<float>& kernel_x,
-                const std::vector<float>& kernel_y) {
-  return ConvolveAndSample(in, kernel_x, kernel_y, 1);
+                const std::vector<float>& kernel_y, ThreadPool* pool) {
+  return ConvolveAndSample(in, kernel_x, kernel_y, 1, pool);
 }
 
 Image3F Convolve(const Image3F& in, const std::vector<float>& kernel_x,
@@ -81,12 +85,13 @@ Image3F Convolve(const Image3F& in, const std::vector<float>& kernel_x,
 }
 
 ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel,
-                         const size_t res) {
-  return ConvolveAndSample(in, kernel, kernel, res);
+                         const size_t res, ThreadPool* pool) {
+  return ConvolveAndSample(in, kernel, kernel, res, pool);
 }
 
-ImageF Convolve(const ImageF& in, const std::vector<float>& kernel) {
-  return ConvolveAndSample(in, kernel, 1);
+ImageF Convolve(const ImageF& in, const std::vector<float>& kernel,
+                ThreadPool* pool) {
+  return ConvolveAndSample(in, kernel, 1, pool);
 }
 
 Image3F Convolve(const Image3F& in, const std::vector<float>& kernel) {
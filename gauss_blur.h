@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <vector>
 
+#include "data_parallel.h"
 #include "image.h"
 
 namespace pik {
@@ -38,28 +39,35 @@ std::vector<T> GaussianKernel(int radius, T sigma) {
 //     mirrored input: [aR ... a1 | a0 a1 a2 .... aN | aN-1 ... aN-R]
 //
 // where R is the radius of the kernel (i.e. kernel size is 2*R+1).
+//
+// The single-plane versions process rows in parallel if "pool" is non-null;
+// the result does not depend on the number of threads.
 
 // TODO(janwas): Deprecated, use ConvolveT instead (if |kernel| <= 5).
-ImageF Convolve(const ImageF& in, const std::vector<float>& kernel);
+ImageF Convolve(const ImageF& in, const std::vector<float>& kernel,
+                ThreadPool* pool = nullptr);
 Image3F Convolve(const Image3F& in, const std::vector<float>& kernel);
 
 // TODO(janwas): Deprecated, use ConvolveT instead (if |kernel| <= 5).
 ImageF Convolve(const ImageF& in, const std::vector<float>& kernel_x,
-                const std::vector<float>& kernel_y);
+                const std::vector<float>& kernel_y,
+                ThreadPool* pool = nullptr);
 Image3F Convolve(const Image3F& in, const std::vector<float>& kernel_x,
                  const std::vector<float>& kernel_y);
 
 // TODO(janwas): Use ConvolveT instead (if |kernel| <= 5 and res == 1).
 // REQUIRES: in.xsize() and in.ysize() are integer multiples of res.
 ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel,
-                         const size_t res);
+                         const size_t res, ThreadPool* pool = nullptr);
 ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel_x,
-                         const std::vector<float>& kernel_y, const size_t res);
+                         const std::vector<float>& kernel_y, const size_t res,
+                         ThreadPool* pool = nullptr);
 
 // TODO(janwas): Use ConvolveT instead (if |kernel| <= 5 and res == 1).
 ImageF ConvolveXSampleAndTranspose(const ImageF& in,
                                    const std::vector<float>& kernel,
-                                   const size_t res);
+                                   const size_t res,
+                                   ThreadPool* pool = nullptr);
 Image3F ConvolveXSampleAndTranspose(const Image3F& in,
                                     const std::vector<float>& kernel,
                                     const size_t res);
@@ -11,6 +11,7 @@
 #include "image.h"
 #include "opsin_params.h"
 #include "padded_bytes.h"
+#include "write_bits.h"
 
 namespace pik {
 namespace {
@@ -465,12 +466,8 @@ void SerializeGradientMap(const GradientMap& gradient, const Rect& rect,
   Image3S quantized = Quantize(gradient, map_rect, quantizer);
   Image3S residuals(map_rect.xsize(), map_rect.ysize());
   ShrinkDC(map_rect, quantized, &residuals);
-  std::string encoded = EncodeImageData(Rect(residuals), residuals, nullptr);
-  size_t pos = compressed->size();
-  compressed->resize(compressed->size() + encoded.size());
-  for (size_t i = 0; i < encoded.size(); i++) {
-    compressed->data()[pos++] = encoded[i];
-  }
+  BitWriter writer(compressed);
+  EncodeImageData(Rect(residuals), residuals, &writer, nullptr);
 }
 
 Status DeserializeGradientMap(size_t xsize_dc, size_t ysize_dc, bool grayscale,
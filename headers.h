@@ -122,6 +122,9 @@ struct GroupHeader {
 
     visitor->BeginExtensions(&extensions);
     // Extensions: in chronological order of being added to the format.
+    if (visitor->Conditional(extensions & 1)) {
+      visitor->U32(kU32Direct0To3, 0, &preset_entropy_codes);
+    }
     return visitor->EndExtensions();
   }
 
@@ -133,6 +136,10 @@ struct GroupHeader {
   TileHeader tile_headers[kNumTilesPerGroup];
 
   uint64_t extensions;
+
+  // Extension bit 0: 1-based index of the preset entropy codes (see
+  // entropy_presets.h) used instead of codes stored in the group, or 0.
+  uint32_t preset_entropy_codes;
 };
 
 //------------------------------------------------------------------------------
@@ -241,6 +248,18 @@ struct PassHeader {
 
     visitor->BeginExtensions(&extensions);
     // Extensions: in chronological order of being added to the format.
+    if (visitor->Conditional(extensions & 1)) {
+      visitor->U32(kU32Direct1248, 1, &num_ans_states);
+    }
+    if (visitor->Conditional(extensions & 2)) {
+      visitor->Bool(false, &shared_entropy_codes);
+    }
+    if (visitor->Conditional(extensions & 4)) {
+      visitor->Bool(false, &use_prefix_codes);
+    }
+    if (visitor->Conditional(extensions & 8)) {
+      visitor->Bool(false, &gray_from_y);
+    }
     return visitor->EndExtensions();
   }
 
@@ -280,6 +299,26 @@ struct PassHeader {
   // TODO(janwas): quantization setup (reuse from previous passes)
 
   uint64_t extensions;
+
+  // Extension bit 0: number of interleaved rANS states (1, 2 or 4) used for
+  // the AC tokens of each group. Only meaningful for kPasses.
+  uint32_t num_ans_states;
+
+  // Extension bit 1: whether all groups use the same coefficient order and
+  // AC histograms, which are stored once after the DC groups. Only meaningful
+  // for kPasses.
+  bool shared_entropy_codes;
+
+  // Extension bit 2: whether the DC and AC token streams use prefix (Huffman)
+  // codes instead of ANS; larger, but faster to decode. num_ans_states is then
+  // ignored. Only meaningful for kPasses.
+  bool use_prefix_codes;
+
+  // Extension bit 3: whether the decoder only dequantizes and inverse-
+  // transforms the Y plane of a kGrayscaleOpt pass and derives X and B from Y
+  // (their AC is still stored, but ignored), and then post-processes only Y.
+  // Only set for the last pass; see CanFinalizeGray.
+  bool gray_from_y;
 };
 
 //------------------------------------------------------------------------------
@@ -247,7 +247,8 @@ int ReadHuffmanCodeLengths(const uint8_t* code_length_code_lengths,
   return 1;
 }
 
-bool HuffmanDecodingData::ReadFromBitStream(BitReader* input) {
+bool HuffmanDecodingData::ReadFromBitStream(BitReader* input,
+                                            size_t max_alphabet_size) {
   int ok = 1;
   int simple_code_or_skip;
 
@@ -324,6 +325,9 @@ bool HuffmanDecodingData::ReadFromBitStream(BitReader* input) {
   if (!ok) {
     return PIK_FAILURE("Failed to read Huffman data");
   }
+  if (code_lengths.size() > max_alphabet_size) {
+    return PIK_FAILURE("Huffman alphabet too large");
+  }
   uint16_t counts[16] = {0};
   for (int i = 0; i < code_lengths.size(); ++i) {
     ++counts[code_lengths[i]];
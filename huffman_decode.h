@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "bit_reader.h"
+#include "compiler_specific.h"
 
 namespace pik {
 
@@ -33,8 +34,9 @@ struct HuffmanDecodingData {
 
   // Decodes the Huffman code lengths from the bit-stream and fills in the
   // pre-allocated table with the corresponding 2-level Huffman decoding table.
-  // Returns false if the Huffman code lengths can not de decoded.
-  bool ReadFromBitStream(BitReader* input);
+  // Returns false if the Huffman code lengths can not de decoded or there are
+  // more than "max_alphabet_size" of them.
+  bool ReadFromBitStream(BitReader* input, size_t max_alphabet_size = 1 << 16);
 
   std::vector<HuffmanCode> table_;
 };
@@ -57,6 +59,34 @@ struct HuffmanDecoder {
   }
 };
 
+// Decodes token streams written with HuffmanEncodingData. Same interface as
+// ANSSymbolReaderT, so that the token decoders can use either; callers also
+// call FillBitBuffer before each ReadSymbol.
+class HuffmanSymbolReader {
+ public:
+  explicit HuffmanSymbolReader(const std::vector<HuffmanDecodingData>* codes)
+      : codes_(codes->data()) {}
+
+  PIK_INLINE int ReadSymbol(const int histo_idx, BitReader* PIK_RESTRICT br) {
+    const HuffmanCode* table = codes_[histo_idx].table_.data();
+    table += br->PeekFixedBits<kHuffmanTableBits>();
+    const int nbits = table->bits - kHuffmanTableBits;
+    if (PIK_UNLIKELY(nbits > 0)) {
+      br->Advance(kHuffmanTableBits);
+      table += table->value;
+      table += br->PeekBits(nbits);
+    }
+    br->Advance(table->bits);
+    return table->value;
+  }
+
+  // Prefix codes have no final state to verify.
+  bool CheckANSFinalState() const { return true; }
+
+ private:
+  const HuffmanDecodingData* codes_;
+};
+
 }  // namespace pik
 
 #endif  // HUFFMAN_DECODE_H_
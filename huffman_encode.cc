@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <limits>
 #include <memory>
 #include <vector>
@@ -549,10 +550,25 @@ void BuildAndVisitHuffmanTree(const uint32_t* histogram, const size_t length,
 void BuildAndStoreHuffmanTree(const uint32_t* histogram, const size_t length,
                               uint8_t* depth, uint16_t* bits,
                               size_t* storage_ix, uint8_t* storage) {
-  BitWriter bit_writer(storage_ix, storage);
+  WriteBitsVisitor bit_writer(storage_ix, storage);
   BuildAndVisitHuffmanTree(histogram, length, depth, bits, &bit_writer);
 }
 
+void HuffmanEncodingData::BuildAndStore(const uint32_t* histogram,
+                                        size_t histo_size, size_t* storage_ix,
+                                        uint8_t* storage) {
+  PIK_ASSERT(histo_size <= 256);
+  memset(depth, 0, sizeof(depth));
+  memset(bits, 0, sizeof(bits));
+  if (storage_ix == nullptr || storage == nullptr) {
+    BitCounter bit_counter;
+    BuildAndVisitHuffmanTree(histogram, histo_size, depth, bits, &bit_counter);
+  } else {
+    BuildAndStoreHuffmanTree(histogram, histo_size, depth, bits, storage_ix,
+                             storage);
+  }
+}
+
 void BuildHuffmanTreeAndCountBits(const uint32_t* histogram,
                                   const size_t length, size_t* histogram_bits,
                                   size_t* data_bits) {
@@ -19,6 +19,17 @@ void BuildAndStoreHuffmanTree(const uint32_t* histogram, const size_t length,
 void BuildHuffmanTreeAndCountBits(const uint32_t* histogram,
                                   const size_t length, size_t* histogram_bits,
                                   size_t* data_bits);
+
+// Prefix code of one histogram of up to 256 symbols; the counterpart of
+// ANSEncodingData for token streams decoded with HuffmanSymbolReader.
+struct HuffmanEncodingData {
+  void BuildAndStore(const uint32_t* histogram, size_t histo_size,
+                     size_t* storage_ix, uint8_t* storage);
+
+  // Codes of symbols that do not occur (or of the only one) have zero length.
+  uint8_t depth[256];
+  uint16_t bits[256];
+};
 }  // namespace pik
 
 #endif  // HUFFMAN_ENCODE_H_
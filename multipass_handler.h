@@ -13,6 +13,7 @@
 #include "common.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
+#include "dct_util.h"
 #include "headers.h"
 #include "image.h"
 #include "noise.h"
@@ -89,6 +90,9 @@ class MultipassManager {
   // This version is only called if we decoded a lossless pass.
   virtual void SetDecodedPass(CodecInOut* io) = 0;
 
+  // Returns the number of passes stored by SetDecodedPass so far.
+  virtual size_t NumDecodedPasses() const = 0;
+
   // Used *on the encoder only* to forcibly enable adaptive reconstruction in
   // GetQuantizer.
   virtual void UseAdaptiveReconstruction() {}
@@ -100,7 +104,7 @@ class MultipassManager {
                                             const Rect& group_rect) = 0;
 
   // Methods to retrieve color correlation, ac strategy and quantizer.
-  virtual void GetColorCorrelationMap(const Image3F& opsin,
+  virtual void GetColorCorrelationMap(const Image3F& opsin, ThreadPool* pool,
                                       ColorCorrelationMap* cmap) = 0;
 
   virtual void GetAcStrategy(float butteraugli_target,
@@ -122,6 +126,29 @@ class MultipassManager {
 
   // Remove DC information from the image. Runs per-pass.
   virtual void StripDCInfo(PassEncCache* cache) {}
+
+  // Used *on the encoder only*: computes the TransposedScaledDCT of the input
+  // of the current pass (after DecorrelateOpsin) once, for the heuristics and
+  // InitializePassEncCache to share.
+  void ComputeOpsinDCT(const Image3F& opsin, ThreadPool* pool) {
+    const size_t xsize = opsin.xsize() * kBlockDim;
+    const size_t ysize = opsin.ysize() / kBlockDim;
+    if (opsin_dct_.xsize() != xsize || opsin_dct_.ysize() != ysize) {
+      opsin_dct_ = Image3F(xsize, ysize);
+    }
+    TransposedScaledDCT(opsin, pool, &opsin_dct_);
+  }
+
+  // Returns the coefficients computed by the last ComputeOpsinDCT, which must
+  // have been called with "opsin" (checked via the size).
+  const Image3F& OpsinDCT(const Image3F& opsin) const {
+    PIK_CHECK(opsin_dct_.xsize() == opsin.xsize() * kBlockDim &&
+              opsin_dct_.ysize() == opsin.ysize() / kBlockDim);
+    return opsin_dct_;
+  }
+
+ private:
+  Image3F opsin_dct_;
 };
 
 }  // namespace pik
@@ -503,27 +503,21 @@ void DecodeFloatParam(float precision, float* val, BitReader* br) {
   *val = sign * absval_quant / precision;
 }
 
-std::string EncodeNoise(const NoiseParams& noise_params) {
+void EncodeNoise(const NoiseParams& noise_params, BitWriter* writer) {
   const size_t kMaxNoiseSize = 16;
-  std::string output(kMaxNoiseSize, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  writer->Reserve(kMaxNoiseSize * kBitsPerByte);
+  size_t* storage_ix = writer->pos();
+  uint8_t* storage = writer->storage();
   const bool have_noise =
       (noise_params.alpha != 0.0f || noise_params.gamma != 0.0f ||
        noise_params.beta != 0.0f);
-  WriteBits(1, have_noise, &storage_ix, storage);
+  WriteBits(1, have_noise, storage_ix, storage);
   if (have_noise) {
-    EncodeFloatParam(noise_params.alpha, kNoisePrecision, &storage_ix, storage);
-    EncodeFloatParam(noise_params.gamma, kNoisePrecision, &storage_ix, storage);
-    EncodeFloatParam(noise_params.beta, kNoisePrecision, &storage_ix, storage);
+    EncodeFloatParam(noise_params.alpha, kNoisePrecision, storage_ix, storage);
+    EncodeFloatParam(noise_params.gamma, kNoisePrecision, storage_ix, storage);
+    EncodeFloatParam(noise_params.beta, kNoisePrecision, storage_ix, storage);
   }
-  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
-  WriteBits(jump_bits, 0, &storage_ix, storage);
-  PIK_ASSERT(storage_ix % 8 == 0);
-  size_t output_size = storage_ix >> 3;
-  output.resize(output_size);
-  return output;
+  writer->ZeroPadToByte();
 }
 
 bool DecodeNoise(BitReader* br, NoiseParams* noise_params) {
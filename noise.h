@@ -11,6 +11,7 @@
 
 #include "bit_reader.h"
 #include "image.h"
+#include "write_bits.h"
 
 namespace pik {
 
@@ -35,7 +36,8 @@ void AddNoise(const NoiseParams& noise_params, Image3F* opsin);
 void GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
                        float quality_coef);
 
-std::string EncodeNoise(const NoiseParams& noise_params);
+// Writes "noise_params" and zero-pads to a byte boundary.
+void EncodeNoise(const NoiseParams& noise_params, BitWriter* writer);
 
 bool DecodeNoise(BitReader* br, NoiseParams* noise_params);
 
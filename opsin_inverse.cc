@@ -170,4 +170,37 @@ SIMD_ATTR void OpsinToLinear(const Image3F& opsin, const Rect& rect_out,
   }
 }
 
+TFNode* AddOpsinToLinear(TFNode* xyb, TFBuilder* builder) {
+  PIK_CHECK(OutType(xyb) == TFType::kF32);
+  return builder->AddClosure(
+      "opsin_to_linear", Borders(), Scale(), {xyb}, 3, TFType::kF32,
+      [](const ConstImageViewF* in, const OutputRegion& output_region,
+         const MutableImageViewF* PIK_RESTRICT out) SIMD_ATTR {
+        const SIMD_FULL(float) d;
+        for (size_t y = 0; y < output_region.ysize; ++y) {
+          // Inputs may be unaligned views into the source image.
+          const float* PIK_RESTRICT row_opsin_x = in[0].ConstRow(y);
+          const float* PIK_RESTRICT row_opsin_y = in[1].ConstRow(y);
+          const float* PIK_RESTRICT row_opsin_b = in[2].ConstRow(y);
+          float* PIK_RESTRICT row_linear_r = out[0].Row(y);
+          float* PIK_RESTRICT row_linear_g = out[1].Row(y);
+          float* PIK_RESTRICT row_linear_b = out[2].Row(y);
+
+          for (size_t x = 0; x < output_region.xsize; x += d.N) {
+            const auto in_opsin_x = load_unaligned(d, row_opsin_x + x);
+            const auto in_opsin_y = load_unaligned(d, row_opsin_y + x);
+            const auto in_opsin_b = load_unaligned(d, row_opsin_b + x);
+            PIK_COMPILER_FENCE;
+            SIMD_FULL(float)::V linear_r, linear_g, linear_b;
+            XybToRgb(d, in_opsin_x, in_opsin_y, in_opsin_b, inverse_matrix,
+                     &linear_r, &linear_g, &linear_b);
+
+            store(linear_r, d, row_linear_r + x);
+            store(linear_g, d, row_linear_g + x);
+            store(linear_b, d, row_linear_b + x);
+          }
+        }
+      });
+}
+
 }  // namespace pik
@@ -12,6 +12,7 @@
 #include "data_parallel.h"
 #include "image.h"
 #include "simd/simd.h"
+#include "tile_flow.h"
 
 namespace pik {
 
@@ -25,6 +26,10 @@ SIMD_ATTR void OpsinToLinear(const Image3F& opsin, ThreadPool* pool,
 SIMD_ATTR void OpsinToLinear(const Image3F& opsin, const Rect& rect_out,
                              Image3F* PIK_RESTRICT linear);
 
+// Adds a node to "builder" that converts the three planes of "xyb" to linear
+// sRGB. Same result as OpsinToLinear, but runs per tile within a TFGraph.
+TFNode* AddOpsinToLinear(TFNode* xyb, TFBuilder* builder);
+
 }  // namespace pik
 
 #endif  // OPSIN_INVERSE_H_
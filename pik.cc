@@ -6,14 +6,19 @@
 
 #include "pik.h"
 
+#include <string.h>
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
 #undef PROFILER_ENABLED
 #define PROFILER_ENABLED 1
 #include "adaptive_quantization.h"
+#include "byte_order.h"
 #include "common.h"
 #include "compressed_image.h"
+#include "external_image.h"
 #include "headers.h"
 #include "image.h"
 #include "multipass_handler.h"
@@ -29,12 +34,29 @@
 
 namespace pik {
 
-Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
+// Proposes a distance to try for a given bpp target. This could depend
+// on the entropy in the image, too, but let's start with something.
+static double ApproximateDistanceForBPP(double bpp) {
+  return 1.704 * pow(bpp, -0.804);
+}
+
+Status PixelsToPik(const CompressParams& params, const CodecInOut* io,
                    PaddedBytes* compressed, PikInfo* aux_out,
                    ThreadPool* pool) {
   if (io->xsize() == 0 || io->ysize() == 0) {
     return PIK_FAILURE("Empty image");
   }
+  // With a target size, all passes and their flags start from the distance
+  // that usually reaches it; the last pass then scales its quantization to
+  // the target (see PixelsToPikPass).
+  CompressParams cparams = params;
+  const size_t target_size = params.TargetSize(Rect(io->color()));
+  if (target_size != 0) {
+    const double bpp = static_cast<double>(target_size * kBitsPerByte) /
+                       (io->xsize() * io->ysize());
+    cparams.butteraugli_distance =
+        std::min(std::max(ApproximateDistanceForBPP(bpp), 0.01), 16.0);
+  }
   if (!io->HasOriginalBitsPerSample()) {
     return PIK_FAILURE(
         "Pik requires specifying original bit depth "
@@ -42,10 +64,13 @@ Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
   }
   FileHeader container;
   MakeFileHeader(cparams, io, &container);
+  PaddedBytes preview;
+  PIK_RETURN_IF_ERROR(EncodePreview(cparams, io, pool, &container, &preview));
 
   if (!cparams.lossless_base.empty()) {
     SingleImageManager transform;
-    PikMultipassEncoder encoder(container, compressed, &transform, aux_out);
+    PikMultipassEncoder encoder(container, compressed, &transform, aux_out,
+                                &preview);
     CompressParams p = cparams;
 
     if (ApplyOverride(cparams.adaptive_reconstruction,
@@ -72,13 +97,9 @@ Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
   }
 
   if (!cparams.progressive_mode) {
-    size_t extension_bits, total_bits;
-    PIK_CHECK(CanEncode(container, &extension_bits, &total_bits));
-
-    compressed->resize(DivCeil(total_bits, kBitsPerByte));
     size_t pos = 0;
     PIK_RETURN_IF_ERROR(
-        WriteFileHeader(container, extension_bits, &pos, compressed->data()));
+        WriteFileHeaderAndPreview(&container, preview, &pos, compressed));
     PassParams pass_params;
     pass_params.is_last = true;
     SingleImageManager transform;
@@ -87,7 +108,8 @@ Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
   } else {
     bool lossless = cparams.lossless_mode;
     SingleImageManager transform;
-    PikMultipassEncoder encoder(container, compressed, &transform, aux_out);
+    PikMultipassEncoder encoder(container, compressed, &transform, aux_out,
+                                &preview);
     CompressParams p = cparams;
     PassParams pass_params;
     p.lossless_mode = false;
@@ -182,4 +204,325 @@ Status PikToPixels(const DecompressParams& dparams,
   return true;
 }
 
+Status PikPreviewToPixels(const DecompressParams& dparams,
+                          const PaddedBytes& compressed, CodecInOut* io,
+                          PikInfo* aux_out, ThreadPool* pool) {
+  PROFILER_ZONE("PikPreviewToPixels uninstrumented");
+  BitReader reader(compressed.data(), compressed.size());
+  FileHeader container;
+  PIK_RETURN_IF_ERROR(ReadFileHeader(&reader, &container));
+  const Preview& preview = container.preview;
+  if (preview.size_bits == 0 || preview.xsize == 0 || preview.ysize == 0) {
+    return PIK_FAILURE("No preview");
+  }
+  const size_t preview_end = reader.BitsRead() + preview.size_bits;
+
+  // The preview is a single pass with the same metadata as the main image.
+  FileHeader preview_container = container;
+  preview_container.xsize_minus_1 = preview.xsize - 1;
+  preview_container.ysize_minus_1 = preview.ysize - 1;
+
+  PIK_RETURN_IF_ERROR(reader.JumpToByteBoundary());
+  SingleImageManager transform;
+  PIK_RETURN_IF_ERROR(PikPassToPixels(dparams, compressed, preview_container,
+                                      pool, &reader, io, aux_out, &transform));
+  if (!transform.IsLastPass()) {
+    return PIK_FAILURE("Preview must consist of a single pass");
+  }
+  if (reader.BitsRead() > preview_end) {
+    return PIK_FAILURE("Preview extends past its size_bits");
+  }
+
+  io->enc_size = DivCeil(preview_end, kBitsPerByte);
+  return true;
+}
+
+size_t BytesPerPixel(const PixelFormat format) {
+  switch (format) {
+    case PixelFormat::kRGB8:
+      return 3;
+    case PixelFormat::kRGBA8:
+      return 4;
+    case PixelFormat::kRGB16:
+      return 6;
+    case PixelFormat::kRGBA16:
+      return 8;
+    case PixelFormat::kRGBF:
+      return 12;
+  }
+  return 0;
+}
+
+Status PikOutputSize(const DecompressParams& params,
+                     const PaddedBytes& compressed, size_t* xsize,
+                     size_t* ysize) {
+  BitReader reader(compressed.data(), compressed.size());
+  FileHeader container;
+  PIK_RETURN_IF_ERROR(ReadFileHeader(&reader, &container));
+  if (params.downsample == 0) return PIK_FAILURE("Invalid downsample");
+
+  Rect crop(0, 0, container.xsize(), container.ysize());
+  if (params.crop.xsize() != 0 && params.crop.ysize() != 0) {
+    if (params.crop.x0() >= crop.xsize() || params.crop.y0() >= crop.ysize()) {
+      return PIK_FAILURE("Crop is outside of the image");
+    }
+    crop = Rect(params.crop.x0(), params.crop.y0(), params.crop.xsize(),
+                params.crop.ysize(), crop.xsize(), crop.ysize());
+  }
+  // Same rounding as PikPassDecoder::Finish.
+  const size_t downsample = params.downsample;
+  *xsize =
+      DivCeil(crop.x0() + crop.xsize(), downsample) - crop.x0() / downsample;
+  *ysize =
+      DivCeil(crop.y0() + crop.ysize(), downsample) - crop.y0() / downsample;
+  return true;
+}
+
+// Returns whether the first pass of "compressed" is also the last, i.e.
+// whether DecompressParams::row_callback can decode it.
+static Status IsSinglePass(const PaddedBytes& compressed, bool* single_pass) {
+  BitReader reader(compressed.data(), compressed.size());
+  FileHeader container;
+  PIK_RETURN_IF_ERROR(ReadFileHeader(&reader, &container));
+  // Same as PikToPixels.
+  reader.SkipBits(container.preview.size_bits);
+  PassHeader header;
+  PIK_RETURN_IF_ERROR(ReadPassHeader(&reader, &header));
+  if (!reader.Healthy()) return PIK_FAILURE("Pass header extends after end");
+  *single_pass = header.is_last;
+  return true;
+}
+
+// Converts "io" to "c_desired" and quantizes it into the rows of "buffer"
+// starting at "y0". "io" is either the whole image or a stripe of rows from
+// DecompressParams::row_callback; it may be modified.
+static Status CopyToBuffer(CodecInOut* io, const size_t y0,
+                           const ColorEncoding& c_desired,
+                           const PixelBuffer& buffer,
+                           CodecContext* codec_context, ThreadPool* pool) {
+  if (io->xsize() != buffer.xsize || y0 + io->ysize() > buffer.ysize) {
+    return PIK_FAILURE("PixelBuffer size mismatch");
+  }
+
+  // Grayscale images have identical planes; reinterpreting them as linear RGB
+  // avoids a separate gray to RGB expansion.
+  ColorEncoding c_current = io->c_current();
+  if (io->IsGray()) {
+    if (!IsLinear(c_current.transfer_function)) {
+      PIK_RETURN_IF_ERROR(
+          io->TransformTo(codec_context->c_linear_srgb[1], pool));
+    }
+    c_current = codec_context->c_linear_srgb[0];
+  }
+
+  const bool has_alpha = buffer.format == PixelFormat::kRGBA8 ||
+                         buffer.format == PixelFormat::kRGBA16;
+  const size_t bits_per_sample =
+      buffer.format == PixelFormat::kRGBF
+          ? 32
+          : (buffer.format == PixelFormat::kRGB16 ||
+             buffer.format == PixelFormat::kRGBA16)
+                ? 16
+                : 8;
+
+  // ExternalImage copies alpha samples verbatim, so match their bit depth.
+  const ImageU* alpha = nullptr;
+  ImageU rescaled_alpha;
+  if (has_alpha && io->HasAlpha()) {
+    alpha = &io->alpha();
+    if (io->AlphaBits() != bits_per_sample) {
+      const uint32_t max_from = (1u << io->AlphaBits()) - 1;
+      const uint32_t max_to = (1u << bits_per_sample) - 1;
+      rescaled_alpha = ImageU(io->xsize(), io->ysize());
+      for (size_t y = 0; y < io->ysize(); ++y) {
+        const uint16_t* PIK_RESTRICT row_from = io->alpha().ConstRow(y);
+        uint16_t* PIK_RESTRICT row_to = rescaled_alpha.Row(y);
+        for (size_t x = 0; x < io->xsize(); ++x) {
+          row_to[x] = (row_from[x] * max_to + max_from / 2) / max_from;
+        }
+      }
+      alpha = &rescaled_alpha;
+    }
+  }
+
+  const ExternalImage external(pool, io->color(), Rect(io->color()), c_current,
+                               c_desired, has_alpha, alpha, bits_per_sample,
+                               bits_per_sample, !IsLittleEndian(),
+                               buffer.pixels + y0 * buffer.stride,
+                               buffer.stride);
+  return external.IsHealthy();
+}
+
+Status PikToBuffer(const DecompressParams& params,
+                   const PaddedBytes& compressed,
+                   const ColorEncoding& c_desired, const PixelBuffer& buffer,
+                   CodecContext* codec_context, PikInfo* aux_out,
+                   ThreadPool* pool) {
+  PROFILER_FUNC;
+  if (c_desired.IsGray()) {
+    return PIK_FAILURE("PixelFormat requires an RGB color encoding");
+  }
+  if (params.row_callback) {
+    return PIK_FAILURE("PikToBuffer does not support row_callback");
+  }
+  if (buffer.pixels == nullptr ||
+      buffer.stride < buffer.xsize * BytesPerPixel(buffer.format)) {
+    return PIK_FAILURE("Invalid PixelBuffer");
+  }
+  size_t xsize, ysize;
+  PIK_RETURN_IF_ERROR(PikOutputSize(params, compressed, &xsize, &ysize));
+  if (xsize != buffer.xsize || ysize != buffer.ysize) {
+    return PIK_FAILURE("PixelBuffer size mismatch");
+  }
+
+  // Same conditions as DecompressParams::row_callback.
+  bool single_pass = false;
+  const bool no_crop = params.crop.xsize() == 0 || params.crop.ysize() == 0;
+  if (no_crop && params.downsample == 1) {
+    PIK_RETURN_IF_ERROR(IsSinglePass(compressed, &single_pass));
+  }
+
+  CodecInOut io(codec_context);
+  if (single_pass) {
+    DecompressParams row_params = params;
+    row_params.row_callback = [&](size_t y0, CodecInOut* rows) -> Status {
+      return CopyToBuffer(rows, y0, c_desired, buffer, codec_context, pool);
+    };
+    return PikToPixels(row_params, compressed, &io, aux_out, pool);
+  }
+
+  PIK_RETURN_IF_ERROR(PikToPixels(params, compressed, &io, aux_out, pool));
+  return CopyToBuffer(&io, 0, c_desired, buffer, codec_context, pool);
+}
+
+PikStreamingDecoder::PikStreamingDecoder(const DecompressParams& params,
+                                         CodecContext* codec_context,
+                                         PikInfo* aux_out, ThreadPool* pool)
+    : params_(params),
+      aux_out_(aux_out),
+      pool_(pool),
+      transform_(new SingleImageManager),
+      io_(codec_context) {}
+
+PikStreamingDecoder::~PikStreamingDecoder() {}
+
+Status PikStreamingDecoder::Feed(const uint8_t* data, size_t size) {
+  if (size == 0) return true;
+  if (IsDone() && params_.check_decompressed_size) {
+    return PIK_FAILURE("Pik compressed data size mismatch.");
+  }
+
+  // Exponential growth avoids quadratic copying for small chunks.
+  const size_t old_size = compressed_.size();
+  if (old_size + size > compressed_.capacity()) {
+    compressed_.reserve(std::max(old_size + size, 2 * compressed_.capacity()));
+  }
+  compressed_.resize(old_size + size);
+  if (compressed_.size() != old_size + size) {
+    return PIK_FAILURE("Failed to allocate bitstream buffer");
+  }
+  memcpy(compressed_.data() + old_size, data, size);
+
+  return Advance();
+}
+
+Status PikStreamingDecoder::Advance() {
+  PROFILER_FUNC;
+  // Header parsers return zeros past the end of the data, in which case they
+  // either fail or leave the reader !Healthy(); we then retry once more bytes
+  // have arrived. Retrying is idempotent because each stage only commits its
+  // results (bit_pos_, stage_) after a successful parse, and ReadTOC parses
+  // the gradient map, shared codes and TOC before it modifies DC.
+  const auto incomplete = [](bool ok, const BitReader& reader) {
+    return !ok || !reader.Healthy();
+  };
+
+  for (;;) {
+    // The buffer may have been reallocated, hence a new reader for each stage.
+    BitReader reader(compressed_.data(), compressed_.size());
+    reader.SkipBits(bit_pos_);
+
+    switch (stage_) {
+      case Stage::kFileHeader: {
+        bool ok = ReadFileHeader(&reader, &container_);
+        // Preview is discardable, i.e. content image does not rely on decoded
+        // preview pixels; just skip it, if any.
+        if (ok) reader.SkipBits(container_.preview.size_bits);
+        if (incomplete(ok, reader)) return true;
+        stage_ = Stage::kPassHeaders;
+        break;
+      }
+
+      case Stage::kPassHeaders: {
+        pass_.reset(new PikPassDecoder(params_, container_, pool_, &io_,
+                                       aux_out_, transform_.get()));
+        if (incomplete(pass_->ReadHeaders(&reader), reader)) return true;
+        next_group_ = 0;
+        stage_ = Stage::kDCGroups;
+        break;
+      }
+
+      case Stage::kDCGroups: {
+        // Decode the longest prefix of complete groups (in parallel).
+        size_t end = next_group_;
+        while (end < pass_->NumDCGroups() &&
+               pass_->DCGroupEnd(end) <= compressed_.size()) {
+          ++end;
+        }
+        PIK_RETURN_IF_ERROR(
+            pass_->DecodeDCGroups(compressed_, next_group_, end));
+        next_group_ = end;
+        if (next_group_ != pass_->NumDCGroups()) return true;
+        // bit_pos_ remains at the start of the DC groups, see ReadTOC.
+        stage_ = Stage::kTOC;
+        continue;
+      }
+
+      case Stage::kTOC: {
+        if (incomplete(pass_->ReadTOC(compressed_, &reader), reader)) {
+          return true;
+        }
+        next_group_ = 0;
+        stage_ = Stage::kGroups;
+        break;
+      }
+
+      case Stage::kGroups: {
+        size_t end = next_group_;
+        while (end < pass_->NumGroups() &&
+               pass_->GroupEnd(end) <= compressed_.size()) {
+          ++end;
+        }
+        PIK_RETURN_IF_ERROR(pass_->DecodeGroups(compressed_, next_group_, end));
+        next_group_ = end;
+        if (next_group_ != pass_->NumGroups()) return true;
+
+        PIK_RETURN_IF_ERROR(pass_->Finish());
+        bit_pos_ = pass_->GroupEnd(pass_->NumGroups() - 1) * kBitsPerByte;
+        pass_.reset();
+        stage_ = transform_->IsLastPass() ? Stage::kDone : Stage::kPassHeaders;
+        if (IsDone() && params_.check_decompressed_size &&
+            bit_pos_ != compressed_.size() * kBitsPerByte) {
+          return PIK_FAILURE("Pik compressed data size mismatch.");
+        }
+        continue;
+      }
+
+      case Stage::kDone:
+        return true;
+    }
+
+    bit_pos_ = reader.BitsRead();
+  }
+}
+
+Status PikStreamingDecoder::TakeOutput(CodecInOut* io) {
+  if (!IsDone()) {
+    return PIK_FAILURE("Pik bitstream is truncated or corrupted.");
+  }
+  io_.enc_size = compressed_.size();
+  *io = std::move(io_);
+  return true;
+}
+
 }  // namespace pik
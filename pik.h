@@ -9,8 +9,13 @@
 
 // Top-level interface for PIK encoding/decoding.
 
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
 #include "codec.h"
 #include "data_parallel.h"
+#include "headers.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
 #include "pik_params.h"
@@ -28,11 +33,126 @@ Status PixelsToPik(const CompressParams& params, const CodecInOut* io,
 // `io` appears 'identical' (modulo compression artifacts) to the encoder input
 // in a color-aware viewer. Note that `io`->dec_c_original identifies the color
 // space that was passed to the encoder; clients that need that encoding must
-// call `io`->TransformTo afterwards.
+// call `io`->TransformTo afterwards. For very large images, see
+// DecompressParams::row_callback.
 Status PikToPixels(const DecompressParams& params,
                    const PaddedBytes& compressed, CodecInOut* io,
                    PikInfo* aux_out = nullptr, ThreadPool* pool = nullptr);
 
+// Decodes only the preview image stored after the FileHeader (see
+// CompressParams::preview_size), which is much faster than decoding the main
+// image. "compressed" need only contain the header and preview. Fails if there
+// is no preview. "params" (e.g. crop) refer to the preview's dimensions.
+Status PikPreviewToPixels(const DecompressParams& params,
+                          const PaddedBytes& compressed, CodecInOut* io,
+                          PikInfo* aux_out = nullptr,
+                          ThreadPool* pool = nullptr);
+
+// Interleaved layouts for PikToBuffer. Integer samples are unsigned and in
+// native byte order; float samples are in [0, 255] (same as CodecInOut).
+enum class PixelFormat { kRGB8, kRGBA8, kRGB16, kRGBA16, kRGBF };
+
+// Returns the number of bytes per pixel (all channels) of "format".
+size_t BytesPerPixel(PixelFormat format);
+
+// Caller-allocated destination of PikToBuffer.
+struct PixelBuffer {
+  PixelFormat format;
+  // Must match the decoded size, i.e. after DecompressParams::crop and
+  // downsample (see PikOutputSize).
+  size_t xsize;
+  size_t ysize;
+  uint8_t* pixels;
+  // Bytes between the starts of consecutive rows, >= xsize * BytesPerPixel.
+  size_t stride;
+};
+
+// Returns the size of the image PikToPixels will produce for "compressed".
+// Only reads the file header.
+Status PikOutputSize(const DecompressParams& params,
+                     const PaddedBytes& compressed, size_t* xsize,
+                     size_t* ysize);
+
+// Same as PikToPixels followed by CodecInOut::CopyTo and interleaving, but
+// converts the decoded image to "c_desired" (which must not be grayscale) and
+// quantizes straight into "buffer" in a single multithreaded pass, without the
+// intermediate converted and quantized images. Single-pass images without
+// crop or downsampling are decoded with DecompressParams::row_callback, one
+// stripe of rows at a time, so no full-size image is allocated; this costs
+// some time for post-processing the stripe borders twice, and pixels may
+// differ slightly from PikToPixels (see row_callback). Otherwise, the image
+// is first decoded into a full-size linear Image3F. params.row_callback must
+// be empty. Grayscale images are expanded to RGB, and alpha is opaque if the
+// image has none.
+Status PikToBuffer(const DecompressParams& params,
+                   const PaddedBytes& compressed,
+                   const ColorEncoding& c_desired, const PixelBuffer& buffer,
+                   CodecContext* codec_context, PikInfo* aux_out = nullptr,
+                   ThreadPool* pool = nullptr);
+
+class PikPassDecoder;
+class SingleImageManager;
+
+// Push-style alternative to PikToPixels for bitstreams that arrive in chunks
+// (e.g. from the network). Headers and TOCs are parsed as soon as they are
+// complete, and each DC/AC group is decoded as soon as all of its bytes (as
+// given by the TOC) have arrived, which overlaps receiving and decoding.
+// Usage:
+//   PikStreamingDecoder decoder(dparams, &codec_context);
+//   while (receive(&chunk)) PIK_RETURN_IF_ERROR(decoder.Feed(chunk));
+//   PIK_RETURN_IF_ERROR(decoder.TakeOutput(&io));
+// The output is identical to that of PikToPixels.
+class PikStreamingDecoder {
+ public:
+  // "codec_context", "aux_out" and "pool" must outlive this instance.
+  PikStreamingDecoder(const DecompressParams& params,
+                      CodecContext* codec_context, PikInfo* aux_out = nullptr,
+                      ThreadPool* pool = nullptr);
+  ~PikStreamingDecoder();
+
+  PikStreamingDecoder(const PikStreamingDecoder&) = delete;
+  PikStreamingDecoder& operator=(const PikStreamingDecoder&) = delete;
+
+  // Appends the next "size" bytes of the bitstream and decodes everything that
+  // has become decodable. Fails if a group is corrupt. Headers that cannot be
+  // parsed are assumed to be incomplete (truncation and corruption are
+  // indistinguishable until the end of the stream), see TakeOutput.
+  Status Feed(const uint8_t* data, size_t size);
+  Status Feed(const PaddedBytes& bytes) {
+    return Feed(bytes.data(), bytes.size());
+  }
+
+  // Returns whether the last pass has been decoded.
+  bool IsDone() const { return stage_ == Stage::kDone; }
+
+  // Moves the decoded image to "io". Fails if the bitstream was truncated or
+  // invalid. See PikToPixels for the color space of "io".
+  Status TakeOutput(CodecInOut* io);
+
+ private:
+  enum class Stage { kFileHeader, kPassHeaders, kDCGroups, kTOC, kGroups,
+                     kDone };
+
+  // Runs as many stages as the available bytes allow.
+  Status Advance();
+
+  const DecompressParams params_;
+  PikInfo* aux_out_;
+  ThreadPool* pool_;
+
+  PaddedBytes compressed_;
+  Stage stage_ = Stage::kFileHeader;
+  // Start of the next stage's data.
+  size_t bit_pos_ = 0;
+  // First DC/AC group of the current pass not yet decoded.
+  size_t next_group_ = 0;
+
+  FileHeader container_;
+  std::unique_ptr<SingleImageManager> transform_;
+  std::unique_ptr<PikPassDecoder> pass_;
+  CodecInOut io_;
+};
+
 }  // namespace pik
 
 #endif  // PIK_H_
@@ -60,8 +60,13 @@ enum {
 static const char* kImageLayers[kNumImageLayers] = {"header", "quant", "order",
                                                     "cmap",   "DC",    "AC"};
 
+struct TokenHistograms;  // entropy_coder.h
+
 struct TestingAux {
   Image3F* ac_prediction = nullptr;
+  // If not null, the encoder adds the tokens of each group, in the natural
+  // coefficient order, for training the preset entropy codes. Not thread-safe.
+  TokenHistograms* natural_order_histograms = nullptr;
 };
 
 // Metadata and statistics gathered during compression or decompression.
@@ -20,10 +20,12 @@ namespace pik {
 PikMultipassEncoder::PikMultipassEncoder(const FileHeader& container,
                                          PaddedBytes* output,
                                          MultipassManager* manager,
-                                         PikInfo* info)
+                                         PikInfo* info,
+                                         const PaddedBytes* preview)
     : output_(output),
       info_(info),
       container_(container),
+      preview_(preview),
       multipass_manager_(manager) {}
 
 void PikMultipassEncoder::ExtendOutput(size_t bits) {
@@ -41,12 +43,10 @@ Status PikMultipassEncoder::AddPass(const CompressParams& params,
 
   // On the first pass, write out the container.
   if (num_passes_ == 0) {
-    size_t extension_bits, total_bits;
-    PIK_CHECK(CanEncode(container_, &extension_bits, &total_bits));
-
-    output_->resize(DivCeil(total_bits, kBitsPerByte));
-    PIK_RETURN_IF_ERROR(
-        WriteFileHeader(container_, extension_bits, &pos_, output_->data()));
+    const PaddedBytes no_preview;
+    PIK_RETURN_IF_ERROR(WriteFileHeaderAndPreview(
+        &container_, preview_ != nullptr ? *preview_ : no_preview, &pos_,
+        output_));
   }
 
   // Check that all the frames have the same shape and depth.
@@ -21,8 +21,11 @@
 namespace pik {
 class PikMultipassEncoder {
  public:
+  // "preview" (see EncodePreview) is written after the container; if non-null,
+  // it must outlive this instance.
   PikMultipassEncoder(const FileHeader& container, PaddedBytes* output,
-                      MultipassManager* manager, PikInfo* info = nullptr);
+                      MultipassManager* manager, PikInfo* info = nullptr,
+                      const PaddedBytes* preview = nullptr);
 
   // On the first call, creates the output container and adds the first pass to
   // it. On subsequent calls, just appends the pass. We build the container
@@ -42,6 +45,7 @@ class PikMultipassEncoder {
   PaddedBytes* output_;
   PikInfo* info_;
   FileHeader container_;
+  const PaddedBytes* preview_;  // not owned, may be null
   size_t bits_ = 0;
   size_t pos_ = 0;
   size_t num_passes_ = 0;
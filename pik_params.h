@@ -11,13 +11,18 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <string>
 
 #include "epf.h"
 #include "gaborish.h"
+#include "image.h"
+#include "status.h"
 
 namespace pik {
 
+class CodecInOut;
+
 // Reasonable default for sRGB, matches common monitors. Butteraugli was tuned
 // for this, we scale darker/brighter inputs accordingly.
 static constexpr int kDefaultIntensityTarget = 250;
@@ -33,6 +38,16 @@ static inline bool ApplyOverride(Override o, bool condition) {
   return condition;
 }
 
+// Algorithm for clustering the per-context histograms of each group.
+enum class HistogramClustering {
+  // Greedy pairwise merging over all histograms (ClusterHistograms).
+  kBest,
+  // Farthest-point seeding, then merging only the seeds' clusters
+  // (FastClusterHistograms). About 2-3x faster; output size is within 0.1% of
+  // kBest (either way), so this trades exactness for speed.
+  kFast
+};
+
 struct CompressParams {
   // Only used for benchmarking (comparing vs libjpeg)
   int jpeg_quality = 100;
@@ -40,6 +55,13 @@ struct CompressParams {
   bool clear_metadata = false;
 
   float butteraugli_distance = 1.0f;
+  // If either is nonzero, the encoder ignores butteraugli_distance and instead
+  // scales the quantization, aiming for a file of at most, and within a few
+  // percent of, TargetSize bytes. This is not guaranteed: e.g. the headers and
+  // side information alone may exceed small targets, so callers should check
+  // the resulting size. Usually costs about twice as much as encoding at a
+  // fixed distance; up to about 4x if the first attempts exceed the target
+  // (see EncodePassDataToTargetSize).
   size_t target_size = 0;
   float target_bitrate = 0.0f;
 
@@ -72,6 +94,32 @@ struct CompressParams {
   // Progressive mode.
   bool progressive_mode = false;
 
+  // If nonzero and the image is larger, a downsampled preview whose longer
+  // side is at most this many pixels is stored after the FileHeader. It can
+  // be decoded without the main image, see PikPreviewToPixels.
+  size_t preview_size = 0;
+
+  HistogramClustering histogram_clustering = HistogramClustering::kBest;
+
+  // Number of interleaved rANS states (1, 2 or 4) for AC coefficient tokens.
+  // More states shorten the decoder's dependency chain and thus speed up
+  // decoding, at a cost of 4 bytes per additional state per 64K tokens.
+  size_t ans_states = 1;
+
+  // If true, all groups of a pass share one coefficient order and set of AC
+  // histograms (see PassHeader::shared_entropy_codes) instead of storing their
+  // own, which saves bytes and decoder setup time for images with many groups.
+  bool shared_entropy_codes = false;
+
+  // If true, DC and AC tokens are entropy coded with prefix codes instead of
+  // ANS (see PassHeader::use_prefix_codes): a few percent larger, but faster
+  // to decode.
+  bool use_prefix_codes = false;
+
+  // If true, small groups may reference built-in entropy codes instead of
+  // computing and storing their own (see GroupHeader::preset_entropy_codes).
+  bool use_preset_entropy_codes = true;
+
   // If non-empty, the image referenced by this filepath will be used as a
   // lossless first pass. The difference between that first pass and the
   // original input image will then be encoded as a lossy second pass.
@@ -158,6 +206,31 @@ struct DecompressParams {
   // as long as both old and new implementation co-exist, and eventually
   // only the new implementation should remain.
   bool use_new_dc = false;
+
+  // If nonempty, only this region of the image (clipped to its bounds) is
+  // decoded and returned. Only the groups that influence the region are
+  // decoded, so the cost is proportional to its size rather than the image
+  // size. Pixels may differ slightly from a full decode because the
+  // edge-preserving filter adapts to the range of the decoded pixels.
+  Rect crop = Rect(0, 0, 0, 0);
+
+  // Decodes the image downsampled by this factor (1, 2, 4 or 8, rounding up
+  // the size), e.g. for thumbnails. 8 only decodes DC; 4 and 2 only transform
+  // the lowest 2x2 or 4x4 coefficients of each block. Downsampled decoding
+  // skips noise, smoothing and adaptive reconstruction. "crop" is specified in
+  // full-resolution coordinates.
+  size_t downsample = 1;
+
+  // If set, PikToPixels decodes one row of groups at a time and passes the
+  // finished rows [y0, y0 + rows->ysize()) to this callback (top to bottom)
+  // instead of storing the image in its "io", which only receives the metadata.
+  // Peak memory is then proportional to the image width times the group
+  // height rather than the image size. "rows" is in the same color space as
+  // the output of PikToPixels; the callback may modify or move from it.
+  // Returning false aborts decoding. As with "crop", pixels may differ
+  // slightly from a full decode. Requires a single-pass image and no crop or
+  // downsampling; not supported by PikStreamingDecoder.
+  std::function<Status(size_t y0, CodecInOut* rows)> row_callback;
 };
 
 // Enable features for distances >= these thresholds:
@@ -17,7 +17,10 @@
 #include <cstdint>
 #include <limits>
 #include <memory>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include "noise.h"
 
@@ -38,6 +41,7 @@
 #include "dct.h"
 #include "dct_util.h"
 #include "entropy_coder.h"
+#include "entropy_presets.h"
 #include "external_image.h"
 #include "fast_log.h"
 #include "gaborish.h"
@@ -52,6 +56,7 @@
 #include "profiler.h"
 #include "resize.h"
 #include "simd/targets.h"
+#include "single_image_handler.h"
 #include "size_coder.h"
 
 namespace pik {
@@ -193,23 +198,21 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
                                 const PassHeader& pass_header,
                                 const CodecInOut* io, const Rect& rect,
                                 const Image3F& previous_pass,
-                                PaddedBytes* compressed, size_t& pos,
-                                PikInfo* aux_out) {
+                                BitWriter* writer, PikInfo* aux_out) {
   size_t xsize = rect.xsize();
   size_t ysize = rect.ysize();
+  PaddedBytes compressed;
   if (pass_header.lossless_grayscale) {
     if (pass_header.lossless_16_bits) {
       ImageU channel(xsize, ysize);
       LosslessChannelPass(0, io, rect, previous_pass, &channel);
-      compressed->resize(pos / 8);
-      if (!Grayscale16bit_compress(channel, compressed)) {
+      if (!Grayscale16bit_compress(channel, &compressed)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     } else {
       ImageB channel(xsize, ysize);
       LosslessChannelPass(0, io, rect, previous_pass, &channel);
-      compressed->resize(pos / 8);
-      if (!Grayscale8bit_compress(channel, compressed)) {
+      if (!Grayscale8bit_compress(channel, &compressed)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     }
@@ -219,8 +222,7 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
       LosslessChannelPass(0, io, rect, previous_pass, image.MutablePlane(0));
       LosslessChannelPass(1, io, rect, previous_pass, image.MutablePlane(1));
       LosslessChannelPass(2, io, rect, previous_pass, image.MutablePlane(2));
-      compressed->resize(pos / 8);
-      if (!Colorful16bit_compress(image, compressed)) {
+      if (!Colorful16bit_compress(image, &compressed)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     } else {
@@ -228,13 +230,12 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
       LosslessChannelPass(0, io, rect, previous_pass, image.MutablePlane(0));
       LosslessChannelPass(1, io, rect, previous_pass, image.MutablePlane(1));
       LosslessChannelPass(2, io, rect, previous_pass, image.MutablePlane(2));
-      compressed->resize(pos / 8);
-      if (!Colorful8bit_compress(image, compressed)) {
+      if (!Colorful8bit_compress(image, &compressed)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     }
   }
-  pos = compressed->size() * 8;
+  writer->AppendBytes(compressed);
   return true;
 }
 
@@ -245,14 +246,12 @@ Status PikPassHeuristics(CompressParams cparams, const PassHeader& pass_header,
                          GroupHeader* template_group_header,
                          ColorCorrelationMap* full_cmap,
                          std::shared_ptr<Quantizer>* full_quantizer,
-                         AcStrategyImage* full_ac_strategy, PikInfo* aux_out) {
-  size_t target_size = cparams.TargetSize(Rect(opsin_orig));
-  // TODO(robryk): This should take *template_group_header size, and size of
-  // other passes into account.
-  size_t opsin_target_size = target_size;
-  if (cparams.target_size > 0 || cparams.target_bitrate > 0.0) {
-    cparams.target_size = opsin_target_size;
-  } else if (cparams.butteraugli_distance < 0) {
+                         AcStrategyImage* full_ac_strategy, ThreadPool* pool,
+                         PikInfo* aux_out) {
+  // With a target size, the distance only initializes the heuristics; the
+  // quantization is then scaled by EncodePassDataToTargetSize.
+  if (cparams.TargetSize(Rect(opsin_orig)) == 0 &&
+      cparams.butteraugli_distance < 0) {
     return PIK_FAILURE("Expected non-negative distance");
   }
 
@@ -268,31 +267,93 @@ Status PikPassHeuristics(CompressParams cparams, const PassHeader& pass_header,
   const size_t ysize = opsin_orig.ysize();
   const size_t xsize_blocks = DivCeil(xsize, N);
   const size_t ysize_blocks = DivCeil(ysize, N);
-  multipass_manager->GetColorCorrelationMap(opsin, &*full_cmap);
+  multipass_manager->GetColorCorrelationMap(opsin, pool, &*full_cmap);
   ImageF quant_field = InitialQuantField(
       cparams.butteraugli_distance, cparams.GetIntensityMultiplier(),
-      opsin_orig, cparams, /*pool=*/nullptr, 1.0);
+      opsin_orig, cparams, pool, 1.0);
 
   multipass_manager->GetAcStrategy(cparams.butteraugli_distance, &quant_field,
-                                   opsin,
-                                   /*pool=*/nullptr, full_ac_strategy, aux_out);
+                                   opsin, pool, full_ac_strategy, aux_out);
 
   *full_quantizer = multipass_manager->GetQuantizer(
       cparams, xsize_blocks, ysize_blocks, opsin_orig, opsin, noise_params,
       pass_header, *template_group_header, *full_cmap, *full_ac_strategy,
-      quant_field,
-      /*pool=*/nullptr, aux_out);
+      quant_field, pool, aux_out);
   return true;
 }
 
+// Returns the part of "full_quantizer" covering the group of "handler".
+Quantizer GroupQuantizer(const Quantizer& full_quantizer,
+                         MultipassHandler* handler) {
+  return full_quantizer.Copy(handler->BlockGroupRect());
+}
+
+// Returns the part of "full_cmap" covering the group of "handler".
+ColorCorrelationMap GroupColorCorrelationMap(
+    const ColorCorrelationMap& full_cmap, MultipassHandler* handler) {
+  const Rect& block_group_rect = handler->BlockGroupRect();
+  Rect group_in_color_tiles(
+      block_group_rect.x0() / kColorTileDimInBlocks,
+      block_group_rect.y0() / kColorTileDimInBlocks,
+      DivCeil(block_group_rect.xsize(), kColorTileDimInBlocks),
+      DivCeil(block_group_rect.ysize(), kColorTileDimInBlocks));
+  return full_cmap.Copy(group_in_color_tiles);
+}
+
+// Computes the quantized coefficients of a (lossy) group, given its parts of
+// the quantizer and color correlation map.
+void ComputeGroupEncCache(const CompressParams& cparams,
+                          const PassHeader& pass_header,
+                          const GroupHeader& header,
+                          const AcStrategyImage& ac_strategy,
+                          const Quantizer& quantizer,
+                          const ColorCorrelationMap& cmap,
+                          const PassEncCache& pass_enc_cache, PikInfo* aux_out,
+                          MultipassHandler* multipass_handler,
+                          EncCache* cache) {
+  cache->histogram_clustering = cparams.histogram_clustering;
+  cache->saliency_threshold = cparams.saliency_threshold;
+  cache->saliency_debug_skip_nonsalient =
+      cparams.saliency_debug_skip_nonsalient;
+
+  InitializeEncCache(pass_header, header, pass_enc_cache,
+                     multipass_handler->PaddedGroupRect(), cache);
+  cache->ac_strategy = ac_strategy.Copy(multipass_handler->BlockGroupRect());
+
+  ComputeCoefficients(quantizer, cmap, /*pool=*/nullptr, cache,
+                      multipass_handler->Manager(), aux_out);
+
+  multipass_handler->Manager()->StripInfo(cache);
+}
+
+Status EncodeGroupHeader(const GroupHeader& header, BitWriter* writer,
+                         PikInfo* aux_out) {
+  size_t extension_bits, total_bits;
+  PIK_RETURN_IF_ERROR(CanEncode(header, &extension_bits, &total_bits));
+  writer->Reserve(total_bits);
+  PIK_RETURN_IF_ERROR(WriteGroupHeader(header, extension_bits, writer->pos(),
+                                       writer->storage()));
+  writer->ZeroPadToByte();
+  if (aux_out != nullptr) {
+    aux_out->layers[kLayerHeader].total_size +=
+        DivCeil(total_bits, kBitsPerByte);
+  }
+  return true;
+}
+
+// "group_cache" and "shared_codes" are null unless the pass uses shared
+// entropy codes, in which case the group's coefficients have already been
+// computed by ComputeGroupEncCache.
 Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
                         GroupHeader header, const AcStrategyImage& ac_strategy,
                         const Quantizer& full_quantizer,
                         const ColorCorrelationMap& full_cmap,
                         const CodecInOut* io, const Image3F& opsin_in,
                         const NoiseParams& noise_params,
-                        PaddedBytes* compressed, size_t& pos,
-                        const PassEncCache& pass_enc_cache, PikInfo* aux_out,
+                        const PassEncCache& pass_enc_cache,
+                        const EncCache* group_cache,
+                        const EncoderEntropyCodes* shared_codes,
+                        BitWriter* writer, PikInfo* aux_out,
                         MultipassHandler* multipass_handler) {
   const Rect& rect = multipass_handler->GroupRect();
   const Rect& padded_rect = multipass_handler->PaddedGroupRect();
@@ -310,62 +371,380 @@ Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
   }
   header.nonserialized_have_alpha = pass_header.has_alpha;
 
-  size_t extension_bits, total_bits;
-  PIK_RETURN_IF_ERROR(CanEncode(header, &extension_bits, &total_bits));
-  compressed->resize(DivCeil(pos + total_bits, kBitsPerByte));
-  PIK_RETURN_IF_ERROR(
-      WriteGroupHeader(header, extension_bits, &pos, compressed->data()));
-  WriteZeroesToByteBoundary(&pos, compressed->data());
-  if (aux_out != nullptr) {
-    aux_out->layers[kLayerHeader].total_size +=
-        DivCeil(total_bits, kBitsPerByte);
-  }
-
   if (cparams.lossless_mode) {
+    PIK_RETURN_IF_ERROR(EncodeGroupHeader(header, writer, aux_out));
     Image3F previous_pass;
     PIK_RETURN_IF_ERROR(multipass_handler->GetPreviousPass(
         io->dec_c_original, /*pool=*/nullptr, &previous_pass));
     return PixelsToPikLosslessFrame(cparams, pass_header, io, rect,
-                                    previous_pass, compressed, pos, aux_out);
+                                    previous_pass, writer, aux_out);
   }
 
-  Rect group_in_color_tiles(
-      multipass_handler->BlockGroupRect().x0() / kColorTileDimInBlocks,
-      multipass_handler->BlockGroupRect().y0() / kColorTileDimInBlocks,
-      DivCeil(multipass_handler->BlockGroupRect().xsize(),
-              kColorTileDimInBlocks),
-      DivCeil(multipass_handler->BlockGroupRect().ysize(),
-              kColorTileDimInBlocks));
-  ColorCorrelationMap cmap = full_cmap.Copy(group_in_color_tiles);
+  ColorCorrelationMap cmap =
+      GroupColorCorrelationMap(full_cmap, multipass_handler);
+  Quantizer quantizer = GroupQuantizer(full_quantizer, multipass_handler);
+
   EncCache cache;
-  cache.saliency_threshold = cparams.saliency_threshold;
-  cache.saliency_debug_skip_nonsalient = cparams.saliency_debug_skip_nonsalient;
+  if (group_cache == nullptr) {
+    ComputeGroupEncCache(cparams, pass_header, header, ac_strategy, quantizer,
+                         cmap, pass_enc_cache, aux_out, multipass_handler,
+                         &cache);
+    group_cache = &cache;
+  }
 
-  InitializeEncCache(pass_header, header, pass_enc_cache,
-                     multipass_handler->PaddedGroupRect(), &cache);
-  cache.ac_strategy = ac_strategy.Copy(multipass_handler->BlockGroupRect());
+  if (aux_out != nullptr &&
+      aux_out->testing_aux.natural_order_histograms != nullptr) {
+    CountNaturalOrderTokens(*group_cache, area_to_encode, multipass_handler,
+                            aux_out->testing_aux.natural_order_histograms);
+  }
 
-  Quantizer quantizer =
-      full_quantizer.Copy(multipass_handler->BlockGroupRect());
+  // Without shared codes, small groups may use preset codes instead of their
+  // own; the choice is signaled in the group header.
+  if (shared_codes == nullptr && cparams.use_preset_entropy_codes) {
+    header.preset_entropy_codes = SelectPresetEntropyCodes(
+        *group_cache, area_to_encode, multipass_handler,
+        pass_header.use_prefix_codes);
+    if (header.preset_entropy_codes != 0) {
+      header.extensions |= 1;
+      shared_codes = &PresetEncoderEntropyCodes(header.preset_entropy_codes,
+                                                pass_header.use_prefix_codes);
+    }
+  }
+  PIK_RETURN_IF_ERROR(EncodeGroupHeader(header, writer, aux_out));
 
-  ComputeCoefficients(quantizer, cmap, /*pool=*/nullptr, &cache,
-                      multipass_handler->Manager(), aux_out);
+  EncodeToBitstream(*group_cache, area_to_encode, quantizer, noise_params,
+                    cmap, cparams.fast_mode, multipass_handler, shared_codes,
+                    writer, aux_out);
+  return true;
+}
+
+// Max observed: 1.1M on RGB noise with d0.1.
+// 512*512*4*2 = 2M should be enough for 16-bit RGBA images.
+using GroupSizeCoder = SizeCoderT<0x150F0E0C>;
+
+// Everything PixelsToPikPass determines before encoding the pass data.
+struct PassEncoderInputs {
+  const CompressParams& cparams;
+  const PassHeader& pass_header;
+  const CodecInOut* io;
+  const std::vector<MultipassHandler*>& handlers;
+  const GroupHeader& template_group_header;
+  const ColorCorrelationMap& full_cmap;
+  const std::shared_ptr<Quantizer>& full_quantizer;  // null if lossless
+  const AcStrategyImage& full_ac_strategy;
+  const Image3F& opsin;
+  const NoiseParams& noise_params;
+  MultipassManager* multipass_manager;
+  // Groups gather statistics in copies of this; null if there is no aux_out.
+  const PikInfo* group_aux_template;
+};
+
+// Encodes everything after the pass header into "data": for lossy passes the
+// quantizer, color correlation map and DC, then the shared entropy codes (if
+// any), the group TOC and the groups.
+Status EncodePassData(const PassEncoderInputs& in, ThreadPool* pool,
+                      PaddedBytes* data, PikInfo* aux_out) {
+  const size_t num_groups = in.handlers.size();
+  BitWriter writer(data);
+
+  std::vector<std::unique_ptr<PikInfo>> aux_outs(num_groups);
+  if (aux_out != nullptr) {
+    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+      aux_outs[group_index] = make_unique<PikInfo>(*in.group_aux_template);
+    }
+  }
 
-  multipass_handler->Manager()->StripInfo(&cache);
+  PassEncCache pass_enc_cache;
+  if (in.pass_header.encoding == ImageEncoding::kPasses) {
+    // Initialize pass_enc_cache and encode DC.
+    InitializePassEncCache(in.pass_header, in.opsin,
+                           in.multipass_manager->OpsinDCT(in.opsin),
+                           in.full_ac_strategy, *in.full_quantizer,
+                           in.full_cmap, pool, &pass_enc_cache);
+
+    in.multipass_manager->StripDCInfo(&pass_enc_cache);
+    pass_enc_cache.use_new_dc = in.cparams.use_new_dc;
+
+    // Encode quantizer DC and global scale.
+    PikImageSizeInfo* quant_info =
+        aux_out ? &aux_out->layers[kLayerQuant] : nullptr;
+    in.full_quantizer->Encode(&writer, quant_info);
 
-  PaddedBytes compressed_data =
-      EncodeToBitstream(cache, area_to_encode, quantizer, noise_params, cmap,
-                        cparams.fast_mode, multipass_handler, aux_out);
+    // Encode cmap. TODO(veluca): consider encoding DC part of cmap only here,
+    // and AC in groups.
+    PikImageSizeInfo* cmap_info =
+        aux_out ? &aux_out->layers[kLayerCmap] : nullptr;
+    EncodeColorMap(in.full_cmap.ytob_map, Rect(in.full_cmap.ytob_map),
+                   in.full_cmap.ytob_dc, &writer, cmap_info);
+    EncodeColorMap(in.full_cmap.ytox_map, Rect(in.full_cmap.ytox_map),
+                   in.full_cmap.ytox_dc, &writer, cmap_info);
 
-  compressed->append(compressed_data);
-  pos += compressed_data.size() * kBitsPerByte;
+    PikImageSizeInfo* dc_info = aux_out ? &aux_out->layers[kLayerDC] : nullptr;
+    EncodeDC(*in.full_quantizer, pass_enc_cache, pool, &writer, dc_info);
+  }
+
+  // With shared entropy codes, all groups' coefficients must be known before
+  // encoding any group. The codes are stored before the group TOC.
+  std::vector<EncCache> group_caches;
+  EncoderEntropyCodes shared_codes;
+  if (in.pass_header.encoding == ImageEncoding::kPasses &&
+      in.pass_header.shared_entropy_codes) {
+    group_caches.resize(num_groups);
+    const auto compute_group = [&](const int group_index, const int thread) {
+      MultipassHandler* handler = in.handlers[group_index];
+      ComputeGroupEncCache(
+          in.cparams, in.pass_header, in.template_group_header,
+          in.full_ac_strategy, GroupQuantizer(*in.full_quantizer, handler),
+          GroupColorCorrelationMap(in.full_cmap, handler), pass_enc_cache,
+          aux_outs[group_index].get(), handler, &group_caches[group_index]);
+    };
+    RunOnPool(pool, 0, num_groups, compute_group, "ComputeGroupEncCache");
+
+    EncodeSharedEntropyCodes(group_caches, in.handlers, in.cparams.fast_mode,
+                             &shared_codes, &writer, aux_out);
+  }
+
+  // Compress groups. Each thread appends its groups to its own arena; they
+  // are gathered into the output after the TOC.
+  struct GroupSpan {
+    size_t arena;
+    size_t begin;  // [bytes]
+    size_t size;
+  };
+  std::vector<PaddedBytes> arenas(std::max<size_t>(NumThreads(pool), 1));
+  std::vector<GroupSpan> group_spans(num_groups);
+  std::atomic<int> num_errors{0};
+  const auto process_group = [&](const int group_index, const int thread) {
+    PaddedBytes* arena = &arenas[thread];
+    const size_t begin = arena->size();
+    BitWriter group_writer(arena);
+    const bool shared = !group_caches.empty();
+    if (!PixelsToPikGroup(in.cparams, in.pass_header, in.template_group_header,
+                          in.full_ac_strategy, *in.full_quantizer, in.full_cmap,
+                          in.io, in.opsin, in.noise_params, pass_enc_cache,
+                          shared ? &group_caches[group_index] : nullptr,
+                          shared ? &shared_codes : nullptr, &group_writer,
+                          aux_outs[group_index].get(),
+                          in.handlers[group_index])) {
+      num_errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    group_writer.ZeroPadToByte();
+    group_spans[group_index] = {static_cast<size_t>(thread), begin,
+                                arena->size() - begin};
+  };
+  RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
+
+  if (aux_out != nullptr) {
+    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+      aux_out->Assimilate(*aux_outs[group_index]);
+    }
+  }
+
+  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+
+  // Build TOC.
+  size_t total_groups_size = 0;
+  writer.Reserve(GroupSizeCoder::MaxSize(num_groups) * kBitsPerByte);
+  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+    const size_t group_size = group_spans[group_index].size;
+    GroupSizeCoder::Encode(group_size, writer.pos(), writer.storage());
+    total_groups_size += group_size;
+  }
+  writer.ZeroPadToByte();
 
+  // Gather groups into the output.
+  writer.Reserve(total_groups_size * kBitsPerByte);
+  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+    const GroupSpan& span = group_spans[group_index];
+    writer.AppendBytes(arenas[span.arena].data() + span.begin, span.size);
+  }
   return true;
 }
 
-// Max observed: 1.1M on RGB noise with d0.1.
-// 512*512*4*2 = 2M should be enough for 16-bit RGBA images.
-using GroupSizeCoder = SizeCoderT<0x150F0E0C>;
+// Returns the estimated size [bytes] of the data EncodePassData writes for a
+// lossy pass. The DC is encoded, but the groups are only tokenized (see
+// EstimateGroupSize), so this excludes the entropy codes, quantizer, color
+// correlation map and TOC.
+float EstimatePassDataSize(const PassEncoderInputs& in, ThreadPool* pool) {
+  PROFILER_FUNC;
+  const Quantizer& quantizer = *in.full_quantizer;
+  PassEncCache pass_enc_cache;
+  InitializePassEncCache(in.pass_header, in.opsin,
+                         in.multipass_manager->OpsinDCT(in.opsin),
+                         in.full_ac_strategy, quantizer, in.full_cmap, pool,
+                         &pass_enc_cache);
+  in.multipass_manager->StripDCInfo(&pass_enc_cache);
+  pass_enc_cache.use_new_dc = in.cparams.use_new_dc;
+  BitWriter dc_writer;
+  EncodeDC(quantizer, pass_enc_cache, pool, &dc_writer, /*dc_info=*/nullptr);
+  const size_t dc_size = dc_writer.BitsWritten() / kBitsPerByte;
+
+  std::vector<float> group_sizes(in.handlers.size());
+  const auto estimate_group = [&](const int group_index, const int thread) {
+    MultipassHandler* handler = in.handlers[group_index];
+    EncCache cache;
+    ComputeGroupEncCache(
+        in.cparams, in.pass_header, in.template_group_header,
+        in.full_ac_strategy, GroupQuantizer(quantizer, handler),
+        GroupColorCorrelationMap(in.full_cmap, handler), pass_enc_cache,
+        /*aux_out=*/nullptr, handler, &cache);
+    const Rect& padded_rect = handler->PaddedGroupRect();
+    group_sizes[group_index] = EstimateGroupSize(
+        cache, Rect(0, 0, padded_rect.xsize(), padded_rect.ysize()), handler);
+  };
+  RunOnPool(pool, 0, in.handlers.size(), estimate_group,
+            "EstimatePassDataSize");
+  return std::accumulate(group_sizes.begin(), group_sizes.end(),
+                         static_cast<float>(dc_size));
+}
+
+// Returns a factor for the quantization of the pass (and thus its bitrate)
+// such that "estimate"() is ideally at most, and within a few percent of,
+// "target" [bytes] after "set_factor"(factor), starting from "factor". If no
+// step reaches the target, returns the factor with the smallest estimate.
+// Leaves the quantization at the returned factor and stores its estimate in
+// "factor_estimate".
+template <class SetFactor, class Estimate>
+float SearchQuantizationFactor(const float target, float factor,
+                               const SetFactor& set_factor,
+                               const Estimate& estimate,
+                               float* factor_estimate) {
+  PROFILER_FUNC;
+  constexpr int kMaxSteps = 6;
+  constexpr float kTolerance = 0.02f;
+
+  // The size is roughly a power of the factor: secant steps on the log-log
+  // curve, starting with an exponent of one. Each step aims slightly below the
+  // target so that it is likely to end up within the tolerance.
+  const float log_aim = std::log(std::max(target * (1 - kTolerance / 2), 1.0f));
+  float best_factor = 0.0f;  // Largest estimate within the target.
+  float best_size = 0.0f;
+  float smallest_factor = factor;  // Fallback if no estimate is within it.
+  float smallest_size = std::numeric_limits<float>::max();
+  float prev_log_factor = 0.0f;
+  float prev_log_size = 0.0f;
+  float applied_factor = factor;
+  for (int step = 0; step < kMaxSteps; ++step) {
+    set_factor(factor);
+    applied_factor = factor;
+    const float size = estimate();
+    if (size <= target && size > best_size) {
+      best_factor = factor;
+      best_size = size;
+    }
+    if (size < smallest_size) {
+      smallest_factor = factor;
+      smallest_size = size;
+    }
+    if (size <= target && size >= target * (1 - kTolerance)) break;
+
+    const float log_factor = std::log(factor);
+    const float log_size = std::log(std::max(size, 1.0f));
+    float exponent = 1.0f;
+    if (step != 0 && log_factor != prev_log_factor) {
+      exponent = (log_size - prev_log_size) / (log_factor - prev_log_factor);
+      exponent = std::min(std::max(exponent, 0.25f), 4.0f);
+    }
+    prev_log_factor = log_factor;
+    prev_log_size = log_size;
+    factor = std::exp(log_factor + (log_aim - log_size) / exponent);
+    factor = std::min(std::max(factor, 1.0f / 256), 256.0f);
+  }
+
+  if (best_size == 0.0f) {
+    best_factor = smallest_factor;
+    best_size = smallest_size;
+  }
+  if (best_factor != applied_factor) set_factor(best_factor);
+  *factor_estimate = best_size;
+  return best_factor;
+}
+
+// Same as EncodePassData for the last (lossy) pass, but first scales the
+// quantization of "full_quantizer" (that of "in") by a global factor such
+// that "data" is at most, and close to, "max_size" bytes. The AC strategy,
+// color correlation map and relative quantization field of the heuristics are
+// reused. The search uses EstimatePassDataSize, whose offset from the actual
+// size is corrected after each encoding. This usually costs two encodings of
+// the pass data plus a few cheaper estimates; while the result still exceeds
+// "max_size", up to kMaxRetries (3) more encodings follow. The worst case is
+// thus 4 encodings of the pass data and 24 estimates (each search takes up to
+// 6 steps), about 4x the cost of encoding at a fixed distance. "data" may
+// still exceed "max_size", e.g. if the side information alone does, so
+// callers must check.
+Status EncodePassDataToTargetSize(const PassEncoderInputs& in,
+                                  const size_t max_size,
+                                  Quantizer* full_quantizer, ThreadPool* pool,
+                                  PaddedBytes* data, PikInfo* aux_out) {
+  PROFILER_FUNC;
+  constexpr float kTolerance = 0.03f;
+  constexpr int kMaxRetries = 3;
+
+  // Scaling the float values of the integer field reproduces it for factor 1.
+  const ImageI raw_quant_field = CopyImage(full_quantizer->RawQuantField());
+  const float quant_dc = 1.0f / full_quantizer->inv_quant_dc();
+  const float quant_scale = full_quantizer->Scale();
+  ImageF quant_field(raw_quant_field.xsize(), raw_quant_field.ysize());
+  const auto set_factor = [&](const float factor) {
+    const float mul = quant_scale * factor;
+    for (size_t y = 0; y < quant_field.ysize(); ++y) {
+      const int32_t* PIK_RESTRICT row_raw = raw_quant_field.ConstRow(y);
+      float* PIK_RESTRICT row_quant = quant_field.Row(y);
+      for (size_t x = 0; x < quant_field.xsize(); ++x) {
+        row_quant[x] = row_raw[x] * mul;
+      }
+    }
+    full_quantizer->SetQuantField(quant_dc * factor, QuantField(quant_field));
+  };
+  float estimate_size;
+  const auto estimate = [&]() {
+    return EstimatePassDataSize(in, pool);
+  };
+
+  const PikInfo aux_before = aux_out != nullptr ? *aux_out : PikInfo();
+  float factor = SearchQuantizationFactor(max_size, /*factor=*/1.0f, set_factor,
+                                          estimate, &estimate_size);
+  PIK_RETURN_IF_ERROR(EncodePassData(in, pool, data, aux_out));
+  if (data->size() <= max_size &&
+      data->size() >= max_size * (1 - kTolerance)) {
+    return true;
+  }
+
+  // The estimate excludes the entropy codes and side information, whose size
+  // hardly depends on the quantization. Each retry subtracts the offset of the
+  // latest encoding from the target; retries continue until one fits.
+  size_t last_size = data->size();
+  float last_factor = factor;
+  for (int retry = 0; retry < kMaxRetries; ++retry) {
+    const float overhead = last_size - estimate_size;
+    const float retry_factor = SearchQuantizationFactor(
+        std::max(max_size - overhead, 1.0f), last_factor, set_factor, estimate,
+        &estimate_size);
+    // Same quantization (e.g. the coarsest) => same size.
+    if (retry_factor == last_factor) break;
+    PaddedBytes retry_data;
+    PikInfo retry_aux = aux_before;
+    PIK_RETURN_IF_ERROR(EncodePassData(
+        in, pool, &retry_data, aux_out != nullptr ? &retry_aux : nullptr));
+    last_size = retry_data.size();
+    last_factor = retry_factor;
+
+    // Prefer the larger size within the target, otherwise the smaller one.
+    const bool keep_retry = retry_data.size() <= max_size
+                                ? data->size() > max_size ||
+                                      retry_data.size() > data->size()
+                                : retry_data.size() < data->size();
+    if (keep_retry) {
+      std::swap(*data, retry_data);
+      if (aux_out != nullptr) *aux_out = std::move(retry_aux);
+      factor = retry_factor;
+    }
+    if (data->size() <= max_size) break;
+  }
+  if (factor != last_factor) set_factor(factor);
+  return true;
+}
 
 Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
                        const CodecInOut* io, ThreadPool* pool,
@@ -413,6 +792,29 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
         }
       }
     }
+
+    if (cparams.ans_states != 1) {
+      if (cparams.ans_states != 2 && cparams.ans_states != 4) {
+        return PIK_FAILURE("ans_states must be 1, 2 or 4");
+      }
+      pass_header.num_ans_states = cparams.ans_states;
+      pass_header.extensions |= 1;
+    }
+
+    if (cparams.shared_entropy_codes) {
+      pass_header.shared_entropy_codes = true;
+      pass_header.extensions |= 2;
+    }
+
+    if (cparams.use_prefix_codes) {
+      pass_header.use_prefix_codes = true;
+      pass_header.extensions |= 4;
+    }
+
+    if (pass_header.is_last && CanFinalizeGray(pass_header)) {
+      pass_header.gray_from_y = true;
+      pass_header.extensions |= 8;
+    }
   }
 
   multipass_manager->StartPass(pass_header);
@@ -428,12 +830,17 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
     aux_out->layers[kLayerHeader].total_size +=
         DivCeil(total_bits, kBitsPerByte);
   }
+  PIK_ASSERT(pos == compressed->size() * kBitsPerByte);
 
   const size_t xsize_groups = DivCeil(io->xsize(), kGroupWidth);
   const size_t ysize_groups = DivCeil(io->ysize(), kGroupHeight);
   const size_t num_groups = xsize_groups * ysize_groups;
 
-  std::vector<std::unique_ptr<PikInfo>> aux_outs(num_groups);
+  // Groups gather statistics in copies of "aux_out" as of here.
+  std::unique_ptr<PikInfo> group_aux_template;
+  if (aux_out != nullptr) {
+    group_aux_template = make_unique<PikInfo>(*aux_out);
+  }
   std::vector<MultipassHandler*> handlers(num_groups);
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
     const size_t gx = group_index % xsize_groups;
@@ -442,9 +849,6 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
                     kGroupHeight, io->xsize(), io->ysize());
     handlers[group_index] =
         multipass_manager->GetGroupHandler(group_index, rect);
-    if (aux_out != nullptr) {
-      aux_outs[group_index] = make_unique<PikInfo>(*aux_out);
-    }
   }
 
   GroupHeader template_group_header;
@@ -453,7 +857,6 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
   AcStrategyImage full_ac_strategy;
   Image3F opsin_orig, opsin;
   NoiseParams noise_params;
-  PassEncCache pass_enc_cache;
 
   if (pass_header.encoding == ImageEncoding::kPasses) {
     opsin_orig = OpsinDynamicsImage(io, Rect(io->color()));
@@ -494,97 +897,35 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
     }
 
     multipass_manager->DecorrelateOpsin(&opsin);
+    multipass_manager->ComputeOpsinDCT(opsin, pool);
 
     PIK_RETURN_IF_ERROR(
         PikPassHeuristics(cparams, pass_header, opsin_orig, opsin, noise_params,
                           multipass_manager, &template_group_header, &full_cmap,
-                          &full_quantizer, &full_ac_strategy, aux_out));
-
-    // Initialize pass_enc_cache and encode DC.
-    InitializePassEncCache(pass_header, opsin, full_ac_strategy,
-                           *full_quantizer, full_cmap, pool, &pass_enc_cache);
-
-    multipass_manager->StripDCInfo(&pass_enc_cache);
-    pass_enc_cache.use_new_dc = cparams.use_new_dc;
-
-    PaddedBytes pass_global_code;
-    size_t byte_pos = 0;
-
-    // Encode quantizer DC and global scale.
-    PikImageSizeInfo* quant_info =
-        aux_out ? &aux_out->layers[kLayerQuant] : nullptr;
-    std::string quant_code = full_quantizer->Encode(quant_info);
-
-    // Encode cmap. TODO(veluca): consider encoding DC part of cmap only here,
-    // and AC in groups.
-    PikImageSizeInfo* cmap_info =
-        aux_out ? &aux_out->layers[kLayerCmap] : nullptr;
-    std::string cmap_code =
-        EncodeColorMap(full_cmap.ytob_map, Rect(full_cmap.ytob_map),
-                       full_cmap.ytob_dc, cmap_info) +
-        EncodeColorMap(full_cmap.ytox_map, Rect(full_cmap.ytox_map),
-                       full_cmap.ytox_dc, cmap_info);
-
-    pass_global_code.resize(quant_code.size() + cmap_code.size());
-    Append(quant_code, &pass_global_code, &byte_pos);
-    Append(cmap_code, &pass_global_code, &byte_pos);
-
-    PikImageSizeInfo* dc_info = aux_out ? &aux_out->layers[kLayerDC] : nullptr;
-    pass_global_code.append(
-        EncodeDC(*full_quantizer, pass_enc_cache, pool, dc_info));
-    compressed->append(pass_global_code);
-    pos += pass_global_code.size() * 8;
+                          &full_quantizer, &full_ac_strategy, pool, aux_out));
   }
 
-  // Compress groups.
-  std::vector<PaddedBytes> group_codes(num_groups);
-  std::atomic<int> num_errors{0};
-  const auto process_group = [&](const int group_index, const int thread) {
-    PaddedBytes* group_code = &group_codes[group_index];
-    size_t group_pos = 0;
-    if (!PixelsToPikGroup(cparams, pass_header, template_group_header,
-                          full_ac_strategy, *full_quantizer, full_cmap, io,
-                          opsin, noise_params, group_code, group_pos,
-                          pass_enc_cache, aux_outs[group_index].get(),
-                          handlers[group_index])) {
-      num_errors.fetch_add(1, std::memory_order_relaxed);
-      return;
-    }
-  };
-  RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
-
-  if (aux_out != nullptr) {
-    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-      aux_out->Assimilate(*aux_outs[group_index]);
-    }
-  }
-
-  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
-
-  // Build TOC.
-  PaddedBytes group_toc(GroupSizeCoder::MaxSize(num_groups));
-  size_t group_toc_pos = 0;
-  uint8_t* group_toc_storage = group_toc.data();
-  size_t total_groups_size = 0;
-  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    size_t group_size = group_codes[group_index].size();
-    GroupSizeCoder::Encode(group_size, &group_toc_pos, group_toc_storage);
-    total_groups_size += group_size;
-  }
-  WriteZeroesToByteBoundary(&group_toc_pos, group_toc_storage);
-  group_toc.resize(group_toc_pos / kBitsPerByte);
-
-  // Push output.
-  PIK_ASSERT(pos % kBitsPerByte == 0);
-  compressed->reserve(DivCeil(pos, kBitsPerByte) + group_toc.size() +
-                      total_groups_size);
-  compressed->append(group_toc);
-  pos += group_toc.size() * kBitsPerByte;
-  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    const PaddedBytes& group_code = group_codes[group_index];
-    compressed->append(group_code);
-    pos += group_code.size() * kBitsPerByte;
+  const PassEncoderInputs inputs = {
+      cparams,          pass_header,           io,
+      handlers,         template_group_header, full_cmap,
+      full_quantizer,   full_ac_strategy,      opsin,
+      noise_params,     multipass_manager,     group_aux_template.get()};
+  PaddedBytes data;
+  const size_t target_size = cparams.TargetSize(Rect(io->color()));
+  if (pass_header.encoding == ImageEncoding::kPasses && pass_header.is_last &&
+      target_size != 0) {
+    // Earlier passes and the header count towards the target.
+    const size_t max_size = target_size > compressed->size()
+                                ? target_size - compressed->size()
+                                : 0;
+    PIK_RETURN_IF_ERROR(EncodePassDataToTargetSize(
+        inputs, max_size, full_quantizer.get(), pool, &data, aux_out));
+  } else {
+    PIK_RETURN_IF_ERROR(EncodePassData(inputs, pool, &data, aux_out));
   }
+  BitWriter writer(compressed);
+  writer.AppendBytes(data);
+  pos = compressed->size() * kBitsPerByte;
 
   io->enc_size = compressed->size();
   return true;
@@ -613,6 +954,20 @@ Status ValidateImageDimensions(const FileHeader& container,
 
 namespace {
 
+// Returns the factor by which a pass is downsampled while decoding (see
+// DecompressParams::downsample). The remainder is applied to the decoded
+// pixels, which is much slower.
+size_t DecodingDownsample(const DecompressParams& dparams,
+                          const PassHeader& pass_header) {
+  if (pass_header.encoding != ImageEncoding::kPasses ||
+      pass_header.resampling_factor2 != 2) {
+    return 1;
+  }
+  // Alpha is only stored in groups, which are skipped for 8x.
+  if (pass_header.has_alpha && dparams.downsample == 8) return 4;
+  return dparams.downsample;
+}
+
 // Specializes a 8-bit and 16-bit of converting to float from lossless.
 float ToFloatForLossless(uint8_t in) { return static_cast<float>(in); }
 
@@ -744,13 +1099,21 @@ Status PikGroupToPixels(
     const DecompressParams& dparams, const FileHeader& container,
     const PassHeader* pass_header, const PaddedBytes& compressed,
     const Quantizer& quantizer, const ColorCorrelationMap& full_cmap,
-    BitReader* reader, Image3F* PIK_RESTRICT opsin_output, ImageU* alpha_output,
+    BitReader* reader, const Rect& decoded_rect,
+    Image3F* PIK_RESTRICT opsin_output, ImageU* alpha_output,
     CodecContext* context, PikInfo* aux_out, PassDecCache* pass_dec_cache,
     MultipassHandler* multipass_handler,
     const ColorEncoding& original_color_encoding) {
   PROFILER_FUNC;
   const Rect& padded_rect = multipass_handler->PaddedGroupRect();
   const Rect& rect = multipass_handler->GroupRect();
+  // The outputs only cover decoded_rect.
+  const Rect output_rect(rect.x0() - decoded_rect.x0(),
+                         rect.y0() - decoded_rect.y0(), rect.xsize(),
+                         rect.ysize());
+  const Rect padded_output_rect(padded_rect.x0() - decoded_rect.x0(),
+                                padded_rect.y0() - decoded_rect.y0(),
+                                padded_rect.xsize(), padded_rect.ysize());
   GroupHeader header;
   header.nonserialized_have_alpha = pass_header->has_alpha;
   PIK_RETURN_IF_ERROR(ReadGroupHeader(reader, &header));
@@ -769,7 +1132,8 @@ Status PikGroupToPixels(
     if (container.metadata.transcoded.original_bytes_per_alpha == 0) {
       return PIK_FAILURE("Header claims to contain alpha but the depth is 0.");
     }
-    PIK_RETURN_IF_ERROR(DecodeAlpha(dparams, header.alpha, alpha_output, rect));
+    PIK_RETURN_IF_ERROR(
+        DecodeAlpha(dparams, header.alpha, alpha_output, output_rect));
   }
 
   if (pass_header->encoding == ImageEncoding::kLossless) {
@@ -778,8 +1142,9 @@ Status PikGroupToPixels(
     Image3F previous_pass;
     PIK_RETURN_IF_ERROR(multipass_handler->GetPreviousPass(
         original_color_encoding, /*pool=*/nullptr, &previous_pass));
-    auto result = PikLosslessFrameToPixels(compressed, *pass_header, &pos,
-                                           opsin_output, rect, previous_pass);
+    auto result =
+        PikLosslessFrameToPixels(compressed, *pass_header, &pos, opsin_output,
+                                 output_rect, previous_pass);
     reader->SkipBits((pos - before_pos) << 3);
     // Byte-wise; no need to jump to boundary.
     return result;
@@ -833,11 +1198,13 @@ Status PikGroupToPixels(
   // in DecodeFromBitstream.
   // TODO(veluca): avoid copy by passing opsin_output and having ReconOpsinImage
   // fill it (assuming no resampling).
+  const size_t downsample = DecodingDownsample(dparams, *pass_header);
   Image3F opsin = ReconOpsinImage(*pass_header, header, quantizer,
                                   multipass_handler->BlockGroupRect(),
-                                  &dec_cache, pass_dec_cache, aux_out);
+                                  &dec_cache, pass_dec_cache, aux_out,
+                                  downsample);
 
-  if (pass_header->flags & PassHeader::kNoise) {
+  if ((pass_header->flags & PassHeader::kNoise) && downsample == 1) {
     PROFILER_ZONE("add_noise");
     AddNoise(noise_params, &opsin);
   }
@@ -848,11 +1215,15 @@ Status PikGroupToPixels(
                           resampling_factor2);
   }
 
+  const Rect downsampled_output_rect(padded_output_rect.x0() / downsample,
+                                     padded_output_rect.y0() / downsample,
+                                     opsin.xsize(), opsin.ysize());
   for (size_t c = 0; c < 3; c++) {
-    for (size_t y = 0; y < padded_rect.ysize(); y++) {
+    for (size_t y = 0; y < opsin.ysize(); y++) {
       const float* PIK_RESTRICT row = opsin.ConstPlaneRow(c, y);
-      float* PIK_RESTRICT output_row = padded_rect.PlaneRow(opsin_output, c, y);
-      for (size_t x = 0; x < padded_rect.xsize(); x++) {
+      float* PIK_RESTRICT output_row =
+          downsampled_output_rect.PlaneRow(opsin_output, c, y);
+      for (size_t x = 0; x < opsin.xsize(); x++) {
         output_row[x] = row[x];
       }
     }
@@ -861,60 +1232,275 @@ Status PikGroupToPixels(
   return true;
 }
 
-Status PikPassToPixels(const DecompressParams& dparams,
-                       const PaddedBytes& compressed,
-                       const FileHeader& container, ThreadPool* pool,
-                       BitReader* reader, CodecInOut* io, PikInfo* aux_out,
-                       MultipassManager* multipass_handler) {
-  PROFILER_ZONE("PikPassToPixels uninstrumented");
-  PIK_RETURN_IF_ERROR(ValidateImageDimensions(container, dparams));
+namespace {
+
+// Pixels around DecompressParams::crop that influence it via AC prediction and
+// the post-processing filters (Gaborish, adaptive reconstruction).
+constexpr size_t kCropBorder = 2 * kBlockDim;
+
+// Rows above and below each row of groups that DecodeRows post-processes with
+// it. Multiple of the largest transform, which is post-processed as a whole.
+constexpr size_t kRowBorder = AcStrategy::kMaxBlockDim;
+static_assert(kRowBorder >= kCropBorder, "Row border too small");
+
+// Moves rows [begin, end) of "image" to the top.
+template <typename T>
+void MoveRowsUp(size_t begin, size_t end, Image<T>* image) {
+  for (size_t y = begin; y < end; ++y) {
+    memcpy(image->Row(y - begin), image->ConstRow(y),
+           image->xsize() * sizeof(T));
+  }
+}
+
+template <typename T>
+void MoveRowsUp(size_t begin, size_t end, Image3<T>* image) {
+  for (size_t c = 0; c < 3; ++c) {
+    MoveRowsUp(begin, end, image->MutablePlane(c));
+  }
+}
+
+// Returns the image downsampled by averaging "factor" x "factor" pixels (fewer
+// at the right and bottom borders).
+template <typename T>
+Image<T> DownsampleBox(const Image<T>& in, size_t factor) {
+  const float kRound = std::is_integral<T>::value ? 0.5f : 0.0f;
+  Image<T> out(DivCeil(in.xsize(), factor), DivCeil(in.ysize(), factor));
+  for (size_t y = 0; y < out.ysize(); ++y) {
+    const size_t y1 = std::min((y + 1) * factor, in.ysize());
+    T* PIK_RESTRICT row_out = out.Row(y);
+    for (size_t x = 0; x < out.xsize(); ++x) {
+      const size_t x1 = std::min((x + 1) * factor, in.xsize());
+      float sum = 0.0f;
+      for (size_t iy = y * factor; iy < y1; ++iy) {
+        const T* PIK_RESTRICT row_in = in.ConstRow(iy);
+        for (size_t ix = x * factor; ix < x1; ++ix) {
+          sum += row_in[ix];
+        }
+      }
+      const size_t count = (y1 - y * factor) * (x1 - x * factor);
+      row_out[x] = static_cast<T>(sum / count + kRound);
+    }
+  }
+  return out;
+}
+
+template <typename T>
+Image3<T> DownsampleBox(const Image3<T>& in, size_t factor) {
+  return Image3<T>(DownsampleBox(in.Plane(0), factor),
+                   DownsampleBox(in.Plane(1), factor),
+                   DownsampleBox(in.Plane(2), factor));
+}
+
+bool Intersects(const Rect& a, const Rect& b) {
+  return a.x0() < b.x0() + b.xsize() && b.x0() < a.x0() + a.xsize() &&
+         a.y0() < b.y0() + b.ysize() && b.y0() < a.y0() + a.ysize();
+}
+
+// Returns [begin, end) extended by "border" and aligned to "align", clamped to
+// [0, size).
+void ExpandInterval(size_t begin, size_t end, size_t border, size_t align,
+                    size_t size, size_t* aligned_begin, size_t* aligned_end) {
+  begin = begin > border ? begin - border : 0;
+  *aligned_begin = begin / align * align;
+  *aligned_end = std::min(DivCeil(end + border, align) * align, size);
+}
+
+}  // namespace
+
+Status EncodePreview(const CompressParams& cparams, const CodecInOut* io,
+                     ThreadPool* pool, FileHeader* container,
+                     PaddedBytes* preview) {
+  PROFILER_FUNC;
+  preview->clear();
+  container->preview.xsize = container->preview.ysize = 0;
+  const size_t max_size = std::max(io->xsize(), io->ysize());
+  if (cparams.preview_size == 0 || max_size <= cparams.preview_size) {
+    return true;
+  }
+
+  CodecInOut preview_io(io->Context());
+  preview_io.SetFromImage(
+      DownsampleBox(io->color(), DivCeil(max_size, cparams.preview_size)),
+      io->c_current());
+  preview_io.SetOriginalBitsPerSample(io->original_bits_per_sample());
+  preview_io.dec_c_original = io->dec_c_original;
+  preview_io.metadata = io->metadata;
+
+  // A single, quickly encoded lossy pass; size targets refer to the main image.
+  CompressParams preview_params = cparams;
+  preview_params.preview_size = 0;
+  preview_params.fast_mode = true;
+  preview_params.progressive_mode = false;
+  preview_params.lossless_mode = false;
+  preview_params.lossless_base.clear();
+  preview_params.target_size = 0;
+  preview_params.target_bitrate = 0.0f;
+  preview_params.resampling_factor2 = 2;
+
+  PassParams pass_params;
+  pass_params.is_last = true;
+  SingleImageManager transform;
+  size_t pos = 0;
+  PIK_RETURN_IF_ERROR(PixelsToPikPass(preview_params, pass_params, &preview_io,
+                                      pool, preview, pos, /*aux_out=*/nullptr,
+                                      &transform));
+  WriteZeroesToByteBoundary(&pos, preview->data());
+  preview->resize(pos / kBitsPerByte);
+
+  container->preview.xsize = preview_io.xsize();
+  container->preview.ysize = preview_io.ysize();
+  return true;
+}
+
+Status WriteFileHeaderAndPreview(FileHeader* container,
+                                 const PaddedBytes& preview, size_t* pos,
+                                 PaddedBytes* compressed) {
+  size_t extension_bits, total_bits;
+  size_t size_bits = 0;
+  if (!preview.empty()) {
+    // size_bits includes the padding to the byte boundary at which the preview
+    // starts, which depends on the size of the header and thus on size_bits.
+    // Only growing size_bits (any excess is zero-filled after the preview)
+    // ensures this converges.
+    for (;;) {
+      container->preview.size_bits = size_bits;
+      PIK_RETURN_IF_ERROR(CanEncode(*container, &extension_bits, &total_bits));
+      const size_t header_end = *pos + total_bits;
+      const size_t needed =
+          DivCeil(header_end, kBitsPerByte) * kBitsPerByte - header_end +
+          preview.size() * kBitsPerByte;
+      if (needed <= size_bits) break;
+      size_bits = needed;
+    }
+  }
+  container->preview.size_bits = size_bits;
+  PIK_RETURN_IF_ERROR(CanEncode(*container, &extension_bits, &total_bits));
+
+  const size_t end = *pos + total_bits + size_bits;
+  compressed->resize(DivCeil(end, kBitsPerByte));
+  PIK_RETURN_IF_ERROR(
+      WriteFileHeader(*container, extension_bits, pos, compressed->data()));
+  if (preview.empty()) return true;
+
+  WriteZeroesToByteBoundary(pos, compressed->data());
+  memcpy(compressed->data() + *pos / kBitsPerByte, preview.data(),
+         preview.size());
+  *pos += preview.size() * kBitsPerByte;
+  WriteBitsPrepareStorage(*pos, compressed->data());
+  while (*pos < end) {
+    WriteBits(std::min<size_t>(end - *pos, 56), 0, pos, compressed->data());
+  }
+  return true;
+}
 
-  io->metadata = container.metadata;
+PikPassDecoder::PikPassDecoder(const DecompressParams& dparams,
+                               const FileHeader& container, ThreadPool* pool,
+                               CodecInOut* io, PikInfo* aux_out,
+                               MultipassManager* multipass_manager)
+    : dparams_(dparams),
+      container_(container),
+      pool_(pool),
+      io_(io),
+      aux_out_(aux_out),
+      multipass_manager_(multipass_manager),
+      quantizer_(kBlockDim, 0, 0, 0),
+      crop_(0, 0, 0, 0),
+      decoded_rect_(0, 0, 0, 0),
+      window_(0, 0, 0, 0),
+      dc_group_offsets_(1, 0),
+      group_offsets_(1, 0) {}
+
+Status PikPassDecoder::ReadHeaders(BitReader* reader) {
+  PROFILER_FUNC;
+  PIK_RETURN_IF_ERROR(ValidateImageDimensions(container_, dparams_));
+
+  io_->metadata = container_.metadata;
 
   // Used when writing the output file unless DecoderHints overrides it.
-  io->SetOriginalBitsPerSample(
-      container.metadata.transcoded.original_bit_depth);
-  io->dec_c_original = container.metadata.transcoded.original_color_encoding;
-  if (io->dec_c_original.icc.empty()) {
+  io_->SetOriginalBitsPerSample(
+      container_.metadata.transcoded.original_bit_depth);
+  io_->dec_c_original = container_.metadata.transcoded.original_color_encoding;
+  if (io_->dec_c_original.icc.empty()) {
     // Removed by MaybeRemoveProfile; fail unless we successfully restore it.
     PIK_RETURN_IF_ERROR(
-        ColorManagement::SetProfileFromFields(&io->dec_c_original));
+        ColorManagement::SetProfileFromFields(&io_->dec_c_original));
   }
 
-  const size_t xsize = container.xsize();
-  const size_t ysize = container.ysize();
-  size_t padded_xsize = DivCeil(xsize, kBlockDim) * kBlockDim;
-  size_t padded_ysize = DivCeil(ysize, kBlockDim) * kBlockDim;
+  const size_t xsize = container_.xsize();
+  const size_t ysize = container_.ysize();
+
+  crop_ = Rect(0, 0, xsize, ysize);
+  const Rect& crop = dparams_.crop;
+  if (crop.xsize() != 0 && crop.ysize() != 0) {
+    if (crop.x0() >= xsize || crop.y0() >= ysize) {
+      return PIK_FAILURE("Crop is outside of the image");
+    }
+    crop_ = Rect(crop.x0(), crop.y0(), crop.xsize(), crop.ysize(), xsize,
+                 ysize);
+  }
+  // Only groups intersecting the crop and its border are decoded.
+  size_t x0, x1, y0, y1;
+  ExpandInterval(crop_.x0(), crop_.x0() + crop_.xsize(), kCropBorder,
+                 kGroupWidth, xsize, &x0, &x1);
+  ExpandInterval(crop_.y0(), crop_.y0() + crop_.ysize(), kCropBorder,
+                 kGroupHeight, ysize, &y0, &y1);
+  decoded_rect_ = Rect(x0, y0, x1 - x0, y1 - y0);
+  window_ = decoded_rect_;
+  if (dparams_.row_callback) {
+    if (!SameSize(crop_, decoded_rect_) || dparams_.downsample != 1) {
+      return PIK_FAILURE("Row callback does not support crop or downsample");
+    }
+    // The first two rows of groups; see DecodeRows.
+    window_ = Rect(0, 0, xsize, std::min(ysize, 2 * kGroupHeight));
+  }
 
-  PassHeader header;
-  PIK_RETURN_IF_ERROR(ReadPassHeader(reader, &header));
+  PIK_RETURN_IF_ERROR(ReadPassHeader(reader, &header_));
 
   PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
   // TODO(veluca): add kProgressive.
-  if (header.encoding != ImageEncoding::kPasses &&
-      header.encoding != ImageEncoding::kLossless) {
+  if (header_.encoding != ImageEncoding::kPasses &&
+      header_.encoding != ImageEncoding::kLossless) {
     return PIK_FAILURE("Unsupported bitstream");
   }
+  if (dparams_.row_callback && !header_.is_last) {
+    // Later passes would require all pixels of this one.
+    return PIK_FAILURE("Row callback requires a single-pass image");
+  }
+
+  multipass_manager_->StartPass(header_);
 
-  multipass_handler->StartPass(header);
+  OverridePassFlags(dparams_, &header_);
 
-  OverridePassFlags(dparams, &header);
+  if (dparams_.downsample != 1 && dparams_.downsample != 2 &&
+      dparams_.downsample != 4 && dparams_.downsample != 8) {
+    return PIK_FAILURE("Invalid downsampling factor");
+  }
+  downsample_ = DecodingDownsample(dparams_, header_);
+
+  if (header_.encoding == ImageEncoding::kLossless &&
+      multipass_manager_->NumDecodedPasses() != 0 &&
+      (!SameSize(decoded_rect_, Rect(0, 0, xsize, ysize)) ||
+       dparams_.downsample != 1)) {
+    // Previous passes were only decoded within decoded_rect_ and/or at reduced
+    // resolution, but this pass reads them at full resolution and full-image
+    // coordinates.
+    return PIK_FAILURE(
+        "Cannot crop or downsample lossless passes after other passes");
+  }
 
-  ImageU alpha;
-  if (header.has_alpha) {
-    alpha = ImageU(xsize, ysize);
+  if (header_.has_alpha) {
+    alpha_ = ImageU(window_.xsize(), WindowCapacity());
   }
 
   const size_t xsize_groups = DivCeil(xsize, kGroupWidth);
   const size_t ysize_groups = DivCeil(ysize, kGroupHeight);
   const size_t num_groups = xsize_groups * ysize_groups;
 
-  std::vector<PikInfo> aux_outs;
-  if (aux_out != nullptr) {
-    aux_outs.resize(num_groups, *aux_out);
+  if (aux_out_ != nullptr) {
+    aux_outs_.assign(num_groups, *aux_out_);
   }
-  std::vector<MultipassHandler*> handlers(num_groups);
+  handlers_.resize(num_groups);
   {
     PROFILER_ZONE("Get handlers");
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
@@ -923,132 +1509,508 @@ Status PikPassToPixels(const DecompressParams& dparams,
       const size_t x = gx * kGroupWidth;
       const size_t y = gy * kGroupHeight;
       Rect rect(x, y, kGroupWidth, kGroupHeight, xsize, ysize);
-      handlers[group_index] =
-          multipass_handler->GetGroupHandler(group_index, rect);
+      handlers_[group_index] =
+          multipass_manager_->GetGroupHandler(group_index, rect);
     }
   }
 
-  const size_t xsize_blocks = padded_xsize / kBlockDim;
-  const size_t ysize_blocks = padded_ysize / kBlockDim;
+  const size_t xsize_blocks = DivCeil(xsize, kBlockDim);
+  const size_t ysize_blocks = DivCeil(ysize, kBlockDim);
+
+  pass_dec_cache_ = PassDecCache();
+  pass_dec_cache_.use_new_dc = dparams_.use_new_dc;
+  pass_dec_cache_.use_prefix_codes = header_.use_prefix_codes;
+  pass_dec_cache_.gray_from_y = header_.gray_from_y;
+  pass_dec_cache_.grayscale = header_.flags & PassHeader::kGrayscaleOpt;
+  pass_dec_cache_.ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
+  pass_dec_cache_.raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
+  if (downsample_ != 8) {
+    pass_dec_cache_.biases = Image3F(
+        DivCeil(window_.xsize(), kBlockDim) * kBlockDim * kBlockDim,
+        DivCeil(WindowCapacity(), kBlockDim));
+    if (header_.gray_from_y && !CanFinalizeGray(header_)) {
+      // X/B biases are not decoded, but read by the three-plane adaptive
+      // reconstruction that DecompressParams may have enabled.
+      FillImage(0.0f, pass_dec_cache_.biases.MutablePlane(0));
+      FillImage(0.0f, pass_dec_cache_.biases.MutablePlane(2));
+    }
+  }
+  pass_dec_cache_.biases_x0 = window_.x0() / kBlockDim;
+  pass_dec_cache_.biases_y0 = window_.y0() / kBlockDim;
+  cmap_ = ColorCorrelationMap(xsize, ysize);
+  quantizer_ = Quantizer(kBlockDim, 0, 0, 0);
+
+  dc_group_offsets_.assign(1, 0);
+  if (header_.encoding == ImageEncoding::kPasses) {
+    PIK_RETURN_IF_ERROR(quantizer_.Decode(reader));
+    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+    DecodeColorMap(reader, &cmap_.ytob_map, &cmap_.ytob_dc);
+    DecodeColorMap(reader, &cmap_.ytox_map, &cmap_.ytox_dc);
+    PIK_RETURN_IF_ERROR(BeginDecodeDC(reader, xsize_blocks, ysize_blocks,
+                                      &dc_group_offsets_, &pass_dec_cache_));
+    if (decoded_rect_.xsize() != xsize || decoded_rect_.ysize() != ysize) {
+      // Skipped DC groups must not contain garbage (used by gradient maps).
+      ZeroFillImage(&pass_dec_cache_.dc);
+    }
+  }
+  dc_codes_begin_ = reader->Position();
+  return true;
+}
 
-  PassDecCache pass_dec_cache;
-  pass_dec_cache.use_new_dc = dparams.use_new_dc;
-  pass_dec_cache.grayscale = header.flags & PassHeader::kGrayscaleOpt;
-  pass_dec_cache.ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
-  pass_dec_cache.raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
-  pass_dec_cache.biases =
-      Image3F(xsize_blocks * kBlockDim * kBlockDim, ysize_blocks);
-  ColorCorrelationMap cmap(xsize, ysize);
-  Quantizer quantizer(kBlockDim, 0, 0, 0);
+size_t PikPassDecoder::WindowCapacity() const {
+  if (!dparams_.row_callback) return window_.ysize();
+  // Two rows of groups plus the border above the first.
+  return std::min(container_.ysize(), 2 * kGroupHeight + kRowBorder);
+}
 
-  if (header.encoding == ImageEncoding::kPasses) {
-    PIK_RETURN_IF_ERROR(quantizer.Decode(reader));
-    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
-    DecodeColorMap(reader, &cmap.ytob_map, &cmap.ytob_dc);
-    DecodeColorMap(reader, &cmap.ytox_map, &cmap.ytox_dc);
-    PIK_RETURN_IF_ERROR(DecodeDC(reader, compressed, header, xsize_blocks,
-                                 ysize_blocks, quantizer, cmap, pool,
-                                 &pass_dec_cache));
+Rect PikPassDecoder::NeededDCBlocks() const {
+  // AC groups also access the DC of adjacent blocks.
+  size_t x0, x1, y0, y1;
+  ExpandInterval(decoded_rect_.x0() / kBlockDim,
+                 DivCeil(decoded_rect_.x0() + decoded_rect_.xsize(), kBlockDim),
+                 1, 1, pass_dec_cache_.dc.xsize(), &x0, &x1);
+  ExpandInterval(decoded_rect_.y0() / kBlockDim,
+                 DivCeil(decoded_rect_.y0() + decoded_rect_.ysize(), kBlockDim),
+                 1, 1, pass_dec_cache_.dc.ysize(), &y0, &y1);
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+Status PikPassDecoder::DecodeDCGroups(const PaddedBytes& compressed,
+                                      size_t begin, size_t end) {
+  if (begin == end) return true;
+  return pik::DecodeDCGroups(compressed, dc_codes_begin_, dc_group_offsets_,
+                             begin, end, NeededDCBlocks(), quantizer_, cmap_,
+                             pool_, &pass_dec_cache_);
+}
+
+Status PikPassDecoder::ReadTOC(const PaddedBytes& compressed,
+                               BitReader* reader) {
+  PROFILER_FUNC;
+  // Pretend all DC groups are read.
+  reader->SkipBits(dc_group_offsets_.back() * kBitsPerByte);
+  if (reader->Position() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+
+  // Parse everything before modifying any state, so that a retry after
+  // truncation (see PikStreamingDecoder) does not apply the gradient map twice.
+  std::shared_ptr<DecoderEntropyCodes> shared_codes;
+  if (header_.encoding == ImageEncoding::kPasses) {
+    PIK_RETURN_IF_ERROR(ReadGradientMap(reader, compressed, header_,
+                                        quantizer_, &pass_dec_cache_));
+    if (header_.shared_entropy_codes) {
+      PROFILER_ZONE("Read shared entropy codes");
+      shared_codes = std::make_shared<DecoderEntropyCodes>();
+      PIK_RETURN_IF_ERROR(DecodeEntropyCodes(reader, header_.use_prefix_codes,
+                                             shared_codes.get()));
+    }
   }
 
   // Read TOC.
+  const size_t num_groups = handlers_.size();
   std::vector<size_t> group_offsets;
   {
     PROFILER_ZONE("Read TOC");
+    group_offsets.assign(1, 0);
     group_offsets.reserve(num_groups + 1);
-    group_offsets.push_back(0);
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
       const uint32_t size = GroupSizeCoder::Decode(reader);
       group_offsets.push_back(group_offsets.back() + size);
     }
     PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
   }
+  if (!reader->Healthy()) return PIK_FAILURE("TOC extends after stream end");
 
-  // Pretend all groups are read.
-  size_t group_codes_begin = reader->Position();
-  reader->SkipBits(group_offsets.back() * kBitsPerByte);
-  if (reader->Position() > compressed.size()) {
-    return PIK_FAILURE("Group code extends after stream end");
+  if (header_.encoding == ImageEncoding::kPasses) {
+    FinishDecodeDC(header_, quantizer_, &pass_dec_cache_);
+    if (shared_codes) pass_dec_cache_.shared_codes = std::move(shared_codes);
   }
+  group_offsets_ = std::move(group_offsets);
+  group_codes_begin_ = reader->Position();
 
-  Image3F opsin(padded_xsize, padded_ysize);
+  if (downsample_ != 8) {
+    opsin_ = Image3F(
+        DivCeil(window_.xsize(), kBlockDim) * kBlockDim / downsample_,
+        DivCeil(WindowCapacity(), kBlockDim) * kBlockDim / downsample_);
+  }
+  return true;
+}
+
+Status PikPassDecoder::DecodeGroup(const PaddedBytes& compressed,
+                                   size_t group_index) {
+  if (!Intersects(handlers_[group_index]->GroupRect(), decoded_rect_)) {
+    return true;
+  }
+  size_t group_code_offset = group_offsets_[group_index];
+  size_t group_reader_limit = group_offsets_[group_index + 1];
+  // TODO(user): this looks ugly; we should get rid of PaddedBytes parameter
+  //               once it is wrapped into BitReader; otherwise it is easy to
+  //               screw the things up.
+  BitReader group_reader(compressed.data(),
+                         group_codes_begin_ + group_reader_limit);
+  group_reader.SkipBits((group_codes_begin_ + group_code_offset) *
+                        kBitsPerByte);
+
+  PikInfo* my_aux_out = aux_out_ ? &aux_outs_[group_index] : nullptr;
+  return PikGroupToPixels(dparams_, container_, &header_, compressed,
+                          quantizer_, cmap_, &group_reader, window_,
+                          &opsin_, &alpha_, io_->Context(), my_aux_out,
+                          &pass_dec_cache_, handlers_[group_index],
+                          io_->dec_c_original);
+}
+
+Status PikPassDecoder::DecodeGroups(const PaddedBytes& compressed,
+                                    size_t begin, size_t end) {
+  PIK_ASSERT(begin <= end && end <= NumGroups());
+  if (dparams_.row_callback) {
+    return PIK_FAILURE("Row callback requires DecodeRows");
+  }
+  if (group_codes_begin_ + group_offsets_[end] > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+  // The output only depends on DC.
+  if (downsample_ == 8) return true;
 
   // Decode groups.
   std::atomic<int> num_errors{0};
   const auto process_group = [&](const int group_index, const int thread) {
-    size_t group_code_offset = group_offsets[group_index];
-    size_t group_reader_limit = group_offsets[group_index + 1];
-    // TODO(user): this looks ugly; we should get rid of PaddedBytes parameter
-    //               once it is wrapped into BitReader; otherwise it is easy to
-    //               screw the things up.
-    BitReader group_reader(compressed.data(),
-                           group_codes_begin + group_reader_limit);
-    group_reader.SkipBits((group_codes_begin + group_code_offset) *
-                          kBitsPerByte);
-
-    PikInfo* my_aux_out = aux_out ? &aux_outs[group_index] : nullptr;
-    if (!PikGroupToPixels(dparams, container, &header, compressed, quantizer,
-                          cmap, &group_reader, &opsin, &alpha, io->Context(),
-                          my_aux_out, &pass_dec_cache, handlers[group_index],
-                          io->dec_c_original)) {
+    if (!DecodeGroup(compressed, group_index)) {
       num_errors.fetch_add(1);
-      return;
     }
   };
-  RunOnPool(pool, 0, num_groups, process_group, "PikPassToPixels");
+  RunOnPool(pool_, begin, end, process_group, "PikPassToPixels");
 
-  if (aux_out != nullptr) {
-    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-      aux_out->Assimilate(aux_outs[group_index]);
-    }
+  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  return true;
+}
+
+Status PikPassDecoder::DecodeDCAndGroups(const PaddedBytes& compressed) {
+  PROFILER_FUNC;
+  PIK_ASSERT(CanDecodeACBeforeDC() && !dparams_.row_callback);
+  const size_t num_dc_groups = NumDCGroups();
+  const size_t num_groups = NumGroups();
+  if (dc_codes_begin_ + dc_group_offsets_.back() > compressed.size() ||
+      group_codes_begin_ + group_offsets_.back() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+  if (downsample_ == 8) {
+    return DecodeDCGroups(compressed, 0, num_dc_groups);
   }
 
-  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  // For each AC group, the range of DC groups covering its blocks plus the
+  // one-block border read by InitializeDecCache.
+  const size_t xsize_blocks = pass_dec_cache_.dc.xsize();
+  const size_t ysize_blocks = pass_dec_cache_.dc.ysize();
+  const size_t xsize_dc_groups = DivCeil(xsize_blocks, kDcGroupDimInBlocks);
+  std::vector<Rect> dc_deps;
+  dc_deps.reserve(num_groups);
+  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
+    const Rect& rect = handlers_[group_index]->GroupRect();
+    size_t x0, x1, y0, y1;
+    ExpandInterval(rect.x0() / kBlockDim,
+                   DivCeil(rect.x0() + rect.xsize(), kBlockDim), 1, 1,
+                   xsize_blocks, &x0, &x1);
+    ExpandInterval(rect.y0() / kBlockDim,
+                   DivCeil(rect.y0() + rect.ysize(), kBlockDim), 1, 1,
+                   ysize_blocks, &y0, &y1);
+    const size_t gx0 = x0 / kDcGroupDimInBlocks;
+    const size_t gy0 = y0 / kDcGroupDimInBlocks;
+    dc_deps.emplace_back(gx0, gy0, DivCeil(x1, kDcGroupDimInBlocks) - gx0,
+                         DivCeil(y1, kDcGroupDimInBlocks) - gy0);
+  }
+
+  // Tasks [0, num_dc_groups) decode DC groups, the rest AC groups. ThreadPool
+  // hands out tasks in increasing order and each thread runs its tasks in
+  // order, so any DC group an AC group waits for is already being decoded by
+  // a thread that never waits itself. Hence there is no deadlock, and no
+  // barrier between DC and AC decoding.
+  std::unique_ptr<std::atomic<bool>[]> dc_done(
+      new std::atomic<bool>[num_dc_groups]);
+  for (size_t i = 0; i < num_dc_groups; ++i) {
+    dc_done[i].store(false, std::memory_order_relaxed);
+  }
+  const Rect needed_blocks = NeededDCBlocks();
+  std::atomic<int> num_errors{0};
+  const auto process_task = [&](const int task, const int thread) {
+    if (static_cast<size_t>(task) < num_dc_groups) {
+      if (!pik::DecodeDCGroups(compressed, dc_codes_begin_, dc_group_offsets_,
+                               task, task + 1, needed_blocks, quantizer_,
+                               cmap_, /*pool=*/nullptr, &pass_dec_cache_)) {
+        num_errors.fetch_add(1);
+      }
+      // Even after errors, lest AC groups wait forever.
+      dc_done[task].store(true, std::memory_order_release);
+      return;
+    }
 
-  if (header.encoding == ImageEncoding::kPasses) {
-    multipass_handler->RestoreOpsin(&opsin);
-    multipass_handler->UpdateBiases(&pass_dec_cache.biases);
-    multipass_handler->StoreBiases(pass_dec_cache.biases);
-    multipass_handler->SetDecodedPass(opsin);
-
-    opsin = FinalizePassDecoding(std::move(opsin), header, quantizer,
-                                 &pass_dec_cache, aux_out);
-
-    Image3F color(padded_xsize, padded_ysize);
-    OpsinToLinear(opsin, Rect(opsin), &color);
-
-    if (header.flags & PassHeader::kGrayscaleOpt) {
-      PROFILER_ZONE("Grayscale opt");
-      // Force all channels to gray
-      for (size_t y = 0; y < color.ysize(); ++y) {
-        float* PIK_RESTRICT row_r = color.PlaneRow(0, y);
-        float* PIK_RESTRICT row_g = color.PlaneRow(1, y);
-        float* PIK_RESTRICT row_b = color.PlaneRow(2, y);
-        for (size_t x = 0; x < color.xsize(); x++) {
-          float gray = row_r[x] * 0.299 + row_g[x] * 0.587 + row_b[x] * 0.114;
-          row_r[x] = row_g[x] = row_b[x] = gray;
+    const size_t group_index = task - num_dc_groups;
+    if (!Intersects(handlers_[group_index]->GroupRect(), decoded_rect_)) {
+      return;
+    }
+    const Rect& deps = dc_deps[group_index];
+    for (size_t gy = deps.y0(); gy < deps.y0() + deps.ysize(); ++gy) {
+      for (size_t gx = deps.x0(); gx < deps.x0() + deps.xsize(); ++gx) {
+        const std::atomic<bool>& done = dc_done[gy * xsize_dc_groups + gx];
+        while (!done.load(std::memory_order_acquire)) {
+          std::this_thread::yield();
         }
       }
     }
+    if (!DecodeGroup(compressed, group_index)) {
+      num_errors.fetch_add(1);
+    }
+  };
+  RunOnPool(pool_, 0, num_dc_groups + num_groups, process_task,
+            "PikPassToPixels DC+AC");
+
+  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  return true;
+}
+
+Status PikPassDecoder::DecodeRows(const PaddedBytes& compressed) {
+  PROFILER_FUNC;
+  PIK_ASSERT(dparams_.row_callback);
+  if (group_codes_begin_ + group_offsets_.back() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+  const size_t xsize = container_.xsize();
+  const size_t ysize = container_.ysize();
+  const size_t padded_ysize = DivCeil(ysize, kBlockDim) * kBlockDim;
+  const size_t xsize_groups = DivCeil(xsize, kGroupWidth);
+  const size_t ysize_groups = DivCeil(ysize, kGroupHeight);
+  const bool is_lossless = header_.encoding == ImageEncoding::kLossless;
+  const ColorEncoding& c =
+      is_lossless ? io_->dec_c_original
+                  : io_->Context()->c_linear_srgb[io_->dec_c_original.IsGray()];
+
+  // Decodes row "gy" of groups into the window.
+  const auto decode_group_row = [&](const size_t gy) -> Status {
+    std::atomic<int> num_errors{0};
+    const auto process_group = [&](const int task, const int thread) {
+      if (!DecodeGroup(compressed, gy * xsize_groups + task)) {
+        num_errors.fetch_add(1);
+      }
+    };
+    RunOnPool(pool_, 0, xsize_groups, process_group, "PikPassToPixels rows");
+    PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+    return true;
+  };
+
+  // The window holds the output rows of group row "gy", all of the next group
+  // row (post-processing needs its first kRowBorder rows) and the border
+  // above. It slides down after each group row.
+  PIK_RETURN_IF_ERROR(decode_group_row(0));
+  for (size_t gy = 0; gy < ysize_groups; ++gy) {
+    if (gy + 1 < ysize_groups) {
+      PIK_RETURN_IF_ERROR(decode_group_row(gy + 1));
+    }
+    const size_t y0 = gy * kGroupHeight;
+    const size_t y1 = std::min(y0 + kGroupHeight, ysize);
+    // Output rows, relative to the window.
+    const Rect rect(0, y0 - window_.y0(), xsize, y1 - y0);
+
+    Image3F color;
+    if (is_lossless) {
+      color = CopyImage(rect, opsin_);
+    } else {
+      // Post-processes the output rows plus the border, starting at the top of
+      // the window (aligned to the largest transform).
+      const size_t post_ysize =
+          std::min(y1 + kRowBorder, padded_ysize) - window_.y0();
+      const Rect block_rect(0, window_.y0() / kBlockDim,
+                            opsin_.xsize() / kBlockDim, post_ysize / kBlockDim);
+      PassDecCache post_cache;
+      post_cache.raw_quant_field =
+          CopyImage(block_rect, pass_dec_cache_.raw_quant_field);
+      post_cache.ac_strategy = pass_dec_cache_.ac_strategy.Copy(block_rect);
+      post_cache.biases = CopyImage(
+          Rect(0, 0, pass_dec_cache_.biases.xsize(), block_rect.ysize()),
+          pass_dec_cache_.biases);
+      Image3F linear(xsize, rect.y0() + rect.ysize());
+      // No aux_out: statistics of overlapping bands would be meaningless.
+      FinalizePassDecodingToLinear(
+          CopyImage(Rect(0, 0, opsin_.xsize(), post_ysize), opsin_), header_,
+          quantizer_, &post_cache,
+          header_.flags & PassHeader::kGrayscaleOpt, pool_, &linear);
+      color = rect.y0() == 0 ? std::move(linear) : CopyImage(rect, linear);
+    }
+
+    CodecInOut rows(io_->Context());
+    rows.metadata = io_->metadata;
+    rows.SetOriginalBitsPerSample(io_->original_bits_per_sample());
+    rows.dec_c_original = io_->dec_c_original;
+    rows.SetFromImage(std::move(color), c);
+    if (header_.has_alpha) {
+      rows.SetAlpha(CopyImage(rect, alpha_),
+                    8 * container_.metadata.transcoded.original_bytes_per_alpha);
+    }
+    PIK_RETURN_IF_ERROR(dparams_.row_callback(y0, &rows));
+
+    if (gy + 1 < ysize_groups) {
+      // Slide down to the next group row and its border.
+      const size_t next_y0 = y1 - kRowBorder;
+      const size_t begin = next_y0 - window_.y0();
+      const size_t end = DivCeil(window_.ysize(), kBlockDim) * kBlockDim;
+      MoveRowsUp(begin, end, &opsin_);
+      MoveRowsUp(begin / kBlockDim, end / kBlockDim, &pass_dec_cache_.biases);
+      if (header_.has_alpha) {
+        MoveRowsUp(begin, window_.ysize(), &alpha_);
+      }
+      window_ = Rect(0, next_y0, xsize,
+                     std::min(ysize, y1 + 2 * kGroupHeight) - next_y0);
+      pass_dec_cache_.biases_y0 = next_y0 / kBlockDim;
+    }
+  }
+
+  if (aux_out_ != nullptr) {
+    for (const PikInfo& group_aux_out : aux_outs_) {
+      aux_out_->Assimilate(group_aux_out);
+    }
+  }
+  return true;
+}
+
+Status PikPassDecoder::Finish() {
+  PROFILER_FUNC;
+  if (dparams_.row_callback) {
+    return PIK_FAILURE("Row callback requires DecodeRows");
+  }
+  const bool is_cropped = decoded_rect_.xsize() != container_.xsize() ||
+                          decoded_rect_.ysize() != container_.ysize();
+  // Output downsampling and the part of it done after decoding.
+  const size_t downsample = dparams_.downsample;
+  const size_t post_downsample = downsample / downsample_;
+  // Relative to decoded_rect_, in output pixels.
+  const size_t crop_x0 = crop_.x0() - decoded_rect_.x0();
+  const size_t crop_y0 = crop_.y0() - decoded_rect_.y0();
+  const Rect crop(crop_x0 / downsample, crop_y0 / downsample,
+                  DivCeil(crop_x0 + crop_.xsize(), downsample) -
+                      crop_x0 / downsample,
+                  DivCeil(crop_y0 + crop_.ysize(), downsample) -
+                      crop_y0 / downsample);
+
+  if (aux_out_ != nullptr) {
+    for (const PikInfo& group_aux_out : aux_outs_) {
+      aux_out_->Assimilate(group_aux_out);
+    }
+  }
+
+  if (header_.encoding == ImageEncoding::kPasses) {
+    if (downsample_ == 8) {
+      opsin_ = DownsampledOpsinFromDC(
+          header_, pass_dec_cache_,
+          Rect(decoded_rect_.x0() / kBlockDim, decoded_rect_.y0() / kBlockDim,
+               DivCeil(decoded_rect_.xsize(), kBlockDim),
+               DivCeil(decoded_rect_.ysize(), kBlockDim)));
+    }
+    multipass_manager_->RestoreOpsin(&opsin_);
+    if (downsample_ == 1) {
+      multipass_manager_->UpdateBiases(&pass_dec_cache_.biases);
+      multipass_manager_->StoreBiases(pass_dec_cache_.biases);
+    }
+    multipass_manager_->SetDecodedPass(opsin_);
+
+    if (is_cropped && downsample_ == 1) {
+      // Post-processing requires the same region as opsin_ and biases.
+      const Rect block_rect(
+          pass_dec_cache_.biases_x0, pass_dec_cache_.biases_y0,
+          DivCeil(decoded_rect_.xsize(), kBlockDim),
+          DivCeil(decoded_rect_.ysize(), kBlockDim));
+      pass_dec_cache_.raw_quant_field =
+          CopyImage(block_rect, pass_dec_cache_.raw_quant_field);
+      pass_dec_cache_.ac_strategy = pass_dec_cache_.ac_strategy.Copy(block_rect);
+    }
+
+    // Block padding is not needed in the output.
+    Image3F color(DivCeil(decoded_rect_.xsize(), downsample_),
+                  DivCeil(decoded_rect_.ysize(), downsample_));
+    const bool grayscale = header_.flags & PassHeader::kGrayscaleOpt;
+    if (downsample_ == 1) {
+      FinalizePassDecodingToLinear(std::move(opsin_), header_, quantizer_,
+                                   &pass_dec_cache_, grayscale, pool_, &color,
+                                   aux_out_);
+    } else {
+      DownsampledPassToLinear(opsin_, grayscale, pool_, &color);
+    }
+    if (post_downsample != 1) {
+      color = DownsampleBox(color, post_downsample);
+    }
+    if (!SameSize(crop, color)) {
+      color = CopyImage(crop, color);
+    }
+
     const ColorEncoding& c =
-        io->Context()->c_linear_srgb[io->dec_c_original.IsGray()];
-    io->SetFromImage(std::move(color), c);
-  } else if (header.encoding == ImageEncoding::kLossless) {
-    io->SetFromImage(std::move(opsin), io->dec_c_original);
-    io->ShrinkTo(xsize, ysize);
-    multipass_handler->SetDecodedPass(io);
+        io_->Context()->c_linear_srgb[io_->dec_c_original.IsGray()];
+    io_->SetFromImage(std::move(color), c);
+  } else if (header_.encoding == ImageEncoding::kLossless) {
+    if ((is_cropped || downsample != 1) && !header_.is_last) {
+      // The next pass would require all pixels of this one.
+      return PIK_FAILURE("Cannot crop or downsample multi-pass lossless images");
+    }
+    if (downsample != 1) {
+      opsin_ = DownsampleBox(opsin_, downsample);
+    }
+    if (is_cropped) {
+      opsin_ = CopyImage(crop, opsin_);
+    }
+    io_->SetFromImage(std::move(opsin_), io_->dec_c_original);
+    io_->ShrinkTo(crop.xsize(), crop.ysize());
+    multipass_manager_->SetDecodedPass(io_);
   } else {
     return PIK_FAILURE("Unsupported image encoding");
   }
 
-  if (header.has_alpha) {
-    io->SetAlpha(std::move(alpha),
-                 8 * container.metadata.transcoded.original_bytes_per_alpha);
+  if (header_.has_alpha) {
+    if (downsample != 1) {
+      alpha_ = DownsampleBox(alpha_, downsample);
+    }
+    if (!SameSize(crop, alpha_)) {
+      alpha_ = CopyImage(crop, alpha_);
+    }
+    io_->SetAlpha(std::move(alpha_),
+                  8 * container_.metadata.transcoded.original_bytes_per_alpha);
   }
 
-  io->ShrinkTo(xsize, ysize);
+  io_->ShrinkTo(crop.xsize(), crop.ysize());
 
   return true;
 }
 
+Status PikPassToPixels(const DecompressParams& dparams,
+                       const PaddedBytes& compressed,
+                       const FileHeader& container, ThreadPool* pool,
+                       BitReader* reader, CodecInOut* io, PikInfo* aux_out,
+                       MultipassManager* multipass_manager) {
+  PROFILER_ZONE("PikPassToPixels uninstrumented");
+  PikPassDecoder decoder(dparams, container, pool, io, aux_out,
+                         multipass_manager);
+  PIK_RETURN_IF_ERROR(decoder.ReadHeaders(reader));
+  const bool overlap =
+      decoder.CanDecodeACBeforeDC() && !dparams.row_callback;
+  if (!overlap) {
+    PIK_RETURN_IF_ERROR(
+        decoder.DecodeDCGroups(compressed, 0, decoder.NumDCGroups()));
+  }
+  PIK_RETURN_IF_ERROR(decoder.ReadTOC(compressed, reader));
+
+  // Pretend all groups are read.
+  reader->SkipBits((decoder.GroupEnd(decoder.NumGroups() - 1) -
+                    reader->Position()) *
+                   kBitsPerByte);
+  if (reader->Position() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+
+  if (dparams.row_callback) {
+    return decoder.DecodeRows(compressed);
+  }
+  if (overlap) {
+    PIK_RETURN_IF_ERROR(decoder.DecodeDCAndGroups(compressed));
+  } else {
+    PIK_RETURN_IF_ERROR(
+        decoder.DecodeGroups(compressed, 0, decoder.NumGroups()));
+  }
+  return decoder.Finish();
+}
+
 }  // namespace pik
@@ -7,10 +7,15 @@
 #ifndef PIK_PASS_H_
 #define PIK_PASS_H_
 
+#include <stddef.h>
+#include <vector>
+
 #include "codec.h"
+#include "color_correlation.h"
 #include "compressed_image.h"
 #include "data_parallel.h"
 #include "headers.h"
+#include "image.h"
 #include "multipass_handler.h"
 #include "noise.h"
 #include "padded_bytes.h"
@@ -40,6 +45,130 @@ Status PixelsToPikPass(CompressParams params, const PassParams& pass_params,
                        PaddedBytes* compressed, size_t& pos, PikInfo* aux_out,
                        MultipassManager* multipass_manager);
 
+// Encodes a copy of `io` downsampled to at most cparams.preview_size pixels
+// per side as a single pass starting at bit 0 of `preview`, and sets the
+// preview dimensions in `container`. Leaves `preview` empty if no preview is
+// requested or `io` is not larger than that.
+Status EncodePreview(const CompressParams& cparams, const CodecInOut* io,
+                     ThreadPool* pool, FileHeader* container,
+                     PaddedBytes* preview);
+
+// Writes `container` at bit position `pos`, followed by `preview` (from
+// EncodePreview, may be empty) starting at the next byte boundary. Sets
+// container->preview.size_bits such that skipping it after the header leads to
+// `pos`, i.e. the first pass of the main image.
+Status WriteFileHeaderAndPreview(FileHeader* container,
+                                 const PaddedBytes& preview, size_t* pos,
+                                 PaddedBytes* compressed);
+
+// Decodes a single pass in stages, each of which only requires a prefix of the
+// pass bitstream. This allows decoding DC and AC groups as soon as their bytes
+// have arrived (see PikStreamingDecoder). Usage:
+//   ReadHeaders; DecodeDCGroups until NumDCGroups; ReadTOC;
+//   DecodeGroups until NumGroups; Finish.
+// If the whole pass is available, ReadHeaders; ReadTOC; DecodeDCAndGroups;
+// Finish avoids waiting for all DC groups before decoding AC groups.
+// Group data is located via byte offsets, so "compressed" may be a different
+// (grown) buffer in each call as long as its prefix is unchanged.
+class PikPassDecoder {
+ public:
+  // All pointers must outlive this instance. "pool" and "aux_out" may be null.
+  PikPassDecoder(const DecompressParams& dparams, const FileHeader& container,
+                 ThreadPool* pool, CodecInOut* io, PikInfo* aux_out,
+                 MultipassManager* multipass_manager);
+
+  PikPassDecoder(const PikPassDecoder&) = delete;
+  PikPassDecoder& operator=(const PikPassDecoder&) = delete;
+
+  // Reads the pass header, quantizer, color correlation map and the DC TOC.
+  // Leaves "reader" at the start of the DC group data.
+  Status ReadHeaders(BitReader* reader);
+
+  size_t NumDCGroups() const { return dc_group_offsets_.size() - 1; }
+  // Returns the byte position in the bitstream at which DC group "group"
+  // ends, i.e. how many bytes must be available to decode it.
+  size_t DCGroupEnd(size_t group) const {
+    return dc_codes_begin_ + dc_group_offsets_[group + 1];
+  }
+  // Decodes DC groups [begin, end).
+  Status DecodeDCGroups(const PaddedBytes& compressed, size_t begin,
+                        size_t end);
+
+  // Requires all DC groups to be decoded unless CanDecodeACBeforeDC. Skips the
+  // DC group data in "reader" (left by ReadHeaders), then reads the gradient
+  // map and the group TOC. Leaves "reader" at the start of the group data.
+  Status ReadTOC(const PaddedBytes& compressed, BitReader* reader);
+
+  // Returns whether ReadTOC and each AC group only depend on the DC groups
+  // covering it, i.e. there is no gradient map (which modifies all DC).
+  bool CanDecodeACBeforeDC() const {
+    return header_.encoding == ImageEncoding::kPasses &&
+           !(header_.flags & PassHeader::kGradientMap);
+  }
+
+  size_t NumGroups() const { return group_offsets_.size() - 1; }
+  size_t GroupEnd(size_t group) const {
+    return group_codes_begin_ + group_offsets_[group + 1];
+  }
+  // Decodes groups [begin, end).
+  Status DecodeGroups(const PaddedBytes& compressed, size_t begin, size_t end);
+
+  // Alternative to DecodeDCGroups and DecodeGroups when the whole pass is
+  // available; requires CanDecodeACBeforeDC and ReadTOC. Decodes all DC and
+  // AC groups in a single parallel loop, starting each AC group as soon as
+  // the DC groups it reads are decoded.
+  Status DecodeDCAndGroups(const PaddedBytes& compressed);
+
+  // Requires all groups to be decoded. Runs per-pass post-processing and
+  // stores the result in "io".
+  Status Finish();
+
+  // Replaces DecodeGroups and Finish if DecompressParams::row_callback is set;
+  // requires ReadTOC. Decodes one row of groups at a time into a window of two
+  // group rows plus a border, post-processes each row of groups separately and
+  // passes the result to the callback.
+  Status DecodeRows(const PaddedBytes& compressed);
+
+ private:
+  // Returns the number of rows allocated for window_.
+  size_t WindowCapacity() const;
+  // Returns the DC blocks required for decoding crop_.
+  Rect NeededDCBlocks() const;
+  Status DecodeGroup(const PaddedBytes& compressed, size_t group_index);
+
+  const DecompressParams& dparams_;
+  const FileHeader& container_;
+  ThreadPool* pool_;
+  CodecInOut* io_;
+  PikInfo* aux_out_;
+  MultipassManager* multipass_manager_;
+
+  PassHeader header_;
+  ImageU alpha_;
+  std::vector<PikInfo> aux_outs_;
+  std::vector<MultipassHandler*> handlers_;
+  PassDecCache pass_dec_cache_;
+  ColorCorrelationMap cmap_;
+  Quantizer quantizer_;
+  Image3F opsin_;
+
+  // Image region to output and the (group-aligned) region decoded for it; both
+  // cover the whole image unless DecompressParams::crop is set.
+  Rect crop_;
+  Rect decoded_rect_;
+  // Region of the image stored in opsin_, alpha_ and biases: decoded_rect_,
+  // except that it slides down in DecodeRows.
+  Rect window_;
+  // Downsampling applied while decoding, see DecodingDownsample.
+  size_t downsample_ = 1;
+
+  // Offsets relative to *_codes_begin_ (byte positions in the bitstream).
+  std::vector<size_t> dc_group_offsets_;
+  size_t dc_codes_begin_ = 0;
+  std::vector<size_t> group_offsets_;
+  size_t group_codes_begin_ = 0;
+};
+
 // Decodes an input image from a byte stream, using the provided container
 // information. See PikToPixels for explanation of `io` color space.
 Status PikPassToPixels(const DecompressParams& params,
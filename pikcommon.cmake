@@ -85,6 +85,8 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/descriptive_statistics.h
   ${CMAKE_CURRENT_LIST_DIR}/entropy_coder.cc
   ${CMAKE_CURRENT_LIST_DIR}/entropy_coder.h
+  ${CMAKE_CURRENT_LIST_DIR}/entropy_presets.cc
+  ${CMAKE_CURRENT_LIST_DIR}/entropy_presets.h
   ${CMAKE_CURRENT_LIST_DIR}/entropy_source.h
   ${CMAKE_CURRENT_LIST_DIR}/epf.cc
   ${CMAKE_CURRENT_LIST_DIR}/epf.h
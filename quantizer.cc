@@ -8,7 +8,6 @@
 
 #include <stdio.h>
 #include <algorithm>
-#include <sstream>
 #include <vector>
 
 #undef PROFILER_ENABLED
@@ -174,17 +173,17 @@ const float* Quantizer::DequantMatrix(int c, size_t quant_kind) const {
   return pik::DequantMatrix(template_id_, quant_kind, c);
 }
 
-std::string Quantizer::Encode(PikImageSizeInfo* info) const {
-  std::stringstream ss;
+void Quantizer::Encode(BitWriter* writer, PikImageSizeInfo* info) const {
+  PIK_ASSERT(writer->BitsWritten() % kBitsPerByte == 0);
   static_assert(kNumQuantTables <= 2, "template_id is supposed to be 1 bit");
   int global_scale_and_template_id = (global_scale_ - 1) | (template_id_ << 15);
-  ss << std::string(1, global_scale_and_template_id >> 8);
-  ss << std::string(1, global_scale_and_template_id & 0xff);
-  ss << std::string(1, quant_dc_ - 1);
+  writer->Reserve(3 * kBitsPerByte);
+  writer->Write(8, (global_scale_and_template_id >> 8) & 0xff);
+  writer->Write(8, global_scale_and_template_id & 0xff);
+  writer->Write(8, (quant_dc_ - 1) & 0xff);
   if (info) {
     info->total_size += 3;
   }
-  return ss.str();
 }
 
 bool Quantizer::Decode(BitReader* br) {
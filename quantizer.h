@@ -22,6 +22,7 @@
 #include "pik_info.h"
 #include "robust_statistics.h"
 #include "simd/simd.h"
+#include "write_bits.h"
 
 // Quantizes DC and AC coefficients, with separate quantization tables according
 // to the quant_kind (which is currently computed from the AC strategy and the
@@ -389,7 +390,8 @@ class Quantizer {
     return std::round(dc * dc_quant_[c]);
   }
 
-  std::string Encode(PikImageSizeInfo* info) const;
+  // Writes the global scale and DC quantization (3 bytes).
+  void Encode(BitWriter* writer, PikImageSizeInfo* info) const;
 
   bool Decode(BitReader* br);
 
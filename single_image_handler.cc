@@ -64,10 +64,11 @@ void SingleImageManager::RestoreOpsin(Image3F* img) {
 }
 
 void SingleImageManager::GetColorCorrelationMap(const Image3F& opsin,
+                                                ThreadPool* pool,
                                                 ColorCorrelationMap* cmap) {
   if (!has_cmap_) {
     cmap_ = std::move(*cmap);
-    FindBestColorCorrelationMap(opsin, &cmap_);
+    FindBestColorCorrelationMap(OpsinDCT(opsin), pool, &cmap_);
     has_cmap_ = true;
   }
   *cmap = cmap_.Copy();
@@ -79,8 +80,8 @@ void SingleImageManager::GetAcStrategy(float butteraugli_target,
                                        AcStrategyImage* ac_strategy,
                                        PikInfo* aux_out) {
   if (!has_ac_strategy_) {
-    FindBestAcStrategy(butteraugli_target, quant_field, src, pool,
-                       &ac_strategy_, aux_out);
+    FindBestAcStrategy(butteraugli_target, quant_field, src, OpsinDCT(src),
+                       pool, &ac_strategy_, aux_out);
     has_ac_strategy_ = true;
   }
   *ac_strategy = ac_strategy_.Copy();
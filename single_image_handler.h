@@ -84,6 +84,7 @@ class SingleImageManager : public MultipassManager {
 
   void SetDecodedPass(const Image3F& opsin) override;
   void SetDecodedPass(CodecInOut* io) override;
+  size_t NumDecodedPasses() const override { return num_passes_; }
 
   bool IsLastPass() const { return current_header_.is_last; }
 
@@ -100,7 +101,7 @@ class SingleImageManager : public MultipassManager {
   MultipassHandler* GetGroupHandler(size_t group_id,
                                     const Rect& group_rect) override;
 
-  void GetColorCorrelationMap(const Image3F& opsin,
+  void GetColorCorrelationMap(const Image3F& opsin, ThreadPool* pool,
                               ColorCorrelationMap* cmap) override;
 
   void GetAcStrategy(float butteraugli_target, const ImageF* quant_field,
@@ -7,15 +7,20 @@
 #ifndef WRITE_BITS_H_
 #define WRITE_BITS_H_
 
-// Unbuffered writes to the bitstream using unaligned 64-bit stores.
+// Writes to the bitstream using unaligned 64-bit stores, either directly or
+// buffered in a register for long runs of writes, and a growable BitWriter
+// built on them.
 
 #include <stdint.h>
 #include <string.h>  // memcpy
+#include <algorithm>
 #include <cstddef>
 
 #include "arch_specific.h"
 #include "byte_order.h"
+#include "common.h"
 #include "compiler_specific.h"
+#include "padded_bytes.h"
 #include "status.h"
 
 namespace pik {
@@ -88,9 +93,64 @@ PIK_INLINE void RewindStorage(const size_t pos0, size_t* PIK_RESTRICT pos,
   array[pos0 >> 3] &= kRewindMasks[pos0 & 7];
 }
 
-class BitWriter {
+// Same bitstream as WriteBits, but keeps the partial byte in a register instead
+// of reloading it from memory on every call, which shortens the dependency
+// chain between consecutive writes. Continues at bit position *pos of
+// "storage", which the caller must have reserved as for WriteBits. *pos is
+// only updated by Flush, which must precede any other access to *pos or the
+// storage.
+class BufferedBitWriter {
+ public:
+  BufferedBitWriter(size_t* PIK_RESTRICT pos, uint8_t* PIK_RESTRICT storage)
+      : pos_(pos),
+        storage_(storage),
+        next_(storage + (*pos >> 3)),
+        num_bits_(*pos & 7),
+        // WriteBits guarantees the unwritten bits of this byte are zero.
+        buffer_(*next_) {}
+
+  BufferedBitWriter(const BufferedBitWriter&) = delete;
+  BufferedBitWriter& operator=(const BufferedBitWriter&) = delete;
+
+  PIK_INLINE void Write(const size_t n_bits, const uint64_t bits) {
+    PIK_ASSERT((bits >> n_bits) == 0);
+    PIK_ASSERT(n_bits <= 56);
+    // num_bits_ < 8, hence the buffer cannot overflow.
+    buffer_ |= bits << num_bits_;
+    num_bits_ += n_bits;
+    // Branchless: always store all 8 bytes, then advance past the complete
+    // ones. Like WriteBits, this zero-initializes the bytes that follow.
+    Store(buffer_, next_);
+    const size_t complete_bits = num_bits_ & ~size_t(7);
+    next_ += complete_bits >> 3;
+    buffer_ >>= complete_bits;  // < 64 because n_bits <= 56.
+    num_bits_ &= 7;
+  }
+
+  // Updates *pos. Writing may continue afterwards.
+  void Flush() { *pos_ = (next_ - storage_) * kBitsPerByte + num_bits_; }
+
+ private:
+  static PIK_INLINE void Store(const uint64_t bits, uint8_t* p) {
+#if PIK_BYTE_ORDER_LITTLE
+    memcpy(p, &bits, sizeof(bits));
+#else
+    StoreLE32(static_cast<uint32_t>(bits), p);
+    StoreLE32(static_cast<uint32_t>(bits >> 32), p + 4);
+#endif
+  }
+
+  size_t* PIK_RESTRICT pos_;
+  uint8_t* storage_;
+  uint8_t* next_;     // holds the first bit of buffer_.
+  size_t num_bits_;   // valid bits in buffer_, < 8 between calls.
+  uint64_t buffer_;
+};
+
+// Adapter for visitors of bits, e.g. BuildAndVisitHuffmanTree.
+class WriteBitsVisitor {
  public:
-  BitWriter(size_t* storage_ix, uint8_t* storage)
+  WriteBitsVisitor(size_t* storage_ix, uint8_t* storage)
       : storage_ix_(storage_ix), storage_(storage) {}
 
   void VisitBits(size_t nbits, uint64_t bits) {
@@ -102,6 +162,102 @@ class BitWriter {
   uint8_t* storage_;
 };
 
+// Appends bits to a growing PaddedBytes. Encoders write directly into a
+// BitWriter rather than returning temporary strings that are copied into the
+// output; PixelsToPikPass gives each thread one arena that all of its groups
+// are written to, so the only copy is the final gather into the output.
+class BitWriter {
+ public:
+  // Appends to "storage" (which must outlive this and not be modified by
+  // others meanwhile) after its current contents.
+  explicit BitWriter(PaddedBytes* storage)
+      : storage_(storage),
+        begin_(storage->size() * kBitsPerByte),
+        pos_(begin_) {}
+  // Writes to internal storage, see TakeBytes.
+  BitWriter() : storage_(&owned_), begin_(0), pos_(0) {}
+
+  BitWriter(const BitWriter&) = delete;
+  BitWriter& operator=(const BitWriter&) = delete;
+
+  // Must be called before writing up to "max_bits" more bits. Grows the
+  // storage geometrically, which invalidates storage().
+  void Reserve(const size_t max_bits) {
+    if (max_bits == 0) return;
+    const size_t size = (pos_ + max_bits + 7) / kBitsPerByte;
+    if (size > storage_->capacity()) {
+      storage_->reserve(std::max(size, 2 * storage_->capacity()));
+    }
+    storage_->resize(size);
+    // PaddedBytes only initializes the first byte of new allocations, but
+    // WriteBits requires the unwritten bits of the current byte to be zero.
+    RewindStorage(pos_, &pos_, storage_->data());
+  }
+
+  void Write(const size_t n_bits, const uint64_t bits) {
+    PIK_ASSERT(pos_ + n_bits <= storage_->size() * kBitsPerByte);
+    WriteBits(n_bits, bits, &pos_, storage_->data());
+  }
+
+  // Pads with zero bits to the next byte boundary and shrinks the storage to
+  // the bytes written, i.e. releases the remainder of the last Reserve.
+  // As after PaddedBytes::resize, the first byte past the end is zero, so
+  // callers may continue with WriteBits after a plain resize.
+  void ZeroPadToByte() {
+    if (pos_ % kBitsPerByte != 0) {
+      WriteZeroesToByteBoundary(&pos_, storage_->data());
+    }
+    storage_->resize(pos_ / kBitsPerByte);
+    if (storage_->data() != nullptr) storage_->data()[storage_->size()] = 0;
+  }
+
+  // Copies whole bytes, e.g. from another BitWriter's storage.
+  void AppendBytes(const uint8_t* bytes, const size_t num_bytes) {
+    PIK_ASSERT(pos_ % kBitsPerByte == 0);
+    if (num_bytes == 0) return;
+    Reserve(num_bytes * kBitsPerByte);
+    memcpy(storage_->data() + pos_ / kBitsPerByte, bytes, num_bytes);
+    pos_ += num_bytes * kBitsPerByte;
+    ZeroPadToByte();
+  }
+  template <class Bytes>
+  void AppendBytes(const Bytes& bytes) {
+    AppendBytes(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+  }
+
+  // Discards everything written after the first "bits_written" bits (as
+  // returned by BitsWritten), e.g. to replace a tentative encoding.
+  void Rewind(const size_t bits_written) {
+    PIK_ASSERT(begin_ + bits_written <= pos_);
+    if (begin_ + bits_written == pos_) return;
+    RewindStorage(begin_ + bits_written, &pos_, storage_->data());
+  }
+
+  // Bits written since construction.
+  size_t BitsWritten() const { return pos_ - begin_; }
+
+  // For functions that write via WriteBits: the position within storage().
+  // Both remain valid until the next Reserve.
+  size_t* pos() { return &pos_; }
+  uint8_t* storage() { return storage_->data(); }
+
+  // Returns the internal storage (padded to a byte boundary) and resets.
+  PaddedBytes TakeBytes() {
+    PIK_ASSERT(storage_ == &owned_);
+    ZeroPadToByte();
+    PaddedBytes bytes = std::move(owned_);
+    owned_ = PaddedBytes();
+    begin_ = pos_ = 0;
+    return bytes;
+  }
+
+ private:
+  PaddedBytes owned_;  // only used by the default constructor.
+  PaddedBytes* storage_;
+  size_t begin_;  // [bits]
+  size_t pos_;    // [bits]
+};
+
 struct BitCounter {
   void VisitBits(size_t nbits, uint64_t bits) { num_bits += nbits; }
   size_t num_bits = 0;
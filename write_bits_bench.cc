@@ -0,0 +1,125 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Microbenchmark for bit writers: measures the throughput of WriteBits and
+// BufferedBitWriter for a token-like mix of field sizes, and verifies that
+// both produce the same bitstream.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "os_specific.h"
+#include "padded_bytes.h"
+#include "write_bits.h"
+
+namespace pik {
+namespace {
+
+struct Field {
+  uint32_t nbits;
+  uint32_t bits;
+};
+
+// Mostly short prefix codes interleaved with extra bits, plus occasional
+// 16-bit (ANS state flush) and 32-bit (raw bytes) fields.
+std::vector<Field> RandomFields(const size_t num_fields, size_t* total_bits) {
+  std::mt19937 rng(129);
+  std::geometric_distribution<uint32_t> short_bits(0.3);
+  std::uniform_int_distribution<uint32_t> kind(0, 63);
+  std::vector<Field> fields(num_fields);
+  *total_bits = 0;
+  for (Field& field : fields) {
+    const uint32_t k = kind(rng);
+    field.nbits = k == 0 ? 32 : k < 4 ? 16 : std::min(short_bits(rng), 15u);
+    field.bits = field.nbits == 0 ? 0 : rng() >> (32 - field.nbits);
+    *total_bits += field.nbits;
+  }
+  return fields;
+}
+
+// Room for all fields plus the 8 bytes touched by the final store.
+PaddedBytes AllocateOutput(const size_t total_bits) {
+  PaddedBytes out(DivCeil(total_bits, kBitsPerByte) + 8);
+  memset(out.data(), 0, out.size());
+  return out;
+}
+
+// Returns the fastest time [s] of "reps" calls to "write"(pos, storage),
+// which must write "total_bits" into zero-initialized storage.
+template <class WriteFunc>
+double TimeWrites(const WriteFunc& write, const size_t total_bits,
+                  const size_t reps, PaddedBytes* out) {
+  double best = 1E10;
+  for (size_t rep = 0; rep < reps; ++rep) {
+    // Both writers rely on the unwritten bits being zero.
+    memset(out->data(), 0, out->size());
+    size_t pos = 0;
+    const double start = Now();
+    write(&pos, out->data());
+    const double elapsed = Now() - start;
+    if (pos != total_bits) return -1.0;
+    best = std::min(best, elapsed);
+  }
+  return best;
+}
+
+void Print(const char* name, const size_t num_fields, const size_t total_bits,
+           const double elapsed) {
+  printf("%s: %zu fields, %zu bits, %.2f ns/field (%.2f Gbit/s)\n", name,
+         num_fields, total_bits, elapsed * 1E9 / num_fields,
+         total_bits * 1E-9 / elapsed);
+}
+
+int Run(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Args: [repetitions]\n");
+    return 1;
+  }
+  const size_t reps = std::max(1, argc == 2 ? atoi(argv[1]) : 20);
+
+  size_t total_bits;
+  const std::vector<Field> fields = RandomFields(1 << 22, &total_bits);
+
+  PaddedBytes unbuffered = AllocateOutput(total_bits);
+  const double elapsed_unbuffered = TimeWrites(
+      [&fields](size_t* pos, uint8_t* storage) {
+        for (const Field& field : fields) {
+          WriteBits(field.nbits, field.bits, pos, storage);
+        }
+      },
+      total_bits, reps, &unbuffered);
+
+  PaddedBytes buffered = AllocateOutput(total_bits);
+  const double elapsed_buffered = TimeWrites(
+      [&fields](size_t* pos, uint8_t* storage) {
+        BufferedBitWriter writer(pos, storage);
+        for (const Field& field : fields) {
+          writer.Write(field.nbits, field.bits);
+        }
+        writer.Flush();
+      },
+      total_bits, reps, &buffered);
+
+  if (elapsed_unbuffered < 0.0 || elapsed_buffered < 0.0 ||
+      memcmp(unbuffered.data(), buffered.data(), unbuffered.size()) != 0) {
+    fprintf(stderr, "Bitstream mismatch\n");
+    return 1;
+  }
+
+  Print("WriteBits", fields.size(), total_bits, elapsed_unbuffered);
+  Print("BufferedBitWriter", fields.size(), total_bits, elapsed_buffered);
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::Run(argc, argv); }